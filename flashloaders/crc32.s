@@ -0,0 +1,53 @@
+/* CRC-32 (IEEE 802.3, reflected, polynomial 0xedb88320) of a memory range,
+ * a nibble at a time from a 16 entry table (thumb1 only)
+ *
+ * r0 = address
+ * r1 = length in bytes
+ * r2 = crc, neither inverted on entry nor on exit
+ * r3 = table
+ * r4 = temp
+ */
+    .syntax unified
+    .thumb
+
+start:
+    adr     r3, table
+next:
+    cmp     r1, #0
+    beq     done
+    ldrb    r4, [r0]
+    eors    r2, r4
+    lsls    r4, r2, #28
+    lsrs    r4, r4, #26         /*  (crc & 0xf) * 4  */
+    ldr     r4, [r3, r4]
+    lsrs    r2, r2, #4
+    eors    r2, r4
+    lsls    r4, r2, #28
+    lsrs    r4, r4, #26
+    ldr     r4, [r3, r4]
+    lsrs    r2, r2, #4
+    eors    r2, r4
+    adds    r0, #1
+    subs    r1, #1
+    b       next
+done:
+    bkpt    #0x00
+
+    .align 2
+table:
+    .word 0x00000000
+    .word 0x1db71064
+    .word 0x3b6e20c8
+    .word 0x26d930ac
+    .word 0x76dc4190
+    .word 0x6b6b51f4
+    .word 0x4db26158
+    .word 0x5005713c
+    .word 0xedb88320
+    .word 0xf00f9344
+    .word 0xd6d6a3e8
+    .word 0xcb61b38c
+    .word 0x9b64c2b0
+    .word 0x86d3d2d4
+    .word 0xa00ae278
+    .word 0xbdbdf21c
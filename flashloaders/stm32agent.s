@@ -0,0 +1,205 @@
+/* Flashing agent: erases, programs and blank checks flash from a queue of
+ * descriptors the host posts, until told to stop (thumb1 only, for the
+ * STM32F0/F1/F3, F1 XL, F2/F4/F7 and L4 flash controllers)
+ *
+ * The agent stays resident in sram. The control block r0 points at holds
+ * the queue state, the flash controller details filled in by the host for
+ * the family at hand, and a ring of 32 descriptors:
+ *
+ *  +0  head        descriptors posted, written by the host
+ *  +4  tail        descriptors done, written by the agent
+ *  +8  status      0, or why the agent stopped: the error bits of the flash
+ *                  status register, or the address of a word not erased
+ *  +12 sr          flash status register
+ *  +16 cr          flash control register
+ *  +20 ar          1 if the page address goes to cr + 4 (F0/F1)
+ *  +24 bsy         busy bit(s) in sr
+ *  +28 err         error bits in sr
+ *  +32 strt        start bit in cr
+ *  +36 pg          cr value for programming
+ *  +40 unit        bytes programmed at a time: 2 (half word), 4 or 8 (words)
+ *  +44 bank2       sr/cr/ar are 0x40 further up from this address on (F1 XL)
+ *  +48 ring        descriptors { op, addr, len, arg }, slot tail % 32
+ *
+ * op 0 stop, 1 erase (arg is the cr value to start it with, addr the page),
+ * 2 program len bytes at addr from arg, 3 blank check len bytes at addr,
+ * 4 unpack len bytes to addr from the compressed data at arg.
+ *
+ * Erase, program and blank check first wait for the bank at addr to finish
+ * what it was doing. An erase does not wait for itself: on the F1 XL, with
+ * a controller per bank, the agent goes on to program the other bank in
+ * the meantime. A blank check of len 0 only waits for the bank.
+ *
+ * Compressed data is a series of tokens: 0x00-0x7f is followed by that
+ * many plus one literal bytes, 0x80-0xff copies that many minus 0x7c bytes
+ * from the offset in the next two bytes (little endian) back. Copying goes
+ * byte by byte, forward, so it unpacks in place from the end of a buffer.
+ * On an error the agent stops with tail at the failed descriptor, for an
+ * erase that is the next descriptor for the same bank.
+ *
+ * r0 = control block
+ * r1 = temp
+ * r2 = addr
+ * r3 = len
+ * r4 = arg
+ * r5 = sr
+ * r6 = cr
+ * r7 = temp
+ */
+    .syntax unified
+    .thumb
+
+start:
+    ldr     r1, [r0, #0]        /*  head  */
+    ldr     r7, [r0, #4]        /*  tail  */
+    cmp     r1, r7
+    beq     start
+    movs    r1, #31
+    ands    r1, r7
+    lsls    r1, r1, #4
+    adds    r1, r1, r0
+    adds    r1, #48             /*  r1 = descriptor  */
+    ldr     r7, [r1, #0]
+    ldr     r2, [r1, #4]
+    ldr     r3, [r1, #8]
+    ldr     r4, [r1, #12]
+    ldr     r5, [r0, #12]
+    ldr     r6, [r0, #16]
+    ldr     r1, [r0, #44]
+    cmp     r2, r1
+    blo     1f
+    adds    r5, #0x40
+    adds    r6, #0x40
+1:
+    cmp     r7, #1
+    beq     erase
+    cmp     r7, #2
+    beq     program
+    cmp     r7, #3
+    beq     blank
+    cmp     r7, #4
+    beq     unpack
+    bkpt    #0x00               /*  stop  */
+
+program:
+    bl      wait
+    bne     fail
+    ldr     r1, [r0, #36]
+    str     r1, [r6]            /*  FLASH->CR = pg  */
+next_unit:
+    cmp     r3, #0
+    beq     op_done
+    ldr     r7, [r0, #40]
+    cmp     r7, #2
+    bne     words
+    ldrh    r1, [r4]
+    strh    r1, [r2]
+    adds    r4, #2
+    adds    r2, #2
+    subs    r3, #2
+    b       unit_done
+words:
+    ldr     r1, [r4]
+    str     r1, [r2]
+    adds    r4, #4
+    adds    r2, #4
+    subs    r3, #4
+    subs    r7, #4
+    bne     words
+unit_done:
+    dsb     sy                  /*  in order flash writes on F7  */
+    bl      wait
+    beq     next_unit
+    b       fail
+
+blank:
+    bl      wait
+    bne     fail
+    mvns    r7, r1              /*  r1 is 0 after a wait without errors  */
+3:
+    cmp     r3, #0
+    beq     op_done
+    ldr     r1, [r2]
+    cmp     r1, r7
+    bne     not_blank
+    adds    r2, #4
+    subs    r3, #4
+    b       3b
+not_blank:
+    str     r2, [r0, #8]        /*  status = addr  */
+    bkpt    #0x00
+
+unpack:
+    adds    r3, r3, r2          /*  r3 = end  */
+5:
+    cmp     r2, r3
+    bhs     next
+    ldrb    r1, [r4]
+    adds    r4, #1
+    cmp     r1, #0x80
+    bhs     match
+    adds    r1, #1              /*  literals  */
+6:
+    ldrb    r7, [r4]
+    strb    r7, [r2]
+    adds    r4, #1
+    adds    r2, #1
+    subs    r1, #1
+    bne     6b
+    b       5b
+match:
+    subs    r1, #0x7c           /*  length  */
+    ldrb    r7, [r4]
+    ldrb    r5, [r4, #1]
+    adds    r4, #2
+    lsls    r5, r5, #8
+    orrs    r7, r5
+    subs    r7, r2, r7          /*  r7 = addr - offset  */
+7:
+    ldrb    r5, [r7]
+    strb    r5, [r2]
+    adds    r7, #1
+    adds    r2, #1
+    subs    r1, #1
+    bne     7b
+    b       5b
+
+erase:
+    bl      wait
+    bne     fail
+    str     r4, [r6]            /*  FLASH->CR = arg  */
+    ldr     r1, [r0, #20]
+    cmp     r1, #0
+    beq     2f
+    str     r2, [r6, #4]        /*  FLASH->AR = addr  */
+2:
+    ldr     r1, [r0, #32]
+    orrs    r1, r4
+    str     r1, [r6]            /*  FLASH->CR = arg | STRT  */
+    b       next
+
+op_done:
+    movs    r1, #0
+    str     r1, [r6]            /*  FLASH->CR = 0  */
+next:
+    ldr     r1, [r0, #4]
+    adds    r1, #1
+    str     r1, [r0, #4]        /*  tail++  */
+    b       start
+
+fail:
+    str     r1, [r0, #8]        /*  status = error bits  */
+    movs    r1, #0
+    str     r1, [r6]
+    bkpt    #0x00
+
+/* wait until not busy, r1 = error bits and Z set if there are none */
+wait:
+    ldr     r7, [r0, #24]
+4:
+    ldr     r1, [r5]
+    tst     r1, r7
+    bne     4b
+    ldr     r7, [r0, #28]
+    ands    r1, r7
+    bx      lr
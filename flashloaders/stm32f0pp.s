@@ -0,0 +1,65 @@
+/* Double buffered variant of stm32f0.s, for STM32F0 and STM32F1 (thumb1 only)
+ *
+ * The host fills the two buffers in turn and hands each one over by
+ * writing its size to the buffer's mailbox word; the loader hands it back
+ * by clearing the word once the contents are programmed. Bit 31 of the
+ * size marks the last buffer.
+ *
+ * r0 = mailbox: size of buffer 0 and 1 in half words, buffers follow
+ * r1 = target
+ * r2 = buffer size in bytes
+ * r3 = flash register bank offset (0x40 for bank 2 of STM32F1 XL)
+ * on exit r3 = half words of the current buffer not written (0 on success)
+ */
+    .syntax unified
+    .thumb
+
+start:
+    ldr     r4, flash_base
+    add     r4, r3
+    movs    r7, #0              /*  offset of the current mailbox word  */
+wait_full:
+    ldr     r6, [r0, r7]
+    cmp     r6, #0
+    beq     wait_full
+    movs    r5, r0              /*  r5 = buffer 0 ...  */
+    adds    r5, #8
+    cmp     r7, #0
+    beq     1f
+    adds    r5, r5, r2          /*  ... or buffer 1  */
+1:
+    lsls    r3, r6, #1
+    lsrs    r3, r3, #1          /*  r3 = half words  */
+next:
+    cmp     r3, #0
+    beq     buffer_done
+    movs    r6, #1
+    str     r6, [r4, #16]       /*  FLASH->CR = FLASH_CR_PG  */
+    ldrh    r6, [r5]
+    strh    r6, [r1]
+busy:
+    ldr     r6, [r4, #12]       /*  FLASH->SR  */
+    lsrs    r6, r6, #1          /*  FLASH_SR_BUSY  */
+    bcs     busy
+    ldr     r6, [r4, #12]
+    lsls    r6, r6, #27         /*  PGERR, WRPRTERR  */
+    bne     exit
+    adds    r5, #2
+    adds    r1, #2
+    subs    r3, #1
+    b       next
+buffer_done:
+    ldr     r6, [r0, r7]
+    str     r3, [r0, r7]        /*  hand the buffer back  */
+    movs    r5, #4
+    eors    r7, r5
+    cmp     r6, #0
+    bge     wait_full           /*  not the last one  */
+exit:
+    movs    r6, #0
+    str     r6, [r4, #16]       /*  FLASH->CR &= ~FLASH_CR_PG  */
+    bkpt    #0x00
+
+    .align 2
+flash_base:
+    .word 0x40022000
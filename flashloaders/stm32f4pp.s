@@ -0,0 +1,48 @@
+@ Double buffered variant of stm32f4.s, see stm32f0pp.s for the protocol
+@ r0 = mailbox: size of buffer 0 and 1 in words, buffers follow
+@ r1 = target
+@ r2 = buffer size in bytes
+@ r3 = words of the current buffer not written, on exit
+@ r4 = flash_base
+@ r5 = source
+@ r6 = mailbox word
+@ r7 = offset of the current mailbox word
+@ ip = temp
+
+    .syntax unified
+    .thumb
+
+start:
+    ldr     r4, flash_base
+    movs    r7, #0
+wait_full:
+    ldr     r6, [r0, r7]
+    cmp     r6, #0
+    beq     wait_full
+    add     r5, r0, #8
+    cbz     r7, 1f
+    add     r5, r2
+1:
+    bic     r3, r6, #0x80000000
+next:
+    cbz     r3, buffer_done
+    ldr     ip, [r5], #4
+    str     ip, [r1], #4
+
+wait:
+    ldrh    ip, [r4, #0x0e]
+    tst     ip, #1
+    bne     wait
+
+    sub     r3, #1
+    b       next
+buffer_done:
+    str     r3, [r0, r7]
+    eor     r7, r7, #4
+    tst     r6, #0x80000000
+    beq     wait_full
+    bkpt
+
+    .align 2
+flash_base:
+    .word 0x40023c00
@@ -0,0 +1,48 @@
+/* STM32L4/G0 flash loader (thumb1 only)
+ *
+ * The two flash controllers share the registers used here, and take
+ * double words.
+ * With PG set in FLASH_CR the loader waits after each double word; with
+ * FSTPG set instead it writes whole rows of 32 double words back to back
+ * and waits once at the end of each row (fast programming).
+ *
+ * r0 = source
+ * r1 = target
+ * r2 = double words, on exit those not written (0 on success)
+ * r3 = flash_base
+ * r4, r5 = temp
+ */
+    .syntax unified
+    .thumb
+
+start:
+    ldr     r3, flash_base
+next:
+    cmp     r2, #0
+    beq     done
+    ldr     r4, [r0]            /*  copy double word from source to target  */
+    ldr     r5, [r0, #4]
+    str     r4, [r1]
+    str     r5, [r1, #4]
+    adds    r0, #8
+    adds    r1, #8
+    subs    r2, #1
+    ldr     r4, [r3, #0x14]     /*  FLASH->CR  */
+    lsrs    r4, r4, #19         /*  FSTPG  */
+    bcc     wait
+    lsls    r4, r1, #24         /*  not at the end of a row yet  */
+    bne     next
+wait:
+    ldr     r4, [r3, #0x10]     /*  FLASH->SR  */
+    lsrs    r5, r4, #17         /*  BSY1  */
+    bcs     wait
+    lsls    r4, r4, #22         /*  PROGERR ... FASTERR  */
+    lsrs    r4, r4, #25
+    beq     next
+    adds    r2, #1              /*  not written after all  */
+done:
+    bkpt    #0x00
+
+    .align 2
+flash_base:
+    .word 0x40022000
@@ -0,0 +1,65 @@
+/* Double buffered variant of stm32g0.s (thumb1 only), see stm32f0pp.s for
+ * the protocol. Waits after each double word, or with FSTPG set in
+ * FLASH_CR at the end of each row; buffers hold whole rows then.
+ *
+ * r0 = mailbox: size of buffer 0 and 1 in double words, buffers follow
+ * r1 = target
+ * r2 = buffer size in bytes
+ * on exit r3 = double words of the current buffer not written (0 on success)
+ */
+    .syntax unified
+    .thumb
+
+start:
+    ldr     r4, flash_base
+    movs    r7, #0              /*  offset of the current mailbox word  */
+wait_full:
+    ldr     r6, [r0, r7]
+    cmp     r6, #0
+    beq     wait_full
+    movs    r5, r0              /*  r5 = buffer 0 ...  */
+    adds    r5, #8
+    cmp     r7, #0
+    beq     1f
+    adds    r5, r5, r2          /*  ... or buffer 1  */
+1:
+    lsls    r3, r6, #1
+    lsrs    r3, r3, #1          /*  r3 = double words  */
+next:
+    cmp     r3, #0
+    beq     buffer_done
+    ldr     r6, [r5]            /*  copy double word from source to target  */
+    str     r6, [r1]
+    ldr     r6, [r5, #4]
+    str     r6, [r1, #4]
+    adds    r5, #8
+    adds    r1, #8
+    subs    r3, #1
+    ldr     r6, [r4, #0x14]     /*  FLASH->CR  */
+    lsrs    r6, r6, #19         /*  FSTPG  */
+    bcc     busy
+    lsls    r6, r1, #24         /*  not at the end of a row yet  */
+    bne     next
+busy:
+    ldr     r6, [r4, #0x10]     /*  FLASH->SR  */
+    lsrs    r6, r6, #17         /*  BSY1  */
+    bcs     busy
+    ldr     r6, [r4, #0x10]
+    lsls    r6, r6, #22         /*  PROGERR ... FASTERR  */
+    lsrs    r6, r6, #25
+    beq     next
+    adds    r3, #1              /*  not written after all  */
+    b       exit
+buffer_done:
+    ldr     r6, [r0, r7]
+    str     r3, [r0, r7]        /*  hand the buffer back  */
+    movs    r5, #4
+    eors    r7, r5
+    cmp     r6, #0
+    bge     wait_full           /*  not the last one  */
+exit:
+    bkpt    #0x00
+
+    .align 2
+flash_base:
+    .word 0x40022000
@@ -0,0 +1,74 @@
+/* STM32L0/L1 flash loader (thumb1 only), program memory and data eeprom
+ *
+ * Writes r2 words in one run: where the target is at the start of a half
+ * page with a whole one left, the loader sets FPRG and PROG in FLASH_PECR,
+ * writes the half page back to back and waits once at its end. Words
+ * before the first and after the last half page go one at a time, as do
+ * all words with a half page size of 0 (data eeprom, which has no half
+ * page mode). The host unlocks PECR and program memory first.
+ *
+ * r0 = source
+ * r1 = target
+ * r2 = words, on exit 0 on success
+ * r3 = flash registers (0x40022000 on L0, 0x40023c00 on L1)
+ * r4 = half page size in bytes (64 on L0, 128 on L1), or 0
+ * r5, r6, r7 = temp
+ */
+    .syntax unified
+    .thumb
+
+start:
+    movs    r7, #0x81           /*  FPRG | PROG  */
+    lsls    r7, r7, #3
+next:
+    cmp     r2, #0
+    beq     done
+    lsrs    r5, r4, #2          /*  words in a half page  */
+    beq     word
+    cmp     r2, r5
+    blo     word
+    subs    r6, r4, #1
+    tst     r6, r1              /*  not at the start of a half page  */
+    bne     word
+    ldr     r6, [r3, #4]        /*  FLASH->PECR |= FPRG | PROG  */
+    orrs    r6, r7
+    str     r6, [r3, #4]
+half_page:
+    ldr     r6, [r0]
+    str     r6, [r1]
+    adds    r0, #4
+    adds    r1, #4
+    subs    r2, #1
+    subs    r5, #1
+    bne     half_page
+    bl      wait
+    ldr     r6, [r3, #4]        /*  FLASH->PECR &= ~(FPRG | PROG)  */
+    bics    r6, r7
+    str     r6, [r3, #4]
+    b       next
+word:
+    ldr     r6, [r0]
+    str     r6, [r1]
+    adds    r0, #4
+    adds    r1, #4
+    subs    r2, #1
+    bl      wait
+    b       next
+
+wait:
+    ldr     r6, [r3, #0x18]     /*  FLASH->SR  */
+    lsrs    r5, r6, #1          /*  BSY  */
+    bcs     wait
+    lsls    r6, r6, #14         /*  WRPERR ... FWWERR  */
+    lsrs    r6, r6, #22
+    bne     fail
+    bx      lr
+fail:
+    ldr     r6, [r3, #4]
+    bics    r6, r7
+    str     r6, [r3, #4]
+    adds    r2, #1              /*  not written after all  */
+done:
+    bkpt    #0x00
+
+    .align 2
@@ -59,6 +59,7 @@ extern "C" {
     // Constant STM32 memory map figures
 #define STM32_FLASH_BASE 0x08000000
 #define STM32_SRAM_BASE 0x20000000
+#define STM32_EEPROM_BASE 0x08080000
 
 // Baud rate divisors for SWDCLK
 #define STLINK_SWDCLK_4MHZ_DIVISOR		0
@@ -109,6 +110,7 @@ extern "C" {
 typedef struct flash_loader {
 	stm32_addr_t loader_addr; /* loader sram adddr */
 	stm32_addr_t buf_addr; /* buffer sram address */
+	size_t pp_size; /* size of each of the two buffers of a double buffered loader, 0 if single buffered */
 } flash_loader_t;
 
     typedef struct _cortex_m3_cpuid_ {
@@ -135,7 +137,39 @@ typedef struct flash_loader {
 
     typedef struct _stlink stlink_t;
 
+    enum stlink_batch_op_type {
+        STLINK_BATCH_READ32 = 0,
+        STLINK_BATCH_WRITE32,
+        STLINK_BATCH_WRITE_REG,
+    };
+
+    struct stlink_batch_op {
+        enum stlink_batch_op_type type;
+        uint32_t addr;      /* address, or register index for WRITE_REG */
+        uint32_t value;     /* value to write, or value read back */
+        int error;          /* 0 once the operation went through */
+    };
+
+    typedef struct stlink_batch {
+        struct stlink_batch_op *ops;
+        size_t count;
+        size_t alloc;
+    } stlink_batch_t;
+
 #include "stlink/backend.h"
+#include "stlink/stats.h"
+#include "stlink/wait.h"
+#include "stlink/erase.h"
+#include "stlink/memcache.h"
+
+    /* the flash loader left in sram by an earlier write, see flash_loader.c */
+    struct stlink_loader_cache {
+        const uint8_t *code;    /* NULL if nothing is known to be there */
+        size_t size;
+        stm32_addr_t addr;
+        size_t pp_size;
+        uint32_t chip_id;
+    };
 
     struct _stlink {
         struct _stlink_backend *backend;
@@ -165,11 +199,38 @@ typedef struct flash_loader {
         stm32_addr_t sram_base;
         size_t sram_size;
 
+        /* data eeprom, L0/L1 only */
+        stm32_addr_t eeprom_base;
+        size_t eeprom_size;
+
         // bootloader
         stm32_addr_t sys_base;
         size_t sys_size;
 
         struct stlink_version_ version;
+
+        // per command transport accounting, see stlink/stats.h
+        struct stlink_stats stats;
+
+        struct stlink_loader_cache loader_cache;
+        // write flash with the flashing agent, not the flash loaders
+        bool flash_agent;
+        // upload compressed data for the flashing agent to unpack
+        bool flash_compress;
+        // let stlink_write_flash() mass erase where that is faster
+        bool allow_mass_erase;
+        // only print the erase plan in stlink_write_flash(), leave the flash as it is
+        bool flash_dry_run;
+        // let stlink_write_flash() fast program whole rows (G0, L4 after a mass erase)
+        bool flash_fast_program;
+        // the flash was mass erased, and no page erased since
+        bool flash_mass_erased;
+
+        // how long flash operations took so far, see stlink/wait.h
+        struct stlink_wait_model wait_model;
+
+        // memory and registers read while the core is halted, see stlink/memcache.h
+        struct stlink_memcache memcache;
     };
 
     int stlink_enter_swd_mode(stlink_t *sl);
@@ -185,15 +246,20 @@ typedef struct flash_loader {
     int stlink_version(stlink_t *sl);
     int stlink_read_debug32(stlink_t *sl, uint32_t addr, uint32_t *data);
     int stlink_read_mem32(stlink_t *sl, uint32_t addr, uint16_t len);
+    int stlink_read_mem32_bulk(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len);
     int stlink_write_debug32(stlink_t *sl, uint32_t addr, uint32_t data);
     int stlink_write_mem32(stlink_t *sl, uint32_t addr, uint16_t len);
     int stlink_write_mem8(stlink_t *sl, uint32_t addr, uint16_t len);
+    int stlink_write_mem32_bulk(stlink_t *sl, uint32_t addr, const uint8_t *buf, size_t len);
+    int stlink_read_mem(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len);
+    int stlink_write_mem(stlink_t *sl, uint32_t addr, const uint8_t *buf, size_t len);
     int stlink_read_all_regs(stlink_t *sl, struct stlink_reg *regp);
     int stlink_read_all_unsupported_regs(stlink_t *sl, struct stlink_reg *regp);
     int stlink_read_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp);
     int stlink_read_unsupported_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp);
     int stlink_write_unsupported_reg(stlink_t *sl, uint32_t value, int r_idx, struct stlink_reg *regp);
     int stlink_write_reg(stlink_t *sl, uint32_t reg, int idx);
+    int stlink_write_regs(stlink_t *sl, uint32_t mask, const uint32_t *values);
     int stlink_step(stlink_t *sl);
     int stlink_current_mode(stlink_t *sl);
     int stlink_force_debug(stlink_t *sl);
@@ -202,12 +268,17 @@ typedef struct flash_loader {
 
     int stlink_erase_flash_mass(stlink_t* sl);
     int stlink_write_flash(stlink_t* sl, stm32_addr_t address, uint8_t* data, uint32_t length, uint8_t eraseonly);
+    int stlink_write_flash_delta(stlink_t* sl, stm32_addr_t address, uint8_t* data, uint32_t length, uint8_t eraseonly);
     int stlink_parse_ihex(const char* path, uint8_t erased_pattern, uint8_t * * mem, size_t * size, uint32_t * begin);
     uint8_t stlink_get_erased_pattern(stlink_t *sl);
     int stlink_mwrite_flash(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr_t addr);
+    int stlink_mwrite_flash_delta(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr_t addr);
     int stlink_fwrite_flash(stlink_t *sl, const char* path, stm32_addr_t addr);
+    int stlink_fwrite_flash_delta(stlink_t *sl, const char* path, stm32_addr_t addr);
     int stlink_mwrite_sram(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr_t addr);
     int stlink_fwrite_sram(stlink_t *sl, const char* path, stm32_addr_t addr);
+    int stlink_mwrite_eeprom(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr_t addr);
+    int stlink_fwrite_eeprom(stlink_t *sl, const char* path, stm32_addr_t addr);
     int stlink_verify_write_flash(stlink_t *sl, stm32_addr_t address, uint8_t *data, uint32_t length);
 
     int stlink_chip_id(stlink_t *sl, uint32_t *chip_id);
@@ -227,13 +298,19 @@ typedef struct flash_loader {
     int write_loader_to_sram(stlink_t *sl, stm32_addr_t* addr, size_t* size);
     int stlink_fread(stlink_t* sl, const char* path, bool is_ihex, stm32_addr_t addr, size_t size);
     int stlink_load_device_params(stlink_t *sl);
+    const struct stlink_stats *stlink_get_stats(stlink_t *sl);
+    void stlink_reset_stats(stlink_t *sl);
+    size_t stlink_format_stats(stlink_t *sl, char *buf, size_t size);
 
 #include "stlink/sg.h"
 #include "stlink/usb.h"
+#include "stlink/sim.h"
+#include "stlink/trace.h"
 #include "stlink/reg.h"
 #include "stlink/commands.h"
 #include "stlink/chipid.h"
 #include "stlink/flash_loader.h"
+#include "stlink/batch.h"
 #include "stlink/version.h"
 
 #ifdef __cplusplus
@@ -29,6 +29,12 @@
         int (*force_debug) (stlink_t *sl);
         int32_t (*target_voltage) (stlink_t *sl);
         int (*set_swdclk) (stlink_t * stl, uint16_t divisor);		
+        int (*read_mem32_bulk) (stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len);
+        int (*batch) (stlink_t *sl, struct stlink_batch_op *ops, size_t count);
+        int (*write_mem32_bulk) (stlink_t *sl, uint32_t addr, const uint8_t *buf, size_t len);
+        // the clock waits go by, for backends with a clock of their own
+        uint64_t (*time_us) (stlink_t *sl);
+        void (*sleep_us) (stlink_t *sl, uint64_t us);
     } stlink_backend_t;
 
 #endif /* STLINK_BACKEND_H_ */
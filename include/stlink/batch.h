@@ -0,0 +1,54 @@
+/*
+ * File:   stlink/batch.h
+ *
+ * Queue of debug register accesses that are sent to the probe back to
+ * back instead of waiting for each reply in turn.
+ */
+#ifndef STLINK_BATCH_H_
+#define STLINK_BATCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "stlink.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * Build a batch, submit it, then pick up the read results and the per
+     * operation status from ops[]. The batch is left queued after submit,
+     * so it can be sent again; stlink_batch_reset() empties it.
+     *
+     *     stlink_batch_t b;
+     *     stlink_batch_init(&b);
+     *     stlink_batch_write32(&b, FLASH_KEYR, FLASH_KEY1);
+     *     stlink_batch_write32(&b, FLASH_KEYR, FLASH_KEY2);
+     *     int cr = stlink_batch_read32(&b, FLASH_CR);
+     *     if (stlink_batch_submit(sl, &b) == 0)
+     *         val = b.ops[cr].value;
+     *     stlink_batch_free(&b);
+     */
+    int stlink_batch_init(stlink_batch_t *b);
+    void stlink_batch_reset(stlink_batch_t *b);
+    void stlink_batch_free(stlink_batch_t *b);
+
+    /* queue an operation, return its index in ops[] or -1 if out of memory */
+    int stlink_batch_read32(stlink_batch_t *b, uint32_t addr);
+    int stlink_batch_write32(stlink_batch_t *b, uint32_t addr, uint32_t data);
+    int stlink_batch_write_reg(stlink_batch_t *b, uint32_t reg, int idx);
+    /* values[idx] for every bit idx set in mask, returns the first index, or -1 */
+    int stlink_batch_write_regs(stlink_batch_t *b, uint32_t mask, const uint32_t *values);
+
+    /* 0 if every operation succeeded, -1 otherwise (see ops[].error) */
+    int stlink_batch_submit(stlink_t *sl, stlink_batch_t *b);
+
+    /* one call per operation, for backends that can't do better */
+    int stlink_batch_run_each(stlink_t *sl, struct stlink_batch_op *ops, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STLINK_BATCH_H_ */
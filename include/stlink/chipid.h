@@ -86,6 +86,7 @@ struct stlink_chipid_params {
 	uint32_t sram_size;
 	uint32_t bootrom_base;
 	uint32_t bootrom_size;
+	uint32_t eeprom_size;	/* data eeprom at STM32_EEPROM_BASE, L0/L1 only */
 };
 
 const struct stlink_chipid_params *stlink_chipid_get_params(uint32_t chipid);
@@ -0,0 +1,77 @@
+/*
+ * File:   stlink/erase.h
+ *
+ * Erase planning: which pages or sectors a write has to erase, taken from
+ * a table of the flash geometry instead of page by page. Pages a crc run
+ * on the target finds erased already are left alone, and where the timing
+ * model in stlink/wait.h says a mass erase is faster, and the caller does
+ * not mind losing the rest of the flash, the plan is a mass erase.
+ */
+#ifndef STLINK_ERASE_H_
+#define STLINK_ERASE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STLINK_FLASH_REGIONS_MAX 8
+
+    /* count pages (or sectors) of size bytes each, from addr on */
+    struct stlink_flash_region {
+        stm32_addr_t addr;
+        uint32_t size;
+        uint32_t count;
+    };
+
+    struct stlink_flash_geometry {
+        size_t count;
+        struct stlink_flash_region region[STLINK_FLASH_REGIONS_MAX];
+    };
+
+    /* a part of flash to write */
+    struct stlink_flash_range {
+        stm32_addr_t addr;
+        uint32_t len;
+    };
+
+#define STLINK_ERASE_BLANK_CHECK (1u << 0)  /* leave out pages found erased */
+#define STLINK_ERASE_MASS (1u << 1)         /* mass erase, if that is faster */
+
+    struct stlink_erase_page {
+        stm32_addr_t addr;
+        uint32_t size;
+        bool blank;             /* erased already, left alone */
+    };
+
+    typedef struct stlink_erase_plan {
+        bool mass;              /* a mass erase instead of the pages */
+        size_t count;
+        struct stlink_erase_page *pages;
+        uint64_t est_us;        /* what the plan is expected to take */
+        uint64_t pages_us;      /* erasing the pages that are not blank */
+        uint64_t mass_us;       /* a mass erase, 0 if not known */
+    } stlink_erase_plan_t;
+
+    /* the pages of sl's flash, as runs of equal size; -1 if too irregular */
+    int stlink_flash_geometry(stlink_t *sl, struct stlink_flash_geometry *g);
+    /**
+     * Plan erasing the pages that the n ranges touch. With
+     * STLINK_ERASE_BLANK_CHECK, the target checks them first, so it has
+     * to be halted. Free the plan with stlink_erase_plan_free().
+     */
+    int stlink_erase_plan(stlink_t *sl, const struct stlink_flash_range *ranges, size_t n,
+            unsigned int flags, stlink_erase_plan_t *plan);
+    int stlink_erase_plan_run(stlink_t *sl, const stlink_erase_plan_t *plan);
+    /* render the plan as text, returns the length it needs like snprintf */
+    size_t stlink_format_erase_plan(const stlink_erase_plan_t *plan, char *buf, size_t size);
+    void stlink_erase_plan_free(stlink_erase_plan_t *plan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STLINK_ERASE_H_ */
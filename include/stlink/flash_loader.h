@@ -9,6 +9,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #include "stlink.h"
 
@@ -19,6 +20,69 @@ extern "C" {
 int stlink_flash_loader_init(stlink_t *sl, flash_loader_t* fl);
 int stlink_flash_loader_write_to_sram(stlink_t *sl, stm32_addr_t* addr, size_t* size);
 int stlink_flash_loader_run(stlink_t *sl, flash_loader_t* fl, stm32_addr_t target, const uint8_t* buf, size_t size);
+/* forget the loader kept in sram if [addr, addr + len) overlaps it */
+void stlink_flash_loader_invalidate(stlink_t *sl, stm32_addr_t addr, size_t len);
+
+/* CRC-32 of len bytes at addr, computed by the halted target; the sram
+   and registers the routine uses are restored after */
+int stlink_flash_crc32(stlink_t *sl, stm32_addr_t addr, size_t len, uint32_t *crc);
+/* the same on the host, start with crc 0 */
+uint32_t stlink_crc32(uint32_t crc, const uint8_t *buf, size_t len);
+
+/*
+ * The compression the agent unpacks, see flashloaders/stm32agent.s: LZ77
+ * with byte aligned tokens, small and fast enough for the target.
+ * Compress len bytes into at most size bytes at dst and return the
+ * compressed size, 0 if it does not come out smaller than len.
+ */
+size_t stlink_lz_compress(uint8_t *dst, size_t size, const uint8_t *src, size_t len);
+
+/*
+ * The flashing agent, see flashloaders/stm32agent.s: stays in sram and
+ * works through a queue of erase, program and blank check descriptors,
+ * so a whole image goes out as a handful of transfers.
+ */
+#define STLINK_AGENT_SLOTS 32
+#define STLINK_AGENT_BUFS 2
+
+enum stlink_agent_op {
+    STLINK_AGENT_STOP = 0,
+    STLINK_AGENT_ERASE,         /* start erasing the page at addr, arg the CR value that starts it */
+    STLINK_AGENT_PROGRAM,       /* len bytes at addr, from the sram at arg */
+    STLINK_AGENT_BLANK,         /* check len bytes at addr are erased, 0 to wait for the bank */
+    STLINK_AGENT_UNPACK,        /* len bytes to the sram at addr, from the compressed data at arg */
+};
+
+typedef struct flash_agent {
+    stm32_addr_t ctl;           /* control block, the ring of descriptors follows */
+    stm32_addr_t buf_addr;      /* program data buffers */
+    size_t buf_size;
+    size_t unit;                /* bytes programmed at a time */
+    uint32_t queued;            /* descriptors queued */
+    uint32_t head;              /* descriptors handed over to the agent */
+    uint32_t tail;              /* descriptors known to be done */
+    uint32_t programs;          /* program descriptors queued */
+    uint32_t buf_desc[STLINK_AGENT_BUFS];   /* the descriptor that last used each buffer */
+    uint32_t ring[STLINK_AGENT_SLOTS][4];
+    /* model time of the work posted up to each descriptor, see stlink/wait.h */
+    uint64_t model_us;
+    uint64_t model_done_us;
+    uint64_t bank_us[2];        /* when each bank's controller is done */
+    uint64_t due[2 * STLINK_AGENT_SLOTS];
+    uint8_t op[2 * STLINK_AGENT_SLOTS];
+} flash_agent_t;
+
+/* load and start the agent; 1 if there is none for the chip, or too little sram */
+int stlink_flash_agent_start(stlink_t *sl, flash_agent_t *ag);
+/* queue one descriptor, waiting for a free slot in the ring; it goes out
+   along with the next program descriptor, or when the ring is full */
+int stlink_flash_agent_post(stlink_t *sl, flash_agent_t *ag, enum stlink_agent_op op,
+        stm32_addr_t addr, uint32_t len, uint32_t arg);
+/* upload size bytes for addr and queue programming them, as many descriptors
+   as it takes; with sl->flash_compress, compressed where that pays off */
+int stlink_flash_agent_program(stlink_t *sl, flash_agent_t *ag, stm32_addr_t addr, const uint8_t *buf, size_t size);
+/* stop the agent once everything queued, erases included, is done; -1 if anything failed */
+int stlink_flash_agent_finish(stlink_t *sl, flash_agent_t *ag);
 
 #ifdef __cplusplus
 }
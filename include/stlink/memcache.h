@@ -0,0 +1,79 @@
+/*
+ * File:   stlink/memcache.h
+ *
+ * Read cache for target memory and the core registers, for debuggers that
+ * read the same stack and variables over and over while the core is
+ * halted. Memory is cached a page at a time. Everything is dropped when
+ * the core may run or be reset, and on writes to anything the cache does
+ * not cover (peripherals, the flash controller), which may change memory
+ * behind its back. Writes to cached pages update them (write-through) or
+ * drop them.
+ */
+#ifndef STLINK_MEMCACHE_H_
+#define STLINK_MEMCACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STLINK_MEMCACHE_PAGE 256
+#define STLINK_MEMCACHE_PAGES 64
+/* read along with the registers on the first stop, from the page of sp up */
+#define STLINK_MEMCACHE_PREFETCH 1024
+
+    struct stlink_memcache_page {
+        uint32_t addr;          /* page aligned */
+        bool valid;
+        uint64_t used;          /* for evicting the least recently used */
+        uint8_t data[STLINK_MEMCACHE_PAGE];
+    };
+
+    struct stlink_memcache {
+        bool enabled;
+        bool write_through;     /* writes update cached pages instead of dropping them */
+        bool halted;            /* the core has stayed halted since the cache filled */
+        bool regs_valid;
+        struct stlink_reg regs; /* as stlink_read_all_regs() read them */
+        uint64_t tick;
+        uint64_t hits, misses;  /* in pages */
+        struct stlink_memcache_page page[STLINK_MEMCACHE_PAGES];
+    };
+
+    /* reads len bytes (a multiple of 4) from the target, past the cache */
+    typedef int (*stlink_memcache_fill_t)(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len);
+
+    /* turn the cache on or off, it starts out empty either way */
+    void stlink_memcache_enable(stlink_t *sl, bool enable, bool write_through);
+    /* drop everything, and wait for the core to be seen halted again */
+    void stlink_memcache_invalidate(stlink_t *sl);
+    /* the core is halted now */
+    void stlink_memcache_halted(stlink_t *sl);
+
+    /* true if reads of addr's range go through the cache right now */
+    bool stlink_memcache_usable(stlink_t *sl, uint32_t addr, size_t len);
+    /* read len bytes (a multiple of 4) through the cache, fill reads what it lacks */
+    int stlink_memcache_read(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len,
+            stlink_memcache_fill_t fill);
+    /* copy len bytes from the cache if it has them all, 0 then */
+    int stlink_memcache_lookup(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len);
+    /* data was written to addr, NULL if not known */
+    void stlink_memcache_write(stlink_t *sl, uint32_t addr, const uint8_t *data, size_t len);
+
+    /* the core registers, if they were read since the core halted */
+    bool stlink_memcache_get_regs(stlink_t *sl, struct stlink_reg *regp);
+    /* the core registers were read, the first time since the halt the
+       memory around sp is read along with them */
+    void stlink_memcache_put_regs(stlink_t *sl, const struct stlink_reg *regp,
+            stlink_memcache_fill_t fill);
+    /* a register was written */
+    void stlink_memcache_regs_written(stlink_t *sl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STLINK_MEMCACHE_H_ */
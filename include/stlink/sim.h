@@ -0,0 +1,60 @@
+/*
+ * File:   stlink/sim.h
+ *
+ * In process model of a ST-Link with a STM32 attached: memory map, core
+ * run state and registers and the flash controllers programmed by
+ * common.c. Lets the library, the flash loaders' host side protocol and
+ * the tools run without a probe, e.g. to track throughput in CI.
+ */
+#ifndef STLINK_SIM_H
+#define STLINK_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "stlink.h"
+#include "stlink/logging.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Timings are in microseconds and charged to a simulated clock (see
+       stlink_sim_time_us()), or actually slept when realtime is set.
+       Zero sizes and ids select the defaults noted below. */
+    struct stlink_sim_config {
+        uint32_t chip_id;       /* selects memory map and flash controller */
+        uint32_t core_id;       /* default: the one usually seen for that chip */
+        size_t flash_size;      /* default: 128 KiB */
+        int voltage;            /* mV, default 3300 */
+
+        unsigned cmd_us;        /* round trip of one probe command */
+        unsigned kib_us;        /* transfer time per KiB of payload */
+        unsigned depth;         /* commands in flight for batches and bulk
+                                   access, default STLINK_USB_PIPELINE_DEPTH */
+        unsigned erase_us;      /* page or sector erase */
+        unsigned mass_erase_us;
+        unsigned program_us;    /* one programming unit (half, single or double word) */
+        bool realtime;
+    };
+
+    /**
+     * Open a simulated stlink, see stlink_open_usb()
+     * @param verbose Verbosity loglevel
+     * @param reset   Reset the target
+     * @param cfg     Target description
+     * @retval NULL   Unknown chip id or out of memory
+     */
+    stlink_t *stlink_open_sim(enum ugly_loglevel verbose, bool reset, const struct stlink_sim_config *cfg);
+    /* simulated time elapsed since stlink_open_sim() */
+    uint64_t stlink_sim_time_us(stlink_t *sl);
+    /* direct access to the modeled flash, sram, system memory or data
+       eeprom, NULL unless addr..addr+len lies within one of them */
+    uint8_t *stlink_sim_mem(stlink_t *sl, uint32_t addr, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STLINK_SIM_H */
@@ -0,0 +1,54 @@
+/*
+ * File:   stlink/stats.h
+ *
+ * Per command accounting of the transport layer: how often each probe
+ * command was issued, how many payload bytes it moved and how long the
+ * round trips took. Plus, for flash writes, how well the data compressed
+ * and the throughput that came out of it.
+ */
+#ifndef STLINK_STATS_H_
+#define STLINK_STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* bucket i counts round trips of [2^i, 2^(i+1)) us, the last one
+       everything slower, bucket 0 everything below 2 us */
+#define STLINK_STATS_BUCKETS 16
+
+    struct stlink_cmd_stats {
+        uint64_t count;
+        uint64_t bytes;
+        uint64_t total_us;
+        uint64_t max_us;
+        uint64_t hist[STLINK_STATS_BUCKETS];
+    };
+
+    /* flash writes: what was written, and what went over the link for it */
+    struct stlink_flash_stats {
+        uint64_t bytes;
+        uint64_t sent;
+        uint64_t packed;        /* buffers sent compressed */
+        uint64_t total_us;      /* erasing, writing and verifying */
+    };
+
+    /* indexed by opcode: the sub command for STLINK_DEBUG_COMMAND,
+       the first command byte for everything else */
+    struct stlink_stats {
+        struct stlink_cmd_stats cmd[256];
+        struct stlink_flash_stats flash;
+    };
+
+    uint64_t stlink_time_us(void);
+    uint8_t stlink_stats_opcode(const unsigned char *cmd);
+    void stlink_stats_record(struct stlink_stats *st, uint8_t opcode, size_t bytes, uint64_t start_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STLINK_STATS_H_ */
@@ -21,9 +21,19 @@ struct flash_opts
     int log_level;
     enum flash_format format;
     size_t flash_size;	/* --flash=n[k][m] */
+    int stats;		/* --stats */
+    const char* record;	/* --record=<trace> */
+    const char* replay;	/* --replay=<trace> */
+    int realtime;	/* --realtime */
+    int delta;		/* --delta */
+    int agent;		/* --agent */
+    int compress;	/* --compress */
+    int dry_run;	/* --dry-run */
+    int allow_mass_erase;	/* --allow-mass-erase */
+    int fast_program;	/* --fast-program */
 };
 
-#define FLASH_OPTS_INITIALIZER {0, NULL, { 0 }, NULL, 0, 0, 0, 0, 0, 0 }
+#define FLASH_OPTS_INITIALIZER {0, NULL, { 0 }, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, NULL, 0, 0, 0, 0, 0, 0, 0 }
 
 int flash_get_opts(struct flash_opts* o, int ac, char** av);
 
@@ -0,0 +1,38 @@
+/*
+ * File:   stlink/trace.h
+ *
+ * Record the backend calls of a session, with their payloads and timing,
+ * to a trace file, and serve such a trace back in place of a probe. A
+ * replay follows the recorded calls strictly, so it can be used as long
+ * as the code under test issues the same sequence of backend calls.
+ */
+#ifndef STLINK_TRACE_H_
+#define STLINK_TRACE_H_
+
+#include <stdbool.h>
+
+#include "stlink.h"
+#include "stlink/logging.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * Record all further backend calls of sl to path, until stlink_close()
+     * @retval -1 The file can not be created
+     */
+    int stlink_trace_record(stlink_t *sl, const char *path);
+    /**
+     * Open a recorded trace. The returned stlink starts out in the state sl
+     * had when stlink_trace_record() was called.
+     * @param realtime Take as long as each call took when recorded
+     * @retval NULL    No trace, or a trace of a different version
+     */
+    stlink_t *stlink_open_replay(enum ugly_loglevel verbose, const char *path, bool realtime);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STLINK_TRACE_H_ */
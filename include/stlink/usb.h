@@ -26,6 +26,12 @@ extern "C" {
 #define STLINK_SG_SIZE 31
 #define STLINK_CMD_SIZE 16
 
+/* Number of requests kept in flight by the pipelined paths (bulk memory
+   access and batches), and the size of one READMEM_32BIT/WRITEMEM_32BIT
+   request (anything larger stalls the STLINK2) */
+#define STLINK_USB_PIPELINE_DEPTH 4
+#define STLINK_USB_MEM_CHUNK 0x1800
+
     struct stlink_libusb {
         libusb_context* libusb_ctx;
         libusb_device_handle* usb_handle;
@@ -34,6 +40,12 @@ extern "C" {
         int protocoll;
         unsigned int sg_transfer_idx;
         unsigned int cmd_len;
+        // command whose data phase is still outstanding, for the stats
+        struct stlink_stats *stats;
+        uint64_t stats_start;
+        size_t stats_bytes;
+        uint8_t stats_opcode;
+        int stats_pending;
     };
 
     /**
@@ -0,0 +1,71 @@
+/*
+ * File:   stlink/wait.h
+ *
+ * Waiting for the target: for the flash controller to finish an erase or
+ * program operation, or for a loader to reach its breakpoint. Instead of
+ * polling flat out, a wait sleeps through most of the time the operation
+ * is expected to take, then polls with exponential backoff until a hard
+ * deadline. Backends with a clock of their own, like the simulator,
+ * provide the time and the sleeping.
+ */
+#ifndef STLINK_WAIT_H_
+#define STLINK_WAIT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    enum stlink_flash_op {
+        STLINK_FLASH_OP_ERASE = 0,      /* one page or sector of len bytes */
+        STLINK_FLASH_OP_MASS_ERASE,     /* len bytes, the whole flash */
+        STLINK_FLASH_OP_PROGRAM,        /* len bytes in one operation */
+    };
+
+#define STLINK_FLASH_OPS 3
+
+    /* how much faster (< 1024) or slower than the model the target has
+       been, per operation; 0 until measured */
+    struct stlink_wait_model {
+        uint32_t scale[STLINK_FLASH_OPS];
+    };
+
+    /* sleep on the host, for any number of us */
+    void stlink_sleep_us(uint64_t us);
+    /* the time in us, on the backend's clock if it has one */
+    uint64_t stlink_now_us(stlink_t *sl);
+
+    /* 1 if done, 0 to keep waiting, -1 to give up */
+    typedef int (*stlink_wait_cb)(stlink_t *sl, void *arg);
+
+    /**
+     * Wait until done() says so. Sleeps 3/4 of expect_us, polls every
+     * expect_us / 16 until expect_us are up, then backs off exponentially.
+     * Without an expectation, polls from the start, at least every 1.6 ms.
+     * @retval -1 done() failed, or it took longer than timeout_us
+     */
+    int stlink_wait(stlink_t *sl, uint64_t expect_us, uint64_t timeout_us,
+            stlink_wait_cb done, void *arg);
+    /* datasheet time of op on len bytes for sl's flash, 0 if unknown */
+    uint64_t stlink_flash_op_us(stlink_t *sl, enum stlink_flash_op op, size_t len);
+    /**
+     * Wait for work the model says takes model_us, most of it op, as
+     * stlink_wait_flash() does but without learning from it.
+     */
+    int stlink_wait_model(stlink_t *sl, enum stlink_flash_op op, uint64_t model_us,
+            stlink_wait_cb done, void *arg);
+    /**
+     * Wait for op on len bytes to finish, expecting what the model and the
+     * earlier operations on this target suggest. len 0 waits for whatever
+     * operation is pending.
+     */
+    int stlink_wait_flash(stlink_t *sl, enum stlink_flash_op op, size_t len,
+            stlink_wait_cb done, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STLINK_WAIT_H_ */
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "stlink.h"
+#include "stlink/batch.h"
+#include "stlink/logging.h"
+
+#define BATCH_ALLOC_STEP 16
+
+int stlink_batch_init(stlink_batch_t *b) {
+    memset(b, 0, sizeof(*b));
+    return 0;
+}
+
+void stlink_batch_reset(stlink_batch_t *b) {
+    b->count = 0;
+}
+
+void stlink_batch_free(stlink_batch_t *b) {
+    free(b->ops);
+    memset(b, 0, sizeof(*b));
+}
+
+static int stlink_batch_add(stlink_batch_t *b, enum stlink_batch_op_type type,
+        uint32_t addr, uint32_t value) {
+    struct stlink_batch_op *op;
+
+    if (b->count == b->alloc) {
+        size_t alloc = b->alloc + BATCH_ALLOC_STEP;
+        struct stlink_batch_op *ops = realloc(b->ops, alloc * sizeof(*ops));
+        if (ops == NULL) {
+            ELOG("Failed to grow batch to %u operations\n", (unsigned int) alloc);
+            return -1;
+        }
+        b->ops = ops;
+        b->alloc = alloc;
+    }
+
+    op = &b->ops[b->count];
+    op->type = type;
+    op->addr = addr;
+    op->value = value;
+    op->error = -1;
+
+    return (int) b->count++;
+}
+
+int stlink_batch_read32(stlink_batch_t *b, uint32_t addr) {
+    return stlink_batch_add(b, STLINK_BATCH_READ32, addr, 0);
+}
+
+int stlink_batch_write32(stlink_batch_t *b, uint32_t addr, uint32_t data) {
+    return stlink_batch_add(b, STLINK_BATCH_WRITE32, addr, data);
+}
+
+int stlink_batch_write_reg(stlink_batch_t *b, uint32_t reg, int idx) {
+    return stlink_batch_add(b, STLINK_BATCH_WRITE_REG, (uint32_t) idx, reg);
+}
+
+int stlink_batch_write_regs(stlink_batch_t *b, uint32_t mask, const uint32_t *values) {
+    int first = -1;
+
+    for (int idx = 0; idx < 32 && (mask >> idx); idx++) {
+        if (mask & (1u << idx)) {
+            int i = stlink_batch_write_reg(b, values[idx], idx);
+            if (i == -1)
+                return -1;
+            if (first == -1)
+                first = i;
+        }
+    }
+
+    return first;
+}
+
+int stlink_batch_run_each(stlink_t *sl, struct stlink_batch_op *ops, size_t count) {
+    int ret = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        struct stlink_batch_op *op = &ops[i];
+
+        switch (op->type) {
+        case STLINK_BATCH_READ32:
+            op->error = sl->backend->read_debug32(sl, op->addr, &op->value);
+            break;
+        case STLINK_BATCH_WRITE32:
+            op->error = sl->backend->write_debug32(sl, op->addr, op->value);
+            break;
+        case STLINK_BATCH_WRITE_REG:
+            op->error = sl->backend->write_reg(sl, op->value, (int) op->addr);
+            break;
+        }
+        if (op->error)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+int stlink_batch_submit(stlink_t *sl, stlink_batch_t *b) {
+    int ret;
+
+    DLOG("*** stlink_batch_submit %u ops ***\n", (unsigned int) b->count);
+    if (b->count == 0)
+        return 0;
+
+    for (size_t i = 0; i < b->count; i++) {
+        b->ops[i].error = -1;
+        if (b->ops[i].type == STLINK_BATCH_WRITE32) {
+            uint8_t bytes[4];
+
+            stlink_flash_loader_invalidate(sl, b->ops[i].addr, 4);
+            write_uint32(bytes, b->ops[i].value);
+            stlink_memcache_write(sl, b->ops[i].addr, bytes, 4);
+        } else if (b->ops[i].type == STLINK_BATCH_WRITE_REG) {
+            stlink_memcache_regs_written(sl);
+        }
+    }
+
+    if (sl->backend->batch)
+        ret = sl->backend->batch(sl, b->ops, b->count);
+    else
+        ret = stlink_batch_run_each(sl, b->ops, b->count);
+
+    for (size_t i = 0; i < b->count; i++) {
+        if (b->ops[i].error) {
+            if (b->ops[i].type == STLINK_BATCH_WRITE32)
+                stlink_memcache_write(sl, b->ops[i].addr, NULL, 4);
+            ELOG("batch operation %u (type %d, %#x) failed\n",
+                    (unsigned int) i, b->ops[i].type, b->ops[i].addr);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
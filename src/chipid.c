@@ -136,8 +136,8 @@ static const struct stlink_chipid_params devices[] = {
             .bootrom_size = 0x800
         },
         {
-            // This ignores the EEPROM! (and uses the page erase size,
-            // not the sector write protection...)
+            // This uses the page erase size, not the sector write
+            // protection...
             .chip_id = STLINK_CHIPID_STM32_L1_MEDIUM,
             .description = "L1 Med-density device",
             .flash_type = STLINK_FLASH_TYPE_L0,
@@ -145,7 +145,8 @@ static const struct stlink_chipid_params devices[] = {
             .flash_pagesize = 0x100,
             .sram_size = 0x4000,
             .bootrom_base = 0x1ff00000,
-            .bootrom_size = 0x1000
+            .bootrom_size = 0x1000,
+            .eeprom_size = 0x1000
         },
         {
             .chip_id = STLINK_CHIPID_STM32_L1_CAT2,
@@ -155,7 +156,8 @@ static const struct stlink_chipid_params devices[] = {
             .flash_pagesize = 0x100,
             .sram_size = 0x8000,
             .bootrom_base = 0x1ff00000,
-            .bootrom_size = 0x1000
+            .bootrom_size = 0x1000,
+            .eeprom_size = 0x1000
         },
         {
             .chip_id = STLINK_CHIPID_STM32_L1_MEDIUM_PLUS,
@@ -165,7 +167,8 @@ static const struct stlink_chipid_params devices[] = {
             .flash_pagesize = 0x100,
             .sram_size = 0x8000,/*Not completely clear if there are some with 48K*/
             .bootrom_base = 0x1ff00000,
-            .bootrom_size = 0x1000
+            .bootrom_size = 0x1000,
+            .eeprom_size = 0x2000
         },
         {
             .chip_id = STLINK_CHIPID_STM32_L1_HIGH,
@@ -175,7 +178,8 @@ static const struct stlink_chipid_params devices[] = {
             .flash_pagesize = 0x100,
             .sram_size = 0xC000, /*Not completely clear if there are some with 32K*/
             .bootrom_base = 0x1ff00000,
-            .bootrom_size = 0x1000
+            .bootrom_size = 0x1000,
+            .eeprom_size = 0x3000
         },
         {
             .chip_id = STLINK_CHIPID_STM32_L152_RE,
@@ -185,7 +189,8 @@ static const struct stlink_chipid_params devices[] = {
             .flash_pagesize = 0x100,
             .sram_size = 0x14000, /*Not completely clear if there are some with 32K*/
             .bootrom_base = 0x1ff00000,
-            .bootrom_size = 0x1000
+            .bootrom_size = 0x1000,
+            .eeprom_size = 0x4000
         },
         {
             .chip_id = STLINK_CHIPID_STM32_F1_CONN,
@@ -376,7 +381,8 @@ static const struct stlink_chipid_params devices[] = {
             .flash_pagesize = 0x80,
             .sram_size = 0x2000,
             .bootrom_base = 0x1ff0000,
-            .bootrom_size = 0x1000
+            .bootrom_size = 0x1000,
+            .eeprom_size = 0x800
         },
         {
             // STM32L0x Category 5
@@ -388,7 +394,8 @@ static const struct stlink_chipid_params devices[] = {
             .flash_pagesize = 0x80,
             .sram_size = 0x5000,
             .bootrom_base = 0x1ff0000,
-            .bootrom_size = 0x2000
+            .bootrom_size = 0x2000,
+            .eeprom_size = 0x1800
         },
         {
             // STM32L0x Category 2
@@ -400,7 +407,8 @@ static const struct stlink_chipid_params devices[] = {
             .flash_pagesize = 0x80,
             .sram_size = 0x2000,
             .bootrom_base = 0x1ff0000,
-            .bootrom_size = 0x1000
+            .bootrom_size = 0x1000,
+            .eeprom_size = 0x400
         },
         {
             // STM32F334, STM32F303x6/8, and STM32F328
@@ -505,7 +513,8 @@ static const struct stlink_chipid_params devices[] = {
             .flash_pagesize = 0x80,
             .sram_size = 0x2000,
             .bootrom_base = 0x1ff00000,
-            .bootrom_size = 0x2000
+            .bootrom_size = 0x2000,
+            .eeprom_size = 0x200
         },
         {
             // STM32G071/081 (from RM0444)
@@ -91,6 +91,9 @@
 #define STM32G0_FLASH_PCROP1BER (STM32G0_FLASH_REGS_ADDR + 0x38)
 #define STM32G0_FLASH_SECR (STM32G0_FLASH_REGS_ADDR + 0x80)
 
+#define STM32G0_FLASH_CR_FSTPG  18      /* Fast programming, a row at a time */
+#define STM32G0_FLASH_ROW       256     /* 32 double words */
+
 //32L4 register base is at FLASH_REGS_ADDR (0x40022000)
 #define STM32L4_FLASH_KEYR      (FLASH_REGS_ADDR + 0x08)
 #define STM32L4_FLASH_SR        (FLASH_REGS_ADDR + 0x10)
@@ -108,6 +111,7 @@
 #define STM32L4_FLASH_CR_STRT   16      /* Start command */
 #define STM32L4_FLASH_CR_BKER   11      /* Bank select for page erase */
 #define STM32L4_FLASH_CR_PNB    3       /* Page number (8 bits) */
+#define STM32L4_FLASH_CR_FSTPG  18      /* Fast programming, as on the G0 */
 // Bits requesting flash operations (useful when we want to clear them)
 #define STM32L4_FLASH_CR_OPBITS                                     \
     ((1lu<<STM32L4_FLASH_CR_PG) | (1lu<<STM32L4_FLASH_CR_PER)       \
@@ -246,6 +250,8 @@ static void unlock_flash(stlink_t *sl) {
        an invalid sequence results in a definitive lock of
        the FPEC block until next reset.
        */
+    stlink_batch_t b;
+
     if (sl->flash_type == STLINK_FLASH_TYPE_F4)
         key_reg = FLASH_F4_KEYR;
     else if (sl->flash_type == STLINK_FLASH_TYPE_L4)
@@ -253,13 +259,17 @@ static void unlock_flash(stlink_t *sl) {
     else
         key_reg = FLASH_KEYR;
 
-    stlink_write_debug32(sl, key_reg, FLASH_KEY1);
-    stlink_write_debug32(sl, key_reg, FLASH_KEY2);
+    stlink_batch_init(&b);
+    stlink_batch_write32(&b, key_reg, FLASH_KEY1);
+    stlink_batch_write32(&b, key_reg, FLASH_KEY2);
 
     if (sl->flash_type == STLINK_FLASH_TYPE_F1_XL) {
-        stlink_write_debug32(sl, FLASH_KEYR2, FLASH_KEY1);
-        stlink_write_debug32(sl, FLASH_KEYR2, FLASH_KEY2);
+        stlink_batch_write32(&b, FLASH_KEYR2, FLASH_KEY1);
+        stlink_batch_write32(&b, FLASH_KEYR2, FLASH_KEY2);
     }
+
+    stlink_batch_submit(sl, &b);
+    stlink_batch_free(&b);
 }
 
 static int unlock_flash_if(stlink_t *sl) {
@@ -303,13 +313,13 @@ static void lock_flash(stlink_t *sl) {
 static void set_flash_cr_pg(stlink_t *sl) {
     uint32_t cr_reg, x;
 
-    x = read_flash_cr(sl);
-
     if (sl->flash_type == STLINK_FLASH_TYPE_F4) {
         cr_reg = FLASH_F4_CR;
+        x = read_flash_cr(sl);
         x |= 1 << FLASH_CR_PG;
     } else if (sl->flash_type == STLINK_FLASH_TYPE_L4) {
         cr_reg = STM32L4_FLASH_CR;
+        x = read_flash_cr(sl);
         x &= ~STM32L4_FLASH_CR_OPBITS;
         x |= 1 << STM32L4_FLASH_CR_PG;
     } else {
@@ -334,14 +344,20 @@ static void __attribute__((unused)) clear_flash_cr_pg(stlink_t *sl) {
     stlink_write_debug32(sl, cr_reg, n);
 }
 
-static void set_flash_cr_per(stlink_t *sl) {
+/* queue the page erase sequence for the page holding addr into b,
+   CR is fully known here so no read back is needed to set STRT */
+static void set_flash_cr_per(stlink_batch_t *b, uint32_t addr) {
     const uint32_t n = 1 << FLASH_CR_PER;
-    stlink_write_debug32(sl, FLASH_CR, n);
+    stlink_batch_write32(b, FLASH_CR, n);
+    stlink_batch_write32(b, FLASH_AR, addr);
+    stlink_batch_write32(b, FLASH_CR, n | (1 << FLASH_CR_STRT));
 }
 
-static void set_flash_cr2_per(stlink_t *sl) {
+static void set_flash_cr2_per(stlink_batch_t *b, uint32_t addr) {
     const uint32_t n = 1 << FLASH_CR_PER;
-    stlink_write_debug32(sl, FLASH_CR2, n);
+    stlink_batch_write32(b, FLASH_CR2, n);
+    stlink_batch_write32(b, FLASH_AR2, addr);
+    stlink_batch_write32(b, FLASH_CR2, n | (1 << FLASH_CR_STRT));
 }
 
 static void __attribute__((unused)) clear_flash_cr_per(stlink_t *sl) {
@@ -366,18 +382,23 @@ static void set_flash_cr_mer(stlink_t *sl, bool v) {
         cr_pg = 1 << FLASH_CR_PG;
     }
 
+    stlink_batch_t b;
+
     stlink_read_debug32(sl, cr_reg, &val);
+    stlink_batch_init(&b);
     if (val & cr_pg) {
         /* STM32F030 will drop MER bit if PG was set */
         val &= ~cr_pg;
-        stlink_write_debug32(sl, cr_reg, val);
+        stlink_batch_write32(&b, cr_reg, val);
     }
 
     if(v)
         val |= cr_mer;
     else
         val &= ~cr_mer;
-    stlink_write_debug32(sl, cr_reg, val);
+    stlink_batch_write32(&b, cr_reg, val);
+    stlink_batch_submit(sl, &b);
+    stlink_batch_free(&b);
 }
 
 static void set_flash_cr2_mer(stlink_t *sl, bool v) {
@@ -481,25 +502,59 @@ static inline unsigned int is_flash_busy(stlink_t *sl) {
     return res;
 }
 
-static void wait_flash_busy(stlink_t *sl) {
-    /* todo: add some delays here */
-    while (is_flash_busy(sl))
-        ;
+struct flash_sr_wait {
+    uint32_t sr;
+    uint32_t busy;
+};
+
+static int flash_sr_not_busy(stlink_t *sl, void *arg) {
+    const struct flash_sr_wait *w = arg;
+    uint32_t val;
+
+    if (stlink_read_debug32(sl, w->sr, &val) == -1)
+        return -1;
+    return (val & w->busy) == 0;
+}
+
+/* same as wait_flash_busy(), for flash controllers is_flash_busy() doesn't know */
+static int wait_flash_sr(stlink_t *sl, uint32_t sr, uint32_t busy, enum stlink_flash_op op, size_t len) {
+    struct flash_sr_wait w = { sr, busy };
+    return stlink_wait_flash(sl, op, len, flash_sr_not_busy, &w);
 }
 
-static void wait_flash_busy_progress(stlink_t *sl) {
-    int i = 0;
+static int flash_not_busy(stlink_t *sl, void *arg) {
+    (void) arg;
+    return !is_flash_busy(sl);
+}
+
+/* wait for op on len bytes to finish, or for whatever is going on if len is 0 */
+static int wait_flash_busy(stlink_t *sl, enum stlink_flash_op op, size_t len) {
+    return stlink_wait_flash(sl, op, len, flash_not_busy, NULL);
+}
+
+/* a dot a second */
+static int flash_not_busy_progress(stlink_t *sl, void *arg) {
+    uint64_t *dot_at = arg;
+
+    if (!is_flash_busy(sl))
+        return 1;
+    if (stlink_time_us() >= *dot_at) {
+        fprintf(stdout, ".");
+        fflush(stdout);
+        *dot_at = stlink_time_us() + 1000000;
+    }
+    return 0;
+}
+
+static int wait_flash_busy_progress(stlink_t *sl) {
+    uint64_t dot_at = stlink_time_us() + 1000000;
+    int ret;
+
     fprintf(stdout, "Mass erasing");
     fflush(stdout);
-    while (is_flash_busy(sl)) {
-        usleep(10000);
-        i++;
-        if (i % 100 == 0) {
-            fprintf(stdout, ".");
-            fflush(stdout);
-        }
-    }
+    ret = stlink_wait_flash(sl, STLINK_FLASH_OP_MASS_ERASE, sl->flash_size, flash_not_busy_progress, &dot_at);
     fprintf(stdout, "\n");
+    return ret;
 }
 
 static inline unsigned int is_flash_eop(stlink_t *sl) {
@@ -517,14 +572,6 @@ static void __attribute__((unused)) wait_flash_eop(stlink_t *sl) {
         ;
 }
 
-static inline void write_flash_ar(stlink_t *sl, uint32_t n) {
-    stlink_write_debug32(sl, FLASH_AR, n);
-}
-
-static inline void write_flash_ar2(stlink_t *sl, uint32_t n) {
-    stlink_write_debug32(sl, FLASH_AR2, n);
-}
-
 static inline void write_flash_cr_psiz(stlink_t *sl, uint32_t n) {
     uint32_t x = read_flash_cr(sl);
     x &= ~(0x03 << 8);
@@ -536,7 +583,8 @@ static inline void write_flash_cr_psiz(stlink_t *sl, uint32_t n) {
 }
 
 
-static inline void write_flash_cr_snb(stlink_t *sl, uint32_t n) {
+/* select sector n and queue the write of CR into b, returns the value written */
+static inline uint32_t write_flash_cr_snb(stlink_t *sl, stlink_batch_t *b, uint32_t n) {
     uint32_t x = read_flash_cr(sl);
     x &= ~FLASH_F4_CR_SNB_MASK;
     x |= (n << FLASH_F4_CR_SNB);
@@ -544,12 +592,20 @@ static inline void write_flash_cr_snb(stlink_t *sl, uint32_t n) {
 #if DEBUG_FLASH
     fprintf(stdout, "SNB:0x%x 0x%x\n", x, n);
 #endif
-    stlink_write_debug32(sl, FLASH_F4_CR, x);
+    stlink_batch_write32(b, FLASH_F4_CR, x);
+    return x;
 }
 
-static inline void write_flash_cr_bker_pnb(stlink_t *sl, uint32_t n) {
-    stlink_write_debug32(sl, STM32L4_FLASH_SR, 0xFFFFFFFF & ~(1<<STM32L4_FLASH_SR_BSY));
-    uint32_t x = read_flash_cr(sl);
+/* select page n and queue the write of CR into b, returns the value written */
+static inline uint32_t write_flash_cr_bker_pnb(stlink_t *sl, stlink_batch_t *b, uint32_t n) {
+    int cr;
+    uint32_t x;
+
+    stlink_batch_write32(b, STM32L4_FLASH_SR, 0xFFFFFFFF & ~(1<<STM32L4_FLASH_SR_BSY));
+    cr = stlink_batch_read32(b, STM32L4_FLASH_CR);
+    stlink_batch_submit(sl, b);
+    x = (cr < 0) ? 0 : b->ops[cr].value;
+    stlink_batch_reset(b);
     x &=~ STM32L4_FLASH_CR_OPBITS;
     x &=~ STM32L4_FLASH_CR_PAGEMASK;
     x &= ~(1<<STM32L4_FLASH_CR_MER1);
@@ -559,7 +615,8 @@ static inline void write_flash_cr_bker_pnb(stlink_t *sl, uint32_t n) {
 #if DEBUG_FLASH
     fprintf(stdout, "BKER:PNB:0x%x 0x%x\n", x, n);
 #endif
-    stlink_write_debug32(sl, STM32L4_FLASH_CR, x);
+    stlink_batch_write32(b, STM32L4_FLASH_CR, x);
+    return x;
 }
 
 // Delegates to the backends...
@@ -590,8 +647,13 @@ int stlink_enter_swd_mode(stlink_t *sl) {
 
 // Force the core into the debug mode -> halted state.
 int stlink_force_debug(stlink_t *sl) {
+    int ret;
+
     DLOG("*** stlink_force_debug_mode ***\n");
-    return sl->backend->force_debug(sl);
+    ret = sl->backend->force_debug(sl);
+    if (ret == 0)
+        stlink_memcache_halted(sl);
+    return ret;
 }
 
 int stlink_exit_dfu_mode(stlink_t *sl) {
@@ -659,6 +721,8 @@ int stlink_load_device_params(stlink_t *sl) {
 
     stlink_chip_id(sl, &chip_id);
     sl->chip_id = chip_id & 0xfff;
+    sl->loader_cache.code = NULL;
+    memset(&sl->wait_model, 0, sizeof(sl->wait_model));
     /* Fix chip_id for F4 rev A errata , Read CPU ID, as CoreID is the same for F2/F4*/
     if (sl->chip_id == 0x411) {
         uint32_t cpuid;
@@ -704,6 +768,8 @@ int stlink_load_device_params(stlink_t *sl) {
     sl->flash_type = params->flash_type;
     sl->flash_pgsz = params->flash_pagesize;
     sl->sram_size = params->sram_size;
+    sl->eeprom_base = STM32_EEPROM_BASE;
+    sl->eeprom_size = params->eeprom_size;
     sl->sys_base = params->bootrom_base;
     sl->sys_size = params->bootrom_size;
 
@@ -723,16 +789,23 @@ int stlink_load_device_params(stlink_t *sl) {
 
 int stlink_reset(stlink_t *sl) {
     DLOG("*** stlink_reset ***\n");
+    sl->loader_cache.code = NULL;
+    sl->flash_mass_erased = false;
+    stlink_memcache_invalidate(sl);
     return sl->backend->reset(sl);
 }
 
 int stlink_jtag_reset(stlink_t *sl, int value) {
     DLOG("*** stlink_jtag_reset ***\n");
+    sl->loader_cache.code = NULL;
+    sl->flash_mass_erased = false;
+    stlink_memcache_invalidate(sl);
     return sl->backend->jtag_reset(sl, value);
 }
 
 int stlink_run(stlink_t *sl) {
     DLOG("*** stlink_run ***\n");
+    stlink_memcache_invalidate(sl);
     return sl->backend->run(sl);
 }
 
@@ -747,6 +820,10 @@ int stlink_status(stlink_t *sl) {
     DLOG("*** stlink_status ***\n");
     ret = sl->backend->status(sl);
     stlink_core_stat(sl);
+    if (ret == 0 && sl->core_stat == STLINK_CORE_HALTED)
+        stlink_memcache_halted(sl);
+    else
+        stlink_memcache_invalidate(sl);
 
     return ret;
 }
@@ -825,17 +902,33 @@ int stlink_read_debug32(stlink_t *sl, uint32_t addr, uint32_t *data) {
 }
 
 int stlink_write_debug32(stlink_t *sl, uint32_t addr, uint32_t data) {
+    uint8_t bytes[4];
+    int ret;
+
     DLOG("*** stlink_write_debug32 %x to %#x\n", data, addr);
-    return sl->backend->write_debug32(sl, addr, data);
+    stlink_flash_loader_invalidate(sl, addr, 4);
+    write_uint32(bytes, data);
+    stlink_memcache_write(sl, addr, bytes, 4);
+    ret = sl->backend->write_debug32(sl, addr, data);
+    if (ret)
+        stlink_memcache_write(sl, addr, NULL, 4);
+    return ret;
 }
 
 int stlink_write_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    int ret;
+
     DLOG("*** stlink_write_mem32 %u bytes to %#x\n", len, addr);
     if (len % 4 != 0) {
         fprintf(stderr, "Error: Data length doesn't have a 32 bit alignment: +%d byte.\n", len % 4);
         abort();
     }
-    return sl->backend->write_mem32(sl, addr, len);
+    stlink_flash_loader_invalidate(sl, addr, len);
+    stlink_memcache_write(sl, addr, sl->q_buf, len);
+    ret = sl->backend->write_mem32(sl, addr, len);
+    if (ret)
+        stlink_memcache_write(sl, addr, NULL, len);
+    return ret;
 }
 
 int stlink_read_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
@@ -845,22 +938,171 @@ int stlink_read_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
                 len % 4);
         abort();
     }
+    if (stlink_memcache_lookup(sl, addr, sl->q_buf, len) == 0) {
+        sl->q_len = len;
+        return 0;
+    }
     return sl->backend->read_mem32(sl, addr, len);
 }
 
+/* stlink_read_mem32_bulk() past the cache */
+static int read_mem32_bulk(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len) {
+    if (sl->backend->read_mem32_bulk)
+        return sl->backend->read_mem32_bulk(sl, addr, buf, len);
+
+    for (size_t off = 0; off < len; off += 0x1800) {
+        size_t chunk = (len - off > 0x1800) ? 0x1800 : len - off;
+        if (sl->backend->read_mem32(sl, addr + (uint32_t) off, (uint16_t) chunk))
+            return -1;
+        memcpy(buf + off, sl->q_buf, chunk);
+    }
+
+    return 0;
+}
+
+/**
+ * Read len bytes (a multiple of 4) from addr into a caller supplied buffer.
+ * Backends that can keep several requests in flight do so, the others
+ * are driven chunk by chunk through read_mem32 and q_buf, so buf must not
+ * be q_buf. While the core is halted the read may come from, and go to,
+ * the memory cache.
+ */
+int stlink_read_mem32_bulk(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len) {
+    DLOG("*** stlink_read_mem32_bulk %u bytes from %#x ***\n", (unsigned int) len, addr);
+    if (len % 4 != 0) {
+        fprintf(stderr, "Error: Data length doesn't have a 32 bit alignment: +%d byte.\n",
+                (int) (len % 4));
+        abort();
+    }
+
+    if (stlink_memcache_usable(sl, addr, len))
+        return stlink_memcache_read(sl, addr, buf, len, read_mem32_bulk);
+    return read_mem32_bulk(sl, addr, buf, len);
+}
+
+/**
+ * Write len bytes (a multiple of 4) from a caller supplied buffer to addr.
+ * Counterpart of stlink_read_mem32_bulk().
+ */
+int stlink_write_mem32_bulk(stlink_t *sl, uint32_t addr, const uint8_t *buf, size_t len) {
+    int ret = 0;
+
+    DLOG("*** stlink_write_mem32_bulk %u bytes to %#x ***\n", (unsigned int) len, addr);
+    if (len % 4 != 0) {
+        fprintf(stderr, "Error: Data length doesn't have a 32 bit alignment: +%d byte.\n",
+                (int) (len % 4));
+        abort();
+    }
+
+    stlink_flash_loader_invalidate(sl, addr, len);
+    stlink_memcache_write(sl, addr, buf, len);
+    if (sl->backend->write_mem32_bulk) {
+        ret = sl->backend->write_mem32_bulk(sl, addr, buf, len);
+    } else {
+        for (size_t off = 0; off < len && ret == 0; off += 0x1800) {
+            size_t chunk = (len - off > 0x1800) ? 0x1800 : len - off;
+            memcpy(sl->q_buf, buf + off, chunk);
+            if (sl->backend->write_mem32(sl, addr + (uint32_t) off, (uint16_t) chunk))
+                ret = -1;
+        }
+    }
+    // written through above, but maybe not to the target
+    if (ret)
+        stlink_memcache_write(sl, addr, NULL, len);
+
+    return ret;
+}
+
+/**
+ * Read len bytes from addr into buf, with no alignment requirements on
+ * either. The unaligned head and tail are taken from the enclosing words.
+ */
+int stlink_read_mem(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len) {
+    uint8_t word[4];
+    size_t head = (4 - (addr & 3)) & 3;
+    size_t body, tail;
+
+    if (head > len)
+        head = len;
+    body = (len - head) & ~(size_t) 3;
+    tail = len - head - body;
+
+    if (head) {
+        if (stlink_read_mem32_bulk(sl, addr & ~3u, word, 4))
+            return -1;
+        memcpy(buf, word + (addr & 3), head);
+    }
+
+    if (body && stlink_read_mem32_bulk(sl, addr + (uint32_t) head, buf + head, body))
+        return -1;
+
+    if (tail) {
+        if (stlink_read_mem32_bulk(sl, addr + (uint32_t) (head + body), word, 4))
+            return -1;
+        memcpy(buf + head + body, word, tail);
+    }
+
+    return 0;
+}
+
+/**
+ * Write len bytes from buf to addr, with no alignment requirements on
+ * either. The word aligned part goes out as 32 bit accesses, the
+ * unaligned head and tail as 8 bit ones.
+ */
+int stlink_write_mem(stlink_t *sl, uint32_t addr, const uint8_t *buf, size_t len) {
+    size_t head = (4 - (addr & 3)) & 3;
+    size_t body, tail;
+    int ret = 0;
+
+    if (head > len)
+        head = len;
+    body = (len - head) & ~(size_t) 3;
+    tail = len - head - body;
+
+    if (head) {
+        memcpy(sl->q_buf, buf, head);
+        ret |= stlink_write_mem8(sl, addr, (uint16_t) head);
+    }
+
+    if (body)
+        ret |= stlink_write_mem32_bulk(sl, addr + (uint32_t) head, buf + head, body);
+
+    if (tail) {
+        memcpy(sl->q_buf, buf + head + body, tail);
+        ret |= stlink_write_mem8(sl, addr + (uint32_t) (head + body), (uint16_t) tail);
+    }
+
+    return ret ? -1 : 0;
+}
+
 int stlink_write_mem8(stlink_t *sl, uint32_t addr, uint16_t len) {
+    int ret;
+
     DLOG("*** stlink_write_mem8 ***\n");
     if (len > 0x40 ) { // !!! never ever: Writing more then 0x40 bytes gives unexpected behaviour
         fprintf(stderr, "Error: Data length > 64: +%d byte.\n",
                 len);
         abort();
     }
-    return sl->backend->write_mem8(sl, addr, len);
+    stlink_flash_loader_invalidate(sl, addr, len);
+    stlink_memcache_write(sl, addr, sl->q_buf, len);
+    ret = sl->backend->write_mem8(sl, addr, len);
+    if (ret)
+        stlink_memcache_write(sl, addr, NULL, len);
+    return ret;
 }
 
 int stlink_read_all_regs(stlink_t *sl, struct stlink_reg *regp) {
+    int ret;
+
     DLOG("*** stlink_read_all_regs ***\n");
-    return sl->backend->read_all_regs(sl, regp);
+    if (stlink_memcache_get_regs(sl, regp))
+        return 0;
+    ret = sl->backend->read_all_regs(sl, regp);
+    if (ret == 0)
+        stlink_memcache_put_regs(sl, regp, read_mem32_bulk);
+    return ret;
 }
 
 int stlink_read_all_unsupported_regs(stlink_t *sl, struct stlink_reg *regp) {
@@ -870,9 +1112,32 @@ int stlink_read_all_unsupported_regs(stlink_t *sl, struct stlink_reg *regp) {
 
 int stlink_write_reg(stlink_t *sl, uint32_t reg, int idx) {
     DLOG("*** stlink_write_reg\n");
+    stlink_memcache_regs_written(sl);
     return sl->backend->write_reg(sl, reg, idx);
 }
 
+/*
+ * Write values[idx] to every register idx set in mask, as one batch so the
+ * probe gets all the writes back to back.
+ */
+int stlink_write_regs(stlink_t *sl, uint32_t mask, const uint32_t *values) {
+    stlink_batch_t b;
+    int ret;
+
+    DLOG("*** stlink_write_regs %#x ***\n", mask);
+    if (mask == 0)
+        return 0;
+
+    stlink_batch_init(&b);
+    if (stlink_batch_write_regs(&b, mask, values) == -1)
+        ret = -1;
+    else
+        ret = stlink_batch_submit(sl, &b);
+    stlink_batch_free(&b);
+
+    return ret;
+}
+
 int stlink_read_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
     DLOG("*** stlink_read_reg\n");
     DLOG(" (%d) ***\n", r_idx);
@@ -882,6 +1147,10 @@ int stlink_read_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
         return -1;
     }
 
+    /* r0-r15, xpsr and the stack pointers, as the last stlink_read_all_regs() had them */
+    if (r_idx <= 18 && stlink_memcache_get_regs(sl, regp))
+        return 0;
+
     return sl->backend->read_reg(sl, r_idx, regp);
 }
 
@@ -924,6 +1193,7 @@ int stlink_write_unsupported_reg(stlink_t *sl, uint32_t val, int r_idx, struct s
         return -1;
     }
 
+    stlink_memcache_regs_written(sl);
     return sl->backend->write_unsupported_reg(sl, val, r_convert, regp);
 }
 
@@ -939,8 +1209,15 @@ bool stlink_is_core_halted(stlink_t *sl)
 }
 
 int stlink_step(stlink_t *sl) {
+    int ret;
+
     DLOG("*** stlink_step ***\n");
-    return sl->backend->step(sl);
+    stlink_memcache_invalidate(sl);
+    ret = sl->backend->step(sl);
+    /* the core halts again after the instruction */
+    if (ret == 0)
+        stlink_memcache_halted(sl);
+    return ret;
 }
 
 int stlink_current_mode(stlink_t *sl) {
@@ -1086,44 +1363,74 @@ static void unmap_file(mapped_file_t * mf) {
     mf->len = 0;
 }
 
-/* Limit the block size to compare to 0x1800
-   Anything larger will stall the STLINK2
-   Maybe STLINK V1 needs smaller value!*/
-static int check_file(stlink_t* sl, mapped_file_t* mf, stm32_addr_t addr) {
+/* Compare length bytes at addr with data, in windows of up to
+   STLINK_COMPARE_WINDOW bytes. Large enough windows in flash are compared
+   by their CRC-32, computed on the target, and only read back when that
+   differs. On a mismatch the offset of the first differing byte is stored
+   in *fail_off. */
+#define STLINK_COMPARE_WINDOW (64 * 1024)
+#define STLINK_COMPARE_CRC_MIN (16 * 1024)
+
+static int stlink_read_compare(stlink_t* sl, stm32_addr_t addr, const uint8_t* data, size_t length, size_t* fail_off) {
     size_t off;
-    size_t n_cmp = sl->flash_pgsz;
-    if ( n_cmp > 0x1800)
-        n_cmp = 0x1800;
+    int res = 0;
+    uint8_t* buf = malloc(STLINK_COMPARE_WINDOW);
+    bool use_crc = (addr >= sl->flash_base && (uint64_t) addr + length <= (uint64_t) sl->flash_base + sl->flash_size);
 
-    for (off = 0; off < mf->len; off += n_cmp) {
-        size_t aligned_size;
+    if (buf == NULL)
+        return -1;
 
-        /* adjust last page size */
-        size_t cmp_size = n_cmp;
-        if ((off + n_cmp) > mf->len)
-            cmp_size = mf->len - off;
+    for (off = 0; off < length; off += STLINK_COMPARE_WINDOW) {
+        size_t cmp_size = STLINK_COMPARE_WINDOW;
+        uint32_t crc;
 
-        aligned_size = cmp_size;
-        if (aligned_size & (4 - 1))
-            aligned_size = (cmp_size + 4) & ~(4 - 1);
+        /* adjust last window size */
+        if ((off + cmp_size) > length)
+            cmp_size = length - off;
 
-        stlink_read_mem32(sl, addr + (uint32_t) off, aligned_size);
+        if (use_crc && cmp_size >= STLINK_COMPARE_CRC_MIN) {
+            if (stlink_flash_crc32(sl, addr + (uint32_t) off, cmp_size, &crc) == -1) {
+                /* read it all back then */
+                use_crc = false;
+            } else if (crc == stlink_crc32(0, data + off, cmp_size)) {
+                continue;
+            } else {
+                DLOG("crc mismatch at %#zx, reading back\n", addr + off);
+            }
+        }
 
-        if (memcmp(sl->q_buf, mf->base + off, cmp_size))
-            return -1;
+        if (stlink_read_mem(sl, addr + (uint32_t) off, buf, cmp_size)) {
+            if (fail_off)
+                *fail_off = off;
+            res = -1;
+            break;
+        }
+        if (memcmp(buf, data + off, cmp_size)) {
+            size_t i = 0;
+            while (buf[i] == data[off + i])
+                i++;
+            if (fail_off)
+                *fail_off = off + i;
+            res = -1;
+            break;
+        }
     }
 
-    return 0;
+    free(buf);
+    return res;
+}
+
+static int check_file(stlink_t* sl, mapped_file_t* mf, stm32_addr_t addr) {
+    return stlink_read_compare(sl, addr, mf->base, mf->len, NULL);
 }
 
 static void stlink_fwrite_finalize(stlink_t *sl, stm32_addr_t addr) {
-    unsigned int val;
+    uint32_t regs[16];
     /* set stack*/
-    stlink_read_debug32(sl, addr, &val);
-    stlink_write_reg(sl, val, 13);
+    stlink_read_debug32(sl, addr, &regs[13]);
     /* Set PC to the reset routine*/
-    stlink_read_debug32(sl, addr + 4, &val);
-    stlink_write_reg(sl, val, 15);
+    stlink_read_debug32(sl, addr + 4, &regs[15]);
+    stlink_write_regs(sl, (1u << 13) | (1u << 15), regs);
     stlink_run(sl);
 }
 
@@ -1131,8 +1438,6 @@ int stlink_mwrite_sram(stlink_t * sl, uint8_t* data, uint32_t length, stm32_addr
     /* write the file in sram at addr */
 
     int error = -1;
-    size_t off;
-    size_t len;
 
     /* check addr range is inside the sram */
     if (addr < sl->sram_base) {
@@ -1150,31 +1455,8 @@ int stlink_mwrite_sram(stlink_t * sl, uint8_t* data, uint32_t length, stm32_addr
         goto on_error;
     }
 
-    len = length;
-
-    if(len & 3) {
-      len -= len & 3;
-    }
-
-    /* do the copy by 1k blocks */
-    for (off = 0; off < len; off += 1024) {
-        size_t size = 1024;
-        if ((off + size) > len)
-            size = len - off;
-
-        memcpy(sl->q_buf, data + off, size);
-
-        /* round size if needed */
-        if (size & 3)
-            size += 2;
-
-        stlink_write_mem32(sl, addr + (uint32_t) off, size);
-    }
-
-    if(length > len) {
-        memcpy(sl->q_buf, data + len, length - len);
-        stlink_write_mem8(sl, addr + (uint32_t) len, length - len);
-    }
+    if (stlink_write_mem(sl, addr, data, length))
+        goto on_error;
 
     /* success */
     error = 0;
@@ -1188,8 +1470,6 @@ int stlink_fwrite_sram(stlink_t * sl, const char* path, stm32_addr_t addr) {
     /* write the file in sram at addr */
 
     int error = -1;
-    size_t off;
-    size_t len;
     mapped_file_t mf = MAPPED_FILE_INITIALIZER;
 
     if (map_file(&mf, path) == -1) {
@@ -1213,30 +1493,9 @@ int stlink_fwrite_sram(stlink_t * sl, const char* path, stm32_addr_t addr) {
         goto on_error;
     }
 
-    len = mf.len;
-
-    if(len & 3) {
-      len -= len & 3;
-    }
-
-    /* do the copy by 1k blocks */
-    for (off = 0; off < len; off += 1024) {
-        size_t size = 1024;
-        if ((off + size) > len)
-            size = len - off;
-
-        memcpy(sl->q_buf, mf.base + off, size);
-
-        /* round size if needed */
-        if (size & 3)
-            size += 2;
-
-        stlink_write_mem32(sl, addr + (uint32_t) off, size);
-    }
-
-    if(mf.len > len) {
-        memcpy(sl->q_buf, mf.base + len, mf.len - len);
-        stlink_write_mem8(sl, addr + (uint32_t) len, mf.len - len);
+    if (stlink_write_mem(sl, addr, mf.base, mf.len)) {
+        fprintf(stderr, "stlink_write_mem() == -1\n");
+        goto on_error;
     }
 
     /* check the file ha been written */
@@ -1259,6 +1518,7 @@ typedef bool (*save_block_fn)(void* arg, uint8_t* block, ssize_t len);
 static int stlink_read(stlink_t* sl, stm32_addr_t addr, size_t size, save_block_fn fn, void* fn_arg) {
 
     int error = -1;
+    uint8_t* buf;
 
     if (size <1)
         size = sl->flash_size;
@@ -1266,21 +1526,24 @@ static int stlink_read(stlink_t* sl, stm32_addr_t addr, size_t size, save_block_
     if (size > sl->flash_size)
         size = sl->flash_size;
 
-    size_t cmp_size = (sl->flash_pgsz > 0x1800)? 0x1800:sl->flash_pgsz;
-    for (size_t off = 0; off < size; off += cmp_size) {
-        size_t aligned_size;
+    /* not into q_buf: backends without bulk reads go through it chunk by chunk */
+    size_t window = Q_BUF_LEN & ~(size_t) 3;
+    buf = malloc(window);
+    if (buf == NULL)
+        return -1;
 
-        /* adjust last page size */
-        if ((off + cmp_size) > size)
-            cmp_size = size - off;
+    /* read in windows, each one pipelined by the backend */
+    for (size_t off = 0; off < size; off += window) {
+        size_t read_size = window;
 
-        aligned_size = cmp_size;
-        if (aligned_size & (4 - 1))
-            aligned_size = (cmp_size + 4) & ~(4 - 1);
+        /* adjust last window size */
+        if ((off + read_size) > size)
+            read_size = size - off;
 
-        stlink_read_mem32(sl, addr + (uint32_t) off, aligned_size);
+        if (stlink_read_mem(sl, addr + (uint32_t) off, buf, read_size))
+            goto on_error;
 
-        if (!fn(fn_arg, sl->q_buf, aligned_size)) {
+        if (!fn(fn_arg, buf, read_size)) {
             goto on_error;
         }
     }
@@ -1289,6 +1552,7 @@ static int stlink_read(stlink_t* sl, stm32_addr_t addr, size_t size, save_block_
     error = 0;
 
 on_error:
+    free(buf);
     return error;
 }
 
@@ -1424,17 +1688,7 @@ int stlink_fread(stlink_t* sl, const char* path, bool is_ihex, stm32_addr_t addr
 
 int write_buffer_to_sram(stlink_t *sl, flash_loader_t* fl, const uint8_t* buf, size_t size) {
     /* write the buffer right after the loader */
-    size_t chunk = size & ~0x3;
-    size_t rem   = size & 0x3;
-    if (chunk) {
-        memcpy(sl->q_buf, buf, chunk);
-        stlink_write_mem32(sl, fl->buf_addr, chunk);
-    }
-    if (rem) {
-        memcpy(sl->q_buf, buf+chunk, rem);
-        stlink_write_mem8(sl, (fl->buf_addr) + (uint32_t) chunk, rem);
-    }
-    return 0;
+    return stlink_write_mem(sl, fl->buf_addr, buf, size);
 }
 
 uint32_t calculate_F4_sectornum(uint32_t flashaddr){
@@ -1515,13 +1769,19 @@ uint32_t stlink_calculate_pagesize(stlink_t *sl, uint32_t flashaddr){
  */
 int stlink_erase_flash_page(stlink_t *sl, stm32_addr_t flashaddr)
 {
+    sl->flash_mass_erased = false;
     if (sl->flash_type == STLINK_FLASH_TYPE_F4 || sl->flash_type == STLINK_FLASH_TYPE_L4) {
         /* wait for ongoing op to finish */
-        wait_flash_busy(sl);
+        if (wait_flash_busy(sl, STLINK_FLASH_OP_ERASE, 0) == -1)
+            return -1;
 
         /* unlock if locked */
         unlock_flash_if(sl);
 
+        stlink_batch_t b;
+        uint32_t cr, cr_strt;
+        stlink_batch_init(&b);
+
         /* select the page to erase */
         if ((sl->chip_id == STLINK_CHIPID_STM32_L4) ||
             (sl->chip_id == STLINK_CHIPID_STM32_L43X) ||
@@ -1532,14 +1792,16 @@ int stlink_erase_flash_page(stlink_t *sl, stm32_addr_t flashaddr)
 
             fprintf(stderr, "EraseFlash - Page:0x%x Size:0x%x ", page, stlink_calculate_pagesize(sl, flashaddr));
 
-            write_flash_cr_bker_pnb(sl, page);
+            cr = write_flash_cr_bker_pnb(sl, &b, page);
+            cr_strt = 1 << STM32L4_FLASH_CR_STRT;
         } else if (sl->chip_id == STLINK_CHIPID_STM32_F7 || sl->chip_id == STLINK_CHIPID_STM32_F7XXXX) {
             // calculate the actual page from the address
             uint32_t sector=calculate_F7_sectornum(flashaddr);
 
             fprintf(stderr, "EraseFlash - Sector:0x%x Size:0x%x ", sector, stlink_calculate_pagesize(sl, flashaddr));
 
-            write_flash_cr_snb(sl, sector);
+            cr = write_flash_cr_snb(sl, &b, sector);
+            cr_strt = 1 << FLASH_F4_CR_STRT;
         } else {
             // calculate the actual page from the address
             uint32_t sector=calculate_F4_sectornum(flashaddr);
@@ -1549,14 +1811,21 @@ int stlink_erase_flash_page(stlink_t *sl, stm32_addr_t flashaddr)
             //the SNB values for flash sectors in the second bank do not directly follow the values for the first bank on 2mb devices...
             if (sector >= 12) sector += 4;
 
-            write_flash_cr_snb(sl, sector);
+            cr = write_flash_cr_snb(sl, &b, sector);
+            cr_strt = 1 << FLASH_F4_CR_STRT;
         }
 
-        /* start erase operation */
-        set_flash_cr_strt(sl);
+        /* start erase operation, sent along with the selection */
+        stlink_batch_write32(&b, (sl->flash_type == STLINK_FLASH_TYPE_L4) ? STM32L4_FLASH_CR : FLASH_F4_CR,
+                cr | cr_strt);
+        stlink_batch_submit(sl, &b);
+        stlink_batch_free(&b);
 
         /* wait for completion */
-        wait_flash_busy(sl);
+        if (wait_flash_busy(sl, STLINK_FLASH_OP_ERASE, stlink_calculate_pagesize(sl, flashaddr)) == -1) {
+            lock_flash(sl);
+            return -1;
+        }
 
         /* relock the flash */
         //todo: fails to program if this is in
@@ -1624,9 +1893,8 @@ int stlink_erase_flash_page(stlink_t *sl, stm32_addr_t flashaddr)
            page erase command, even though PM0062 recommends to wait before it.
            Test shows that a few iterations is performed in the following loop
            before busy bit is cleared.*/
-        do {
-            stlink_read_debug32(sl, flash_regs_base + FLASH_SR_OFF, &val);
-        } while ((val & (1 << 0)) != 0);
+        if (wait_flash_sr(sl, flash_regs_base + FLASH_SR_OFF, 1 << 0, STLINK_FLASH_OP_ERASE, sl->flash_pgsz) == -1)
+            return -1;
 
         /* reset lock bits */
         stlink_read_debug32(sl, flash_regs_base + FLASH_PECR_OFF, &val);
@@ -1662,9 +1930,8 @@ int stlink_erase_flash_page(stlink_t *sl, stm32_addr_t flashaddr)
         val |= (1 << 16);
         stlink_write_debug32(sl, STM32G0_FLASH_CR, val);
         /* Wait for 'busy' bit in FLASH_SR to clear. */
-        do {
-            stlink_read_debug32(sl, STM32G0_FLASH_SR, &val);
-        } while ((val & (1 << 16)) != 0);
+        if (wait_flash_sr(sl, STM32G0_FLASH_SR, 1 << 16, STLINK_FLASH_OP_ERASE, sl->flash_pgsz) == -1)
+            return -1;
         /* Clear PER ('erase enable') bit. */
         stlink_read_debug32(sl, STM32G0_FLASH_CR, &val);
         val &= ~(0x00000002);
@@ -1675,43 +1942,49 @@ int stlink_erase_flash_page(stlink_t *sl, stm32_addr_t flashaddr)
         stlink_write_debug32(sl, STM32G0_FLASH_CR, val);
     } else if ((sl->flash_type == STLINK_FLASH_TYPE_F0) || ((sl->flash_type == STLINK_FLASH_TYPE_F1_XL) && (flashaddr < FLASH_BANK2_START_ADDR))) {
         /* wait for ongoing op to finish */
-        wait_flash_busy(sl);
+        if (wait_flash_busy(sl, STLINK_FLASH_OP_ERASE, 0) == -1)
+            return -1;
 
         /* unlock if locked */
         unlock_flash_if(sl);
 
-        /* set the page erase bit */
-        set_flash_cr_per(sl);
-
-        /* select the page to erase */
-        write_flash_ar(sl, flashaddr);
-
-        /* start erase operation, reset by hw with bsy bit */
-        set_flash_cr_strt(sl);
+        /* set the page erase bit, select the page to erase and start
+           the erase operation (reset by hw with bsy bit) in one go */
+        stlink_batch_t b;
+        stlink_batch_init(&b);
+        set_flash_cr_per(&b, flashaddr);
+        stlink_batch_submit(sl, &b);
+        stlink_batch_free(&b);
 
         /* wait for completion */
-        wait_flash_busy(sl);
+        if (wait_flash_busy(sl, STLINK_FLASH_OP_ERASE, stlink_calculate_pagesize(sl, flashaddr)) == -1) {
+            lock_flash(sl);
+            return -1;
+        }
 
         /* relock the flash */
         lock_flash(sl);
     } else if ((sl->flash_type == STLINK_FLASH_TYPE_F1_XL) && (flashaddr >= FLASH_BANK2_START_ADDR)) {
         /* wait for ongoing op to finish */
-        wait_flash_busy(sl);
+        if (wait_flash_busy(sl, STLINK_FLASH_OP_ERASE, 0) == -1)
+            return -1;
 
         /* unlock if locked */
         unlock_flash_if(sl);
 
-        /* set the page erase bit */
-        set_flash_cr2_per(sl);
-
-        /* select the page to erase */
-        write_flash_ar2(sl, flashaddr);
-
-        /* start erase operation, reset by hw with bsy bit */
-        set_flash_cr2_strt(sl);
+        /* set the page erase bit, select the page to erase and start
+           the erase operation (reset by hw with bsy bit) in one go */
+        stlink_batch_t b;
+        stlink_batch_init(&b);
+        set_flash_cr2_per(&b, flashaddr);
+        stlink_batch_submit(sl, &b);
+        stlink_batch_free(&b);
 
         /* wait for completion */
-        wait_flash_busy(sl);
+        if (wait_flash_busy(sl, STLINK_FLASH_OP_ERASE, stlink_calculate_pagesize(sl, flashaddr)) == -1) {
+            lock_flash(sl);
+            return -1;
+        }
 
         /* relock the flash */
         lock_flash(sl);
@@ -1726,6 +1999,7 @@ int stlink_erase_flash_page(stlink_t *sl, stm32_addr_t flashaddr)
 }
 
 int stlink_erase_flash_mass(stlink_t *sl) {
+    sl->flash_mass_erased = false;
     /* TODO: User MER bit to mass-erase G0 series. */
     if (sl->flash_type == STLINK_FLASH_TYPE_L0 || sl->flash_type == STLINK_FLASH_TYPE_G0) {
         /* erase each page */
@@ -1743,7 +2017,8 @@ int stlink_erase_flash_mass(stlink_t *sl) {
         fprintf(stdout, "\n");
     } else {
         /* wait for ongoing op to finish */
-        wait_flash_busy(sl);
+        if (wait_flash_busy(sl, STLINK_FLASH_OP_ERASE, 0) == -1)
+            return -1;
 
         /* unlock if locked */
         unlock_flash_if(sl);
@@ -1763,7 +2038,10 @@ int stlink_erase_flash_mass(stlink_t *sl) {
         }
 
         /* wait for completion */
-        wait_flash_busy_progress(sl);
+        if (wait_flash_busy_progress(sl) == -1) {
+            lock_flash(sl);
+            return -1;
+        }
 
         /* relock the flash */
         lock_flash(sl);
@@ -1778,6 +2056,7 @@ int stlink_erase_flash_mass(stlink_t *sl) {
 
         /* todo: verify the erased memory */
     }
+    sl->flash_mass_erased = true;
     return 0;
 }
 
@@ -1807,94 +2086,490 @@ int stlink_fcheck_flash(stlink_t *sl, const char* path, stm32_addr_t addr) {
  */
 int stlink_verify_write_flash(stlink_t *sl, stm32_addr_t address, uint8_t *data, unsigned length) {
     size_t off;
-    size_t cmp_size = (sl->flash_pgsz > 0x1800)? 0x1800:sl->flash_pgsz;
     ILOG("Starting verification of write complete\n");
-    for (off = 0; off < length; off += cmp_size) {
-        size_t aligned_size;
+    if (stlink_read_compare(sl, address, data, length, &off)) {
+        ELOG("Verification of flash failed at offset: %u\n", (unsigned int)off);
+        return -1;
+    }
+    ILOG("Flash written and verified! jolly good!\n");
+    return 0;
 
-        /* adjust last page size */
-        if ((off + cmp_size) > length)
-            cmp_size = length - off;
+}
 
-        aligned_size = cmp_size;
-        if (aligned_size & (4 - 1))
-            aligned_size = (cmp_size + 4) & ~(4 - 1);
+/* erased runs shorter than this are programmed along with the data around
+   them, restarting a loader or splitting a buffer costs more */
+#define FLASH_SKIP_MIN 256
 
-        stlink_read_mem32(sl, address + (uint32_t) off, aligned_size);
+/* true if the n bytes at p are what the erase left in flash anyway */
+static bool flash_erased(stlink_t *sl, const uint8_t *p, size_t n) {
+    const uint8_t erased = stlink_get_erased_pattern(sl);
 
-        if (memcmp(sl->q_buf, data + off, cmp_size)) {
-	  ELOG("Verification of flash failed at offset: %u\n", (unsigned int)off);
-            return -1;
-        }
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] != erased)
+            return false;
     }
-    ILOG("Flash written and verified! jolly good!\n");
-    return 0;
-
+    return true;
 }
 
-int stm32l1_write_half_pages(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t len, uint32_t pagesize)
-{
-    unsigned int count;
-    unsigned int num_half_pages = len / pagesize;
-    uint32_t val;
-    uint32_t flash_regs_base;
-    flash_loader_t fl;
+/*
+ * The next run of the image to program, at or after *off: skips the units
+ * that read as erased, then takes everything up to the first gap bytes or
+ * more of them. Returns its length and sets *off to its start, 0 when
+ * nothing is left.
+ */
+static size_t flash_next_run(stlink_t *sl, const uint8_t *base, size_t len, size_t *off, size_t unit, size_t gap) {
+    size_t start = *off, end, blank = 0;
+
+    while (start < len && flash_erased(sl, base + start, (len - start < unit) ? len - start : unit))
+        start += unit;
+
+    for (end = start; end < len && blank < gap; ) {
+        const size_t n = (len - end < unit) ? len - end : unit;
+
+        blank = flash_erased(sl, base + end, n) ? blank + n : 0;
+        end += n;
+    }
+
+    if (start > len)
+        start = len;
+    sl->stats.flash.sent -= start - *off;
+    *off = start;
+    return (start < len) ? end - blank - start : 0;
+}
 
+/* L0/L1: where the flash registers are, and the half page size */
+static void stm32l_flash_regs(stlink_t *sl, uint32_t *flash_regs_base, uint32_t *pagesize) {
     if (sl->chip_id == STLINK_CHIPID_STM32_L0 || sl->chip_id == STLINK_CHIPID_STM32_L0_CAT5 || sl->chip_id == STLINK_CHIPID_STM32_L0_CAT2 || sl->chip_id == STLINK_CHIPID_STM32_L011) {
-        flash_regs_base = STM32L0_FLASH_REGS_ADDR;
+        *flash_regs_base = STM32L0_FLASH_REGS_ADDR;
+        *pagesize = L0_WRITE_BLOCK_SIZE;
     } else {
-        flash_regs_base = STM32L_FLASH_REGS_ADDR;
+        *flash_regs_base = STM32L_FLASH_REGS_ADDR;
+        *pagesize = L1_WRITE_BLOCK_SIZE;
     }
+}
+
+/* L0/L1: submit b with a read of PECR at its end, and free it */
+static int stm32l_submit_read_pecr(stlink_t *sl, stlink_batch_t *b, uint32_t flash_regs_base, uint32_t *pecr) {
+    int i = stlink_batch_read32(b, flash_regs_base + FLASH_PECR_OFF);
+    int ret = (i < 0 || stlink_batch_submit(sl, b)) ? -1 : 0;
+
+    if (ret == 0)
+        *pecr = b->ops[i].value;
+    stlink_batch_free(b);
+    return ret;
+}
 
-    ILOG("Starting Half page flash write for STM32L core id\n");
-    /* flash loader initialization */
-    if (stlink_flash_loader_init(sl, &fl) == -1) {
-        WLOG("stlink_flash_loader_init() == -1\n");
+/* L0/L1: unlock PECR, and the program memory too if prg is set */
+static int stm32l_unlock_pecr(stlink_t *sl, uint32_t flash_regs_base, bool prg) {
+    stlink_batch_t b;
+    uint32_t val;
+
+    /* disable pecr protection */
+    stlink_batch_init(&b);
+    stlink_batch_write32(&b, flash_regs_base + FLASH_PEKEYR_OFF, 0x89abcdef);
+    stlink_batch_write32(&b, flash_regs_base + FLASH_PEKEYR_OFF, 0x02030405);
+
+    /* check pecr.pelock is cleared */
+    if (stm32l_submit_read_pecr(sl, &b, flash_regs_base, &val))
+        return -1;
+    if (val & (1 << 0)) {
+        ELOG("pecr.pelock not clear (%#x)\n", val);
         return -1;
     }
-    /* Unlock already done */
-    stlink_read_debug32(sl, flash_regs_base + FLASH_PECR_OFF, &val);
-    val |= (1 << FLASH_L1_FPRG);
-    stlink_write_debug32(sl, flash_regs_base + FLASH_PECR_OFF, val);
+    if (!prg)
+        return 0;
 
-    val |= (1 << FLASH_L1_PROG);
-    stlink_write_debug32(sl, flash_regs_base + FLASH_PECR_OFF, val);
-    do {
-        stlink_read_debug32(sl, flash_regs_base + FLASH_SR_OFF, &val);
-    } while ((val & (1 << 0)) != 0);
+    /* unlock program memory, only now: PRGKEYR written while PECR is
+       still locked locks PECR until the next reset */
+    stlink_batch_init(&b);
+    stlink_batch_write32(&b, flash_regs_base + FLASH_PRGKEYR_OFF, 0x8c9daebf);
+    stlink_batch_write32(&b, flash_regs_base + FLASH_PRGKEYR_OFF, 0x13141516);
 
-    for (count = 0; count  < num_half_pages; count ++) {
-        if (stlink_flash_loader_run(sl, &fl, addr + count * pagesize, base + count * pagesize, pagesize) == -1) {
-            WLOG("l1_stlink_flash_loader_run(%#zx) failed! == -1\n", addr + count * pagesize);
-            stlink_read_debug32(sl, flash_regs_base + FLASH_PECR_OFF, &val);
-            val &= ~((1 << FLASH_L1_FPRG) |(1 << FLASH_L1_PROG));
-            stlink_write_debug32(sl, flash_regs_base + FLASH_PECR_OFF, val);
-            return -1;
-        }
-        /* wait for sr.busy to be cleared */
-        if (sl->verbose >= 1) {
-            /* show progress. writing procedure is slow
-               and previous errors are misleading */
-            fprintf(stdout, "\r%3u/%u halfpages written", count + 1, num_half_pages);
-            fflush(stdout);
-        }
-        do {
-            stlink_read_debug32(sl, flash_regs_base + FLASH_SR_OFF, &val);
-        } while ((val & (1 << 0)) != 0);
+    /* check pecr.prglock is cleared */
+    if (stm32l_submit_read_pecr(sl, &b, flash_regs_base, &val))
+        return -1;
+    if (val & (1 << 1)) {
+        ELOG("pecr.prglock not clear (%#x)\n", val);
+        return -1;
     }
+
+    return 0;
+}
+
+/* L0/L1: reset the lock bits */
+static void stm32l_lock_pecr(stlink_t *sl, uint32_t flash_regs_base) {
+    uint32_t val;
+
     stlink_read_debug32(sl, flash_regs_base + FLASH_PECR_OFF, &val);
-    val &= ~(1 << FLASH_L1_PROG);
-    stlink_write_debug32(sl, flash_regs_base + FLASH_PECR_OFF, val);
-    stlink_read_debug32(sl, flash_regs_base + FLASH_PECR_OFF, &val);
-    val &= ~(1 << FLASH_L1_FPRG);
+    val |= (1 << 0) | (1 << 1) | (1 << 2);
     stlink_write_debug32(sl, flash_regs_base + FLASH_PECR_OFF, val);
+}
+
+/*
+ * Write len bytes to program memory or data eeprom with the L0/L1 loader,
+ * PECR unlocked. A loader run takes as much as fits in sram: the words up
+ * to the first half page, the half pages and the words after the last.
+ * Runs end at a half page boundary, so the next one starts at one.
+ */
+static int stm32l1_write_half_pages(stlink_t *sl, flash_loader_t *fl, stm32_addr_t addr, const uint8_t *base,
+        uint32_t len, uint32_t pagesize) {
+    size_t buf_size = (sl->sram_size / 2 > 0x4000) ? 0x4000 : sl->sram_size / 2;
+
+    buf_size &= ~(size_t) (pagesize - 1);
+    for (uint32_t off = 0; off < len; ) {
+        const stm32_addr_t target = addr + off;
+        uint32_t size = ((target + (uint32_t) buf_size) & ~(pagesize - 1)) - target;
+
+        if (size > len - off)
+            size = len - off;
+        if (stlink_flash_loader_run(sl, fl, target, base + off, size) == -1) {
+            ELOG("stlink_flash_loader_run(%#x) failed! == -1\n", target);
+            return -1;
+        }
+        off += size;
+        if (sl->verbose >= 1) {
+            /* show progress. writing procedure is slow
+               and previous errors are misleading */
+            fprintf(stdout, "\r%3u/%u halfpages written", (off + pagesize - 1) / pagesize,
+                    (len + pagesize - 1) / pagesize);
+            fflush(stdout);
+        }
+    }
 
     return 0;
 }
 
-int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t len, uint8_t eraseonly) {
-    size_t off;
+/* The same a word at a time, for where the loader fails: slow, but it
+   takes no sram and leaves the core alone */
+static int stm32l1_write_words(stlink_t *sl, uint32_t flash_regs_base, stm32_addr_t addr, const uint8_t *base,
+        uint32_t len) {
+    for (uint32_t off = 0; off < len; off += sizeof(uint32_t)) {
+        if (stlink_write_debug32(sl, addr + off, read_uint32(base, (int) off)) == -1
+                || wait_flash_sr(sl, flash_regs_base + FLASH_SR_OFF, 1 << 0, STLINK_FLASH_OP_PROGRAM, 4) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+int stlink_mwrite_eeprom(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr_t addr) {
+    /* write the block in the data eeprom at addr, a word at a time */
+    const uint32_t size = (length + 3) & ~3u;
+    uint32_t flash_regs_base;
+    uint32_t pagesize;
     flash_loader_t fl;
+    uint8_t *words;
+    bool loader;
+    int error = -1;
+
+    if (sl->flash_type != STLINK_FLASH_TYPE_L0 || sl->eeprom_size == 0) {
+        ELOG("no data eeprom on this chip\n");
+        return -1;
+    }
+
+    /* check addr range is inside the eeprom */
+    if (addr < sl->eeprom_base) {
+        ELOG("addr too low\n");
+        return -1;
+    } else if ((addr + size) < addr) {
+        ELOG("addr overruns\n");
+        return -1;
+    } else if ((addr + size) > (sl->eeprom_base + sl->eeprom_size)) {
+        ELOG("addr too high\n");
+        return -1;
+    } else if (addr & 3) {
+        ELOG("unaligned addr\n");
+        return -1;
+    }
+
+    words = malloc(size);
+    if (words == NULL)
+        return -1;
+    memcpy(words, data, length);
+    if (size > length) {
+        /* the last word keeps the bytes after the block */
+        uint32_t last;
+
+        if (stlink_read_debug32(sl, addr + size - 4, &last) == -1)
+            goto on_error;
+        for (uint32_t i = length; i < size; i++)
+            words[i] = (uint8_t) (last >> (8 * (i & 3)));
+    }
+
+    stm32l_flash_regs(sl, &flash_regs_base, &pagesize);
+    loader = (stlink_flash_loader_init(sl, &fl) != -1);
+    if (stm32l_unlock_pecr(sl, flash_regs_base, false) == -1)
+        goto on_error;
+    if (!loader || stm32l1_write_half_pages(sl, &fl, addr, words, size, pagesize) == -1) {
+        WLOG("flash loader failed, writing the data eeprom a word at a time\n");
+        stlink_force_debug(sl);
+        error = stm32l1_write_words(sl, flash_regs_base, addr, words, size);
+    } else {
+        error = 0;
+    }
+    stm32l_lock_pecr(sl, flash_regs_base);
+
+    /* check the block has been written */
+    if (error == 0 && (stlink_read_mem(sl, addr, words, size) == -1 || memcmp(words, data, length) != 0)) {
+        ELOG("eeprom verification failed\n");
+        error = -1;
+    }
+
+on_error:
+    free(words);
+    return error;
+}
+
+int stlink_fwrite_eeprom(stlink_t *sl, const char* path, stm32_addr_t addr) {
+    /* write the file in the data eeprom at addr */
+    mapped_file_t mf = MAPPED_FILE_INITIALIZER;
+    int error;
+
+    if (map_file(&mf, path) == -1) {
+        ELOG("map_file() == -1\n");
+        return -1;
+    }
+    error = stlink_mwrite_eeprom(sl, mf.base, (uint32_t) mf.len, addr);
+    unmap_file(&mf);
+
+    return error;
+}
+
+/* the CR value that starts erasing the page at flashaddr, for the flashing agent */
+static uint32_t flash_agent_erase_cr(stlink_t *sl, stm32_addr_t flashaddr) {
+    uint32_t sector;
+
+    if (sl->flash_type == STLINK_FLASH_TYPE_F4) {
+        if (sl->chip_id == STLINK_CHIPID_STM32_F7 || sl->chip_id == STLINK_CHIPID_STM32_F7XXXX) {
+            sector = calculate_F7_sectornum(flashaddr);
+        } else {
+            sector = calculate_F4_sectornum(flashaddr);
+            // the SNB values of the second bank on 2mb devices do not follow the first bank's
+            if (sector >= 12) sector += 4;
+        }
+        /* parallelism 32 bit, as for programming */
+        return (sector << FLASH_F4_CR_SNB) | (1 << FLASH_F4_CR_SER) | (2 << 8);
+    } else if (sl->flash_type == STLINK_FLASH_TYPE_L4) {
+        return (calculate_L4_page(sl, flashaddr) << STM32L4_FLASH_CR_PNB) | (1lu << STM32L4_FLASH_CR_PER);
+    }
+    return 1 << FLASH_CR_PER;
+}
+
+/* true if the flashing agent can write sl's flash */
+static bool flash_agent_for(stlink_t *sl) {
+    return sl->flash_agent && ((sl->flash_type == STLINK_FLASH_TYPE_F0) || (sl->flash_type == STLINK_FLASH_TYPE_F1_XL)
+            || (sl->flash_type == STLINK_FLASH_TYPE_F4) || (sl->flash_type == STLINK_FLASH_TYPE_L4));
+}
+
+/*
+ * The k-th of count pages in the order the agent does them. The first n1
+ * are in bank 1 of a F1 XL, the rest in bank 2 with a controller of its
+ * own; taking turns between them, one bank erases while the other programs.
+ */
+static size_t flash_agent_turn(size_t count, size_t n1, size_t k) {
+    const size_t n2 = count - n1, both = 2 * ((n1 < n2) ? n1 : n2);
+
+    if (k < both)
+        return (k % 2) ? n1 + k / 2 : k / 2;
+    return (n1 > n2) ? k - n2 : k;
+}
+
+/*
+ * Erase, blank check and program it all through the flashing agent: the
+ * whole plan is posted to its queue, the host only waits for free slots
+ * and buffers. Each page is erased before the one ahead of it is
+ * programmed, so on the F1 XL both banks are busy at the same time.
+ * Returns 1 if the agent cannot be used after all, or failed part way
+ * with the plan set to have the flash loaders erase every page again.
+ */
+static int stlink_write_flash_agent(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t len, uint8_t eraseonly,
+        stlink_erase_plan_t *plan) {
+    flash_agent_t ag;
+    unsigned int page_count = 0;
+    size_t n1 = plan->count;
+    int ret = 0;
+
+    if (plan->mass) {
+        if (stlink_erase_plan_run(sl, plan) == -1)
+            return -1;
+        /* nothing left to erase, should the loaders have to take over */
+        plan->mass = false;
+        for (size_t i = 0; i < plan->count; i++)
+            plan->pages[i].blank = true;
+    }
+
+    /* wait for ongoing op to finish */
+    if (wait_flash_busy(sl, STLINK_FLASH_OP_ERASE, 0) == -1)
+        return -1;
+
+    if (unlock_flash_if(sl) == -1)
+        return -1;
+
+    if (stlink_flash_agent_start(sl, &ag) != 0) {
+        lock_flash(sl);
+        return 1;
+    }
+
+    if (sl->flash_type == STLINK_FLASH_TYPE_F1_XL) {
+        for (n1 = 0; n1 < plan->count && plan->pages[n1].addr < FLASH_BANK2_START_ADDR; n1++)
+            ;
+    }
+
+    for (size_t k = 0; k <= plan->count && ret == 0; k++) {
+        const struct stlink_erase_page *p;
+        size_t off, end, size;
+
+        if (k < plan->count) {
+            p = &plan->pages[flash_agent_turn(plan->count, n1, k)];
+            if (!p->blank) {
+                ret = stlink_flash_agent_post(sl, &ag, STLINK_AGENT_ERASE, p->addr, p->size,
+                        flash_agent_erase_cr(sl, p->addr));
+                sl->flash_mass_erased = false;
+                page_count++;
+            }
+        }
+        if (k == 0 || ret == -1)
+            continue;
+
+        /* the page before: check it is blank up to where the write ends, the
+           verification covers the rest, then program what the erase did not
+           leave as it should be */
+        p = &plan->pages[flash_agent_turn(plan->count, n1, k - 1)];
+        end = (size_t) addr + len - p->addr;
+        if (!p->blank)
+            ret = stlink_flash_agent_post(sl, &ag, STLINK_AGENT_BLANK, p->addr,
+                    (uint32_t) ((end < p->size) ? ((end + 3) & ~(size_t) 3) : p->size), 0);
+
+        off = (p->addr > addr) ? p->addr - addr : 0;
+        end = (end < p->size) ? len : p->addr + p->size - addr;
+        while (!eraseonly && ret == 0 && (size = flash_next_run(sl, base, end, &off, ag.unit, FLASH_SKIP_MIN)) > 0) {
+            ret = stlink_flash_agent_program(sl, &ag, addr + (uint32_t) off, base + off, size);
+            off += size;
+        }
+    }
+
+    if (ret == -1 || stlink_flash_agent_finish(sl, &ag) == -1) {
+        WLOG("Failed to write flash through the flashing agent, falling back to the flash loaders\n");
+        stlink_force_debug(sl);
+        lock_flash(sl);
+        for (size_t i = 0; i < plan->count; i++)
+            plan->pages[i].blank = false;
+        return 1;
+    }
+
+    lock_flash(sl);
+    ILOG("Finished erasing %u pages%s through the flashing agent\n", page_count,
+            eraseonly ? "" : " and writing them");
+
+    return 0;
+}
+
+/*
+ * Fast programming on the L4 takes a mass erase of the flash before, with
+ * no page erased since; a plan that erases pages rules it out. Without
+ * the option, or otherwise, the flash is programmed the standard way.
+ */
+static bool flash_fast_for(stlink_t *sl, const stlink_erase_plan_t *plan) {
+    if (!sl->flash_fast_program || sl->flash_type != STLINK_FLASH_TYPE_L4)
+        return false;
+    if (plan->mass)
+        return true;
+    if (!sl->flash_mass_erased)
+        return false;
+    for (size_t i = 0; i < plan->count; i++) {
+        if (!plan->pages[i].blank)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Program the runs of base that are not erased already with FSTPG set,
+ * padded out to whole rows with the erased value. The rows lie in flash
+ * erased just before, so the padding leaves it as it is.
+ */
+static int flash_write_rows(stlink_t *sl, flash_loader_t *fl, stm32_addr_t addr, const uint8_t *base, size_t len) {
+    const size_t buf_size = (sl->sram_size > 0x8000) ? 0x8000 : 0x4000;
+    uint8_t *rows = NULL;
+    size_t off, size;
+
+    for (off = 0; (size = flash_next_run(sl, base, len, &off, 8, FLASH_SKIP_MIN)) > 0; off += size) {
+        const stm32_addr_t start = (addr + (uint32_t) off) & ~(uint32_t) (STM32G0_FLASH_ROW - 1);
+        const size_t n = (addr + off + size - start + STM32G0_FLASH_ROW - 1) & ~(size_t) (STM32G0_FLASH_ROW - 1);
+        uint8_t *p = realloc(rows, n);
+
+        if (p == NULL) {
+            free(rows);
+            return -1;
+        }
+        rows = p;
+        memset(rows, stlink_get_erased_pattern(sl), n);
+        memcpy(rows + (addr + off - start), base + off, size);
+        sl->stats.flash.sent += n - size;
+
+        for (size_t k = 0; k < n; k += buf_size) {
+            const size_t chunk = fl->pp_size ? n : ((n - k > buf_size) ? buf_size : n - k);
+
+            if (stlink_flash_loader_run(sl, fl, start + (uint32_t) k, rows + k, chunk) == -1) {
+                ELOG("stlink_flash_loader_run(%#x) failed! == -1\n", start + (uint32_t) k);
+                free(rows);
+                return -1;
+            }
+            /* the double buffered loader streams it all in one run */
+            if (fl->pp_size)
+                break;
+        }
+    }
+    free(rows);
+    return 0;
+}
+
+/*
+ * Program the runs of base that are not erased already on the G0 a double
+ * word at a time, with PG set. Both words and the status read go out as
+ * one batch.
+ */
+static int stm32g0_write_dwords(stlink_t *sl, stm32_addr_t addr, const uint8_t *base, size_t len) {
+    stlink_batch_t b;
+    size_t off, size;
+    int ret = 0;
+
+    stlink_batch_init(&b);
+    for (off = 0; ret == 0 && (size = flash_next_run(sl, base, len, &off, 8, FLASH_SKIP_MIN)) > 0; off += size) {
+        for (size_t k = off; k < off + size; k += 2 * sizeof(uint32_t)) {
+            uint32_t data = 0;
+            int sr;
+
+            stlink_batch_reset(&b);
+            stlink_batch_write32(&b, addr + (uint32_t) k, read_uint32(base, (int) k));
+            /* Do we need a dummy write? See sec 3.3.8 of RM0444. */
+            if (k + sizeof(uint32_t) < len)
+                data = read_uint32(base, (int) (k + sizeof(uint32_t)));
+            stlink_batch_write32(&b, addr + (uint32_t) (k + sizeof(uint32_t)), data);
+            sr = stlink_batch_read32(&b, STM32G0_FLASH_SR);
+            if (stlink_batch_submit(sl, &b) || sr < 0) {
+                ret = -1;
+                break;
+            }
+            /* Wait for 'busy' bit in FLASH_SR to clear. */
+            if ((b.ops[sr].value & (1 << 16)) != 0
+                    && wait_flash_sr(sl, STM32G0_FLASH_SR, 1 << 16, STLINK_FLASH_OP_PROGRAM, 2 * sizeof(uint32_t)) == -1) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    stlink_batch_free(&b);
+    return ret;
+}
+
+static int write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t len, uint8_t eraseonly) {
+    struct stlink_flash_range range;
+    stlink_erase_plan_t plan;
+    size_t off, size;
+    flash_loader_t fl;
+    bool fast;
+    int ret;
     ILOG("Attempting to write %d (%#x) bytes to stm32 address: %u (%#x)\n",
             len, len, addr, addr);
     /* check addr range is inside the flash */
@@ -1921,25 +2596,40 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
 
     // Make sure we've loaded the context with the chip details
     stlink_core_id(sl);
-    /* erase each page */
-    int page_count = 0;
-    for (off = 0; off < len; off += stlink_calculate_pagesize(sl, addr + (uint32_t) off)) {
-        /* addr must be an addr inside the page */
-        if (stlink_erase_flash_page(sl, addr + (uint32_t) off) == -1) {
-            ELOG("Failed to erase_flash_page(%#zx) == -1\n", addr + off);
-            return -1;
+
+    /* the pages to erase, all in one go */
+    range.addr = addr;
+    range.len = len;
+    if (stlink_erase_plan(sl, &range, 1, STLINK_ERASE_BLANK_CHECK | (sl->allow_mass_erase ? STLINK_ERASE_MASS : 0),
+                &plan) == -1)
+        return -1;
+    if (sl->flash_dry_run) {
+        char *text;
+
+        size = stlink_format_erase_plan(&plan, NULL, 0);
+        text = malloc(size + 1);
+        if (text) {
+            stlink_format_erase_plan(&plan, text, size + 1);
+            fputs(text, stdout);
+            free(text);
         }
-        fprintf(stdout,"\rFlash page at addr: 0x%08lx erased",
-                (unsigned long)(addr + off));
-        fflush(stdout);
-        page_count++;
+        stlink_erase_plan_free(&plan);
+        return 0;
     }
-    fprintf(stdout,"\n");
-    ILOG("Finished erasing %d pages of %d (%#x) bytes\n",
-            page_count, sl->flash_pgsz, sl->flash_pgsz);
 
-    if (eraseonly)
-        return 0;
+    /* the flashing agent does it all from one queue, where there is one;
+       it has no fast programming */
+    fast = !eraseonly && flash_fast_for(sl, &plan);
+    ret = (flash_agent_for(sl) && !fast) ? stlink_write_flash_agent(sl, addr, base, len, eraseonly, &plan) : 1;
+    if (ret != 1) {
+        stlink_erase_plan_free(&plan);
+        return (ret == 0 && !eraseonly) ? stlink_verify_write_flash(sl, addr, base, len) : ret;
+    }
+
+    ret = stlink_erase_plan_run(sl, &plan);
+    stlink_erase_plan_free(&plan);
+    if (ret == -1 || eraseonly)
+        return ret;
 
     if ((sl->flash_type == STLINK_FLASH_TYPE_F4) || (sl->flash_type == STLINK_FLASH_TYPE_L4)) {
         /* todo: check write operation */
@@ -1990,12 +2680,31 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
             }
         }
 
+        if (fast && sl->flash_mass_erased) {
+            uint32_t val;
+
+            ILOG("Fast programming after a mass erase\n");
+            stlink_read_debug32(sl, STM32L4_FLASH_CR, &val);
+            val &= ~STM32L4_FLASH_CR_OPBITS;
+            stlink_write_debug32(sl, STM32L4_FLASH_CR, val | (1lu << STM32L4_FLASH_CR_FSTPG));
+            ret = flash_write_rows(sl, &fl, addr, base, len);
+            stlink_write_debug32(sl, STM32L4_FLASH_CR, val);
+            lock_flash(sl);
+            return (ret == -1) ? -1 : stlink_verify_write_flash(sl, addr, base, len);
+        }
+
         /* set programming mode */
         set_flash_cr_pg(sl);
 
 		size_t buf_size = (sl->sram_size > 0x8000) ? 0x8000 : 0x4000;
-        for(off = 0; off < len;) {
-            size_t size = len - off > buf_size ? buf_size : len - off;
+        if (fl.pp_size) {
+            /* the double buffered loader streams it all in one run */
+            buf_size = len;
+        }
+        /* what is erased already need not be written */
+        for (off = 0; (size = flash_next_run(sl, base, len, &off, 8, FLASH_SKIP_MIN)) > 0; off += size) {
+            if (size > buf_size)
+                size = buf_size;
 
             printf("size: %u\n", (unsigned int)size);
 
@@ -2003,8 +2712,6 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
                 ELOG("stlink_flash_loader_run(%#zx) failed! == -1\n", addr + off);
                 return -1;
             }
-
-            off += size;
         }
 
         /* Relock flash */
@@ -2012,7 +2719,16 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
 
     }	//STM32F4END
     else if (sl->flash_type == STLINK_FLASH_TYPE_G0) {
-        uint32_t val;
+        /* whole rows through the loader only with the option */
+        bool rows = sl->flash_fast_program;
+        uint32_t val, mode;
+
+        ILOG("Starting Flash write for G0\n");
+        if (rows && stlink_flash_loader_init(sl, &fl) == -1) {
+            WLOG("stlink_flash_loader_init() == -1, writing a double word at a time\n");
+            rows = false;
+        }
+
         /* Unlock flash. */
         stlink_read_debug32(sl, STM32G0_FLASH_CR, &val);
         if ((val & (1<<31))) {
@@ -2026,125 +2742,59 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
                 return -1;
             }
         }
-        /* Set PG 'allow programming' bit. */
+        /* Fast programming whole rows at a time, or set PG 'allow
+           programming' bit */
+        mode = rows ? (1 << STM32G0_FLASH_CR_FSTPG) : 0x00000001;
         stlink_read_debug32(sl, STM32G0_FLASH_CR, &val);
-        val |= 0x00000001;
+        val |= mode;
         stlink_write_debug32(sl, STM32G0_FLASH_CR, val);
-        /* Write all words. */
-        off = 0;
-        for ( ; off < len; off += sizeof(uint32_t)) {
-            uint32_t data;
-            if (off > 254)
-                fprintf(stdout, "\r");
-
-            if ((off % sl->flash_pgsz) > (sl->flash_pgsz -5)) {
-                fprintf(stdout, "\r%3u/%3u pages written",
-                        (unsigned int)(off/sl->flash_pgsz),
-                        (unsigned int)(len/sl->flash_pgsz));
-                fflush(stdout);
-            }
-            write_uint32((unsigned char*) &data, *(uint32_t*) (base + off));
-            stlink_write_debug32(sl, addr + (uint32_t) off, data);
-            /* Wait for 'busy' bit in FLASH_SR to clear. */
-            do {
-                stlink_read_debug32(sl, STM32G0_FLASH_SR, &val);
-            } while ((val & (1 << 16)) != 0);
-        }
-        /* Do we need a dummy write? See sec 3.3.8 of RM0444. */
-        /* (Flash writes happen 2 words at a time.) */
-        if ((off / sizeof(uint32_t)) % 2 != 0) {
-            /* Write a single word of zeros. */
-            stlink_write_debug32(sl, addr + (uint32_t) off, 0);
-            /* Wait for 'busy' bit in FLASH_SR to clear. */
-            do {
-                stlink_read_debug32(sl, STM32G0_FLASH_SR, &val);
-            } while ((val & (1 << 16)) != 0);
-        }
-        /* Reset PG bit. */
+
+        if (rows)
+            ret = flash_write_rows(sl, &fl, addr, base, len);
+        else
+            ret = stm32g0_write_dwords(sl, addr, base, len);
+
+        /* Reset FSTPG or PG bit. */
         stlink_read_debug32(sl, STM32G0_FLASH_CR, &val);
-        val &= ~(0x00000001);
+        val &= ~mode;
         stlink_write_debug32(sl, STM32G0_FLASH_CR, val);
         /* Re-lock flash. */
         stlink_read_debug32(sl, STM32G0_FLASH_CR, &val);
         val |= 0x80000000;
         stlink_write_debug32(sl, STM32G0_FLASH_CR, val);
+        if (ret == -1)
+            return -1;
     }
     else if (sl->flash_type == STLINK_FLASH_TYPE_L0) {
-        /* use fast word write. todo: half page. */
-        uint32_t val;
         uint32_t flash_regs_base;
         uint32_t pagesize;
 
-        if (sl->chip_id == STLINK_CHIPID_STM32_L0 || sl->chip_id == STLINK_CHIPID_STM32_L0_CAT5 || sl->chip_id == STLINK_CHIPID_STM32_L0_CAT2 || sl->chip_id == STLINK_CHIPID_STM32_L011) {
-            flash_regs_base = STM32L0_FLASH_REGS_ADDR;
-            pagesize = L0_WRITE_BLOCK_SIZE;
-        } else {
-            flash_regs_base = STM32L_FLASH_REGS_ADDR;
-            pagesize = L1_WRITE_BLOCK_SIZE;
-        }
-
-        /* todo: check write operation */
-
-        /* disable pecr protection */
-        stlink_write_debug32(sl, flash_regs_base + FLASH_PEKEYR_OFF, 0x89abcdef);
-        stlink_write_debug32(sl, flash_regs_base + FLASH_PEKEYR_OFF, 0x02030405);
+        stm32l_flash_regs(sl, &flash_regs_base, &pagesize);
 
-        /* check pecr.pelock is cleared */
-        stlink_read_debug32(sl, flash_regs_base + FLASH_PECR_OFF, &val);
-        if (val & (1 << 0)) {
-            fprintf(stderr, "pecr.pelock not clear\n");
+        ILOG("Starting Flash write for L0/L1\n");
+        bool loader = (stlink_flash_loader_init(sl, &fl) != -1);
+        if (!loader)
+            WLOG("stlink_flash_loader_init() == -1, writing a word at a time\n");
+        if (stm32l_unlock_pecr(sl, flash_regs_base, true) == -1)
             return -1;
-        }
 
-        /* unlock program memory */
-        stlink_write_debug32(sl, flash_regs_base + FLASH_PRGKEYR_OFF, 0x8c9daebf);
-        stlink_write_debug32(sl, flash_regs_base + FLASH_PRGKEYR_OFF, 0x13141516);
-
-        /* check pecr.prglock is cleared */
-        stlink_read_debug32(sl, flash_regs_base + FLASH_PECR_OFF, &val);
-        if (val & (1 << 1)) {
-            fprintf(stderr, "pecr.prglock not clear\n");
-            return -1;
-        }
-        off = 0;
-        if (len > pagesize) {
-            if (stm32l1_write_half_pages(sl, addr, base, len, pagesize) == -1) {
+        /* what is erased already need not be written */
+        for (off = 0; (size = flash_next_run(sl, base, len, &off, sizeof(uint32_t), FLASH_SKIP_MIN)) > 0; off += size) {
+            if (loader && stm32l1_write_half_pages(sl, &fl, addr + (uint32_t) off, base + off, (uint32_t) size, pagesize) == 0)
+                continue;
+            if (loader) {
                 /* This may happen on a blank device! */
-                WLOG("\nwrite_half_pages failed == -1\n");
-            } else {
-                off = (len / pagesize)*pagesize;
+                WLOG("\nwrite_half_pages failed == -1, writing a word at a time\n");
+                stlink_force_debug(sl);
+                loader = false;
             }
-        }
-
-        /* write remainingword in program memory */
-        for ( ; off < len; off += sizeof(uint32_t)) {
-            uint32_t data;
-            if (off > 254)
-                fprintf(stdout, "\r");
-
-            if ((off % sl->flash_pgsz) > (sl->flash_pgsz -5)) {
-                fprintf(stdout, "\r%3u/%3u pages written",
-                        (unsigned int)(off/sl->flash_pgsz),
-			(unsigned int)(len/sl->flash_pgsz));
-                fflush(stdout);
+            if (stm32l1_write_words(sl, flash_regs_base, addr + (uint32_t) off, base + off, (uint32_t) size) == -1) {
+                stm32l_lock_pecr(sl, flash_regs_base);
+                return -1;
             }
-
-            write_uint32((unsigned char*) &data, *(uint32_t*) (base + off));
-            stlink_write_debug32(sl, addr + (uint32_t) off, data);
-
-            /* wait for sr.busy to be cleared */
-            do {
-                stlink_read_debug32(sl, flash_regs_base + FLASH_SR_OFF, &val);
-            } while ((val & (1 << 0)) != 0);
-
-            /* todo: check redo write operation */
-
         }
         fprintf(stdout, "\n");
-        /* reset lock bits */
-        stlink_read_debug32(sl, flash_regs_base + FLASH_PECR_OFF, &val);
-        val |= (1 << 0) | (1 << 1) | (1 << 2);
-        stlink_write_debug32(sl, flash_regs_base + FLASH_PECR_OFF, val);
+        stm32l_lock_pecr(sl, flash_regs_base);
     } else if ((sl->flash_type == STLINK_FLASH_TYPE_F0) || (sl->flash_type == STLINK_FLASH_TYPE_F1_XL)) {
         ILOG("Starting Flash write for VL/F0/F3/F1_XL core id\n");
         /* flash loader initialization */
@@ -2153,11 +2803,13 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
             return -1;
         }
 
-        int write_block_count = 0;
-        for (off = 0; off < len; off += sl->flash_pgsz) {
-            /* adjust last write size */
-            size_t size = sl->flash_pgsz;
-            if ((off + sl->flash_pgsz) > len) size = len - off;
+        /* the double buffered loader streams it all in one run */
+        const size_t step = fl.pp_size ? len : sl->flash_pgsz;
+        const unsigned long pages = (unsigned long) ((len + sl->flash_pgsz - 1) / sl->flash_pgsz);
+        /* what is erased already need not be written */
+        for (off = 0; (size = flash_next_run(sl, base, len, &off, 8, FLASH_SKIP_MIN)) > 0; off += size) {
+            if (size > step)
+                size = step;
 
             /* unlock and set programming mode */
             unlock_flash_if(sl);
@@ -2173,7 +2825,8 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
             if (sl->verbose >= 1) {
                 /* show progress. writing procedure is slow
                    and previous errors are misleading */
-                fprintf(stdout, "\r%3u/%lu pages written", ++write_block_count, (unsigned long)((len+sl->flash_pgsz-1)/sl->flash_pgsz));
+                fprintf(stdout, "\r%3lu/%lu pages written",
+                        (unsigned long) ((off + size + sl->flash_pgsz - 1) / sl->flash_pgsz), pages);
                 fflush(stdout);
             }
         }
@@ -2186,6 +2839,81 @@ int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t
     return stlink_verify_write_flash(sl, addr, base, len);
 }
 
+int stlink_write_flash(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t len, uint8_t eraseonly) {
+    const uint64_t t0 = stlink_now_us(sl);
+    int ret;
+
+    /* sent as it is, less what reads as erased or goes out compressed */
+    if (!eraseonly) {
+        sl->stats.flash.bytes += len;
+        sl->stats.flash.sent += len;
+    }
+    ret = write_flash(sl, addr, base, len, eraseonly);
+    if (!eraseonly)
+        sl->stats.flash.total_us += stlink_now_us(sl) - t0;
+
+    return ret;
+}
+
+/* erase and program the pages from addr + off on, as one write */
+static int stlink_write_flash_run(stlink_t *sl, stm32_addr_t addr, uint8_t* base, size_t off, size_t len, uint8_t eraseonly) {
+    if (len == 0)
+        return 0;
+    return stlink_write_flash(sl, addr + (uint32_t) off, base + off, (uint32_t) len, eraseonly);
+}
+
+/**
+ * Like stlink_write_flash(), but compare each page (or sector, as given
+ * by stlink_calculate_pagesize()) first, and only erase and program the
+ * runs of pages that differ from base.
+ */
+int stlink_write_flash_delta(stlink_t *sl, stm32_addr_t addr, uint8_t* base, uint32_t len, uint8_t eraseonly) {
+    size_t off, size, run = 0, run_len = 0;
+    size_t skip = 0, skip_len = 0;
+    unsigned int pages = 0, skipped = 0;
+    int ret = 0;
+
+    if (addr < sl->flash_base || (uint64_t) addr + len > (uint64_t) sl->flash_base + sl->flash_size) {
+        ELOG("%#x+%#x is not inside the flash\n", addr, len);
+        return -1;
+    }
+
+    for (off = 0; off < len; off += size) {
+        const uint32_t pgsz = stlink_calculate_pagesize(sl, addr + (uint32_t) off);
+        size = (len - off > pgsz) ? pgsz : len - off;
+
+        pages++;
+        if (stlink_read_compare(sl, addr + (uint32_t) off, base + off, size, NULL) != 0) {
+            if (skip_len) {
+                ILOG("Skipping unchanged flash at %#zx-%#zx\n", addr + skip, addr + skip + skip_len - 1);
+                skip_len = 0;
+            }
+            if (run_len == 0)
+                run = off;
+            run_len += size;
+            continue;
+        }
+
+        skipped++;
+        if (skip_len == 0)
+            skip = off;
+        skip_len += size;
+        ret = stlink_write_flash_run(sl, addr, base, run, run_len, eraseonly);
+        run_len = 0;
+        if (ret)
+            break;
+    }
+
+    if (ret == 0) {
+        if (skip_len)
+            ILOG("Skipping unchanged flash at %#zx-%#zx\n", addr + skip, addr + skip + skip_len - 1);
+        ret = stlink_write_flash_run(sl, addr, base, run, run_len, eraseonly);
+        ILOG("Delta write: %u of %u pages unchanged and skipped\n", skipped, pages);
+    }
+
+    return ret;
+}
+
 // note: length not checked
 static uint8_t stlink_parse_hex(const char* hex) {
     uint8_t d[2];
@@ -2349,8 +3077,8 @@ uint8_t stlink_get_erased_pattern(stlink_t *sl) {
         return 0xff;
 }
 
-int stlink_mwrite_flash(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr_t addr) {
-    /* write the block in flash at addr */
+/* Write an image, leaving out the erased bytes at its end */
+static int stlink_write_image(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr_t addr, bool delta) {
     int err;
     unsigned int num_empty, idx;
     uint8_t erased_pattern = stlink_get_erased_pattern(sl);
@@ -2366,23 +3094,32 @@ int stlink_mwrite_flash(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr
     if(num_empty != 0) {
         ILOG("Ignoring %d bytes of 0x%02x at end of file\n", num_empty, erased_pattern);
     }
-    err = stlink_write_flash(sl, addr, data, (num_empty == length) ? (uint32_t) length : (uint32_t) length - num_empty, num_empty == length);
+    const uint8_t eraseonly = (num_empty == length);
+    if (!eraseonly)
+        length -= num_empty;
+    if (delta)
+        err = stlink_write_flash_delta(sl, addr, data, length, eraseonly);
+    else
+        err = stlink_write_flash(sl, addr, data, length, eraseonly);
     stlink_fwrite_finalize(sl, addr);
     return err;
 }
 
+int stlink_mwrite_flash(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr_t addr) {
+    /* write the block in flash at addr */
+    return stlink_write_image(sl, data, length, addr, false);
+}
+
 /**
- * Write the given binary file into flash at address "addr"
- * @param sl
- * @param path readable file path, should be binary image
- * @param addr where to start writing
- * @return 0 on success, -ve on failure.
+ * Like stlink_mwrite_flash(), but only erase and program the pages that
+ * do not hold the data already, see stlink_write_flash_delta()
  */
-int stlink_fwrite_flash(stlink_t *sl, const char* path, stm32_addr_t addr) {
-    /* write the file in flash at addr */
+int stlink_mwrite_flash_delta(stlink_t *sl, uint8_t* data, uint32_t length, stm32_addr_t addr) {
+    return stlink_write_image(sl, data, length, addr, true);
+}
+
+static int stlink_fwrite_image(stlink_t *sl, const char* path, stm32_addr_t addr, bool delta) {
     int err;
-    unsigned int num_empty, idx;
-    uint8_t erased_pattern = stlink_get_erased_pattern(sl);
     mapped_file_t mf = MAPPED_FILE_INITIALIZER;
 
     if (map_file(&mf, path) == -1) {
@@ -2390,19 +3127,28 @@ int stlink_fwrite_flash(stlink_t *sl, const char* path, stm32_addr_t addr) {
         return -1;
     }
 
-    idx = (unsigned int) mf.len;
-    for(num_empty = 0; num_empty != mf.len; ++num_empty) {
-        if (mf.base[--idx] != erased_pattern) {
-            break;
-        }
-    }
-    /* Round down to words */
-    num_empty -= (num_empty & 3);
-    if(num_empty != 0) {
-        ILOG("Ignoring %d bytes of 0x%02x at end of file\n", num_empty, erased_pattern);
-    }
-    err = stlink_write_flash(sl, addr, mf.base, (num_empty == mf.len) ? (uint32_t) mf.len : (uint32_t) mf.len - num_empty, num_empty == mf.len);
-    stlink_fwrite_finalize(sl, addr);
+    err = stlink_write_image(sl, mf.base, (uint32_t) mf.len, addr, delta);
     unmap_file(&mf);
     return err;
 }
+
+/**
+ * Write the given binary file into flash at address "addr"
+ * @param sl
+ * @param path readable file path, should be binary image
+ * @param addr where to start writing
+ * @return 0 on success, -ve on failure.
+ */
+int stlink_fwrite_flash(stlink_t *sl, const char* path, stm32_addr_t addr) {
+    /* write the file in flash at addr */
+    return stlink_fwrite_image(sl, path, addr, false);
+}
+
+/**
+ * Write the given binary file into flash at address "addr", skipping the
+ * pages that already hold their part of it
+ * @return 0 on success, -ve on failure.
+ */
+int stlink_fwrite_flash_delta(stlink_t *sl, const char* path, stm32_addr_t addr) {
+    return stlink_fwrite_image(sl, path, addr, true);
+}
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stlink.h"
+#include "stlink/erase.h"
+#include "stlink/logging.h"
+#include "stats_internal.h"
+
+/* pages that take this long to erase are worth a blank check of their own,
+   for smaller ones the check costs about as much as it saves */
+#define ERASE_CHECK_PAGE_US 50000
+
+int stlink_flash_geometry(stlink_t *sl, struct stlink_flash_geometry *g) {
+    const size_t pgsz = sl->flash_pgsz;
+    stm32_addr_t addr = (stm32_addr_t) sl->flash_base;
+    const stm32_addr_t end = addr + (uint32_t) sl->flash_size;
+    struct stlink_flash_region *r = NULL;
+
+    g->count = 0;
+    while (addr < end) {
+        const uint32_t size = stlink_calculate_pagesize(sl, addr);
+
+        if (size == 0)
+            break;
+        if (r == NULL || r->size != size) {
+            if (g->count == STLINK_FLASH_REGIONS_MAX) {
+                sl->flash_pgsz = pgsz;
+                return -1;
+            }
+            r = &g->region[g->count++];
+            r->addr = addr;
+            r->size = size;
+            r->count = 0;
+        }
+        r->count++;
+        addr += size;
+    }
+
+    /* stlink_calculate_pagesize() leaves the size of the page it was asked about */
+    sl->flash_pgsz = pgsz;
+    return 0;
+}
+
+static bool erase_range_touches(const struct stlink_flash_range *ranges, size_t n,
+        stm32_addr_t addr, uint32_t size) {
+    for (size_t i = 0; i < n; i++) {
+        if (ranges[i].len && ranges[i].addr < (uint64_t) addr + size
+                && addr < (uint64_t) ranges[i].addr + ranges[i].len)
+            return true;
+    }
+    return false;
+}
+
+/* true if the target finds len bytes from addr erased */
+static bool erase_blank(stlink_t *sl, stm32_addr_t addr, uint32_t len) {
+    uint8_t erased[256];
+    uint32_t crc = 0, target;
+
+    memset(erased, stlink_get_erased_pattern(sl), sizeof(erased));
+    for (uint32_t off = 0; off < len; off += sizeof(erased))
+        crc = stlink_crc32(crc, erased, (len - off < sizeof(erased)) ? len - off : sizeof(erased));
+
+    return stlink_flash_crc32(sl, addr, len, &target) == 0 && target == crc;
+}
+
+/* check the runs of adjacent pages as a whole, then the big pages on their own */
+static void erase_check_blank(stlink_t *sl, stlink_erase_plan_t *plan) {
+    size_t i = 0;
+
+    while (i < plan->count) {
+        const stm32_addr_t start = plan->pages[i].addr;
+        stm32_addr_t end = start;
+        size_t j = i;
+
+        while (j < plan->count && plan->pages[j].addr == end)
+            end += plan->pages[j++].size;
+
+        if (erase_blank(sl, start, end - start)) {
+            for (; i < j; i++)
+                plan->pages[i].blank = true;
+            continue;
+        }
+        if (j - i == 1) {
+            i = j;
+            continue;
+        }
+        for (; i < j; i++) {
+            struct stlink_erase_page *p = &plan->pages[i];
+
+            if (stlink_flash_op_us(sl, STLINK_FLASH_OP_ERASE, p->size) >= ERASE_CHECK_PAGE_US)
+                p->blank = erase_blank(sl, p->addr, p->size);
+        }
+    }
+}
+
+/* the pages of g the ranges touch, stored to pages unless it is NULL; returns their number */
+static size_t erase_pages(const struct stlink_flash_geometry *g, const struct stlink_flash_range *ranges,
+        size_t n, struct stlink_erase_page *pages) {
+    size_t count = 0;
+
+    for (size_t r = 0; r < g->count; r++) {
+        for (uint32_t k = 0; k < g->region[r].count; k++) {
+            const uint32_t size = g->region[r].size;
+            const stm32_addr_t addr = g->region[r].addr + k * size;
+
+            if (!erase_range_touches(ranges, n, addr, size))
+                continue;
+            if (pages) {
+                pages[count].addr = addr;
+                pages[count].size = size;
+                pages[count].blank = false;
+            }
+            count++;
+        }
+    }
+
+    return count;
+}
+
+int stlink_erase_plan(stlink_t *sl, const struct stlink_flash_range *ranges, size_t n,
+        unsigned int flags, stlink_erase_plan_t *plan) {
+    struct stlink_flash_geometry g;
+
+    memset(plan, 0, sizeof(*plan));
+    if (stlink_flash_geometry(sl, &g) == -1) {
+        ELOG("no flash geometry for chip %#x\n", sl->chip_id);
+        return -1;
+    }
+
+    plan->count = erase_pages(&g, ranges, n, NULL);
+    if (plan->count) {
+        plan->pages = calloc(plan->count, sizeof(*plan->pages));
+        if (plan->pages == NULL)
+            return -1;
+        erase_pages(&g, ranges, n, plan->pages);
+    }
+
+    if ((flags & STLINK_ERASE_BLANK_CHECK) && plan->count)
+        erase_check_blank(sl, plan);
+
+    for (size_t i = 0; i < plan->count; i++) {
+        if (!plan->pages[i].blank)
+            plan->pages_us += stlink_flash_op_us(sl, STLINK_FLASH_OP_ERASE, plan->pages[i].size);
+    }
+    /* L0/L1 and G0 mass erase page by page */
+    if (sl->flash_type == STLINK_FLASH_TYPE_L0 || sl->flash_type == STLINK_FLASH_TYPE_G0) {
+        for (size_t r = 0; r < g.count; r++)
+            plan->mass_us += g.region[r].count * stlink_flash_op_us(sl, STLINK_FLASH_OP_ERASE, g.region[r].size);
+    } else {
+        plan->mass_us = stlink_flash_op_us(sl, STLINK_FLASH_OP_MASS_ERASE, sl->flash_size);
+    }
+
+    plan->mass = (flags & STLINK_ERASE_MASS) && plan->mass_us && plan->mass_us < plan->pages_us;
+    plan->est_us = plan->mass ? plan->mass_us : plan->pages_us;
+
+    return 0;
+}
+
+int stlink_erase_plan_run(stlink_t *sl, const stlink_erase_plan_t *plan) {
+    int page_count = 0;
+
+    if (plan->mass)
+        return stlink_erase_flash_mass(sl);
+
+    for (size_t i = 0; i < plan->count; i++) {
+        if (plan->pages[i].blank)
+            continue;
+        if (stlink_erase_flash_page(sl, plan->pages[i].addr) == -1) {
+            ELOG("Failed to erase_flash_page(%#x) == -1\n", plan->pages[i].addr);
+            return -1;
+        }
+        fprintf(stdout,"\rFlash page at addr: 0x%08lx erased",
+                (unsigned long) plan->pages[i].addr);
+        fflush(stdout);
+        page_count++;
+    }
+    if (page_count)
+        fprintf(stdout,"\n");
+    ILOG("Finished erasing %d of %u pages, the rest was blank\n", page_count, (unsigned int) plan->count);
+
+    return 0;
+}
+
+size_t stlink_format_erase_plan(const stlink_erase_plan_t *plan, char *buf, size_t size) {
+    size_t len = 0, blank = 0;
+
+    for (size_t i = 0; i < plan->count; i++)
+        blank += plan->pages[i].blank;
+
+    if (plan->mass)
+        stlink_appendf(buf, size, &len,
+                "erase plan: mass erase, %.1f ms estimated (%u pages one by one: %.1f ms)\n",
+                plan->est_us / 1000.0, (unsigned int) (plan->count - blank), plan->pages_us / 1000.0);
+    else
+        stlink_appendf(buf, size, &len,
+                "erase plan: %u pages, %u of them blank, %.1f ms estimated (mass erase: %.1f ms)\n",
+                (unsigned int) plan->count, (unsigned int) blank, plan->est_us / 1000.0,
+                plan->mass_us / 1000.0);
+    for (size_t i = 0; i < plan->count; i++) {
+        stlink_appendf(buf, size, &len, "  0x%08x %7u bytes  %s\n",
+                plan->pages[i].addr, plan->pages[i].size, plan->pages[i].blank ? "blank" : "erase");
+    }
+
+    return len;
+}
+
+void stlink_erase_plan_free(stlink_erase_plan_t *plan) {
+    free(plan->pages);
+    memset(plan, 0, sizeof(*plan));
+}
@@ -1,12 +1,37 @@
 #include "stlink.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "flash_loader_internal.h"
+
 #define FLASH_REGS_BANK2_OFS 0x40
 #define FLASH_BANK2_START_ADDR 0x08080000
 
+/* double buffered loader: per buffer size limits, and the mailbox flag for the last buffer */
+#define PP_BUF_MIN 0x400
+#define PP_BUF_MAX 0x4000
+#define PP_LAST (1u << 31)
+#define PP_TIMEOUT_US 5000000
+
+/* the crc routine, at the end of sram: allow 4us per byte on top */
+#define CRC_TIMEOUT_US 1000000
+
+/* the flashing agent's control block, see flashloaders/stm32agent.s */
+#define AGENT_TAIL 0x04
+#define AGENT_STATUS 0x08
+#define AGENT_RING 0x30
+#define AGENT_CTL_SIZE (AGENT_RING + 16 * STLINK_AGENT_SLOTS)
+
+/* L0/L1 flash registers, see flashloaders/stm32lxhp.s */
+#define STM32L0_FLASH_REGS 0x40022000
+#define STM32L1_FLASH_REGS 0x40023c00
+
+/* the loaders take their arguments in r0..r(n-1) and start at pc */
+#define LOADER_REGS_MASK(n) (((1u << (n)) - 1) | (1u << 15))
+
 /* from openocd, contrib/loaders/flash/stm32.s */
 static const uint8_t loader_code_stm32vl[] = {
         0x08, 0x4c, /* ldr	r4, STM32_FLASH_BASE */
@@ -78,20 +103,53 @@ static const uint8_t loader_code_stm32vl[] = {
     };
 
     static const uint8_t loader_code_stm32l[] = {
-        // flashloaders/stm32lx.s
-
-        0x04, 0xe0, //     b test_done          ; Go to compare
-        // write_word:
-        0x04, 0x68, //     ldr      r4, [r0]    ; Load one word from address in r0
-        0x0c, 0x60, //     str      r4, [r1]    ; Store the word to address in r1
-        0x04, 0x30, //     adds     r0, #4      ; Increment r0
-        0x04, 0x31, //     adds     r1, #4      ; Increment r1
-        0x01, 0x3a, //     subs     r2, #1      ; Decrement r2
-        // test_done:
-        0x00, 0x2a, //     cmp      r2, #0      ; Compare r2 to 0
-        0xf8, 0xd8, //     bhi      write_word  ; Loop if above 0
-        0x00, 0xbe, //     bkpt     #0x00       ; Set breakpoint to exit
-        0x00, 0x00
+        // flashloaders/stm32lxhp.s -- thumb1 only
+        0x81, 0x27,             // start:       movs    r7, #0x81
+        0xff, 0x00,             //              lsls    r7, r7, #3
+        0x00, 0x2a,             // next:        cmp     r2, #0
+        0x29, 0xd0,             //              beq     done
+        0xa5, 0x08,             //              lsrs    r5, r4, #2
+        0x14, 0xd0,             //              beq     word
+        0xaa, 0x42,             //              cmp     r2, r5
+        0x12, 0xd3,             //              blo     word
+        0x66, 0x1e,             //              subs    r6, r4, #1
+        0x0e, 0x42,             //              tst     r6, r1
+        0x0f, 0xd1,             //              bne     word
+        0x5e, 0x68,             //              ldr     r6, [r3, #4]
+        0x3e, 0x43,             //              orrs    r6, r7
+        0x5e, 0x60,             //              str     r6, [r3, #4]
+        0x06, 0x68,             // half_page:   ldr     r6, [r0]
+        0x0e, 0x60,             //              str     r6, [r1]
+        0x04, 0x30,             //              adds    r0, #4
+        0x04, 0x31,             //              adds    r1, #4
+        0x01, 0x3a,             //              subs    r2, #1
+        0x01, 0x3d,             //              subs    r5, #1
+        0xf8, 0xd1,             //              bne     half_page
+        0x00, 0xf0, 0x0c, 0xf8, //              bl      wait
+        0x5e, 0x68,             //              ldr     r6, [r3, #4]
+        0xbe, 0x43,             //              bics    r6, r7
+        0x5e, 0x60,             //              str     r6, [r3, #4]
+        0xe6, 0xe7,             //              b       next
+        0x06, 0x68,             // word:        ldr     r6, [r0]
+        0x0e, 0x60,             //              str     r6, [r1]
+        0x04, 0x30,             //              adds    r0, #4
+        0x04, 0x31,             //              adds    r1, #4
+        0x01, 0x3a,             //              subs    r2, #1
+        0x00, 0xf0, 0x01, 0xf8, //              bl      wait
+        0xde, 0xe7,             //              b       next
+        0x9e, 0x69,             // wait:        ldr     r6, [r3, #0x18]
+        0x75, 0x08,             //              lsrs    r5, r6, #1
+        0xfc, 0xd2,             //              bcs     wait
+        0xb6, 0x03,             //              lsls    r6, r6, #14
+        0xb6, 0x0d,             //              lsrs    r6, r6, #22
+        0x00, 0xd1,             //              bne     fail
+        0x70, 0x47,             //              bx      lr
+        0x5e, 0x68,             // fail:        ldr     r6, [r3, #4]
+        0xbe, 0x43,             //              bics    r6, r7
+        0x5e, 0x60,             //              str     r6, [r3, #4]
+        0x01, 0x32,             //              adds    r2, #1
+        0x00, 0xbe,             // done:        bkpt    #0x00
+        0x00, 0x00,             //              .align  2
     };
 
     static const uint8_t loader_code_stm32f4[] = {
@@ -139,23 +197,33 @@ static const uint8_t loader_code_stm32vl[] = {
         0x00, 0x3c, 0x02, 0x40,
     };
 
-    static const uint8_t loader_code_stm32l4[] = {
-        // flashloaders/stm32l4.s
-        0x08, 0x4b,             // start: ldr   r3, [pc, #32] ; <flash_base>
-        0x72, 0xb1,             // next:  cbz   r2, <done>
-        0x04, 0x68,             //        ldr   r4, [r0, #0]
-        0x45, 0x68,             //        ldr   r5, [r0, #4]
-        0x0c, 0x60,             //        str   r4, [r1, #0]
-        0x4d, 0x60,             //        str   r5, [r1, #4]
-        0x5c, 0x8a,             // wait:  ldrh  r4, [r3, #18]
-        0x14, 0xf0, 0x01, 0x0f, //        tst.w r4, #1
-        0xfb, 0xd1,             //        bne.n <wait>
-        0x00, 0xf1, 0x08, 0x00, //        add.w r0, r0, #8
-        0x01, 0xf1, 0x08, 0x01, //        add.w r1, r1, #8
-        0xa2, 0xf1, 0x01, 0x02, //        sub.w r2, r2, #1
-        0xef, 0xe7,             //        b.n   <next>
-        0x00, 0xbe,             // done:  bkpt  0x0000
-        0x00, 0x20, 0x02, 0x40  // flash_base:  .word 0x40022000
+    static const uint8_t loader_code_stm32g0[] = {
+        // flashloaders/stm32g0.s -- thumb1 only, also used for STM32L4
+        0x0b, 0x4b,             // start:       ldr     r3, flash_base
+        0x00, 0x2a,             // next:        cmp     r2, #0
+        0x12, 0xd0,             //              beq     done
+        0x04, 0x68,             //              ldr     r4, [r0]
+        0x45, 0x68,             //              ldr     r5, [r0, #4]
+        0x0c, 0x60,             //              str     r4, [r1]
+        0x4d, 0x60,             //              str     r5, [r1, #4]
+        0x08, 0x30,             //              adds    r0, #8
+        0x08, 0x31,             //              adds    r1, #8
+        0x01, 0x3a,             //              subs    r2, #1
+        0x5c, 0x69,             //              ldr     r4, [r3, #0x14]
+        0xe4, 0x0c,             //              lsrs    r4, r4, #19
+        0x01, 0xd3,             //              bcc     wait
+        0x0c, 0x06,             //              lsls    r4, r1, #24
+        0xf1, 0xd1,             //              bne     next
+        0x1c, 0x69,             // wait:        ldr     r4, [r3, #0x10]
+        0x65, 0x0c,             //              lsrs    r5, r4, #17
+        0xfc, 0xd2,             //              bcs     wait
+        0xa4, 0x05,             //              lsls    r4, r4, #22
+        0x64, 0x0e,             //              lsrs    r4, r4, #25
+        0xeb, 0xd0,             //              beq     next
+        0x01, 0x32,             //              adds    r2, #1
+        0x00, 0xbe,             // done:        bkpt    #0x00
+        0xc0, 0x46,             //              nop
+        0x00, 0x20, 0x02, 0x40  // flash_base:  .word   0x40022000
     };
 
 	static const uint8_t loader_code_stm32f7[] = {
@@ -200,23 +268,584 @@ static const uint8_t loader_code_stm32vl[] = {
         0x00, 0x3c, 0x02, 0x40  //      .word   0x40023c00
     };
 
+    /*
+     * Double buffered loaders, see flashloaders/stm32f0pp.s for the
+     * protocol. r0 mailbox, r1 target, r2 buffer size, r3 bank register
+     * offset; on exit r3 holds the units of the current buffer not written.
+     */
+    static const uint8_t loader_code_stm32f0_pp[] = {
+        // flashloaders/stm32f0pp.s -- thumb1 only, also used for STM32VL/F1/F3
+        0x12, 0x4c,             // start:       ldr     r4, flash_base
+        0x1c, 0x44,             //              add     r4, r3
+        0x00, 0x27,             //              movs    r7, #0
+        0xc6, 0x59,             // wait_full:   ldr     r6, [r0, r7]
+        0x00, 0x2e,             //              cmp     r6, #0
+        0xfc, 0xd0,             //              beq     wait_full
+        0x05, 0x00,             //              movs    r5, r0
+        0x08, 0x35,             //              adds    r5, #8
+        0x00, 0x2f,             //              cmp     r7, #0
+        0x00, 0xd0,             //              beq     1f
+        0xad, 0x18,             //              adds    r5, r5, r2
+        0x73, 0x00,             // 1:           lsls    r3, r6, #1
+        0x5b, 0x08,             //              lsrs    r3, r3, #1
+        0x00, 0x2b,             // next:        cmp     r3, #0
+        0x0d, 0xd0,             //              beq     buffer_done
+        0x01, 0x26,             //              movs    r6, #1
+        0x26, 0x61,             //              str     r6, [r4, #16]   /* FLASH->CR = FLASH_CR_PG */
+        0x2e, 0x88,             //              ldrh    r6, [r5]
+        0x0e, 0x80,             //              strh    r6, [r1]
+        0xe6, 0x68,             // busy:        ldr     r6, [r4, #12]   /* FLASH->SR */
+        0x76, 0x08,             //              lsrs    r6, r6, #1      /* FLASH_SR_BUSY */
+        0xfc, 0xd2,             //              bcs     busy
+        0xe6, 0x68,             //              ldr     r6, [r4, #12]
+        0xf6, 0x06,             //              lsls    r6, r6, #27     /* PGERR, WRPRTERR */
+        0x09, 0xd1,             //              bne     exit
+        0x02, 0x35,             //              adds    r5, #2
+        0x02, 0x31,             //              adds    r1, #2
+        0x01, 0x3b,             //              subs    r3, #1
+        0xef, 0xe7,             //              b       next
+        0xc6, 0x59,             // buffer_done: ldr     r6, [r0, r7]
+        0xc3, 0x51,             //              str     r3, [r0, r7]    /* hand the buffer back */
+        0x04, 0x25,             //              movs    r5, #4
+        0x6f, 0x40,             //              eors    r7, r5
+        0x00, 0x2e,             //              cmp     r6, #0
+        0xdf, 0xda,             //              bge     wait_full       /* not the last one */
+        0x00, 0x26,             // exit:        movs    r6, #0
+        0x26, 0x61,             //              str     r6, [r4, #16]   /* FLASH->CR &= ~FLASH_CR_PG */
+        0x00, 0xbe,             //              bkpt    #0x00
+        0x00, 0x20, 0x02, 0x40  // flash_base:  .word   0x40022000
+    };
 
+    static const uint8_t loader_code_stm32f4_pp[] = {
+        // flashloaders/stm32f4pp.s
+        0x0f, 0x4c,             // start:       ldr     r4, flash_base
+        0x00, 0x27,             //              movs    r7, #0
+        0xc6, 0x59,             // wait_full:   ldr     r6, [r0, r7]
+        0x00, 0x2e,             //              cmp     r6, #0
+        0xfc, 0xd0,             //              beq     wait_full
+        0x00, 0xf1, 0x08, 0x05, //              add     r5, r0, #8
+        0x07, 0xb1,             //              cbz     r7, 1f
+        0x15, 0x44,             //              add     r5, r2
+        0x26, 0xf0, 0x00, 0x43, // 1:           bic     r3, r6, #0x80000000
+        0x5b, 0xb1,             // next:        cbz     r3, buffer_done
+        0x55, 0xf8, 0x04, 0xcb, //              ldr     ip, [r5], #4
+        0x41, 0xf8, 0x04, 0xcb, //              str     ip, [r1], #4
+        0xb4, 0xf8, 0x0e, 0xc0, // wait:        ldrh    ip, [r4, #0x0e]
+        0x1c, 0xf0, 0x01, 0x0f, //              tst     ip, #1
+        0xfa, 0xd1,             //              bne     wait
+        0xa3, 0xf1, 0x01, 0x03, //              sub     r3, #1
+        0xf2, 0xe7,             //              b       next
+        0xc3, 0x51,             // buffer_done: str     r3, [r0, r7]
+        0x87, 0xf0, 0x04, 0x07, //              eor     r7, r7, #4
+        0x16, 0xf0, 0x00, 0x4f, //              tst     r6, #0x80000000
+        0xe3, 0xd0,             //              beq     wait_full
+        0x00, 0xbe,             //              bkpt
+        0x00, 0xbf,             //              nop
+        0x00, 0x3c, 0x02, 0x40  // flash_base:  .word   0x40023c00
+    };
 
-int stlink_flash_loader_init(stlink_t *sl, flash_loader_t *fl)
+    static const uint8_t loader_code_stm32f7_pp[] = {
+        // flashloaders/stm32f7pp.s
+        0x10, 0x4c,             // start:       ldr     r4, flash_base
+        0x00, 0x27,             //              movs    r7, #0
+        0xc6, 0x59,             // wait_full:   ldr     r6, [r0, r7]
+        0x00, 0x2e,             //              cmp     r6, #0
+        0xfc, 0xd0,             //              beq     wait_full
+        0x00, 0xf1, 0x08, 0x05, //              add     r5, r0, #8
+        0x07, 0xb1,             //              cbz     r7, 1f
+        0x15, 0x44,             //              add     r5, r2
+        0x26, 0xf0, 0x00, 0x43, // 1:           bic     r3, r6, #0x80000000
+        0x6b, 0xb1,             // next:        cbz     r3, buffer_done
+        0x55, 0xf8, 0x04, 0xcb, //              ldr     ip, [r5], #4
+        0x41, 0xf8, 0x04, 0xcb, //              str     ip, [r1], #4
+        0xbf, 0xf3, 0x4f, 0x8f, //              dsb     sy
+        0xb4, 0xf8, 0x0e, 0xc0, // wait:        ldrh    ip, [r4, #0x0e]
+        0x1c, 0xf0, 0x01, 0x0f, //              tst     ip, #1
+        0xfa, 0xd1,             //              bne     wait
+        0xa3, 0xf1, 0x01, 0x03, //              sub     r3, #1
+        0xf0, 0xe7,             //              b       next
+        0xc3, 0x51,             // buffer_done: str     r3, [r0, r7]
+        0x87, 0xf0, 0x04, 0x07, //              eor     r7, r7, #4
+        0x16, 0xf0, 0x00, 0x4f, //              tst     r6, #0x80000000
+        0xe1, 0xd0,             //              beq     wait_full
+        0x00, 0xbe,             //              bkpt
+        0x00, 0xbf,             //              nop
+        0x00, 0x3c, 0x02, 0x40  // flash_base:  .word   0x40023c00
+    };
+
+    static const uint8_t loader_code_stm32g0_pp[] = {
+        // flashloaders/stm32g0pp.s -- thumb1 only, also used for STM32L4
+        0x14, 0x4c,             // start:       ldr     r4, flash_base
+        0x00, 0x27,             //              movs    r7, #0
+        0xc6, 0x59,             // wait_full:   ldr     r6, [r0, r7]
+        0x00, 0x2e,             //              cmp     r6, #0
+        0xfc, 0xd0,             //              beq     wait_full
+        0x05, 0x00,             //              movs    r5, r0
+        0x08, 0x35,             //              adds    r5, #8
+        0x00, 0x2f,             //              cmp     r7, #0
+        0x00, 0xd0,             //              beq     1f
+        0xad, 0x18,             //              adds    r5, r5, r2
+        0x73, 0x00,             // 1:           lsls    r3, r6, #1
+        0x5b, 0x08,             //              lsrs    r3, r3, #1
+        0x00, 0x2b,             // next:        cmp     r3, #0
+        0x14, 0xd0,             //              beq     buffer_done
+        0x2e, 0x68,             //              ldr     r6, [r5]
+        0x0e, 0x60,             //              str     r6, [r1]
+        0x6e, 0x68,             //              ldr     r6, [r5, #4]
+        0x4e, 0x60,             //              str     r6, [r1, #4]
+        0x08, 0x35,             //              adds    r5, #8
+        0x08, 0x31,             //              adds    r1, #8
+        0x01, 0x3b,             //              subs    r3, #1
+        0x66, 0x69,             //              ldr     r6, [r4, #0x14]
+        0xf6, 0x0c,             //              lsrs    r6, r6, #19
+        0x01, 0xd3,             //              bcc     busy
+        0x0e, 0x06,             //              lsls    r6, r1, #24
+        0xf1, 0xd1,             //              bne     next
+        0x26, 0x69,             // busy:        ldr     r6, [r4, #0x10]
+        0x76, 0x0c,             //              lsrs    r6, r6, #17
+        0xfc, 0xd2,             //              bcs     busy
+        0x26, 0x69,             //              ldr     r6, [r4, #0x10]
+        0xb6, 0x05,             //              lsls    r6, r6, #22
+        0x76, 0x0e,             //              lsrs    r6, r6, #25
+        0xea, 0xd0,             //              beq     next
+        0x01, 0x33,             //              adds    r3, #1
+        0x05, 0xe0,             //              b       exit
+        0xc6, 0x59,             // buffer_done: ldr     r6, [r0, r7]
+        0xc3, 0x51,             //              str     r3, [r0, r7]
+        0x04, 0x25,             //              movs    r5, #4
+        0x6f, 0x40,             //              eors    r7, r5
+        0x00, 0x2e,             //              cmp     r6, #0
+        0xd8, 0xda,             //              bge     wait_full
+        0x00, 0xbe,             // exit:        bkpt    #0x00
+        0x00, 0x20, 0x02, 0x40  // flash_base:  .word   0x40022000
+    };
+
+    static const uint8_t loader_code_crc32[] = {
+        // flashloaders/crc32.s -- thumb1 only; r0 address, r1 length, r2 crc (not inverted)
+        0x09, 0xa3,             // start:  adr     r3, table
+        0x00, 0x29,             // next:   cmp     r1, #0
+        0x0e, 0xd0,             //         beq     done
+        0x04, 0x78,             //         ldrb    r4, [r0]
+        0x62, 0x40,             //         eors    r2, r4
+        0x14, 0x07,             //         lsls    r4, r2, #28
+        0xa4, 0x0e,             //         lsrs    r4, r4, #26     /* (crc & 0xf) * 4 */
+        0x1c, 0x59,             //         ldr     r4, [r3, r4]
+        0x12, 0x09,             //         lsrs    r2, r2, #4
+        0x62, 0x40,             //         eors    r2, r4
+        0x14, 0x07,             //         lsls    r4, r2, #28
+        0xa4, 0x0e,             //         lsrs    r4, r4, #26
+        0x1c, 0x59,             //         ldr     r4, [r3, r4]
+        0x12, 0x09,             //         lsrs    r2, r2, #4
+        0x62, 0x40,             //         eors    r2, r4
+        0x01, 0x30,             //         adds    r0, #1
+        0x01, 0x39,             //         subs    r1, #1
+        0xee, 0xe7,             //         b       next
+        0x00, 0xbe,             // done:   bkpt    #0x00
+        0xc0, 0x46,             //         nop
+        0x00, 0x00, 0x00, 0x00, // table:  .word   0x00000000
+        0x64, 0x10, 0xb7, 0x1d, //         .word   0x1db71064
+        0xc8, 0x20, 0x6e, 0x3b, //         .word   0x3b6e20c8
+        0xac, 0x30, 0xd9, 0x26, //         .word   0x26d930ac
+        0x90, 0x41, 0xdc, 0x76, //         .word   0x76dc4190
+        0xf4, 0x51, 0x6b, 0x6b, //         .word   0x6b6b51f4
+        0x58, 0x61, 0xb2, 0x4d, //         .word   0x4db26158
+        0x3c, 0x71, 0x05, 0x50, //         .word   0x5005713c
+        0x20, 0x83, 0xb8, 0xed, //         .word   0xedb88320
+        0x44, 0x93, 0x0f, 0xf0, //         .word   0xf00f9344
+        0xe8, 0xa3, 0xd6, 0xd6, //         .word   0xd6d6a3e8
+        0x8c, 0xb3, 0x61, 0xcb, //         .word   0xcb61b38c
+        0xb0, 0xc2, 0x64, 0x9b, //         .word   0x9b64c2b0
+        0xd4, 0xd2, 0xd3, 0x86, //         .word   0x86d3d2d4
+        0x78, 0xe2, 0x0a, 0xa0, //         .word   0xa00ae278
+        0x1c, 0xf2, 0xbd, 0xbd  //         .word   0xbdbdf21c
+    };
+
+    /*
+     * The flashing agent, see flashloaders/stm32agent.s for the control
+     * block and the descriptors. r0 control block.
+     */
+    static const uint8_t loader_code_stm32_agent[] = {
+        // flashloaders/stm32agent.s -- thumb1 only
+        0x01, 0x68,             // start:       ldr     r1, [r0, #0]
+        0x47, 0x68,             //              ldr     r7, [r0, #4]
+        0xb9, 0x42,             //              cmp     r1, r7
+        0xfb, 0xd0,             //              beq     start
+        0x1f, 0x21,             //              movs    r1, #31
+        0x39, 0x40,             //              ands    r1, r7
+        0x09, 0x01,             //              lsls    r1, r1, #4
+        0x09, 0x18,             //              adds    r1, r1, r0
+        0x30, 0x31,             //              adds    r1, #48
+        0x0f, 0x68,             //              ldr     r7, [r1, #0]
+        0x4a, 0x68,             //              ldr     r2, [r1, #4]
+        0x8b, 0x68,             //              ldr     r3, [r1, #8]
+        0xcc, 0x68,             //              ldr     r4, [r1, #12]
+        0xc5, 0x68,             //              ldr     r5, [r0, #12]
+        0x06, 0x69,             //              ldr     r6, [r0, #16]
+        0xc1, 0x6a,             //              ldr     r1, [r0, #44]
+        0x8a, 0x42,             //              cmp     r2, r1
+        0x01, 0xd3,             //              blo     1f
+        0x40, 0x35,             //              adds    r5, #0x40
+        0x40, 0x36,             //              adds    r6, #0x40
+        0x01, 0x2f,             // 1:           cmp     r7, #1
+        0x4e, 0xd0,             //              beq     erase
+        0x02, 0x2f,             //              cmp     r7, #2
+        0x04, 0xd0,             //              beq     program
+        0x03, 0x2f,             //              cmp     r7, #3
+        0x1f, 0xd0,             //              beq     blank
+        0x04, 0x2f,             //              cmp     r7, #4
+        0x2b, 0xd0,             //              beq     unpack
+        0x00, 0xbe,             //              bkpt    #0x00
+        0x00, 0xf0, 0x5c, 0xf8, // program:     bl      wait
+        0x56, 0xd1,             //              bne     fail
+        0x41, 0x6a,             //              ldr     r1, [r0, #36]
+        0x31, 0x60,             //              str     r1, [r6]
+        0x00, 0x2b,             // next_unit:   cmp     r3, #0
+        0x4c, 0xd0,             //              beq     op_done
+        0x87, 0x6a,             //              ldr     r7, [r0, #40]
+        0x02, 0x2f,             //              cmp     r7, #2
+        0x05, 0xd1,             //              bne     words
+        0x21, 0x88,             //              ldrh    r1, [r4]
+        0x11, 0x80,             //              strh    r1, [r2]
+        0x02, 0x34,             //              adds    r4, #2
+        0x02, 0x32,             //              adds    r2, #2
+        0x02, 0x3b,             //              subs    r3, #2
+        0x06, 0xe0,             //              b       unit_done
+        0x21, 0x68,             // words:       ldr     r1, [r4]
+        0x11, 0x60,             //              str     r1, [r2]
+        0x04, 0x34,             //              adds    r4, #4
+        0x04, 0x32,             //              adds    r2, #4
+        0x04, 0x3b,             //              subs    r3, #4
+        0x04, 0x3f,             //              subs    r7, #4
+        0xf8, 0xd1,             //              bne     words
+        0xbf, 0xf3, 0x4f, 0x8f, // unit_done:   dsb     sy
+        0x00, 0xf0, 0x43, 0xf8, //              bl      wait
+        0xe8, 0xd0,             //              beq     next_unit
+        0x3c, 0xe0,             //              b       fail
+        0x00, 0xf0, 0x3f, 0xf8, // blank:       bl      wait
+        0x39, 0xd1,             //              bne     fail
+        0xcf, 0x43,             //              mvns    r7, r1
+        0x00, 0x2b,             // 3:           cmp     r3, #0
+        0x30, 0xd0,             //              beq     op_done
+        0x11, 0x68,             //              ldr     r1, [r2]
+        0xb9, 0x42,             //              cmp     r1, r7
+        0x02, 0xd1,             //              bne     not_blank
+        0x04, 0x32,             //              adds    r2, #4
+        0x04, 0x3b,             //              subs    r3, #4
+        0xf7, 0xe7,             //              b       3b
+        0x82, 0x60,             // not_blank:   str     r2, [r0, #8]
+        0x00, 0xbe,             //              bkpt    #0x00
+        0x9b, 0x18,             // unpack:      adds    r3, r3, r2
+        0x9a, 0x42,             // 5:           cmp     r2, r3
+        0x27, 0xd2,             //              bhs     next
+        0x21, 0x78,             //              ldrb    r1, [r4]
+        0x01, 0x34,             //              adds    r4, #1
+        0x80, 0x29,             //              cmp     r1, #0x80
+        0x07, 0xd2,             //              bhs     match
+        0x01, 0x31,             //              adds    r1, #1
+        0x27, 0x78,             // 6:           ldrb    r7, [r4]
+        0x17, 0x70,             //              strb    r7, [r2]
+        0x01, 0x34,             //              adds    r4, #1
+        0x01, 0x32,             //              adds    r2, #1
+        0x01, 0x39,             //              subs    r1, #1
+        0xf9, 0xd1,             //              bne     6b
+        0xf1, 0xe7,             //              b       5b
+        0x7c, 0x39,             // match:       subs    r1, #0x7c
+        0x27, 0x78,             //              ldrb    r7, [r4]
+        0x65, 0x78,             //              ldrb    r5, [r4, #1]
+        0x02, 0x34,             //              adds    r4, #2
+        0x2d, 0x02,             //              lsls    r5, r5, #8
+        0x2f, 0x43,             //              orrs    r7, r5
+        0xd7, 0x1b,             //              subs    r7, r2, r7
+        0x3d, 0x78,             // 7:           ldrb    r5, [r7]
+        0x15, 0x70,             //              strb    r5, [r2]
+        0x01, 0x37,             //              adds    r7, #1
+        0x01, 0x32,             //              adds    r2, #1
+        0x01, 0x39,             //              subs    r1, #1
+        0xf9, 0xd1,             //              bne     7b
+        0xe3, 0xe7,             //              b       5b
+        0x00, 0xf0, 0x14, 0xf8, // erase:       bl      wait
+        0x0e, 0xd1,             //              bne     fail
+        0x34, 0x60,             //              str     r4, [r6]
+        0x41, 0x69,             //              ldr     r1, [r0, #20]
+        0x00, 0x29,             //              cmp     r1, #0
+        0x00, 0xd0,             //              beq     2f
+        0x72, 0x60,             //              str     r2, [r6, #4]
+        0x01, 0x6a,             // 2:           ldr     r1, [r0, #32]
+        0x21, 0x43,             //              orrs    r1, r4
+        0x31, 0x60,             //              str     r1, [r6]
+        0x01, 0xe0,             //              b       next
+        0x00, 0x21,             // op_done:     movs    r1, #0
+        0x31, 0x60,             //              str     r1, [r6]
+        0x41, 0x68,             // next:        ldr     r1, [r0, #4]
+        0x01, 0x31,             //              adds    r1, #1
+        0x41, 0x60,             //              str     r1, [r0, #4]
+        0x88, 0xe7,             //              b       start
+        0x81, 0x60,             // fail:        str     r1, [r0, #8]
+        0x00, 0x21,             //              movs    r1, #0
+        0x31, 0x60,             //              str     r1, [r6]
+        0x00, 0xbe,             //              bkpt    #0x00
+        0x87, 0x69,             // wait:        ldr     r7, [r0, #24]
+        0x29, 0x68,             // 4:           ldr     r1, [r5]
+        0x39, 0x42,             //              tst     r1, r7
+        0xfc, 0xd1,             //              bne     4b
+        0xc7, 0x69,             //              ldr     r7, [r0, #28]
+        0x39, 0x40,             //              ands    r1, r7
+        0x70, 0x47              //              bx      lr
+    };
+
+
+
+/* CRC-32 as zlib's crc32(), computed like the target does */
+uint32_t stlink_crc32(uint32_t crc, const uint8_t *buf, size_t len)
 {
-	size_t size;
+    const uint8_t *table = loader_code_crc32 + sizeof(loader_code_crc32) - 64;
 
-	/* allocate the loader in sram */
-	if (stlink_flash_loader_write_to_sram(sl, &fl->loader_addr, &size) == -1) {
-		WLOG("Failed to write flash loader to sram!\n");
-		return -1;
-	}
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= buf[i];
+        crc = (crc >> 4) ^ read_uint32(table, (int) (4 * (crc & 0xf)));
+        crc = (crc >> 4) ^ read_uint32(table, (int) (4 * (crc & 0xf)));
+    }
+    return ~crc;
+}
 
-	/* allocate a one page buffer in sram right after loader */
-	fl->buf_addr = fl->loader_addr + (uint32_t) size;
-	ILOG("Successfully loaded flash loader in sram\n");
+#define LZ_LITERALS_MAX 0x80
+#define LZ_MATCH_MIN 4
+#define LZ_MATCH_MAX (0xff - 0x7c)
+#define LZ_OFFSET_MAX 0xffff
+#define LZ_HASH_BITS 12
 
-	return 0;
+static size_t lz_literals(uint8_t *dst, size_t size, size_t out, const uint8_t *src, size_t n)
+{
+    while (n > 0) {
+        const size_t k = (n > LZ_LITERALS_MAX) ? LZ_LITERALS_MAX : n;
+
+        if (out + 1 + k > size)
+            return SIZE_MAX;
+        dst[out++] = (uint8_t) (k - 1);
+        memcpy(dst + out, src, k);
+        out += k;
+        src += k;
+        n -= k;
+    }
+    return out;
+}
+
+/* Greedy, with the last position of each 4 byte hash as the only
+   candidate: runs of padding come out as matches at offset 1. */
+size_t stlink_lz_compress(uint8_t *dst, size_t size, const uint8_t *src, size_t len)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    size_t i = 0, lit = 0, out = 0;
+
+    memset(table, 0, sizeof(table));
+    while (i + LZ_MATCH_MIN <= len) {
+        const uint32_t h = (read_uint32(src, (int) i) * 2654435761u) >> (32 - LZ_HASH_BITS);
+        const size_t cand = table[h];
+        size_t n = 0;
+
+        table[h] = (uint32_t) i + 1;
+        if (cand && i + 1 - cand <= LZ_OFFSET_MAX) {
+            const size_t max = (len - i > LZ_MATCH_MAX) ? LZ_MATCH_MAX : len - i;
+            while (n < max && src[cand - 1 + n] == src[i + n])
+                n++;
+        }
+        if (n < LZ_MATCH_MIN) {
+            i++;
+            continue;
+        }
+
+        out = lz_literals(dst, size, out, src + lit, i - lit);
+        if (out == SIZE_MAX || out + 3 > size)
+            return 0;
+        dst[out++] = (uint8_t) (0x7c + n);
+        dst[out++] = (uint8_t) ((i + 1 - cand) & 0xff);
+        dst[out++] = (uint8_t) ((i + 1 - cand) >> 8);
+        i += n;
+        lit = i;
+    }
+
+    out = lz_literals(dst, size, out, src + lit, len - lit);
+    return (out == SIZE_MAX || out >= len) ? 0 : out;
+}
+
+int stlink_lz_decompress(uint8_t *dst, size_t len, const uint8_t *src, size_t size)
+{
+    size_t in = 0, out = 0;
+
+    while (out < len) {
+        size_t n;
+        uint8_t t;
+
+        if (in >= size)
+            return -1;
+        t = src[in++];
+        if (t < 0x80) {
+            n = (size_t) t + 1;
+            if (out + n > len || in + n > size)
+                return -1;
+            /* byte by byte, the literals may be just ahead in the same buffer */
+            for (; n > 0; n--)
+                dst[out++] = src[in++];
+        } else {
+            size_t off;
+
+            n = (size_t) t - 0x7c;
+            if (out + n > len || in + 2 > size)
+                return -1;
+            off = src[in] | (size_t) src[in + 1] << 8;
+            in += 2;
+            if (off == 0 || off > out)
+                return -1;
+            for (; n > 0; n--, out++)
+                dst[out] = dst[out - off];
+        }
+    }
+
+    return 0;
+}
+
+bool stlink_flash_loader_is_crc32(const uint8_t *code, size_t len)
+{
+    return len >= sizeof(loader_code_crc32)
+        && memcmp(code, loader_code_crc32, sizeof(loader_code_crc32)) == 0;
+}
+
+static int loader_halted(stlink_t *sl, void *arg) {
+    (void) arg;
+    return stlink_is_core_halted(sl);
+}
+
+/* Have the target compute the CRC-32 of len bytes at addr. Runs code on
+   the core, so it has to be halted. The routine goes to the top of sram,
+   where the stack usually is, and uses r0-r4; that sram, those registers,
+   pc and xpsr are read first and put back after, so a debugger attached
+   sees the core as it was. */
+int stlink_flash_crc32(stlink_t *sl, stm32_addr_t addr, size_t len, uint32_t *crc)
+{
+    const stm32_addr_t code_addr = (sl->sram_base + (uint32_t) sl->sram_size - sizeof(loader_code_crc32)) & ~3u;
+    const uint32_t saved_mask = LOADER_REGS_MASK(5) | (1u << 16);
+    const uint64_t timeout = CRC_TIMEOUT_US + 4 * (uint64_t) len;
+    uint8_t saved[sizeof(loader_code_crc32)];
+    struct stlink_reg rr;
+    uint32_t regs[17];
+    int ret = -1;
+
+    if (sl->sram_size < 2 * sizeof(loader_code_crc32)
+            || (addr < code_addr + sizeof(loader_code_crc32) && code_addr < (uint64_t) addr + len)) {
+        return -1;
+    }
+    if (!stlink_is_core_halted(sl)) {
+        DLOG("core is running, not computing the crc on the target\n");
+        return -1;
+    }
+
+    if (stlink_read_all_regs(sl, &rr) == -1
+            || stlink_read_mem(sl, code_addr, saved, sizeof(saved)) == -1)
+        return -1;
+    memcpy(regs, rr.r, sizeof(rr.r));
+    regs[16] = rr.xpsr;
+
+    memcpy(sl->q_buf, loader_code_crc32, sizeof(loader_code_crc32));
+    if (stlink_write_mem32(sl, code_addr, sizeof(loader_code_crc32)) == -1)
+        goto on_error;
+
+    {
+        uint32_t args[16];
+
+        args[0] = addr; /* address */
+        args[1] = (uint32_t) len; /* length */
+        args[2] = 0xffffffff; /* crc */
+        args[15] = code_addr; /* pc register */
+        if (stlink_write_regs(sl, LOADER_REGS_MASK(3), args)) {
+            ELOG("failed to set up the crc registers\n");
+            goto on_error;
+        }
+    }
+
+    stlink_run(sl);
+
+    if (stlink_wait(sl, 0, timeout, loader_halted, NULL) == -1) {
+        ELOG("crc run error\n");
+        stlink_force_debug(sl);
+        goto on_error;
+    }
+
+    if (stlink_read_reg(sl, 1, &rr) == -1 || rr.r[1] != 0
+            || stlink_read_reg(sl, 2, &rr) == -1) {
+        ELOG("crc run stopped early\n");
+        goto on_error;
+    }
+
+    *crc = ~rr.r[2];
+    ret = 0;
+
+on_error:
+    if (stlink_write_mem(sl, code_addr, saved, sizeof(saved)) == -1
+            || stlink_write_regs(sl, saved_mask, regs) == -1) {
+        ELOG("failed to restore the sram and registers the crc routine used\n");
+        ret = -1;
+    }
+    return ret;
+}
+
+/* Remember the loader just written to sram, so that later writes in the
+   session can skip uploading it again */
+static void flash_loader_cache_set(stlink_t *sl, const uint8_t *code, size_t size, size_t pp_size)
+{
+    struct stlink_loader_cache *c = &sl->loader_cache;
+
+    c->code = code;
+    c->size = size;
+    c->addr = sl->sram_base;
+    c->pp_size = pp_size;
+    c->chip_id = sl->chip_id;
+}
+
+/* True if code is what an earlier write left in sram and it is still
+   there: same chip, nothing written over it since and reads back as
+   written. */
+static bool flash_loader_cache_valid(stlink_t *sl, const uint8_t *code)
+{
+    struct stlink_loader_cache *c = &sl->loader_cache;
+
+    if (c->code == NULL || c->code != code)
+        return false;
+
+    if (c->chip_id != sl->chip_id || c->addr != sl->sram_base
+            || stlink_read_mem32(sl, c->addr, (uint16_t) c->size) == -1
+            || memcmp(sl->q_buf, c->code, c->size) != 0) {
+        DLOG("flash loader in sram is gone, loading it again\n");
+        c->code = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+/* Point fl at the loader an earlier write left in sram, if it is still
+   there. The flashing agent does not count. */
+static int flash_loader_cached(stlink_t *sl, flash_loader_t *fl)
+{
+    struct stlink_loader_cache *c = &sl->loader_cache;
+
+    if (c->code == loader_code_stm32_agent || !flash_loader_cache_valid(sl, c->code))
+        return -1;
+
+    fl->loader_addr = c->addr;
+    fl->buf_addr = c->addr + (uint32_t) c->size;
+    fl->pp_size = c->pp_size;
+    DLOG("Reusing the flash loader in sram\n");
+
+    return 0;
+}
+
+void stlink_flash_loader_invalidate(stlink_t *sl, stm32_addr_t addr, size_t len)
+{
+    struct stlink_loader_cache *c = &sl->loader_cache;
+
+    if (c->code != NULL && addr < (uint64_t) c->addr + c->size && c->addr < (uint64_t) addr + len)
+        c->code = NULL;
 }
 
 static int loader_v_dependent_assignment(stlink_t *sl,
@@ -306,21 +935,18 @@ int stlink_flash_loader_write_to_sram(stlink_t *sl, stm32_addr_t* addr, size_t*
     } else if (sl->chip_id == STLINK_CHIPID_STM32_F0 || sl->chip_id == STLINK_CHIPID_STM32_F04 || sl->chip_id == STLINK_CHIPID_STM32_F0_CAN || sl->chip_id == STLINK_CHIPID_STM32_F0_SMALL || sl->chip_id == STLINK_CHIPID_STM32_F09X) {
         loader_code = loader_code_stm32f0;
         loader_size = sizeof(loader_code_stm32f0);
-    } else if ((sl->chip_id == STLINK_CHIPID_STM32_L4) ||
-              (sl->chip_id == STLINK_CHIPID_STM32_L43X) ||
-              (sl->chip_id == STLINK_CHIPID_STM32_L46X) ||
-              (sl->chip_id == STLINK_CHIPID_STM32_L4RX) ||
-	            (sl->chip_id == STLINK_CHIPID_STM32_L496X))
-      {
-        loader_code = loader_code_stm32l4;
-        loader_size = sizeof(loader_code_stm32l4);
+    } else if (sl->flash_type == STLINK_FLASH_TYPE_L4 || sl->flash_type == STLINK_FLASH_TYPE_G0) {
+        /* same controller, the loader does standard and fast programming */
+        loader_code = loader_code_stm32g0;
+        loader_size = sizeof(loader_code_stm32g0);
     } else {
         ELOG("unknown coreid, not sure what flash loader to use, aborting! coreid: %x, chipid: %x\n", sl->core_id, sl->chip_id);
         return -1;
     }
 
     memcpy(sl->q_buf, loader_code, loader_size);
-    stlink_write_mem32(sl, sl->sram_base, loader_size);
+    if (stlink_write_mem32(sl, sl->sram_base, loader_size) == 0)
+        flash_loader_cache_set(sl, loader_code, loader_size, 0);
 
     *addr = sl->sram_base;
     *size = loader_size;
@@ -329,12 +955,273 @@ int stlink_flash_loader_write_to_sram(stlink_t *sl, stm32_addr_t* addr, size_t*
     return 0;
 }
 
+/* Pick the double buffered loader, write it to sram and split the rest of
+   the sram into the mailbox and the two buffers. Returns -1 when the chip
+   has none or too little sram for it. */
+static int flash_loader_pp_write_to_sram(stlink_t *sl, flash_loader_t *fl)
+{
+    const uint8_t* loader_code = NULL;
+    size_t loader_size = 0;
+    size_t avail;
+
+    if (sl->flash_type == STLINK_FLASH_TYPE_F0 || sl->flash_type == STLINK_FLASH_TYPE_F1_XL) {
+        loader_code = loader_code_stm32f0_pp;
+        loader_size = sizeof(loader_code_stm32f0_pp);
+    } else if (sl->flash_type == STLINK_FLASH_TYPE_F4) {
+        const uint8_t *pp = loader_code_stm32f4_pp;
+        size_t pp_size = sizeof(loader_code_stm32f4_pp);
+
+        if (sl->core_id == STM32F7_CORE_ID || sl->chip_id == STLINK_CHIPID_STM32_F7
+                || sl->chip_id == STLINK_CHIPID_STM32_F7XXXX || sl->chip_id == STLINK_CHIPID_STM32_F72XXX) {
+            pp = loader_code_stm32f7_pp;
+            pp_size = sizeof(loader_code_stm32f7_pp);
+        }
+        /* below 2.7V the flash is written byte wise, only the single buffered loaders do that */
+        if (loader_v_dependent_assignment(sl, &loader_code, &loader_size, pp, pp_size, NULL, 0) == -1)
+            return -1;
+    } else if (sl->flash_type == STLINK_FLASH_TYPE_L4 || sl->flash_type == STLINK_FLASH_TYPE_G0) {
+        loader_code = loader_code_stm32g0_pp;
+        loader_size = sizeof(loader_code_stm32g0_pp);
+    }
+
+    if (loader_code == NULL)
+        return -1;
+
+    avail = (sl->sram_size > loader_size + 8) ? sl->sram_size - loader_size - 8 : 0;
+    /* whole rows for fast programming */
+    fl->pp_size = (avail / 2) & ~(size_t) ((sl->flash_type == STLINK_FLASH_TYPE_L4 || sl->flash_type == STLINK_FLASH_TYPE_G0) ? 255 : 7);
+    if (fl->pp_size > PP_BUF_MAX)
+        fl->pp_size = PP_BUF_MAX;
+    if (fl->pp_size < PP_BUF_MIN) {
+        fl->pp_size = 0;
+        return -1;
+    }
+
+    memcpy(sl->q_buf, loader_code, loader_size);
+    if (stlink_write_mem32(sl, sl->sram_base, (uint16_t) loader_size) == 0)
+        flash_loader_cache_set(sl, loader_code, loader_size, fl->pp_size);
+
+    fl->loader_addr = sl->sram_base;
+    fl->buf_addr = fl->loader_addr + (uint32_t) loader_size;
+    ILOG("Successfully loaded double buffered flash loader in sram, 2x%u bytes\n", (unsigned int) fl->pp_size);
+
+    return 0;
+}
+
+int stlink_flash_loader_init(stlink_t *sl, flash_loader_t *fl)
+{
+	size_t size;
+
+	if (flash_loader_cached(sl, fl) == 0)
+		return 0;
+
+	/* prefer the double buffered loader when there is one for the chip */
+	if (flash_loader_pp_write_to_sram(sl, fl) == 0)
+		return 0;
+
+	/* allocate the loader in sram */
+	if (stlink_flash_loader_write_to_sram(sl, &fl->loader_addr, &size) == -1) {
+		WLOG("Failed to write flash loader to sram!\n");
+		return -1;
+	}
+
+	/* allocate a one page buffer in sram right after loader */
+	fl->buf_addr = fl->loader_addr + (uint32_t) size;
+	fl->pp_size = 0;
+	ILOG("Successfully loaded flash loader in sram\n");
+
+	return 0;
+}
+
+static size_t flash_loader_unit(stlink_t *sl)
+{
+    if ((sl->flash_type == STLINK_FLASH_TYPE_F0) || (sl->flash_type == STLINK_FLASH_TYPE_F1_XL))
+        return sizeof(uint16_t);
+    if ((sl->flash_type == STLINK_FLASH_TYPE_L4) || (sl->flash_type == STLINK_FLASH_TYPE_G0))
+        return sizeof(uint64_t);
+    return sizeof(uint32_t);
+}
+
+struct pp_slot_wait {
+    stm32_addr_t mbox_addr;
+};
+
+static int pp_slot_free(stlink_t *sl, void *arg) {
+    const struct pp_slot_wait *w = arg;
+    uint32_t mbox;
+
+    if (stlink_read_debug32(sl, w->mbox_addr, &mbox) == -1)
+        return -1;
+    if (mbox == 0)
+        return 1;
+    if (stlink_is_core_halted(sl)) {
+        ELOG("flash loader stopped, %u units not written\n", mbox & ~PP_LAST);
+        return -1;
+    }
+    return 0;
+}
+
+/* Wait until the loader hands buffer slot back, or stops */
+static int flash_loader_pp_wait(stlink_t *sl, flash_loader_t *fl, int slot)
+{
+    struct pp_slot_wait w = { fl->buf_addr + 4 * (uint32_t) slot };
+
+    if (stlink_wait(sl, 0, PP_TIMEOUT_US, pp_slot_free, &w) == -1) {
+        ELOG("flash loader run error, buffer %d not done\n", slot);
+        return -1;
+    }
+    return 0;
+}
+
+/* Stream size bytes through the double buffered loader: upload buffer k+1
+   while the target programs buffer k. Everything lies in one flash bank. */
+static int flash_loader_pp_run(stlink_t *sl, flash_loader_t *fl, stm32_addr_t target, const uint8_t *buf, size_t size)
+{
+    const size_t unit = flash_loader_unit(sl);
+    const size_t chunks = (size + fl->pp_size - 1) / fl->pp_size;
+    uint8_t pad[8];
+    uint32_t flash_base = 0;
+    struct stlink_reg rr;
+    uint32_t regs[16];
+    stlink_batch_t b;
+    int i;
+
+    DLOG("Running double buffered flash loader, write address:%#x, size: %u\n", target, (unsigned int)size);
+
+    if ((sl->flash_type == STLINK_FLASH_TYPE_F1_XL) && (target >= FLASH_BANK2_START_ADDR)) {
+        flash_base = FLASH_REGS_BANK2_OFS;
+    }
+
+    for (size_t k = 0; k < chunks; k++) {
+        const int slot = (int) (k & 1);
+        const stm32_addr_t dst = fl->buf_addr + 8 + (uint32_t) (slot * fl->pp_size);
+        const size_t off = k * fl->pp_size;
+        size_t len = size - off > fl->pp_size ? fl->pp_size : size - off;
+        size_t tail = len % unit;
+        uint32_t mbox;
+
+        if (k >= 2 && flash_loader_pp_wait(sl, fl, slot) == -1)
+            return -1;
+
+        if (stlink_write_mem(sl, dst, buf + off, len - tail) == -1)
+            return -1;
+        if (tail) {
+            /* pad the last unit with the erased value */
+            memset(pad, 0xff, sizeof(pad));
+            memcpy(pad, buf + off + len - tail, tail);
+            if (stlink_write_mem(sl, dst + (uint32_t) (len - tail), pad, unit) == -1)
+                return -1;
+            len += unit - tail;
+        }
+
+        mbox = (uint32_t) (len / unit) | ((k + 1 == chunks) ? PP_LAST : 0);
+        if (k == 0) {
+            /* the other mailbox word must be clear before the loader starts */
+            stlink_batch_init(&b);
+            stlink_batch_write32(&b, fl->buf_addr + 4, 0);
+            stlink_batch_write32(&b, fl->buf_addr, mbox);
+            regs[0] = fl->buf_addr; /* mailbox */
+            regs[1] = target; /* target */
+            regs[2] = (uint32_t) fl->pp_size; /* buffer size */
+            regs[3] = flash_base; /* flash register base, only used on VL/F1_XL */
+            regs[15] = fl->loader_addr; /* pc register */
+            stlink_batch_write_regs(&b, LOADER_REGS_MASK(4), regs);
+            i = stlink_batch_submit(sl, &b);
+            stlink_batch_free(&b);
+            if (i) {
+                ELOG("failed to set up the flash loader registers\n");
+                return -1;
+            }
+            stlink_run(sl);
+        } else if (stlink_write_debug32(sl, fl->buf_addr + 4 * (uint32_t) slot, mbox) == -1) {
+            return -1;
+        }
+    }
+
+    /* wait until done (reaches breakpoint), with up to two buffers still to program */
+    if (stlink_wait_flash(sl, STLINK_FLASH_OP_PROGRAM, (size < 2 * fl->pp_size) ? size : 2 * fl->pp_size,
+                loader_halted, NULL) == -1) {
+        ELOG("flash loader run error\n");
+        return -1;
+    }
+
+    /* check the units left over */
+    stlink_read_reg(sl, 3, &rr);
+    if (rr.r[3] != 0) {
+        ELOG("write error, count == %u\n", rr.r[3]);
+        return -1;
+    }
+
+    return 0;
+}
+
+bool stlink_flash_loader_is_double_buffered(const uint8_t *code, size_t len)
+{
+    static const struct { const uint8_t *code; size_t size; } pp[] = {
+        { loader_code_stm32f0_pp, sizeof(loader_code_stm32f0_pp) },
+        { loader_code_stm32f4_pp, sizeof(loader_code_stm32f4_pp) },
+        { loader_code_stm32f7_pp, sizeof(loader_code_stm32f7_pp) },
+        { loader_code_stm32g0_pp, sizeof(loader_code_stm32g0_pp) },
+    };
+
+    for (size_t i = 0; i < sizeof(pp) / sizeof(pp[0]); i++) {
+        if (len >= pp[i].size && memcmp(code, pp[i].code, pp[i].size) == 0)
+            return true;
+    }
+    return false;
+}
+
+/* The L0/L1 loader's flash registers (r3) and half page size (r4), 0 for
+   the data eeprom, which is written a word at a time */
+static void flash_loader_l0_regs(stlink_t *sl, stm32_addr_t target, uint32_t *regs)
+{
+    if (sl->chip_id == STLINK_CHIPID_STM32_L0 || sl->chip_id == STLINK_CHIPID_STM32_L0_CAT5
+            || sl->chip_id == STLINK_CHIPID_STM32_L0_CAT2 || sl->chip_id == STLINK_CHIPID_STM32_L011) {
+        regs[3] = STM32L0_FLASH_REGS;
+        regs[4] = 64;
+    } else {
+        regs[3] = STM32L1_FLASH_REGS;
+        regs[4] = 128;
+    }
+    if (target >= STM32_EEPROM_BASE)
+        regs[4] = 0;
+}
+
+/* the program operations for count words from target: each half page is
+   one, and so is each word before, after or without them */
+static uint64_t flash_loader_l0_ops(stm32_addr_t target, size_t count, uint32_t half)
+{
+    size_t head;
+
+    if (half == 0)
+        return count;
+    head = ((half - target % half) % half) / 4;
+    if (head >= count)
+        return count;
+    count -= head;
+    return head + count / (half / 4) + count % (half / 4);
+}
+
 int stlink_flash_loader_run(stlink_t *sl, flash_loader_t* fl, stm32_addr_t target, const uint8_t* buf, size_t size)
 {
+    if (fl->pp_size) {
+        /* the register bank changes at the bank boundary, that takes a new run */
+        if ((sl->flash_type == STLINK_FLASH_TYPE_F1_XL) && (target < FLASH_BANK2_START_ADDR)
+                && (target + size > FLASH_BANK2_START_ADDR)) {
+            size_t first = FLASH_BANK2_START_ADDR - target;
+            if (flash_loader_pp_run(sl, fl, target, buf, first) == -1)
+                return -1;
+            target += (uint32_t) first;
+            buf += first;
+            size -= first;
+        }
+        return flash_loader_pp_run(sl, fl, target, buf, size);
+    }
+
     struct stlink_reg rr;
-    int i = 0;
     size_t count = 0;
     uint32_t flash_base = 0;
+    int ret;
 
     DLOG("Running flash loader, write address:%#x, size: %u\n", target, (unsigned int)size);
     // FIXME This can never return -1
@@ -344,18 +1231,11 @@ int stlink_flash_loader_run(stlink_t *sl, flash_loader_t* fl, stm32_addr_t targe
         return -1;
     }
 
-    if ((sl->flash_type == STLINK_FLASH_TYPE_F0) || (sl->flash_type == STLINK_FLASH_TYPE_F1_XL)) {
-        count = size / sizeof(uint16_t);
-        if (size % sizeof(uint16_t))
-            ++count;
-    } else if (sl->flash_type == STLINK_FLASH_TYPE_F4 || sl->flash_type == STLINK_FLASH_TYPE_L0) {
-        count = size / sizeof(uint32_t);
-        if (size % sizeof(uint32_t))
-            ++count;
-    } else if (sl->flash_type == STLINK_FLASH_TYPE_L4) {
-        count = size / sizeof(uint64_t);
-        if (size % sizeof(uint64_t))
-            ++count;
+    if ((sl->flash_type == STLINK_FLASH_TYPE_F0) || (sl->flash_type == STLINK_FLASH_TYPE_F1_XL)
+            || (sl->flash_type == STLINK_FLASH_TYPE_F4) || (sl->flash_type == STLINK_FLASH_TYPE_L0)
+            || (sl->flash_type == STLINK_FLASH_TYPE_L4) || (sl->flash_type == STLINK_FLASH_TYPE_G0)) {
+        const size_t unit = flash_loader_unit(sl);
+        count = (size + unit - 1) / unit;
     }
 
     if ((sl->flash_type == STLINK_FLASH_TYPE_F1_XL) && (target >= FLASH_BANK2_START_ADDR)) {
@@ -363,24 +1243,31 @@ int stlink_flash_loader_run(stlink_t *sl, flash_loader_t* fl, stm32_addr_t targe
     }
 
     /* setup core */
-    stlink_write_reg(sl, fl->buf_addr, 0); /* source */
-    stlink_write_reg(sl, target, 1); /* target */
-    stlink_write_reg(sl, (uint32_t) count, 2); /* count */
-    stlink_write_reg(sl, flash_base, 3); /* flash register base, only used on VL/F1_XL, but harmless for others */
-    stlink_write_reg(sl, fl->loader_addr, 15); /* pc register */
+    uint32_t regs[16];
+    regs[0] = fl->buf_addr; /* source */
+    regs[1] = target; /* target */
+    regs[2] = (uint32_t) count; /* count */
+    regs[3] = flash_base; /* flash register base, only used on VL/F1_XL, but harmless for others */
+    regs[15] = fl->loader_addr; /* pc register */
+    if (sl->flash_type == STLINK_FLASH_TYPE_L0)
+        flash_loader_l0_regs(sl, target, regs);
+    if (stlink_write_regs(sl, LOADER_REGS_MASK((sl->flash_type == STLINK_FLASH_TYPE_L0) ? 5 : 4), regs)) {
+        ELOG("failed to set up the flash loader registers\n");
+        return -1;
+    }
 
     /* run loader */
     stlink_run(sl);
 
-#define WAIT_ROUNDS 10000
-    /* wait until done (reaches breakpoint) */
-    for (i = 0; i < WAIT_ROUNDS; i++) {
-        usleep(10);
-        if (stlink_is_core_halted(sl))
-            break;
-    }
-
-    if (i >= WAIT_ROUNDS) {
+    /* wait until done (reaches breakpoint); the L0/L1 loader takes a
+       program operation per half page or single word */
+    if (sl->flash_type == STLINK_FLASH_TYPE_L0)
+        ret = stlink_wait_model(sl, STLINK_FLASH_OP_PROGRAM,
+                flash_loader_l0_ops(target, count, regs[4]) * stlink_flash_op_us(sl, STLINK_FLASH_OP_PROGRAM, 4),
+                loader_halted, NULL);
+    else
+        ret = stlink_wait_flash(sl, STLINK_FLASH_OP_PROGRAM, size, loader_halted, NULL);
+    if (ret == -1) {
         ELOG("flash loader run error\n");
         return -1;
     }
@@ -394,3 +1281,406 @@ int stlink_flash_loader_run(stlink_t *sl, flash_loader_t* fl, stm32_addr_t targe
 
     return 0;
 }
+
+/* what the agent needs to know about the flash controller, in the order
+   of the control block */
+struct flash_agent_params {
+    uint32_t sr;
+    uint32_t cr;
+    uint32_t ar;            /* 1 if the page to erase goes to cr + 4 */
+    uint32_t bsy;
+    uint32_t err;
+    uint32_t strt;
+    uint32_t pg;
+    uint32_t unit;
+    uint32_t bank2;         /* registers 0x40 further up from here on */
+};
+
+static const struct flash_agent_params agent_params_f0 = {
+    0x4002200c, 0x40022010, 1, 1u << 0, 0x14, 1u << 6, 1u << 0, 2, 0xffffffff
+};
+static const struct flash_agent_params agent_params_f1_xl = {
+    0x4002200c, 0x40022010, 1, 1u << 0, 0x14, 1u << 6, 1u << 0, 2, FLASH_BANK2_START_ADDR
+};
+/* PG with PSIZ x32 */
+static const struct flash_agent_params agent_params_f4 = {
+    0x40023c0c, 0x40023c10, 0, 1u << 16, 0xf2, 1u << 16, (1u << 0) | (2u << 8), 4, 0xffffffff
+};
+static const struct flash_agent_params agent_params_l4 = {
+    0x40022010, 0x40022014, 0, 1u << 16, 0x3fa, 1u << 16, 1u << 0, 8, 0xffffffff
+};
+
+bool stlink_flash_loader_is_agent(const uint8_t *code, size_t len)
+{
+    return len >= sizeof(loader_code_stm32_agent)
+        && memcmp(code, loader_code_stm32_agent, sizeof(loader_code_stm32_agent)) == 0;
+}
+
+int stlink_flash_agent_start(stlink_t *sl, flash_agent_t *ag)
+{
+    const size_t code_size = sizeof(loader_code_stm32_agent);
+    const struct flash_agent_params *fp;
+    const uint8_t *code = NULL;
+    size_t size, avail;
+    uint32_t regs[16];
+    stlink_batch_t b;
+    int ret;
+
+    switch (sl->flash_type) {
+    case STLINK_FLASH_TYPE_F0:
+        fp = &agent_params_f0;
+        break;
+    case STLINK_FLASH_TYPE_F1_XL:
+        fp = &agent_params_f1_xl;
+        break;
+    case STLINK_FLASH_TYPE_F4:
+        /* the agent programs x32, below 2.7V only the single buffered loaders do it byte wise */
+        if (loader_v_dependent_assignment(sl, &code, &size, loader_code_stm32_agent, code_size, NULL, 0) == -1
+                || code == NULL)
+            return 1;
+        fp = &agent_params_f4;
+        break;
+    case STLINK_FLASH_TYPE_L4:
+        fp = &agent_params_l4;
+        break;
+    default:
+        return 1;
+    }
+
+    avail = (sl->sram_size > code_size + AGENT_CTL_SIZE) ? sl->sram_size - code_size - AGENT_CTL_SIZE : 0;
+    ag->buf_size = (avail / STLINK_AGENT_BUFS) & ~(size_t) 7;
+    if (ag->buf_size > PP_BUF_MAX)
+        ag->buf_size = PP_BUF_MAX;
+    if (ag->buf_size < PP_BUF_MIN)
+        return 1;
+
+    if (flash_loader_cache_valid(sl, loader_code_stm32_agent)) {
+        DLOG("Reusing the flashing agent in sram\n");
+    } else {
+        memcpy(sl->q_buf, loader_code_stm32_agent, code_size);
+        if (stlink_write_mem32(sl, sl->sram_base, (uint16_t) code_size) == -1)
+            return -1;
+        flash_loader_cache_set(sl, loader_code_stm32_agent, code_size, 0);
+    }
+
+    ag->ctl = sl->sram_base + (uint32_t) code_size;
+    ag->buf_addr = ag->ctl + AGENT_CTL_SIZE;
+    ag->unit = fp->unit;
+    ag->queued = 0;
+    ag->head = 0;
+    ag->tail = 0;
+    ag->programs = 0;
+    ag->model_us = 0;
+    ag->model_done_us = 0;
+    ag->bank_us[0] = ag->bank_us[1] = 0;
+
+    /* no errors left over from before, an empty queue and the flash controller, then go */
+    stlink_batch_init(&b);
+    stlink_batch_write32(&b, fp->sr, fp->err);
+    if (sl->flash_type == STLINK_FLASH_TYPE_F1_XL)
+        stlink_batch_write32(&b, fp->sr + FLASH_REGS_BANK2_OFS, fp->err);
+    stlink_batch_write32(&b, ag->ctl, 0);
+    stlink_batch_write32(&b, ag->ctl + AGENT_TAIL, 0);
+    stlink_batch_write32(&b, ag->ctl + AGENT_STATUS, 0);
+    for (size_t i = 0; i < sizeof(*fp) / sizeof(uint32_t); i++)
+        stlink_batch_write32(&b, ag->ctl + 12 + 4 * (uint32_t) i, ((const uint32_t *) fp)[i]);
+    regs[0] = ag->ctl; /* control block */
+    regs[15] = sl->sram_base; /* pc register */
+    stlink_batch_write_regs(&b, LOADER_REGS_MASK(1), regs);
+    ret = stlink_batch_submit(sl, &b);
+    stlink_batch_free(&b);
+    if (ret) {
+        ELOG("failed to set up the flashing agent\n");
+        return -1;
+    }
+
+    stlink_run(sl);
+    ILOG("Started the flashing agent in sram, 2x%u bytes of buffers\n", (unsigned int) ag->buf_size);
+
+    return 0;
+}
+
+static void flash_agent_error(stlink_t *sl, uint32_t status)
+{
+    if (status >= sl->flash_base)
+        ELOG("flash at %#x is not erased\n", status);
+    else
+        ELOG("flash error, status register %#x\n", status);
+}
+
+struct agent_wait {
+    flash_agent_t *ag;
+    uint32_t n;
+};
+
+/* done once the agent is past descriptor n, -1 if it stopped short of it */
+static int agent_past(stlink_t *sl, void *arg) {
+    struct agent_wait *w = arg;
+    flash_agent_t *ag = w->ag;
+    uint32_t tail, status;
+
+    if (stlink_read_mem32(sl, ag->ctl + AGENT_TAIL, 8) == -1)
+        return -1;
+    tail = read_uint32(sl->q_buf, 0);
+    status = read_uint32(sl->q_buf, 4);
+
+    if (tail != ag->tail && tail - ag->tail <= ag->head - ag->tail) {
+        ag->tail = tail;
+        ag->model_done_us = ag->due[(tail - 1) % (2 * STLINK_AGENT_SLOTS)];
+    }
+    if ((int32_t) (ag->tail - w->n) > 0)
+        return 1;
+    if (status != 0) {
+        flash_agent_error(sl, status);
+        return -1;
+    }
+    return 0;
+}
+
+/* Hand the descriptors queued since the last time over to the agent: the
+   descriptors in as few writes as the ring allows, then the head */
+static int flash_agent_flush(stlink_t *sl, flash_agent_t *ag)
+{
+    uint8_t desc[16 * STLINK_AGENT_SLOTS];
+    uint32_t n = ag->head;
+
+    while (n != ag->queued) {
+        const uint32_t slot = n % STLINK_AGENT_SLOTS;
+        uint32_t count = ag->queued - n;
+
+        if (count > STLINK_AGENT_SLOTS - slot)
+            count = STLINK_AGENT_SLOTS - slot;
+        for (uint32_t i = 0; i < count; i++) {
+            for (uint32_t j = 0; j < 4; j++)
+                write_uint32(desc + 16 * i + 4 * j, ag->ring[slot + i][j]);
+        }
+        if (stlink_write_mem(sl, ag->ctl + AGENT_RING + 16 * slot, desc, 16 * count) == -1)
+            return -1;
+        n += count;
+    }
+
+    if (n != ag->head && stlink_write_debug32(sl, ag->ctl, n) == -1) {
+        ELOG("failed to post to the flashing agent\n");
+        return -1;
+    }
+    ag->head = n;
+
+    return 0;
+}
+
+/* Wait until the agent is done with descriptor n, expecting it to take
+   what the work queued up to it is modeled to take */
+static int flash_agent_wait(stlink_t *sl, flash_agent_t *ag, uint32_t n)
+{
+    const size_t i = n % (2 * STLINK_AGENT_SLOTS);
+    struct agent_wait w = { ag, n };
+
+    if ((int32_t) (ag->tail - n) > 0)
+        return 0;
+    if (flash_agent_flush(sl, ag) == -1)
+        return -1;
+
+    if (stlink_wait_model(sl, (enum stlink_flash_op) ag->op[i], ag->due[i] - ag->model_done_us,
+                agent_past, &w) == -1) {
+        ELOG("flashing agent run error, descriptor %u not done\n", n);
+        if (!stlink_is_core_halted(sl))
+            stlink_force_debug(sl);
+        return -1;
+    }
+    return 0;
+}
+
+int stlink_flash_agent_post(stlink_t *sl, flash_agent_t *ag, enum stlink_agent_op op,
+        stm32_addr_t addr, uint32_t len, uint32_t arg)
+{
+    const uint32_t n = ag->queued;
+    uint32_t *d = ag->ring[n % STLINK_AGENT_SLOTS];
+    const size_t i = n % (2 * STLINK_AGENT_SLOTS);
+    /* only the F1 XL has a controller for each bank */
+    uint64_t *bank = &ag->bank_us[(sl->flash_type == STLINK_FLASH_TYPE_F1_XL) && (addr >= FLASH_BANK2_START_ADDR)];
+
+    /* the slot is free once the agent is past the descriptor it held */
+    if (n >= STLINK_AGENT_SLOTS && flash_agent_wait(sl, ag, n - STLINK_AGENT_SLOTS) == -1)
+        return -1;
+
+    /* the agent waits for the bank, then goes on while an erase runs */
+    ag->op[i] = (op == STLINK_AGENT_ERASE) ? STLINK_FLASH_OP_ERASE : STLINK_FLASH_OP_PROGRAM;
+    if (op == STLINK_AGENT_ERASE || op == STLINK_AGENT_PROGRAM || op == STLINK_AGENT_BLANK) {
+        if (*bank > ag->model_us)
+            ag->model_us = *bank;
+        if (op != STLINK_AGENT_BLANK)
+            *bank = ag->model_us + stlink_flash_op_us(sl, (enum stlink_flash_op) ag->op[i], len);
+        if (op == STLINK_AGENT_PROGRAM)
+            ag->model_us = *bank;
+    }
+    ag->due[i] = ag->model_us;
+
+    d[0] = (uint32_t) op;
+    d[1] = addr;
+    d[2] = len;
+    d[3] = arg;
+    ag->queued = n + 1;
+
+    return 0;
+}
+
+/* True if compressed data placed at off in the buffer it unpacks into is
+   read before the unpacked data catches up with it and overwrites it. */
+static bool lz_fits_in_place(const uint8_t *c, size_t csize, size_t len, size_t off)
+{
+    size_t in = 0, out = 0;
+
+    while (out < len && in < csize) {
+        const uint8_t t = c[in];
+
+        if (t < 0x80) {
+            in += (size_t) t + 2;
+            out += (size_t) t + 1;
+        } else {
+            in += 3;
+            out += (size_t) t - 0x7c;
+        }
+        if (out > off + in)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Compress a padded chunk into the buffer at src, to the end of it so the
+ * agent can unpack it in place, and queue the unpacking. Returns 1 if the
+ * chunk is better sent as it is.
+ */
+static int flash_agent_pack(stlink_t *sl, flash_agent_t *ag, stm32_addr_t src,
+        const uint8_t *chunk, size_t len, uint8_t *packed)
+{
+    size_t csize, at, sent;
+
+    /* an eighth less to send at least, the agent has to unpack it */
+    csize = stlink_lz_compress(packed, len - len / 8, chunk, len);
+    if (csize == 0)
+        return 1;
+    at = (ag->buf_size - csize) & ~(size_t) 3;
+    if (!lz_fits_in_place(packed, csize, len, at))
+        return 1;
+
+    sent = (csize + 3) & ~(size_t) 3;
+    memset(packed + csize, 0, sent - csize);
+    if (stlink_write_mem(sl, src + (uint32_t) at, packed, sent) == -1
+            || stlink_flash_agent_post(sl, ag, STLINK_AGENT_UNPACK, src, (uint32_t) len, src + (uint32_t) at) == -1)
+        return -1;
+
+    sl->stats.flash.sent -= len - sent;
+    sl->stats.flash.packed++;
+    return 0;
+}
+
+int stlink_flash_agent_program(stlink_t *sl, flash_agent_t *ag, stm32_addr_t addr, const uint8_t *buf, size_t size)
+{
+    uint8_t *chunk = NULL, *packed = NULL;
+    uint8_t pad[8];
+    size_t off, len;
+    int ret = 0;
+
+    if (sl->flash_compress) {
+        chunk = malloc(ag->buf_size);
+        packed = malloc(ag->buf_size);
+        if (chunk == NULL || packed == NULL) {
+            free(chunk);
+            free(packed);
+            chunk = packed = NULL;
+        }
+    }
+
+    for (off = 0; off < size && ret == 0; off += len) {
+        const uint32_t k = ag->programs % STLINK_AGENT_BUFS;
+        const stm32_addr_t src = ag->buf_addr + k * (uint32_t) ag->buf_size;
+        const stm32_addr_t target = addr + (uint32_t) off;
+        size_t tail, padded;
+
+        len = (size - off > ag->buf_size) ? ag->buf_size : size - off;
+        /* the register bank changes at the bank boundary, the agent picks it per descriptor */
+        if ((sl->flash_type == STLINK_FLASH_TYPE_F1_XL) && (target < FLASH_BANK2_START_ADDR)
+                && (target + len > FLASH_BANK2_START_ADDR))
+            len = FLASH_BANK2_START_ADDR - target;
+        tail = len % ag->unit;
+        padded = len - tail;
+
+        /* the buffer is free once the agent is done programming what it held */
+        if (ag->programs >= STLINK_AGENT_BUFS && flash_agent_wait(sl, ag, ag->buf_desc[k]) == -1) {
+            ret = -1;
+            break;
+        }
+
+        if (chunk) {
+            /* pad the last unit with the erased value */
+            memcpy(chunk, buf + off, len);
+            if (tail) {
+                memset(chunk + len, 0xff, ag->unit - tail);
+                padded += ag->unit;
+            }
+            ret = flash_agent_pack(sl, ag, src, chunk, padded, packed);
+            if (ret == 1)
+                ret = stlink_write_mem(sl, src, chunk, padded);
+        } else {
+            if (padded)
+                ret = stlink_write_mem(sl, src, buf + off, padded);
+            if (ret == 0 && tail) {
+                memset(pad, 0xff, sizeof(pad));
+                memcpy(pad, buf + off + padded, tail);
+                ret = stlink_write_mem(sl, src + (uint32_t) padded, pad, ag->unit);
+                padded += ag->unit;
+            }
+        }
+
+        /* out at once, the agent programs while the next buffer goes up */
+        if (ret == -1 || stlink_flash_agent_post(sl, ag, STLINK_AGENT_PROGRAM, target, (uint32_t) padded, src) == -1
+                || flash_agent_flush(sl, ag) == -1) {
+            ret = -1;
+            break;
+        }
+        ag->buf_desc[k] = ag->queued - 1;
+        ag->programs++;
+    }
+
+    free(chunk);
+    free(packed);
+    return ret;
+}
+
+int stlink_flash_agent_finish(stlink_t *sl, flash_agent_t *ag)
+{
+    uint32_t tail, status;
+
+    /* an erase may still be running, blank checking nothing waits for it */
+    if (stlink_flash_agent_post(sl, ag, STLINK_AGENT_BLANK, (stm32_addr_t) sl->flash_base, 0, 0) == -1
+            || (sl->flash_type == STLINK_FLASH_TYPE_F1_XL
+                && stlink_flash_agent_post(sl, ag, STLINK_AGENT_BLANK, FLASH_BANK2_START_ADDR, 0, 0) == -1)
+            || stlink_flash_agent_post(sl, ag, STLINK_AGENT_STOP, 0, 0, 0) == -1
+            || flash_agent_flush(sl, ag) == -1)
+        return -1;
+
+    /* the agent reaches its breakpoint at the stop descriptor */
+    if (stlink_wait_model(sl, STLINK_FLASH_OP_PROGRAM, ag->model_us - ag->model_done_us,
+                loader_halted, NULL) == -1) {
+        ELOG("flashing agent run error\n");
+        stlink_force_debug(sl);
+        return -1;
+    }
+
+    if (stlink_read_mem32(sl, ag->ctl + AGENT_TAIL, 8) == -1)
+        return -1;
+    tail = read_uint32(sl->q_buf, 0);
+    status = read_uint32(sl->q_buf, 4);
+    if (status != 0) {
+        flash_agent_error(sl, status);
+        return -1;
+    }
+    if (tail != ag->queued - 1) {
+        ELOG("flashing agent stopped after %u of %u descriptors\n", tail, ag->queued - 1);
+        return -1;
+    }
+
+    DLOG("Flashing agent done, %u descriptors\n", tail);
+    return 0;
+}
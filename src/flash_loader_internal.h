@@ -0,0 +1,34 @@
+/*
+ * File:   flash_loader_internal.h
+ *
+ * Not installed: what the simulator and the tests need to know about the
+ * flash loaders. The simulator recognises a loader by its code in sram and
+ * carries out its register protocol, it does not run the thumb code.
+ */
+#ifndef STLINK_FLASH_LOADER_INTERNAL_H_
+#define STLINK_FLASH_LOADER_INTERNAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* true if code starts with one of the double buffered loaders */
+bool stlink_flash_loader_is_double_buffered(const uint8_t *code, size_t len);
+/* true if code starts with the crc routine */
+bool stlink_flash_loader_is_crc32(const uint8_t *code, size_t len);
+/* true if code starts with the agent */
+bool stlink_flash_loader_is_agent(const uint8_t *code, size_t len);
+
+/* unpack len bytes into dst the way the agent does, -1 if the data runs out,
+   see stlink_lz_compress() */
+int stlink_lz_decompress(uint8_t *dst, size_t len, const uint8_t *src, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STLINK_FLASH_LOADER_INTERNAL_H_ */
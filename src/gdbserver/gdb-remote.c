@@ -15,57 +15,123 @@
 #include <sys/poll.h>
 #endif
 
+#include <stlink.h>
+#include <stlink/logging.h>
+
+#include "gdb-remote.h"
+
 static const char hex[] = "0123456789abcdef";
 
-int gdb_send_packet(int fd, char* data) {
-    unsigned int data_length = (unsigned int) strlen(data);
-    int length = data_length + 4;
-    char* packet = malloc(length); /* '$' data (hex) '#' cksum (hex) */
+void gdb_conn_init(gdb_conn_t *c, int fd) {
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+}
+
+void gdb_conn_free(gdb_conn_t *c) {
+    free(c->packet);
+    free(c->reply);
+    free(c->tx);
+    gdb_conn_init(c, -1);
+}
+
+/* make *buf hold at least size bytes, growing it by doubling */
+static int gdb_reserve(char **buf, size_t *buf_size, size_t size) {
+    size_t n = *buf_size ? *buf_size : 256;
+    char *p;
+
+    if (size <= *buf_size)
+        return 0;
+    while (n < size)
+        n *= 2;
+    p = realloc(*buf, n);
+    if (p == NULL)
+        return -1;
+    *buf = p;
+    *buf_size = n;
+    return 0;
+}
+
+/* the next byte from gdb, reading a buffer full when there is none left */
+static int gdb_getc(gdb_conn_t *c, char *ch) {
+    if (c->rx_pos == c->rx_len) {
+        ssize_t n = read(c->fd, c->rx, sizeof(c->rx));
+
+        if (n <= 0)
+            return -2;
+        c->rx_pos = 0;
+        c->rx_len = (size_t) n;
+    }
+    *ch = c->rx[c->rx_pos++];
+    return 0;
+}
+
+static int gdb_write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n <= 0)
+            return -2;
+        buf += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
 
-    memset(packet, 0, length);
+char *gdb_reply_buf(gdb_conn_t *c, size_t len) {
+    if (gdb_reserve(&c->reply, &c->reply_size, len + 1) == -1)
+        return NULL;
+    memset(c->reply, 0, len + 1);
+    return c->reply;
+}
 
-    packet[0] = '$';
+int gdb_send_packet(gdb_conn_t *c, const char* data) {
+    return gdb_send_binary(c, data, strlen(data));
+}
 
+int gdb_send_binary(gdb_conn_t *c, const char* data, size_t data_length) {
+    const size_t length = data_length + 4; /* '$' data '#' cksum (hex) */
     uint8_t cksum = 0;
-    for(unsigned int i = 0; i < data_length; i++) {
-        packet[i + 1] = data[i];
-        cksum += data[i];
+
+    if (gdb_reserve(&c->tx, &c->tx_size, length) == -1)
+        return -1;
+
+    c->tx[0] = '$';
+    for(size_t i = 0; i < data_length; i++) {
+        c->tx[i + 1] = data[i];
+        cksum += (uint8_t) data[i];
     }
 
-    packet[length - 3] = '#';
-    packet[length - 2] = hex[cksum >> 4];
-    packet[length - 1] = hex[cksum & 0xf];
+    c->tx[length - 3] = '#';
+    c->tx[length - 2] = hex[cksum >> 4];
+    c->tx[length - 1] = hex[cksum & 0xf];
 
     while(1) {
-        if(write(fd, packet, length) != length) {
-            free(packet);
+        char ack;
+
+        if(gdb_write_all(c->fd, c->tx, length) != 0)
             return -2;
-        }
 
-        char ack;
-        if(read(fd, &ack, 1) != 1) {
-            free(packet);
+        if(c->no_ack)
+            return 0;
+
+        if(gdb_getc(c, &ack) != 0)
             return -2;
-        }
 
-        if(ack == '+') {
-            free(packet);
+        if(ack == '+')
             return 0;
-        }
     }
 }
 
-#define ALLOC_STEP 1024
-
-int gdb_recv_packet(int fd, char** buffer) {
-    unsigned packet_size = ALLOC_STEP + 1, packet_idx = 0;
-    uint8_t cksum = 0;
+int gdb_recv_packet(gdb_conn_t *c, char** buffer) {
+    size_t packet_idx;
+    uint8_t cksum;
     char recv_cksum[3] = {0};
-    char* packet_buffer = malloc(packet_size);
     unsigned state;
 
 start:
     state = 0;
+    packet_idx = 0;
+    cksum = 0;
     /*
      * 0: waiting $
      * 1: data, waiting #
@@ -74,15 +140,15 @@ start:
      * 4: fin
      */
 
-    char c;
+    char ch;
     while(state != 4) {
-        if(read(fd, &c, 1) != 1) {
+        if(gdb_getc(c, &ch) != 0) {
             return -2;
         }
 
         switch(state) {
         case 0:
-            if(c != '$') {
+            if(ch != '$') {
                 // ignore
             } else {
                 state = 1;
@@ -90,70 +156,74 @@ start:
             break;
 
         case 1:
-            if(c == '#') {
+            if(ch == '#') {
                 state = 2;
             } else {
-                packet_buffer[packet_idx++] = c;
-                cksum += c;
-
-                if(packet_idx == packet_size) {
-                    packet_size += ALLOC_STEP;
-                    packet_buffer = realloc(packet_buffer, packet_size);
-                }
+                /* room for this one and the terminating zero */
+                if(gdb_reserve(&c->packet, &c->packet_size, packet_idx + 2) == -1)
+                    return -1;
+                c->packet[packet_idx++] = ch;
+                cksum += (uint8_t) ch;
             }
             break;
 
         case 2:
-            recv_cksum[0] = c;
+            recv_cksum[0] = ch;
             state = 3;
             break;
 
         case 3:
-            recv_cksum[1] = c;
+            recv_cksum[1] = ch;
             state = 4;
             break;
         }
     }
 
-    uint8_t recv_cksum_int = strtoul(recv_cksum, NULL, 16);
-    if(recv_cksum_int != cksum) {
+    uint8_t recv_cksum_int = (uint8_t) strtoul(recv_cksum, NULL, 16);
+    if(c->no_ack) {
+        /* nothing to ask for again, the transport is reliable anyway */
+        if(recv_cksum_int != cksum)
+            WLOG("packet checksum %02x, expected %02x\n", recv_cksum_int, cksum);
+    } else if(recv_cksum_int != cksum) {
         char nack = '-';
-        if(write(fd, &nack, 1) != 1) {
+        if(write(c->fd, &nack, 1) != 1) {
             return -2;
         }
 
         goto start;
     } else {
         char ack = '+';
-        if(write(fd, &ack, 1) != 1) {
+        if(write(c->fd, &ack, 1) != 1) {
             return -2;
         }
     }
 
-    packet_buffer[packet_idx] = 0;
-    *buffer = packet_buffer;
+    if(gdb_reserve(&c->packet, &c->packet_size, packet_idx + 1) == -1)
+        return -1;
+    c->packet[packet_idx] = 0;
+    *buffer = c->packet;
 
-    return packet_idx;
+    return (int) packet_idx;
 }
 
 // Here we skip any characters which are not \x03, GDB interrupt.
 // As we use the mode with ACK, in a (very unlikely) situation of a packet
-// lost because of this skipping, it will be resent anyway.
-int gdb_check_for_interrupt(int fd) {
+// lost because of this skipping, it will be resent anyway. Without acks,
+// gdb sends nothing else while the target runs.
+int gdb_check_for_interrupt(gdb_conn_t *c) {
     struct pollfd pfd;
-    pfd.fd = fd;
+    pfd.fd = c->fd;
     pfd.events = POLLIN;
 
-    if(poll(&pfd, 1, 0) != 0) {
-        char c;
+    if(c->rx_pos < c->rx_len || poll(&pfd, 1, 0) != 0) {
+        char ch;
 
-        if(read(fd, &c, 1) != 1)
+        if(gdb_getc(c, &ch) != 0)
             return -2;
 
-        if(c == '\x03') // ^C
+        if(ch == '\x03') // ^C
             return 1;
     }
 
     return 0;
 }
-
@@ -1,8 +1,39 @@
 #ifndef _GDB_REMOTE_H_
 #define _GDB_REMOTE_H_
 
-int gdb_send_packet(int fd, char* data);
-int gdb_recv_packet(int fd, char** buffer);
-int gdb_check_for_interrupt(int fd);
+#include <stddef.h>
+#include <stdbool.h>
+
+#define GDB_RX_SIZE 4096
+
+/*
+ * One connection to gdb. Bytes are read from fd a buffer at a time, the
+ * received packet and the reply are kept in buffers that grow as needed
+ * and are reused from packet to packet.
+ */
+typedef struct gdb_conn {
+    int fd;
+    char rx[GDB_RX_SIZE];       /* received, rx_pos up to rx_len not taken yet */
+    size_t rx_pos, rx_len;
+    char *packet;               /* the packet gdb_recv_packet() returned */
+    size_t packet_size;
+    char *reply;                /* see gdb_reply_buf() */
+    size_t reply_size;
+    char *tx;                   /* the reply, framed */
+    size_t tx_size;
+    bool no_ack;                /* QStartNoAckMode: no '+' or '-' either way */
+} gdb_conn_t;
+
+void gdb_conn_init(gdb_conn_t *c, int fd);
+void gdb_conn_free(gdb_conn_t *c);
+/* send data as a packet, in one write, and wait for gdb to take it */
+int gdb_send_packet(gdb_conn_t *c, const char* data);
+/* the same for len bytes of binary data, escaped already */
+int gdb_send_binary(gdb_conn_t *c, const char* data, size_t len);
+/* the next packet in *buffer, valid until the next call; returns its length */
+int gdb_recv_packet(gdb_conn_t *c, char** buffer);
+int gdb_check_for_interrupt(gdb_conn_t *c);
+/* a zeroed buffer for a reply of up to len chars, valid until the next call */
+char *gdb_reply_buf(gdb_conn_t *c, size_t len);
 
 #endif
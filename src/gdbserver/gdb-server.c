@@ -35,6 +35,18 @@
 /* Semihosting doesn't have a short option, we define a value to identify it */
 #define SEMIHOSTING_OPTION 128
 #define SERIAL_OPTION 127
+#define SIM_OPTION 126
+#define RECORD_OPTION 125
+#define REPLAY_OPTION 124
+#define NO_MEMCACHE_OPTION 123
+
+/*
+ * The largest packet gdb may send, set on connect: with a backend that
+ * pipelines reads, an 'm' for as many bytes as one burst of them brings
+ * in, with the reply in hex twice that. Otherwise what it always was.
+ */
+#define GDB_PACKET_SIZE_PIPELINED (2 * STLINK_USB_PIPELINE_DEPTH * STLINK_USB_MEM_CHUNK)
+#define GDB_PACKET_SIZE_DEFAULT 0x3fff
 
 //Allways update the FLASH_PAGE before each use, by calling stlink_calculate_pagesize
 #define FLASH_PAGE (sl->flash_pgsz)
@@ -43,6 +55,12 @@ static stlink_t *connected_stlink = NULL;
 static bool semihosting = false;
 static bool serial_specified = false;
 static char serialnumber[28] = {0};
+static bool sim_specified = false;
+static struct stlink_sim_config sim_config;
+static const char *record_path = NULL;
+static const char *replay_path = NULL;
+static bool memcache = true;
+static unsigned int gdb_packet_size = GDB_PACKET_SIZE_DEFAULT;
 
 static const char hex[] = "0123456789abcdef";
 
@@ -78,7 +96,11 @@ static void cleanup(int signum) {
 
 static stlink_t* do_connect(st_state_t *st) {
     stlink_t *ret = NULL;
-    switch (st->stlink_version) {
+    if (replay_path)
+        ret = stlink_open_replay(st->logging_level, replay_path, false);
+    else if (sim_specified)
+        ret = stlink_open_sim(st->logging_level, st->reset, &sim_config);
+    else switch (st->stlink_version) {
         case 2:
             if(serial_specified){
                 ret = stlink_open_usb(st->logging_level, st->reset, serialnumber);
@@ -91,6 +113,14 @@ static stlink_t* do_connect(st_state_t *st) {
             ret = stlink_v1_open(st->logging_level, st->reset);
             break;
     }
+    if (ret && record_path && !replay_path && stlink_trace_record(ret, record_path)) {
+        stlink_close(ret);
+        ret = NULL;
+    }
+    if (ret) {
+        stlink_memcache_enable(ret, memcache, true);
+        gdb_packet_size = ret->backend->read_mem32_bulk ? GDB_PACKET_SIZE_PIPELINED : GDB_PACKET_SIZE_DEFAULT;
+    }
     return ret;
 }
 
@@ -107,6 +137,10 @@ int parse_options(int argc, char** argv, st_state_t *st) {
         {"version", no_argument, NULL, 'V'},
         {"semihosting", no_argument, NULL, SEMIHOSTING_OPTION},
 	  {"serial", required_argument, NULL, SERIAL_OPTION},
+        {"sim", required_argument, NULL, SIM_OPTION},
+        {"record", required_argument, NULL, RECORD_OPTION},
+        {"replay", required_argument, NULL, REPLAY_OPTION},
+        {"no-memcache", no_argument, NULL, NO_MEMCACHE_OPTION},
         {0, 0, 0, 0},
     };
     const char * help_str = "%s - usage:\n\n"
@@ -129,6 +163,14 @@ int parse_options(int argc, char** argv, st_state_t *st) {
         "\t\t\tEnable semihosting support.\n"
         "  --serial <serial>\n"
         "\t\t\tUse a specific serial number.\n"
+        "  --sim <chipid>[:<flash KiB>]\n"
+        "\t\t\tServe a simulated target instead of a probe.\n"
+        "  --record <file>\n"
+        "\t\t\tRecord the probe traffic of the session to a trace file.\n"
+        "  --replay <file>\n"
+        "\t\t\tServe a recorded trace instead of a probe.\n"
+        "  --no-memcache\n"
+        "\t\t\tRead memory and registers from the target every time, even while it is halted.\n"
         "\n"
         "The STLINKv2 device to use can be specified in the environment\n"
         "variable STLINK_DEVICE on the format <USB_BUS>:<USB_ADDR>.\n"
@@ -198,6 +240,26 @@ int parse_options(int argc, char** argv, st_state_t *st) {
                 }
                 serial_specified = true;
                 break;
+            case SIM_OPTION: {
+                int chip_id = 0, kib = 0;
+                if (sscanf(optarg, "%i:%i", &chip_id, &kib) < 1 || chip_id <= 0 || kib < 0) {
+                    fprintf(stderr, "bad chip id: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                sim_config.chip_id = (uint32_t) chip_id;
+                sim_config.flash_size = (size_t) kib * 1024;
+                sim_specified = true;
+                break;
+            }
+            case RECORD_OPTION:
+                record_path = optarg;
+                break;
+            case REPLAY_OPTION:
+                replay_path = optarg;
+                break;
+            case NO_MEMCACHE_OPTION:
+                memcache = false;
+                break;
         }
     }
 
@@ -1054,6 +1116,38 @@ static size_t unhexify(const char *in, char *out, size_t out_count)
     return i;
 }
 
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Undo the escapes of binary data in place: '}' is followed by the byte
+ * xor 0x20. Returns the length decoded, or -1 if data ends in a '}'.
+ */
+static int unescape(char *data, size_t len)
+{
+    size_t out = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == 0x7d) {
+            if (++i == len)
+                return -1;
+            data[out++] = (char) (data[i] ^ 0x20);
+        } else {
+            data[out++] = data[i];
+        }
+    }
+
+    return (int) out;
+}
+
 int serve(stlink_t *sl, st_state_t *st) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if(sock < 0) {
@@ -1101,21 +1195,35 @@ int serve(stlink_t *sl, st_state_t *st) {
     }
     init_code_breakpoints(sl);
     init_data_watchpoints(sl);
+    // the memory cache waits for the core to be seen halted
+    stlink_status(sl);
 
     ILOG("GDB connected.\n");
 
+    gdb_conn_t conn;
+    gdb_conn_init(&conn, client);
+
     /*
      * To allow resetting the chip from GDB it is required to
      * emulate attaching and detaching to target.
      */
     unsigned int attached = 1;
 
+    /*
+     * Registers for the 'p' packets gdb sends one by one after each stop.
+     * The library caches the core registers while the core stays halted,
+     * the special and FP ones are kept here, read in one batch.
+     */
+    struct stlink_reg regs;
+    bool fp_regs_valid = false;
+
     while(1) {
         char* packet;
 
-        int status = gdb_recv_packet(client, &packet);
+        int status = gdb_recv_packet(&conn, &packet);
         if(status < 0) {
             ELOG("cannot recv: %d\n", status);
+            gdb_conn_free(&conn);
 #if defined(__MINGW32__) || defined(_MSC_VER)
             win32_close_socket(client);
 #endif
@@ -1124,13 +1232,19 @@ int serve(stlink_t *sl, st_state_t *st) {
 
         DLOG("recv: %s\n", packet);
 
-        char* reply = NULL;
+        const char* reply = NULL;
+        size_t reply_len = 0;       /* binary replies only, the rest are strings */
+        bool start_no_ack = false;
         struct stlink_reg regp;
 
+        /* anything but reading may run the core or change the registers */
+        if (strchr("gpmx?", packet[0]) == NULL)
+            fp_regs_valid = false;
+
         switch(packet[0]) {
             case 'q': {
                 if(packet[1] == 'P' || packet[1] == 'C' || packet[1] == 'L') {
-                    reply = strdup("");
+                    reply = "";
                     break;
                 }
 
@@ -1148,14 +1262,15 @@ int serve(stlink_t *sl, st_state_t *st) {
                 DLOG("query: %s;%s\n", queryName, params);
 
                 if(!strcmp(queryName, "Supported")) {
-                    if(sl->chip_id==STLINK_CHIPID_STM32_F4
+                    const bool features = sl->chip_id==STLINK_CHIPID_STM32_F4
                        || sl->chip_id==STLINK_CHIPID_STM32_F4_HD
-                       || sl->core_id==STM32F7_CORE_ID) {
-                        reply = strdup("PacketSize=3fff;qXfer:memory-map:read+;qXfer:features:read+");
-                    }
-                    else {
-                        reply = strdup("PacketSize=3fff;qXfer:memory-map:read+");
-                    }
+                       || sl->core_id==STM32F7_CORE_ID;
+                    char *out = gdb_reply_buf(&conn, 128);
+
+                    if (out)
+                        snprintf(out, 128, "PacketSize=%x;qXfer:memory-map:read+%s;QStartNoAckMode+",
+                                gdb_packet_size, features ? ";qXfer:features:read+" : "");
+                    reply = out;
                 } else if(!strcmp(queryName, "Xfer")) {
                     char *type, *op, *__s_addr, *s_length;
                     char *tok = params;
@@ -1187,11 +1302,15 @@ int serve(stlink_t *sl, st_state_t *st) {
                             length = data_length - addr;
 
                         if(length == 0) {
-                            reply = strdup("l");
+                            reply = "l";
                         } else {
-                            reply = calloc(length + 2, 1);
-                            reply[0] = 'm';
-                            strncpy(&reply[1], data, length);
+                            char *out = gdb_reply_buf(&conn, length + 1);
+
+                            if (out) {
+                                out[0] = 'm';
+                                strncpy(&out[1], data, length);
+                            }
+                            reply = out;
                         }
                     }
                 } else if(!strncmp(queryName, "Rcmd,",4)) {
@@ -1224,15 +1343,15 @@ int serve(stlink_t *sl, st_state_t *st) {
                         cache_sync(sl);
                         stlink_run(sl);
 
-                        reply = strdup("OK");
+                        reply = "OK";
                     } else if (!strncmp(cmd, "halt", 4)) { //halt
-                        reply = strdup("OK");
+                        reply = "OK";
 
                         stlink_force_debug(sl);
 
                         DLOG("Rcmd: halt\n");
                     } else if (!strncmp(cmd, "jtag_reset", 10)) { //jtag_reset
-                        reply = strdup("OK");
+                        reply = "OK";
 
                         stlink_jtag_reset(sl, 0);
                         stlink_jtag_reset(sl, 1);
@@ -1240,7 +1359,7 @@ int serve(stlink_t *sl, st_state_t *st) {
 
                         DLOG("Rcmd: jtag_reset\n");
                     } else if (!strncmp(cmd, "reset", 5)) { //reset
-                        reply = strdup("OK");
+                        reply = "OK";
 
                         stlink_force_debug(sl);
                         stlink_reset(sl);
@@ -1248,6 +1367,29 @@ int serve(stlink_t *sl, st_state_t *st) {
                         init_data_watchpoints(sl);
 
                         DLOG("Rcmd: reset\n");
+                    } else if (!strcmp(cmd, "stats reset")) {
+                        stlink_reset_stats(sl);
+                        reply = "OK";
+
+                        DLOG("Rcmd: stats reset\n");
+                    } else if (!strcmp(cmd, "stats")) {
+                        // console output is sent back hex encoded, like 'qRcmd' itself
+                        size_t text_len = stlink_format_stats(sl, NULL, 0);
+                        char *text = malloc(text_len + 1);
+                        char *out = text ? gdb_reply_buf(&conn, text_len * 2) : NULL;
+
+                        if (out) {
+                            stlink_format_stats(sl, text, text_len + 1);
+
+                            for (size_t i = 0; i < text_len; i++) {
+                                out[i * 2 + 0] = hex[(text[i] >> 4) & 0xf];
+                                out[i * 2 + 1] = hex[text[i] & 0xf];
+                            }
+                        }
+                        reply = out;
+                        free(text);
+
+                        DLOG("Rcmd: stats\n");
                     } else if (!strncmp(cmd, "semihosting ", 12)) {
                         DLOG("Rcmd: got semihosting cmd '%s'", cmd);
                         char *arg = cmd + 12;
@@ -1261,12 +1403,12 @@ int serve(stlink_t *sl, st_state_t *st) {
                             || !strncmp(arg, "1", 1))
                         {
                             semihosting = true;
-                            reply = strdup("OK");
+                            reply = "OK";
                         } else if (!strncmp(arg, "disable", 7)
                             || !strncmp(arg, "0", 1))
                         {
                             semihosting = false;
-                            reply = strdup("OK");
+                            reply = "OK";
                         } else {
                             DLOG("Rcmd: unknown semihosting arg: '%s'\n", arg);
                         }
@@ -1277,13 +1419,23 @@ int serve(stlink_t *sl, st_state_t *st) {
                 }
 
                 if(reply == NULL)
-                    reply = strdup("");
+                    reply = "";
 
                 free(queryName);
 
                 break;
             }
 
+            case 'Q':
+                /* gdb acks the OK, from then on neither side does */
+                if(!strcmp(packet, "QStartNoAckMode")) {
+                    start_no_ack = true;
+                    reply = "OK";
+                } else {
+                    reply = "";
+                }
+                break;
+
             case 'v': {
                 char *params = NULL;
                 char *cmdName = strtok_r(packet, ":;", &params);
@@ -1304,9 +1456,9 @@ int serve(stlink_t *sl, st_state_t *st) {
                                 addr, length);
 
                     if(flash_add_block(addr, length, sl) < 0) {
-                        reply = strdup("E00");
+                        reply = "E00";
                     } else {
-                        reply = strdup("OK");
+                        reply = "OK";
                     }
                 } else if(!strcmp(cmdName, "FlashWrite")) {
                     char *__s_addr, *data;
@@ -1319,44 +1471,38 @@ int serve(stlink_t *sl, st_state_t *st) {
                     unsigned data_length = status - (unsigned int) (data - packet);
 
                     // Length of decoded data cannot be more than
-                    // encoded, as escapes are removed.
-                    // Additional byte is reserved for alignment fix.
-                    uint8_t *decoded = calloc(data_length + 1, 1);
-                    unsigned dec_index = 0;
-                    for(unsigned int i = 0; i < data_length; i++) {
-                        if(data[i] == 0x7d) {
-                            i++;
-                            decoded[dec_index++] = data[i] ^ 0x20;
-                        } else {
-                            decoded[dec_index++] = data[i];
-                        }
-                    }
+                    // encoded, as escapes are removed, so it is decoded
+                    // in place. The terminating zero makes room for the
+                    // alignment fix.
+                    uint8_t *decoded = (uint8_t *) data;
+                    int decoded_length = unescape(data, data_length);
+                    unsigned dec_index = (decoded_length < 0) ? 0 : (unsigned) decoded_length;
 
                     // Fix alignment
                     if(dec_index % 2 != 0)
-                        dec_index++;
+                        decoded[dec_index++] = 0;
 
                     DLOG("binary packet %d -> %d\n", data_length, dec_index);
 
-                    if(flash_populate(addr, decoded, dec_index) < 0) {
-                        reply = strdup("E00");
+                    if(decoded_length < 0 || flash_populate(addr, decoded, dec_index) < 0) {
+                        reply = "E00";
                     } else {
-                        reply = strdup("OK");
+                        reply = "OK";
                     }
                 } else if(!strcmp(cmdName, "FlashDone")) {
                     if(flash_go(sl) < 0) {
-                        reply = strdup("E00");
+                        reply = "E00";
                     } else {
-                        reply = strdup("OK");
+                        reply = "OK";
                     }
                 } else if(!strcmp(cmdName, "Kill")) {
                     attached = 0;
 
-                    reply = strdup("OK");
+                    reply = "OK";
                 }
 
                 if(reply == NULL)
-                    reply = strdup("");
+                    reply = "";
 
                 break;
             }
@@ -1366,9 +1512,10 @@ int serve(stlink_t *sl, st_state_t *st) {
                 stlink_run(sl);
 
                 while(1) {
-                    status = gdb_check_for_interrupt(client);
+                    status = gdb_check_for_interrupt(&conn);
                     if(status < 0) {
                         ELOG("cannot check for int: %d\n", status);
+                        gdb_conn_free(&conn);
 #if defined(__MINGW32__) || defined(_MSC_VER)
                         win32_close_socket(client);
 #endif
@@ -1436,74 +1583,76 @@ int serve(stlink_t *sl, st_state_t *st) {
                     usleep(100000);
                 }
 
-                reply = strdup("S05"); // TRAP
+                reply = "S05"; // TRAP
                 break;
 
             case 's':
 	        cache_sync(sl);
                 stlink_step(sl);
 
-                reply = strdup("S05"); // TRAP
+                reply = "S05"; // TRAP
                 break;
 
             case '?':
                 if(attached) {
-                    reply = strdup("S05"); // TRAP
+                    reply = "S05"; // TRAP
                 } else {
                     /* Stub shall reply OK if not attached. */
-                    reply = strdup("OK");
+                    reply = "OK";
                 }
                 break;
 
-            case 'g':
-                stlink_read_all_regs(sl, &regp);
+            case 'g': {
+                char *out = gdb_reply_buf(&conn, 8 * 16);
+
+                stlink_read_all_regs(sl, &regs);
 
-                reply = calloc(8 * 16 + 1, 1);
-                for(int i = 0; i < 16; i++)
-                    sprintf(&reply[i * 8], "%08x", (uint32_t)htonl(regp.r[i]));
+                for(int i = 0; out && i < 16; i++)
+                    sprintf(&out[i * 8], "%08x", (uint32_t)htonl(regs.r[i]));
+                reply = out;
 
                 break;
+            }
 
             case 'p': {
                 unsigned id = (unsigned int) strtoul(&packet[1], NULL, 16);
                 unsigned myreg = 0xDEADDEAD;
 
+                if(id < 16 || (id >= 0x19 && id <= 0x1B)) {
+                    stlink_read_all_regs(sl, &regs);
+                } else if(id >= 0x1C && id <= 0x40 && !fp_regs_valid) {
+                    fp_regs_valid = (stlink_read_all_unsupported_regs(sl, &regs) == 0);
+                }
+
                 if(id < 16) {
-                    stlink_read_reg(sl, id, &regp);
-                    myreg = htonl(regp.r[id]);
+                    myreg = htonl(regs.r[id]);
                 } else if(id == 0x19) {
-                    stlink_read_reg(sl, 16, &regp);
-                    myreg = htonl(regp.xpsr);
+                    myreg = htonl(regs.xpsr);
                 } else if(id == 0x1A) {
-                    stlink_read_reg(sl, 17, &regp);
-                    myreg = htonl(regp.main_sp);
+                    myreg = htonl(regs.main_sp);
                 } else if(id == 0x1B) {
-                    stlink_read_reg(sl, 18, &regp);
-                    myreg = htonl(regp.process_sp);
+                    myreg = htonl(regs.process_sp);
                 } else if(id == 0x1C) {
-                    stlink_read_unsupported_reg(sl, id, &regp);
-                    myreg = htonl(regp.control);
+                    myreg = htonl(regs.control);
                 } else if(id == 0x1D) {
-                    stlink_read_unsupported_reg(sl, id, &regp);
-                    myreg = htonl(regp.faultmask);
+                    myreg = htonl(regs.faultmask);
                 } else if(id == 0x1E) {
-                    stlink_read_unsupported_reg(sl, id, &regp);
-                    myreg = htonl(regp.basepri);
+                    myreg = htonl(regs.basepri);
                 } else if(id == 0x1F) {
-                    stlink_read_unsupported_reg(sl, id, &regp);
-                    myreg = htonl(regp.primask);
+                    myreg = htonl(regs.primask);
                 } else if(id >= 0x20 && id < 0x40) {
-                    stlink_read_unsupported_reg(sl, id, &regp);
-                    myreg = htonl(regp.s[id-0x20]);
+                    myreg = htonl(regs.s[id-0x20]);
                 } else if(id == 0x40) {
-                    stlink_read_unsupported_reg(sl, id, &regp);
-                    myreg = htonl(regp.fpscr);
+                    myreg = htonl(regs.fpscr);
                 } else {
-                    reply = strdup("E00");
+                    reply = "E00";
                 }
 
-                reply = calloc(8 + 1, 1);
-                sprintf(reply, "%08x", myreg);
+                char *out = gdb_reply_buf(&conn, 8);
+
+                if (out)
+                    sprintf(out, "%08x", myreg);
+                reply = out;
 
                 break;
             }
@@ -1536,26 +1685,32 @@ int serve(stlink_t *sl, st_state_t *st) {
                 } else if(reg == 0x40) {
                     stlink_write_unsupported_reg(sl, ntohl(value), reg, &regp);
                 } else {
-                    reply = strdup("E00");
+                    reply = "E00";
                 }
 
                 if(!reply) {
-                    reply = strdup("OK");
+                    reply = "OK";
                 }
 
                 break;
             }
 
-            case 'G':
+            case 'G': {
+                uint32_t values[16];
+
                 for(int i = 0; i < 16; i++) {
                     char str[9] = {0};
                     strncpy(str, &packet[1 + i * 8], 8);
                     uint32_t reg = (uint32_t) strtoul(str, NULL, 16);
-                    stlink_write_reg(sl, ntohl(reg), i);
+                    values[i] = ntohl(reg);
                 }
 
-                reply = strdup("OK");
+                if(stlink_write_regs(sl, 0xffff, values) == 0)
+                    reply = "OK";
+                else
+                    reply = "E00";
                 break;
+            }
 
             case 'm': {
                 char* s_start = &packet[1];
@@ -1563,26 +1718,31 @@ int serve(stlink_t *sl, st_state_t *st) {
 
                 stm32_addr_t start = (stm32_addr_t) strtoul(s_start, NULL, 16);
                 unsigned     count = (unsigned int) strtoul(s_count, NULL, 16);
+                char*        out;
 
-                unsigned adj_start = start % 4;
-                unsigned count_rnd = (count + adj_start + 4 - 1) / 4 * 4;
-                if (count_rnd > sl->flash_pgsz)
-                    count_rnd = (unsigned int) sl->flash_pgsz;
-                if (count_rnd > 0x1800)
-                    count_rnd = 0x1800;
-                if (count_rnd < count)
-                    count = count_rnd;
+                /* no more than gdb was told it may ask for */
+                if (count > gdb_packet_size) {
+                    reply = "E01";
+                    break;
+                }
+                out = gdb_reply_buf(&conn, (size_t) count * 2);
 
-                if (stlink_read_mem32(sl, start - adj_start, count_rnd) != 0) {
+                /* read into the upper half of the reply, and hex it from the
+                   front: no byte is overwritten before it has been used */
+                if (out == NULL || stlink_read_mem(sl, start, (uint8_t *) out + count, count) != 0) {
                     /* read failed somehow, don't return stale buffer */
                     count = 0;
                 }
 
-                reply = calloc(count * 2 + 1, 1);
                 for(unsigned int i = 0; i < count; i++) {
-                    reply[i * 2 + 0] = hex[sl->q_buf[i + adj_start] >> 4];
-                    reply[i * 2 + 1] = hex[sl->q_buf[i + adj_start] & 0xf];
+                    const uint8_t b = (uint8_t) out[count + i];
+
+                    out[i * 2 + 0] = hex[b >> 4];
+                    out[i * 2 + 1] = hex[b & 0xf];
                 }
+                if (out)
+                    out[count * 2] = 0;
+                reply = out;
 
                 break;
             }
@@ -1594,48 +1754,83 @@ int serve(stlink_t *sl, st_state_t *st) {
 
                 stm32_addr_t start = (stm32_addr_t) strtoul(s_start, NULL, 16);
                 unsigned     count = (unsigned int) strtoul(s_count, NULL, 16);
-                int err = 0;
-
-                if(start % 4) {
-                    unsigned align_count = 4 - start % 4;
-                    if (align_count > count) align_count = count;
-                    for(unsigned int i = 0; i < align_count; i ++) {
-                        char hextmp[3] = { hexdata[i*2], hexdata[i*2+1], 0 };
-                        uint8_t byte = strtoul(hextmp, NULL, 16);
-                        sl->q_buf[i] = byte;
-                    }
-                    err |= stlink_write_mem8(sl, start, align_count);
-                    cache_change(start, align_count);
-                    start += align_count;
-                    count -= align_count;
-                    hexdata += 2*align_count;
+                /* decoded in place, each byte from the two chars at and after it */
+                uint8_t*     data = (uint8_t *) hexdata;
+                int err = (strlen(hexdata) < (size_t) count * 2);
+
+                for(unsigned int i = 0; !err && i < count; i ++) {
+                    const int hi = hex_digit(hexdata[i * 2]), lo = hex_digit(hexdata[i * 2 + 1]);
+
+                    err = (hi < 0 || lo < 0);
+                    data[i] = (uint8_t) ((hi << 4) | lo);
+                }
+                if (!err) {
+                    err = stlink_write_mem(sl, start, data, count);
+                    cache_change(start, count);
                 }
+                reply = err ? "E00" : "OK";
+                break;
+            }
 
-                if(count - count % 4) {
-                    unsigned aligned_count = count - count % 4;
+            case 'x': {
+                /* binary read: 'b' and the data, escaped where it has to be */
+                char* s_start = &packet[1];
+                char* s_count = strstr(&packet[1], ",");
 
-                    for(unsigned int i = 0; i < aligned_count; i ++) {
-                        char hextmp[3] = { hexdata[i*2], hexdata[i*2+1], 0 };
-                        uint8_t byte = strtoul(hextmp, NULL, 16);
-                        sl->q_buf[i] = byte;
-                    }
-                    err |= stlink_write_mem32(sl, start, aligned_count);
-                    cache_change(start, aligned_count);
-                    count -= aligned_count;
-                    start += aligned_count;
-                    hexdata += 2*aligned_count;
+                stm32_addr_t start = (stm32_addr_t) strtoul(s_start, NULL, 16);
+                unsigned     count = s_count ? (unsigned int) strtoul(s_count + 1, NULL, 16) : 0;
+                char*        out = NULL;
+                size_t       len = 1;
+
+                if (s_count != NULL && count <= gdb_packet_size)
+                    out = gdb_reply_buf(&conn, (size_t) count * 2 + 1);
+
+                /* as for 'm', from the upper half: an escaped byte takes two */
+                if (out == NULL
+                        || stlink_read_mem(sl, start, (uint8_t *) out + count + 1, count) != 0) {
+                    reply = "E01";
+                    break;
                 }
 
-                if(count) {
-                    for(unsigned int i = 0; i < count; i ++) {
-                        char hextmp[3] = { hexdata[i*2], hexdata[i*2+1], 0 };
-                        uint8_t byte = strtoul(hextmp, NULL, 16);
-                        sl->q_buf[i] = byte;
+                out[0] = 'b';
+                for(unsigned int i = 0; i < count; i++) {
+                    const char b = out[count + 1 + i];
+
+                    if (b == '#' || b == '$' || b == '}' || b == '*') {
+                        out[len++] = '}';
+                        out[len++] = (char) (b ^ 0x20);
+                    } else {
+                        out[len++] = b;
                     }
-                    err |= stlink_write_mem8(sl, start, count);
+                }
+                reply = out;
+                reply_len = len;
+
+                break;
+            }
+
+            case 'X': {
+                /* binary write; gdb tries 'X' with no data first, to see if it is supported */
+                char* s_start = &packet[1];
+                char* s_count = strstr(&packet[1], ",");
+                char* data = memchr(packet, ':', (size_t) status);
+
+                if (s_count == NULL || data == NULL) {
+                    reply = "E01";
+                    break;
+                }
+                data++;
+
+                stm32_addr_t start = (stm32_addr_t) strtoul(s_start, NULL, 16);
+                unsigned     count = (unsigned int) strtoul(s_count + 1, NULL, 16);
+                int          length = unescape(data, (size_t) (status - (data - packet)));
+                int          err = (length < 0 || (unsigned) length != count);
+
+                if (!err && count) {
+                    err = stlink_write_mem(sl, start, (uint8_t *) data, count);
                     cache_change(start, count);
                 }
-                reply = strdup(err ? "E00" : "OK");
+                reply = err ? "E00" : "OK";
                 break;
             }
 
@@ -1647,9 +1842,9 @@ int serve(stlink_t *sl, st_state_t *st) {
                 switch (packet[1]) {
                     case '1':
                         if(update_code_breakpoint(sl, addr, 1) < 0) {
-                            reply = strdup("E00");
+                            reply = "E00";
                         } else {
-                            reply = strdup("OK");
+                            reply = "OK";
                         }
                         break;
 
@@ -1666,16 +1861,16 @@ int serve(stlink_t *sl, st_state_t *st) {
                         }
 
                         if(add_data_watchpoint(sl, wf, addr, len) < 0) {
-                            reply = strdup("E00");
+                            reply = "E00";
                         } else {
-                            reply = strdup("OK");
+                            reply = "OK";
                             break;
                         }
                     }
                     break;
 
                     default:
-                        reply = strdup("");
+                        reply = "";
                 }
                 break;
             }
@@ -1687,22 +1882,22 @@ int serve(stlink_t *sl, st_state_t *st) {
                 switch (packet[1]) {
                     case '1': // remove breakpoint
                         update_code_breakpoint(sl, addr, 0);
-                        reply = strdup("OK");
+                        reply = "OK";
                         break;
 
                     case '2' : // remove write watchpoint
                     case '3' : // remove read watchpoint
                     case '4' : // remove access watchpoint
                         if(delete_data_watchpoint(sl, addr) < 0) {
-                            reply = strdup("E00");
+                            reply = "E00";
                             break;
                         } else {
-                            reply = strdup("OK");
+                            reply = "OK";
                             break;
                         }
 
                     default:
-                        reply = strdup("");
+                        reply = "";
                 }
                 break;
             }
@@ -1719,7 +1914,7 @@ int serve(stlink_t *sl, st_state_t *st) {
                  */
                 st->persistent = 1;
 
-                reply = strdup("OK");
+                reply = "OK";
 
                 break;
             }
@@ -1733,7 +1928,7 @@ int serve(stlink_t *sl, st_state_t *st) {
 
                 attached = 1;
 
-                reply = strdup("OK");
+                reply = "OK";
 
                 break;
             }
@@ -1760,29 +1955,27 @@ int serve(stlink_t *sl, st_state_t *st) {
                 break;
 
             default:
-                reply = strdup("");
+                reply = "";
         }
 
         if(reply) {
             DLOG("send: %s\n", reply);
 
-            int result = gdb_send_packet(client, reply);
+            int result = reply_len ? gdb_send_binary(&conn, reply, reply_len) : gdb_send_packet(&conn, reply);
             if(result != 0) {
                 ELOG("cannot send: %d\n", result);
-                free(reply);
-                free(packet);
+                gdb_conn_free(&conn);
 #if defined(__MINGW32__) || defined(_MSC_VER)
                 win32_close_socket(client);
 #endif
                 return 1;
             }
-
-            free(reply);
+            if(start_no_ack)
+                conn.no_ack = true;
         }
-
-        free(packet);
     }
 
+    gdb_conn_free(&conn);
 #if defined(__MINGW32__) || defined(_MSC_VER)
     win32_close_socket(client);
 #endif
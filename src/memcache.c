@@ -0,0 +1,234 @@
+#include <string.h>
+
+#include "stlink.h"
+#include "stlink/memcache.h"
+#include "stlink/logging.h"
+
+/* the most pages fetched with one read */
+#define MEMCACHE_RUN 16
+
+/* code, sram and external memory; peripherals from 0x40000000, external
+   devices from 0xa0000000 and the system range from 0xe0000000 are not */
+static bool memcache_cacheable(uint32_t addr, size_t len) {
+    const uint64_t end = (uint64_t) addr + len;
+
+    if (end <= 0x40000000u)
+        return true;
+    return addr >= 0x60000000u && end <= 0xa0000000u;
+}
+
+static struct stlink_memcache_page *memcache_find(struct stlink_memcache *c, uint32_t addr) {
+    for (size_t i = 0; i < STLINK_MEMCACHE_PAGES; i++) {
+        if (c->page[i].valid && c->page[i].addr == addr)
+            return &c->page[i];
+    }
+    return NULL;
+}
+
+/* an unused page, or else the least recently used one */
+static struct stlink_memcache_page *memcache_victim(struct stlink_memcache *c) {
+    struct stlink_memcache_page *v = &c->page[0];
+
+    for (size_t i = 0; i < STLINK_MEMCACHE_PAGES; i++) {
+        if (!c->page[i].valid)
+            return &c->page[i];
+        if (c->page[i].used < v->used)
+            v = &c->page[i];
+    }
+    return v;
+}
+
+/* copy what page holds of addr's range to where it goes in buf */
+static void memcache_copy(const struct stlink_memcache_page *p, uint32_t addr, uint8_t *buf, size_t len) {
+    const uint64_t lo = (p->addr > addr) ? p->addr : addr;
+    const uint64_t hi_page = (uint64_t) p->addr + STLINK_MEMCACHE_PAGE;
+    const uint64_t hi = (hi_page < (uint64_t) addr + len) ? hi_page : (uint64_t) addr + len;
+
+    memcpy(buf + (lo - addr), p->data + (lo - p->addr), hi - lo);
+}
+
+void stlink_memcache_enable(stlink_t *sl, bool enable, bool write_through) {
+    struct stlink_memcache *c = &sl->memcache;
+
+    stlink_memcache_invalidate(sl);
+    c->enabled = enable;
+    c->write_through = write_through;
+    c->hits = c->misses = 0;
+}
+
+void stlink_memcache_invalidate(stlink_t *sl) {
+    struct stlink_memcache *c = &sl->memcache;
+
+    if (c->halted || c->regs_valid)
+        DLOG("memcache: dropped\n");
+    for (size_t i = 0; i < STLINK_MEMCACHE_PAGES; i++)
+        c->page[i].valid = false;
+    c->halted = false;
+    c->regs_valid = false;
+}
+
+void stlink_memcache_halted(stlink_t *sl) {
+    if (sl->memcache.enabled)
+        sl->memcache.halted = true;
+}
+
+bool stlink_memcache_usable(stlink_t *sl, uint32_t addr, size_t len) {
+    const struct stlink_memcache *c = &sl->memcache;
+
+    return c->enabled && c->halted && len && memcache_cacheable(addr, len);
+}
+
+int stlink_memcache_read(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len,
+        stlink_memcache_fill_t fill) {
+    struct stlink_memcache *c = &sl->memcache;
+    const uint64_t end = (uint64_t) addr + len;
+    uint64_t p = addr & ~(uint32_t) (STLINK_MEMCACHE_PAGE - 1);
+
+    /* a dump bigger than half the cache would only push the stack out */
+    if (len > STLINK_MEMCACHE_PAGE * STLINK_MEMCACHE_PAGES / 2)
+        return fill(sl, addr, buf, len);
+
+    while (p < end) {
+        struct stlink_memcache_page *page = memcache_find(c, (uint32_t) p);
+        uint8_t run[STLINK_MEMCACHE_PAGE * MEMCACHE_RUN];
+        uint64_t q = p;
+        size_t n = 0;
+
+        if (page) {
+            memcache_copy(page, addr, buf, len);
+            page->used = ++c->tick;
+            c->hits++;
+            p += STLINK_MEMCACHE_PAGE;
+            continue;
+        }
+
+        /* the pages missing from here on, in one read */
+        while (q < end && n < MEMCACHE_RUN && !memcache_find(c, (uint32_t) q)) {
+            q += STLINK_MEMCACHE_PAGE;
+            n++;
+        }
+
+        if (fill(sl, (uint32_t) p, run, n * STLINK_MEMCACHE_PAGE)) {
+            /* whole pages may reach into memory that is not there, try
+               the part asked for on its own */
+            const uint64_t lo = (p > addr) ? p : addr;
+            const uint64_t hi = (q < end) ? q : end;
+
+            DLOG("memcache: %u pages from %#x failed\n", (unsigned int) n, (uint32_t) p);
+            if (fill(sl, (uint32_t) lo, buf + (lo - addr), (size_t) (hi - lo)))
+                return -1;
+            p = q;
+            continue;
+        }
+
+        for (size_t k = 0; k < n; k++, p += STLINK_MEMCACHE_PAGE) {
+            page = memcache_victim(c);
+            page->addr = (uint32_t) p;
+            page->valid = true;
+            page->used = ++c->tick;
+            memcpy(page->data, run + k * STLINK_MEMCACHE_PAGE, STLINK_MEMCACHE_PAGE);
+            memcache_copy(page, addr, buf, len);
+            c->misses++;
+        }
+    }
+
+    return 0;
+}
+
+int stlink_memcache_lookup(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len) {
+    struct stlink_memcache *c = &sl->memcache;
+    const uint64_t end = (uint64_t) addr + len;
+    const uint64_t first = addr & ~(uint32_t) (STLINK_MEMCACHE_PAGE - 1);
+
+    if (!stlink_memcache_usable(sl, addr, len))
+        return -1;
+    for (uint64_t p = first; p < end; p += STLINK_MEMCACHE_PAGE) {
+        if (!memcache_find(c, (uint32_t) p))
+            return -1;
+    }
+
+    for (uint64_t p = first; p < end; p += STLINK_MEMCACHE_PAGE) {
+        struct stlink_memcache_page *page = memcache_find(c, (uint32_t) p);
+
+        memcache_copy(page, addr, buf, len);
+        page->used = ++c->tick;
+        c->hits++;
+    }
+
+    return 0;
+}
+
+void stlink_memcache_write(stlink_t *sl, uint32_t addr, const uint8_t *data, size_t len) {
+    struct stlink_memcache *c = &sl->memcache;
+    const uint64_t end = (uint64_t) addr + len;
+
+    if (!c->enabled || len == 0)
+        return;
+
+    /* flash controller, peripherals, the debug registers: anything may
+       have changed, down to whether the core still is halted */
+    if (!memcache_cacheable(addr, len)) {
+        stlink_memcache_invalidate(sl);
+        return;
+    }
+
+    for (size_t i = 0; i < STLINK_MEMCACHE_PAGES; i++) {
+        struct stlink_memcache_page *page = &c->page[i];
+        const uint64_t page_end = (uint64_t) page->addr + STLINK_MEMCACHE_PAGE;
+
+        if (!page->valid || page_end <= addr || page->addr >= end)
+            continue;
+        if (c->write_through && data) {
+            const uint64_t lo = (page->addr > addr) ? page->addr : addr;
+            const uint64_t hi = (page_end < end) ? page_end : end;
+
+            memcpy(page->data + (lo - page->addr), data + (lo - addr), hi - lo);
+        } else {
+            page->valid = false;
+        }
+    }
+}
+
+bool stlink_memcache_get_regs(stlink_t *sl, struct stlink_reg *regp) {
+    const struct stlink_memcache *c = &sl->memcache;
+
+    if (!c->enabled || !c->halted || !c->regs_valid)
+        return false;
+
+    memcpy(regp->r, c->regs.r, sizeof(regp->r));
+    regp->xpsr = c->regs.xpsr;
+    regp->main_sp = c->regs.main_sp;
+    regp->process_sp = c->regs.process_sp;
+    regp->rw = c->regs.rw;
+    regp->rw2 = c->regs.rw2;
+    return true;
+}
+
+void stlink_memcache_put_regs(stlink_t *sl, const struct stlink_reg *regp,
+        stlink_memcache_fill_t fill) {
+    struct stlink_memcache *c = &sl->memcache;
+    const uint32_t sp = regp->r[13];
+    const uint32_t sram_end = (uint32_t) (sl->sram_base + sl->sram_size);
+    uint8_t stack[STLINK_MEMCACHE_PREFETCH];
+    uint32_t start;
+    size_t len;
+
+    if (!c->enabled || !c->halted)
+        return;
+    c->regs = *regp;
+    c->regs_valid = true;
+
+    /* the frames gdb is about to unwind, if the stack is in sram */
+    if (sp < sl->sram_base || sp >= sram_end)
+        return;
+    start = sp & ~(uint32_t) (STLINK_MEMCACHE_PAGE - 1);
+    len = STLINK_MEMCACHE_PREFETCH;
+    if (len > sram_end - start)
+        len = (sram_end - start) & ~(size_t) 3;
+    if (stlink_memcache_usable(sl, start, len))
+        stlink_memcache_read(sl, start, stack, len, fill);
+}
+
+void stlink_memcache_regs_written(stlink_t *sl) {
+    sl->memcache.regs_valid = false;
+}
@@ -330,6 +330,7 @@ int stlink_q(stlink_t *sl) {
     //uint8_t cdb_len = 6;  // FIXME varies!!!
     uint8_t cdb_len = 10;  // FIXME varies!!!
     uint8_t lun = 0;  // always zero...
+    uint64_t start = stlink_time_us();
     uint32_t tag = send_usb_mass_storage_command(sg->usb_handle, sg->ep_req,
             sg->cdb_cmd_blk, cdb_len, lun, LIBUSB_ENDPOINT_IN, sl->q_len);
 
@@ -381,6 +382,8 @@ int stlink_q(stlink_t *sl) {
     if (rx_length > 0 && real_transferred != rx_length) {
         return -1;
     }
+    stlink_stats_record(&sl->stats, stlink_stats_opcode(sg->cdb_cmd_blk),
+            rx_length > 0 ? (size_t) rx_length : 0, start);
     return 0;
 }
 
@@ -807,6 +810,7 @@ int _stlink_sg_read_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
 
 int _stlink_sg_write_mem8(stlink_t *sl, uint32_t addr, uint16_t len) {
     struct stlink_libsg *sg = sl->backend_data;
+    uint64_t start = stlink_time_us();
     int ret;
 
     clear_cdb(sg);
@@ -828,6 +832,7 @@ int _stlink_sg_write_mem8(stlink_t *sl, uint32_t addr, uint16_t len) {
     if (ret == -1)
         return ret;
 
+    stlink_stats_record(&sl->stats, sg->cdb_cmd_blk[1], len, start);
     stlink_print_data(sl);
     return 0;
 }
@@ -836,6 +841,7 @@ int _stlink_sg_write_mem8(stlink_t *sl, uint32_t addr, uint16_t len) {
 
 int _stlink_sg_write_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
     struct stlink_libsg *sg = sl->backend_data;
+    uint64_t start = stlink_time_us();
     int ret;
 
     clear_cdb(sg);
@@ -857,6 +863,7 @@ int _stlink_sg_write_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
     if (ret == -1)
         return ret;
 
+    stlink_stats_record(&sl->stats, sg->cdb_cmd_blk[1], len, start);
     stlink_print_data(sl);
     return 0;
 }
@@ -939,7 +946,12 @@ static stlink_backend_t _stlink_sg_backend = {
     _stlink_sg_current_mode,
     _stlink_sg_force_debug,
     NULL, /* target_voltage */
-    NULL /* set_swdclk */
+    NULL, /* set_swdclk */
+    NULL, /* read_mem32_bulk */
+    NULL, /* batch */
+    NULL, /* write_mem32_bulk */
+    NULL, /* time_us */
+    NULL  /* sleep_us */
 };
 
 static stlink_t* stlink_open(const int verbose) {
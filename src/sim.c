@@ -0,0 +1,1791 @@
+/*
+ * Simulated ST-Link backend: an in process model of the probe and a STM32
+ * target, good enough to run common.c, the flash loaders' host side
+ * protocol and the tools without hardware.
+ *
+ * Modeled are flash, sram and system memory, the core run state and
+ * registers (including DCRSR/DCRDR), DHCSR, DEMCR, AIRCR and the flash
+ * controllers of the F0/F1_XL, F4, L0/L1, L4 and G0 families. Everything
+ * else in the peripheral and system space reads back what was last
+ * written. No target code is executed: running the core with the pc in
+ * sram stands in for the flash loader (r0 source, r1 target, r2 units,
+ * r3 bank register offset; on L0/L1 r3 the flash registers and r4 the
+ * half page size), which is the only code the tools run. The
+ * double buffered loaders, the flashing agent and the crc routine are
+ * recognised by their code; the first two serve their mailbox or queue as
+ * the host fills it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stlink.h"
+#include "stlink/sim.h"
+#include "stlink/logging.h"
+#include "stlink/flash_loader.h"
+#include "flash_loader_internal.h"
+
+#define SIM_FLASH_REGS          0x40022000  /* F0, F1_XL, L0, L4, G0 */
+#define SIM_FLASH_REGS_F4       0x40023c00  /* F2/F4/F7, L1 */
+#define SIM_FLASH_REGS_SIZE     0x100
+#define SIM_FLASH_BANK2_OFF     0x80000     /* F1_XL */
+#define SIM_EEPROM_BASE         0x08080000  /* L0/L1 data eeprom */
+
+#define SIM_FLASH_KEY1          0x45670123
+#define SIM_FLASH_KEY2          0xcdef89ab
+#define SIM_PEKEY1              0x89abcdef
+#define SIM_PEKEY2              0x02030405
+#define SIM_PRGKEY1             0x8c9daebf
+#define SIM_PRGKEY2             0x13141516
+
+/* L0/L1 PECR and SR */
+#define SIM_PECR_PELOCK         (1u << 0)
+#define SIM_PECR_PRGLOCK        (1u << 1)
+#define SIM_PECR_OPTLOCK        (1u << 2)
+#define SIM_PECR_PROG           (1u << 3)
+#define SIM_PECR_ERASE          (1u << 9)
+#define SIM_PECR_FPRG           (1u << 10)
+#define SIM_L0_SR_BSY           (1u << 0)
+#define SIM_L0_SR_EOP           (1u << 1)
+#define SIM_L0_SR_READY         (1u << 3)
+#define SIM_L0_SR_WRPERR        (1u << 8)
+#define SIM_L0_SR_PGAERR        (1u << 9)
+
+#define SIM_DHCSR_C_HALT        (1u << 1)
+#define SIM_DHCSR_C_STEP        (1u << 2)
+#define SIM_DHCSR_C_DEBUGEN     (1u << 0)
+#define SIM_DHCSR_S_REGRDY      (1u << 16)
+#define SIM_DHCSR_S_HALT        (1u << 17)
+#define SIM_DCRSR_REGWNR        (1u << 16)
+#define SIM_DEMCR               0xe000edfc
+#define SIM_DEMCR_VC_CORERESET  (1u << 0)
+#define SIM_DBGMCU_IDCODE       0xe0042000
+#define SIM_DBGMCU_IDCODE_M0    0x40015800
+#define SIM_DWT_CTRL            0xe0001000
+#define SIM_PP_LAST             (1u << 31)
+#define SIM_CRC_KIB_US          1000        /* the crc routine does 1 MiB/s */
+#define SIM_BLANK_KIB_US        100         /* the agent checks 10 MiB/s blank */
+#define SIM_UNPACK_KIB_US       250         /* and unpacks 4 MiB/s */
+#define SIM_G0_CR_FSTPG         (1u << 18)  /* L4 too */
+#define SIM_G0_SR_MISSERR       (1u << 8)
+#define SIM_G0_ROW              256
+#define SIM_AGENT_RING          0x30        /* see flashloaders/stm32agent.s */
+#define SIM_AGENT_CTL_SIZE      (SIM_AGENT_RING + 16 * STLINK_AGENT_SLOTS)
+
+struct stlink_sim_fpec {
+    uint32_t cr;
+    uint32_t sr;
+    uint32_t ar;
+    int key;                /* 1 after KEY1, -1 once the sequence went wrong */
+    uint64_t busy_until;
+    uint32_t row_next;      /* where fast programming goes on */
+    bool mass_erased;       /* L4: no page erased since a mass erase */
+};
+
+struct stlink_sim_io {
+    uint32_t addr;
+    uint32_t val;
+};
+
+struct stlink_sim {
+    struct stlink_sim_config cfg;
+    const struct stlink_chipid_params *params;
+    enum stlink_flash_type flash_type;
+    uint32_t cpuid;
+    uint32_t fpec_base;
+
+    uint8_t *flash;
+    uint8_t *sram;
+    uint8_t *sys;
+    uint8_t *eeprom;
+    uint8_t erased;
+
+    struct stlink_reg reg;
+    bool halted;
+    uint64_t halt_at;       /* a running flash loader reaches its bkpt then */
+
+    /* a running double buffered flash loader */
+    bool pp;
+    bool pp_busy;           /* programming the current buffer until pp_done_at */
+    bool pp_last;
+    int pp_slot;
+    uint32_t pp_mbox;
+    uint32_t pp_bank;
+    uint32_t pp_left;       /* units of the current buffer not written */
+    uint64_t pp_done_at;
+
+    /* a running flashing agent */
+    bool agent;
+    bool agent_busy;        /* with the descriptor at tail until agent_done_at */
+    uint32_t agent_ctl;
+    uint32_t agent_status;
+    uint64_t agent_done_at;
+    uint32_t dcrdr;
+    uint32_t demcr;
+
+    struct stlink_sim_fpec fpec[2];     /* the second one is F1_XL bank 2 */
+    uint32_t pecr;
+    int pekey;
+    int prgkey;
+    uint32_t optr;
+
+    struct stlink_sim_io *io;
+    size_t io_count;
+    size_t io_alloc;
+
+    int mode;
+    uint16_t swdclk;
+    uint64_t epoch;
+    uint64_t skew;
+};
+
+static const stlink_backend_t _stlink_sim_backend;
+
+static uint64_t sim_now(struct stlink_sim *sim) {
+    return stlink_time_us() - sim->epoch + sim->skew;
+}
+
+/* let us pass on the clock, for real only in realtime mode */
+static void sim_pass(struct stlink_sim *sim, uint64_t us) {
+    if (sim->cfg.realtime)
+        stlink_sleep_us(us);
+    else
+        sim->skew += us;
+}
+
+/* Charge count commands moving bytes of payload to the clock. Pipelined
+   commands share their round trips, like the libusb backend does. */
+static void sim_charge(struct stlink_sim *sim, size_t count, size_t bytes, bool pipelined) {
+    size_t trips = pipelined ? (count + sim->cfg.depth - 1) / sim->cfg.depth : count;
+
+    sim_pass(sim, (uint64_t) trips * sim->cfg.cmd_us + (uint64_t) bytes * sim->cfg.kib_us / 1024);
+}
+
+static void sim_cmd(stlink_t *sl, uint8_t opcode, size_t bytes, uint64_t start) {
+    sim_charge(sl->backend_data, 1, bytes, false);
+    stlink_stats_record(&sl->stats, opcode, bytes, start);
+}
+
+static uint8_t *sim_region(struct stlink_sim *sim, uint32_t addr, size_t len) {
+    const struct {
+        uint8_t *mem;
+        uint32_t base;
+        size_t size;
+    } map[] = {
+        { sim->flash, STM32_FLASH_BASE, sim->cfg.flash_size },
+        { sim->sram, STM32_SRAM_BASE, sim->params->sram_size },
+        { sim->sys, sim->params->bootrom_base, sim->params->bootrom_size },
+        { sim->eeprom, SIM_EEPROM_BASE, sim->params->eeprom_size },
+    };
+
+    for (size_t i = 0; i < STLINK_ARRAY_SIZE(map); i++) {
+        if (map[i].mem != NULL && addr >= map[i].base && addr - map[i].base <= map[i].size
+                && len <= map[i].size - (addr - map[i].base))
+            return map[i].mem + (addr - map[i].base);
+    }
+
+    return NULL;
+}
+
+static bool sim_is_eeprom(struct stlink_sim *sim, const uint8_t *p) {
+    return sim->eeprom != NULL && p >= sim->eeprom && p < sim->eeprom + sim->params->eeprom_size;
+}
+
+/* written through the flash controller: the flash and the data eeprom */
+static bool sim_is_flash(struct stlink_sim *sim, const uint8_t *p) {
+    return (p >= sim->flash && p < sim->flash + sim->cfg.flash_size) || sim_is_eeprom(sim, p);
+}
+
+/* L0 half pages are 64, L1 ones 128 bytes */
+static uint32_t sim_l0_half_page(struct stlink_sim *sim) {
+    return (sim->fpec_base == SIM_FLASH_REGS) ? 64 : 128;
+}
+
+static uint32_t sim_io_read(struct stlink_sim *sim, uint32_t addr) {
+    for (size_t i = 0; i < sim->io_count; i++) {
+        if (sim->io[i].addr == addr)
+            return sim->io[i].val;
+    }
+
+    switch (addr) {
+    case STLINK_REG_CM3_FP_CTRL:
+        return 0x260;       /* 6 code, 2 literal comparators */
+    case SIM_DWT_CTRL:
+        return 0x40000000;  /* 4 comparators */
+    default:
+        return 0;
+    }
+}
+
+static void sim_io_write(struct stlink_sim *sim, uint32_t addr, uint32_t val) {
+    for (size_t i = 0; i < sim->io_count; i++) {
+        if (sim->io[i].addr == addr) {
+            sim->io[i].val = val;
+            return;
+        }
+    }
+
+    if (sim->io_count == sim->io_alloc) {
+        size_t alloc = sim->io_alloc ? 2 * sim->io_alloc : 64;
+        struct stlink_sim_io *io = realloc(sim->io, alloc * sizeof(*io));
+        if (io == NULL)
+            return;
+        sim->io = io;
+        sim->io_alloc = alloc;
+    }
+    sim->io[sim->io_count].addr = addr;
+    sim->io[sim->io_count].val = val;
+    sim->io_count++;
+}
+
+/* core */
+
+static uint32_t *sim_reg_slot(struct stlink_reg *r, uint32_t idx) {
+    switch (idx) {
+    case 16: return &r->xpsr;
+    case 17: return &r->main_sp;
+    case 18: return &r->process_sp;
+    case 19: return &r->rw;
+    case 20: return &r->rw2;
+    default: return (idx < 16) ? &r->r[idx] : NULL;
+    }
+}
+
+/* register selectors as used by DCRSR */
+static uint32_t sim_core_reg(struct stlink_sim *sim, uint32_t sel) {
+    struct stlink_reg *r = &sim->reg;
+
+    if (sel == 0x14)
+        return ((uint32_t) r->control << 24) | ((uint32_t) r->faultmask << 16)
+            | ((uint32_t) r->basepri << 8) | r->primask;
+    if (sel == 0x21)
+        return r->fpscr;
+    if (sel >= 0x40 && sel < 0x60)
+        return r->s[sel - 0x40];
+    if (sel <= 18)
+        return *sim_reg_slot(r, sel);
+
+    return 0;
+}
+
+static void sim_set_core_reg(struct stlink_sim *sim, uint32_t sel, uint32_t val) {
+    struct stlink_reg *r = &sim->reg;
+
+    if (sel == 0x14) {
+        r->control = (uint8_t) (val >> 24);
+        r->faultmask = (uint8_t) (val >> 16);
+        r->basepri = (uint8_t) (val >> 8);
+        r->primask = (uint8_t) val;
+    } else if (sel == 0x21) {
+        r->fpscr = val;
+    } else if (sel >= 0x40 && sel < 0x60) {
+        r->s[sel - 0x40] = val;
+    } else if (sel <= 18) {
+        *sim_reg_slot(r, sel) = val;
+    }
+}
+
+static void sim_pp_update(struct stlink_sim *sim);
+static void sim_agent_update(struct stlink_sim *sim);
+
+static void sim_update(struct stlink_sim *sim) {
+    if (sim->pp)
+        sim_pp_update(sim);
+    if (sim->agent)
+        sim_agent_update(sim);
+    if (!sim->halted && sim_now(sim) >= sim->halt_at)
+        sim->halted = true;
+}
+
+static void sim_halt(struct stlink_sim *sim) {
+    sim->halted = true;
+    sim->pp = false;
+    sim->agent = false;
+}
+
+static uint32_t sim_read_le32(const uint8_t *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void sim_write_le32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+    p[2] = (uint8_t) (v >> 16);
+    p[3] = (uint8_t) (v >> 24);
+}
+
+static void sim_reset_system(struct stlink_sim *sim, bool halt) {
+    memset(&sim->reg, 0, sizeof(sim->reg));
+    sim->reg.main_sp = sim_read_le32(sim->flash);
+    sim->reg.r[13] = sim->reg.main_sp;
+    sim->reg.r[14] = 0xffffffff;
+    sim->reg.r[15] = sim_read_le32(sim->flash + 4) & ~1u;
+    sim->reg.xpsr = 0x01000000;
+
+    for (int i = 0; i < 2; i++) {
+        memset(&sim->fpec[i], 0, sizeof(sim->fpec[i]));
+        if (sim->flash_type == STLINK_FLASH_TYPE_F0 || sim->flash_type == STLINK_FLASH_TYPE_F1_XL)
+            sim->fpec[i].cr = 1u << 7;
+        else
+            sim->fpec[i].cr = 1u << 31;
+    }
+    sim->pecr = SIM_PECR_PELOCK | SIM_PECR_PRGLOCK | SIM_PECR_OPTLOCK;
+    sim->pekey = 0;
+    sim->prgkey = 0;
+
+    sim->halted = halt || (sim->demcr & SIM_DEMCR_VC_CORERESET);
+    sim->halt_at = UINT64_MAX;
+    sim->pp = false;
+    sim->agent = false;
+}
+
+/* flash */
+
+static struct stlink_sim_fpec *sim_fpec_for(struct stlink_sim *sim, uint32_t addr) {
+    if (sim->flash_type == STLINK_FLASH_TYPE_F1_XL && addr - STM32_FLASH_BASE >= SIM_FLASH_BANK2_OFF)
+        return &sim->fpec[1];
+    return &sim->fpec[0];
+}
+
+static void sim_flash_busy(struct stlink_sim *sim, struct stlink_sim_fpec *f, unsigned us) {
+    uint64_t now = sim_now(sim);
+    f->busy_until = ((f->busy_until > now) ? f->busy_until : now) + us;
+}
+
+static void sim_flash_erase(struct stlink_sim *sim, struct stlink_sim_fpec *f, uint32_t off, size_t size, unsigned us) {
+    if (off >= sim->cfg.flash_size) {
+        DLOG("sim: erase beyond the end of flash at +%#x\n", off);
+        return;
+    }
+    if (size > sim->cfg.flash_size - off)
+        size = sim->cfg.flash_size - off;
+
+    memset(sim->flash + off, sim->erased, size);
+    sim_flash_busy(sim, f, us);
+}
+
+/* Program len bytes at p. Returns -1 and flags the error in the status
+   register if the controller is not set up for it, or the target has
+   bits to be set (anything but L0/L1 can only clear bits). */
+static int sim_flash_program(struct stlink_sim *sim, uint8_t *p, const uint8_t *data, size_t len) {
+    const bool eeprom = sim_is_eeprom(sim, p);
+    const uint32_t addr = eeprom ? SIM_EEPROM_BASE + (uint32_t) (p - sim->eeprom)
+        : STM32_FLASH_BASE + (uint32_t) (p - sim->flash);
+    struct stlink_sim_fpec *f = sim_fpec_for(sim, addr);
+    uint32_t lock, err_seq, err_prog, pg = 1;
+
+    switch (sim->flash_type) {
+    case STLINK_FLASH_TYPE_L0:
+        /* the data eeprom only takes unlocking PECR */
+        if ((sim->pecr & SIM_PECR_PELOCK) || (!eeprom && (sim->pecr & SIM_PECR_PRGLOCK))) {
+            f->sr |= SIM_L0_SR_WRPERR;
+            return -1;
+        }
+        if ((sim->pecr & (SIM_PECR_ERASE | SIM_PECR_PROG)) == (SIM_PECR_ERASE | SIM_PECR_PROG)) {
+            const uint32_t pgsz = sim->params->flash_pagesize;
+            const uint32_t off = (addr - STM32_FLASH_BASE) & ~(pgsz - 1);
+            sim_flash_erase(sim, f, off, pgsz, sim->cfg.erase_us);
+            return 0;
+        }
+        /* a half page goes in one, once its last word is written; the
+           data eeprom has no half pages */
+        if (sim->pecr & SIM_PECR_FPRG) {
+            if (eeprom) {
+                f->sr |= SIM_L0_SR_PGAERR;
+                return -1;
+            }
+            memcpy(p, data, len);
+            if ((addr + (uint32_t) len) % sim_l0_half_page(sim) == 0)
+                sim_flash_busy(sim, f, sim->cfg.program_us);
+            return 0;
+        }
+        /* word writes erase on their own */
+        memcpy(p, data, len);
+        sim_flash_busy(sim, f, sim->cfg.program_us);
+        return 0;
+    case STLINK_FLASH_TYPE_F0:
+    case STLINK_FLASH_TYPE_F1_XL:
+        lock = 1u << 7;
+        err_seq = 1u << 2;      /* PGERR */
+        err_prog = 1u << 2;
+        break;
+    default:
+        lock = 1u << 31;
+        err_seq = 1u << 7;      /* PGSERR */
+        err_prog = (sim->flash_type == STLINK_FLASH_TYPE_F4) ? (1u << 7) : (1u << 3);
+        if (sim->flash_type != STLINK_FLASH_TYPE_F4)
+            pg |= SIM_G0_CR_FSTPG;
+        break;
+    }
+
+    if ((f->cr & lock) || !(f->cr & pg)) {
+        DLOG("sim: flash write at %#x outside of programming mode\n", addr);
+        f->sr |= err_seq;
+        return -1;
+    }
+    /* the L4 only fast programs a mass erased flash */
+    if (sim->flash_type == STLINK_FLASH_TYPE_L4 && (f->cr & SIM_G0_CR_FSTPG) && !f->mass_erased) {
+        DLOG("sim: fast programming at %#x without a mass erase\n", addr);
+        f->sr |= err_seq;
+        return -1;
+    }
+    /* fast programming goes a row at a time, without a gap */
+    if (f->cr & pg & SIM_G0_CR_FSTPG) {
+        if (addr % SIM_G0_ROW != 0 && addr != f->row_next) {
+            DLOG("sim: fast programming at %#x out of sequence\n", addr);
+            f->sr |= SIM_G0_SR_MISSERR;
+            return -1;
+        }
+        f->row_next = addr + (uint32_t) len;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        if ((p[i] & data[i]) != data[i]) {
+            DLOG("sim: flash write at %#x to a location not erased\n", addr + (uint32_t) i);
+            f->sr |= err_prog;
+            return -1;
+        }
+    }
+
+    memcpy(p, data, len);
+    sim_flash_busy(sim, f, sim->cfg.program_us);
+    return 0;
+}
+
+static void sim_key(int *state, uint32_t val, uint32_t key1, uint32_t key2, bool *unlock) {
+    *unlock = false;
+    if (*state == 0 && val == key1) {
+        *state = 1;
+    } else if (*state == 1 && val == key2) {
+        *state = 0;
+        *unlock = true;
+    } else {
+        /* wrong sequence, locked until the next reset */
+        *state = -1;
+    }
+}
+
+/* F4 sector number (SNB) to flash offset and size */
+static bool sim_f4_sector(struct stlink_sim *sim, uint32_t snb, uint32_t *off, uint32_t *size) {
+    const uint32_t chip = sim->params->chip_id;
+    uint32_t bank = 0;
+
+    if (chip == STLINK_CHIPID_STM32_F7 || chip == STLINK_CHIPID_STM32_F7XXXX) {
+        if (snb < 4) {
+            *off = snb * 0x8000;
+            *size = 0x8000;
+        } else if (snb == 4) {
+            *off = 0x20000;
+            *size = 0x20000;
+        } else {
+            *off = (snb - 4) * 0x40000;
+            *size = 0x40000;
+        }
+        return true;
+    }
+
+    if (snb >= 16) {
+        /* second bank of 2 MiB parts */
+        bank = 0x100000;
+        snb -= 16;
+    } else if (snb >= 12) {
+        return false;
+    }
+
+    if (snb < 4) {
+        *off = snb * 0x4000;
+        *size = 0x4000;
+    } else if (snb == 4) {
+        *off = 0x10000;
+        *size = 0x10000;
+    } else {
+        *off = (snb - 4) * 0x20000;
+        *size = 0x20000;
+    }
+    *off += bank;
+    return true;
+}
+
+static bool sim_l4_dual_bank(struct stlink_sim *sim) {
+    const uint32_t chip = sim->params->chip_id;
+
+    return (chip == STLINK_CHIPID_STM32_L4 || chip == STLINK_CHIPID_STM32_L496X
+            || chip == STLINK_CHIPID_STM32_L4RX) && (sim->optr & (1u << 21));
+}
+
+static uint32_t sim_fpec_read(struct stlink_sim *sim, uint32_t off) {
+    const uint64_t now = sim_now(sim);
+    struct stlink_sim_fpec *f = &sim->fpec[0];
+
+    switch (sim->flash_type) {
+    case STLINK_FLASH_TYPE_F0:
+    case STLINK_FLASH_TYPE_F1_XL:
+        if (off >= 0x40 && sim->flash_type == STLINK_FLASH_TYPE_F1_XL) {
+            f = &sim->fpec[1];
+            off -= 0x40;
+        }
+        switch (off) {
+        case 0x0c: return f->sr | ((now < f->busy_until) ? 1u : 0);
+        case 0x10: return f->cr;
+        case 0x14: return f->ar;
+        case 0x20: return 0xffffffff;   /* no write protection */
+        default: return 0;
+        }
+    case STLINK_FLASH_TYPE_F4:
+        switch (off) {
+        case 0x0c: return f->sr | ((now < f->busy_until) ? (1u << 16) : 0);
+        case 0x10: return f->cr;
+        case 0x14: return 0x0fffaaed;
+        default: return 0;
+        }
+    case STLINK_FLASH_TYPE_L4:
+    case STLINK_FLASH_TYPE_G0:
+        switch (off) {
+        case 0x10: return f->sr | ((now < f->busy_until) ? (1u << 16) : 0);
+        case 0x14: return f->cr;
+        case 0x20: return sim->optr;
+        default: return 0;
+        }
+    case STLINK_FLASH_TYPE_L0:
+        switch (off) {
+        case 0x04: return sim->pecr;
+        case 0x18: return f->sr | ((now < f->busy_until) ? SIM_L0_SR_BSY : SIM_L0_SR_READY);
+        default: return 0;
+        }
+    default:
+        return 0;
+    }
+}
+
+static void sim_fpec_write_f0(struct stlink_sim *sim, uint32_t off, uint32_t val) {
+    const uint32_t lock = 1u << 7, per = 1u << 1, mer = 1u << 2, strt = 1u << 6;
+    struct stlink_sim_fpec *f = &sim->fpec[0];
+    bool unlock;
+    int bank = 0;
+
+    if (off >= 0x40 && sim->flash_type == STLINK_FLASH_TYPE_F1_XL) {
+        f = &sim->fpec[1];
+        off -= 0x40;
+        bank = 1;
+    }
+
+    switch (off) {
+    case 0x04:
+        sim_key(&f->key, val, SIM_FLASH_KEY1, SIM_FLASH_KEY2, &unlock);
+        if (unlock)
+            f->cr &= ~lock;
+        break;
+    case 0x0c:
+        f->sr &= ~(val & 0x34);
+        break;
+    case 0x10:
+        if (f->cr & lock)
+            break;
+        f->cr = val & ~strt;
+        if (!(val & strt))
+            break;
+        if (val & per) {
+            const uint32_t pgsz = sim->params->flash_pagesize;
+            sim_flash_erase(sim, f, (f->ar - STM32_FLASH_BASE) & ~(pgsz - 1), pgsz, sim->cfg.erase_us);
+        } else if (val & mer) {
+            if (sim->flash_type != STLINK_FLASH_TYPE_F1_XL)
+                sim_flash_erase(sim, f, 0, sim->cfg.flash_size, sim->cfg.mass_erase_us);
+            else if (bank == 0)
+                sim_flash_erase(sim, f, 0, SIM_FLASH_BANK2_OFF, sim->cfg.mass_erase_us);
+            else
+                sim_flash_erase(sim, f, SIM_FLASH_BANK2_OFF, sim->cfg.flash_size, sim->cfg.mass_erase_us);
+        }
+        f->sr |= 1u << 5;   /* EOP */
+        break;
+    case 0x14:
+        if (!(f->cr & lock))
+            f->ar = val;
+        break;
+    }
+}
+
+static void sim_fpec_write_f4(struct stlink_sim *sim, uint32_t off, uint32_t val) {
+    const uint32_t lock = 1u << 31, ser = 1u << 1, mer = (1u << 2) | (1u << 15), strt = 1u << 16;
+    struct stlink_sim_fpec *f = &sim->fpec[0];
+    uint32_t soff, ssize;
+    bool unlock;
+
+    switch (off) {
+    case 0x04:
+        sim_key(&f->key, val, SIM_FLASH_KEY1, SIM_FLASH_KEY2, &unlock);
+        if (unlock)
+            f->cr &= ~lock;
+        break;
+    case 0x0c:
+        f->sr &= ~(val & 0xf3);
+        break;
+    case 0x10:
+        if (f->cr & lock)
+            break;
+        f->cr = val & ~strt;
+        if (!(val & strt))
+            break;
+        if (val & ser) {
+            if (sim_f4_sector(sim, (val >> 3) & 0x1f, &soff, &ssize))
+                sim_flash_erase(sim, f, soff, ssize, sim->cfg.erase_us);
+            else
+                f->sr |= 1u << 7;
+        } else if (val & mer) {
+            sim_flash_erase(sim, f, 0, sim->cfg.flash_size, sim->cfg.mass_erase_us);
+        }
+        f->sr |= 1u << 0;   /* EOP */
+        break;
+    }
+}
+
+static void sim_fpec_write_l4(struct stlink_sim *sim, uint32_t off, uint32_t val) {
+    const uint32_t lock = 1u << 31, per = 1u << 1, mer1 = 1u << 2, mer2 = 1u << 15, strt = 1u << 16;
+    const uint32_t pgsz = sim->params->flash_pagesize;
+    const uint32_t half = (uint32_t) sim->cfg.flash_size / 2;
+    struct stlink_sim_fpec *f = &sim->fpec[0];
+    bool unlock;
+
+    switch (off) {
+    case 0x08:
+        sim_key(&f->key, val, SIM_FLASH_KEY1, SIM_FLASH_KEY2, &unlock);
+        if (unlock)
+            f->cr &= ~lock;
+        break;
+    case 0x10:
+        f->sr &= ~(val & 0xc3fb);
+        break;
+    case 0x14:
+        if (f->cr & lock)
+            break;
+        f->cr = val & ~strt;
+        if (!(val & strt))
+            break;
+        if (val & per) {
+            uint32_t page;
+            if (sim->flash_type == STLINK_FLASH_TYPE_G0) {
+                page = (val >> 3) & 0xff;
+                sim_flash_erase(sim, f, page * pgsz, pgsz, sim->cfg.erase_us);
+            } else if (sim_l4_dual_bank(sim)) {
+                page = (val >> 3) & 0xff;
+                sim_flash_erase(sim, f, ((val & (1u << 11)) ? half : 0) + page * pgsz, pgsz, sim->cfg.erase_us);
+            } else {
+                /* single bank: BKER is the top bit of the page number */
+                page = (val >> 3) & 0x1ff;
+                sim_flash_erase(sim, f, page * pgsz, pgsz, sim->cfg.erase_us);
+            }
+            f->mass_erased = false;
+        } else if (sim->flash_type == STLINK_FLASH_TYPE_L4 && sim_l4_dual_bank(sim) && (val & (mer1 | mer2))) {
+            if (val & mer1)
+                sim_flash_erase(sim, f, 0, half, sim->cfg.mass_erase_us);
+            if (val & mer2)
+                sim_flash_erase(sim, f, half, half, sim->cfg.mass_erase_us);
+            f->mass_erased = (val & (mer1 | mer2)) == (mer1 | mer2);
+        } else if (val & (mer1 | mer2)) {
+            sim_flash_erase(sim, f, 0, sim->cfg.flash_size, sim->cfg.mass_erase_us);
+            f->mass_erased = true;
+        }
+        f->sr |= 1u << 0;   /* EOP */
+        break;
+    }
+}
+
+static void sim_fpec_write_l0(struct stlink_sim *sim, uint32_t off, uint32_t val) {
+    const uint32_t locks = SIM_PECR_PELOCK | SIM_PECR_PRGLOCK | SIM_PECR_OPTLOCK;
+    struct stlink_sim_fpec *f = &sim->fpec[0];
+    bool unlock;
+
+    switch (off) {
+    case 0x04:
+        if (sim->pecr & SIM_PECR_PELOCK)
+            break;
+        /* lock bits can only be set here, PELOCK takes the others along
+           and ends any erase or programming mode */
+        if (val & SIM_PECR_PELOCK)
+            val = locks;
+        sim->pecr = (val & ~locks) | ((sim->pecr | val) & locks);
+        if (sim->pecr & SIM_PECR_PELOCK) {
+            sim->pekey = 0;
+            sim->prgkey = 0;
+        }
+        break;
+    case 0x0c:
+        if (!(sim->pecr & SIM_PECR_PELOCK))
+            break;
+        sim_key(&sim->pekey, val, SIM_PEKEY1, SIM_PEKEY2, &unlock);
+        if (unlock)
+            sim->pecr &= ~SIM_PECR_PELOCK;
+        break;
+    case 0x10:
+        if (!(sim->pecr & SIM_PECR_PRGLOCK))
+            break;
+        if (sim->pecr & SIM_PECR_PELOCK) {
+            sim->prgkey = -1;
+            break;
+        }
+        sim_key(&sim->prgkey, val, SIM_PRGKEY1, SIM_PRGKEY2, &unlock);
+        if (unlock)
+            sim->pecr &= ~SIM_PECR_PRGLOCK;
+        break;
+    case 0x18:
+        f->sr &= ~(val & (0x3f00 | SIM_L0_SR_EOP));
+        break;
+    }
+}
+
+static void sim_fpec_write(struct stlink_sim *sim, uint32_t off, uint32_t val) {
+    switch (sim->flash_type) {
+    case STLINK_FLASH_TYPE_F0:
+    case STLINK_FLASH_TYPE_F1_XL:
+        sim_fpec_write_f0(sim, off, val);
+        break;
+    case STLINK_FLASH_TYPE_F4:
+        sim_fpec_write_f4(sim, off, val);
+        break;
+    case STLINK_FLASH_TYPE_L4:
+    case STLINK_FLASH_TYPE_G0:
+        sim_fpec_write_l4(sim, off, val);
+        break;
+    case STLINK_FLASH_TYPE_L0:
+        sim_fpec_write_l0(sim, off, val);
+        break;
+    default:
+        break;
+    }
+}
+
+static size_t sim_loader_unit(struct stlink_sim *sim) {
+    switch (sim->flash_type) {
+    case STLINK_FLASH_TYPE_F0:
+    case STLINK_FLASH_TYPE_F1_XL:
+        return 2;
+    case STLINK_FLASH_TYPE_L4:
+    case STLINK_FLASH_TYPE_G0:
+        return 8;
+    default:
+        return 4;
+    }
+}
+
+/* How long programming one unit takes: with fast programming on the L4
+   and G0 a row takes 1.7 instead of 2.7 ms */
+static uint64_t sim_unit_us(struct stlink_sim *sim) {
+    if ((sim->flash_type == STLINK_FLASH_TYPE_L4 || sim->flash_type == STLINK_FLASH_TYPE_G0)
+            && (sim->fpec[0].cr & SIM_G0_CR_FSTPG))
+        return (uint64_t) sim->cfg.program_us * 17 / 27;
+    return sim->cfg.program_us;
+}
+
+/* Program count units from *src to *dst like the flash loaders do, and
+   stop at the first programming error. Returns the units written. */
+static size_t sim_loader_copy(struct stlink_sim *sim, uint32_t *src, uint32_t *dst, size_t count, uint32_t bank) {
+    const size_t unit = sim_loader_unit(sim);
+    size_t n;
+
+    for (n = 0; n < count; n++) {
+        uint8_t *s = sim_region(sim, *src, unit);
+        uint8_t *d = sim_region(sim, *dst, unit);
+
+        if (s == NULL || d == NULL || sim_is_flash(sim, s) || !sim_is_flash(sim, d))
+            break;
+
+        if (sim->flash_type == STLINK_FLASH_TYPE_F0 || sim->flash_type == STLINK_FLASH_TYPE_F1_XL) {
+            /* the loader sets PG itself, in the bank r3 points at */
+            struct stlink_sim_fpec *f = &sim->fpec[(bank == 0x40) ? 1 : 0];
+            if (!(f->cr & (1u << 7)))
+                f->cr = 1;
+        }
+
+        if (sim_flash_program(sim, d, s, unit))
+            break;
+
+        *src += (uint32_t) unit;
+        *dst += (uint32_t) unit;
+    }
+
+    return n;
+}
+
+/* Stand in for the L0/L1 loader: the same, but a whole half page at the
+   start of one goes with FPRG and PROG set, in one program operation */
+static uint64_t sim_run_loader_l0(struct stlink_sim *sim) {
+    struct stlink_reg *r = &sim->reg;
+    const uint32_t half = r->r[4];
+    uint64_t us = 0;
+
+    if (r->r[3] != sim->fpec_base || (half != 0 && half != sim_l0_half_page(sim))) {
+        DLOG("sim: L0/L1 loader with flash registers %#x, half pages of %u bytes\n", r->r[3], half);
+        return 0;
+    }
+
+    while (r->r[2] > 0) {
+        const bool whole = half != 0 && r->r[2] >= half / 4 && r->r[1] % half == 0;
+        const size_t n = whole ? half / 4 : 1;
+        size_t done;
+
+        if (whole)
+            sim->pecr |= SIM_PECR_FPRG | SIM_PECR_PROG;
+        done = sim_loader_copy(sim, &r->r[0], &r->r[1], n, 0);
+        sim->pecr &= ~(SIM_PECR_FPRG | SIM_PECR_PROG);
+        r->r[2] -= (uint32_t) done;
+        if (done < n)
+            break;
+        us += sim->cfg.program_us;
+    }
+
+    return us;
+}
+
+/* Stand in for the flash loaders: copy r2 units from r0 to r1 and stop at
+   the first programming error, leaving r2 at the number of units not
+   written. Returns how long the loader runs. */
+static uint64_t sim_run_loader(struct stlink_sim *sim) {
+    struct stlink_reg *r = &sim->reg;
+    size_t n;
+
+    if (sim->flash_type == STLINK_FLASH_TYPE_L0)
+        return sim_run_loader_l0(sim);
+
+    n = sim_loader_copy(sim, &r->r[0], &r->r[1], r->r[2], r->r[3]);
+
+    r->r[2] -= (uint32_t) n;
+    return (uint64_t) n * sim_unit_us(sim);
+}
+
+/* Serve the double buffered loader: take a buffer once its mailbox word
+   is set (r0 mailbox, r2 buffer size), program it, clear the word when the
+   time for it has passed and stop after the last buffer or an error, with
+   the units not written in r3. */
+static void sim_pp_update(struct stlink_sim *sim) {
+    uint64_t t = sim_now(sim);
+
+    while (sim->pp) {
+        const uint32_t mbox_addr = sim->pp_mbox + 4 * (uint32_t) sim->pp_slot;
+        uint8_t *mbox = sim_region(sim, mbox_addr, 4);
+        uint32_t word, count, src;
+
+        if (mbox == NULL) {
+            sim->pp = false;
+            sim->halted = true;
+            return;
+        }
+
+        if (sim->pp_busy) {
+            if (t < sim->pp_done_at)
+                return;
+            t = sim->pp_done_at;
+            sim_write_le32(mbox, sim->pp_left);
+            sim->pp_busy = false;
+            sim->pp_slot ^= 1;
+            if (sim->pp_last || sim->pp_left) {
+                sim->reg.r[3] = sim->pp_left;
+                sim->pp = false;
+                sim->halted = true;
+            }
+            continue;
+        }
+
+        word = sim_read_le32(mbox);
+        if (word == 0)
+            return;
+
+        count = word & ~SIM_PP_LAST;
+        src = sim->pp_mbox + 8 + (uint32_t) sim->pp_slot * sim->reg.r[2];
+        sim->pp_left = count - (uint32_t) sim_loader_copy(sim, &src, &sim->reg.r[1], count, sim->pp_bank);
+        sim->pp_last = (word & SIM_PP_LAST) != 0;
+        sim->pp_busy = true;
+        sim->pp_done_at = t + (uint64_t) (count - sim->pp_left) * sim_unit_us(sim);
+    }
+}
+
+/* Run the descriptor at d like the flashing agent does, through the flash
+   controller as described by the control block ctl, from t on. Returns when
+   the agent is done with it; sets agent_status and returns if it fails. */
+static uint64_t sim_agent_run(struct stlink_sim *sim, const uint8_t *ctl, const uint8_t *d, uint64_t t) {
+    const uint32_t op = sim_read_le32(d), addr = sim_read_le32(d + 4);
+    const uint32_t len = sim_read_le32(d + 8), arg = sim_read_le32(d + 12);
+    const uint32_t bank = (addr >= sim_read_le32(ctl + 44)) ? 0x40 : 0;
+    const uint32_t sr = sim_read_le32(ctl + 12) + bank - sim->fpec_base;
+    const uint32_t cr = sim_read_le32(ctl + 16) + bank - sim->fpec_base;
+    const uint32_t err = sim_read_le32(ctl + 28);
+    const uint32_t unit = sim_read_le32(ctl + 40);
+    struct stlink_sim_fpec *f = sim_fpec_for(sim, addr);
+    uint64_t us = 0;
+
+    /* everything but unpacking waits for the bank first */
+    if (op != STLINK_AGENT_UNPACK) {
+        if (f->busy_until > t)
+            t = f->busy_until;
+        sim->agent_status = sim_fpec_read(sim, sr) & err;
+        if (sim->agent_status)
+            return t;
+    }
+
+    switch (op) {
+    case STLINK_AGENT_ERASE:
+        /* and goes on while it runs */
+        sim_fpec_write(sim, cr, arg);
+        if (sim_read_le32(ctl + 20))
+            sim_fpec_write(sim, cr + 4, addr);
+        sim_fpec_write(sim, cr, arg | sim_read_le32(ctl + 32));
+        f->busy_until = t + sim->cfg.erase_us;
+        return t;
+    case STLINK_AGENT_PROGRAM:
+        sim_fpec_write(sim, cr, sim_read_le32(ctl + 36));
+        for (uint32_t off = 0; off < len && unit != 0; off += unit) {
+            uint8_t *s = sim_region(sim, arg + off, unit);
+            uint8_t *p = sim_region(sim, addr + off, unit);
+
+            if (s == NULL || p == NULL || sim_is_flash(sim, s) || !sim_is_flash(sim, p)
+                    || sim_flash_program(sim, p, s, unit))
+                break;
+            us += sim->cfg.program_us;
+        }
+        break;
+    case STLINK_AGENT_BLANK: {
+        const uint8_t *p = sim_region(sim, addr, len);
+
+        for (uint32_t off = 0; p != NULL && off < len; off += 4) {
+            if (sim_read_le32(p + off) != 0xffffffff) {
+                sim->agent_status = addr + off;
+                break;
+            }
+        }
+        if (sim->agent_status == 0)
+            sim_fpec_write(sim, cr, 0);
+        return t + (uint64_t) len * SIM_BLANK_KIB_US / 1024;
+    }
+    case STLINK_AGENT_UNPACK: {
+        uint8_t *p = sim_region(sim, addr, len);
+        const uint8_t *end = sim->sram + sim->params->sram_size;
+        const uint8_t *s = sim_region(sim, arg, 0);
+
+        /* both in sram */
+        if (p == NULL || s == NULL || p < sim->sram || p >= end || s < sim->sram || s >= end
+                || stlink_lz_decompress(p, len, s, (size_t) (end - s)) == -1)
+            DLOG("sim: agent unpacking to %#x from %#x failed\n", addr, arg);
+        return t + (uint64_t) len * SIM_UNPACK_KIB_US / 1024;
+    }
+    default:
+        return t;
+    }
+
+    /* the agent waits on the controller itself */
+    f->busy_until = t + us;
+    sim->agent_status = sim_fpec_read(sim, sr) & err;
+    sim_fpec_write(sim, cr, 0);
+    return t + us;
+}
+
+/* Serve the flashing agent: take the descriptors the host posts one after
+   the other, each done when the time for it has passed, and stop at a stop
+   descriptor or after an error, with status set. */
+static void sim_agent_update(struct stlink_sim *sim) {
+    uint64_t t = sim_now(sim);
+
+    while (sim->agent) {
+        uint8_t *ctl = sim_region(sim, sim->agent_ctl, SIM_AGENT_CTL_SIZE);
+        uint32_t head, tail;
+        const uint8_t *d;
+
+        if (ctl == NULL) {
+            sim_halt(sim);
+            return;
+        }
+
+        tail = sim_read_le32(ctl + 4);
+        if (sim->agent_busy) {
+            if (t < sim->agent_done_at)
+                return;
+            t = sim->agent_done_at;
+            sim->agent_busy = false;
+            if (sim->agent_status) {
+                sim_write_le32(ctl + 8, sim->agent_status);
+                sim_halt(sim);
+                return;
+            }
+            sim_write_le32(ctl + 4, tail + 1);
+            continue;
+        }
+
+        head = sim_read_le32(ctl);
+        if (head == tail)
+            return;
+
+        d = ctl + SIM_AGENT_RING + 16 * (tail % STLINK_AGENT_SLOTS);
+        if (sim_read_le32(d) == STLINK_AGENT_STOP || sim_read_le32(d) > STLINK_AGENT_UNPACK) {
+            sim_halt(sim);
+            return;
+        }
+
+        sim->agent_status = 0;
+        sim->agent_done_at = sim_agent_run(sim, ctl, d, t);
+        sim->agent_busy = true;
+    }
+}
+
+static void sim_resume(struct stlink_sim *sim) {
+    const uint32_t pc = sim->reg.r[15];
+    const uint8_t *code;
+    size_t avail;
+
+    sim_update(sim);
+    if (!sim->halted)
+        return;
+
+    sim->halted = false;
+    sim->halt_at = UINT64_MAX;
+    if (pc < STM32_SRAM_BASE || pc - STM32_SRAM_BASE >= sim->params->sram_size)
+        return;
+
+    code = sim->sram + (pc - STM32_SRAM_BASE);
+    avail = sim->params->sram_size - (pc - STM32_SRAM_BASE);
+    if (stlink_flash_loader_is_crc32(code, avail)) {
+        /* r0 address, r1 length, r2 crc, not inverted */
+        struct stlink_reg *r = &sim->reg;
+        const uint8_t *p = sim_region(sim, r->r[0], r->r[1]);
+
+        if (p != NULL) {
+            r->r[2] = ~stlink_crc32(~r->r[2], p, r->r[1]);
+            sim->halt_at = sim_now(sim) + (uint64_t) r->r[1] * SIM_CRC_KIB_US / 1024;
+            r->r[0] += r->r[1];
+            r->r[1] = 0;
+        } else {
+            sim->halt_at = sim_now(sim);
+        }
+        return;
+    }
+
+    if (stlink_flash_loader_is_agent(code, avail)) {
+        sim->agent = true;
+        sim->agent_busy = false;
+        sim->agent_ctl = sim->reg.r[0];
+        sim_update(sim);
+        return;
+    }
+
+    if (stlink_flash_loader_is_double_buffered(code, avail)) {
+        sim->pp = true;
+        sim->pp_busy = false;
+        sim->pp_slot = 0;
+        sim->pp_mbox = sim->reg.r[0];
+        sim->pp_bank = sim->reg.r[3];
+        sim_update(sim);
+        return;
+    }
+
+    sim->halt_at = sim_now(sim) + sim_run_loader(sim);
+}
+
+static void sim_step(struct stlink_sim *sim) {
+    sim_update(sim);
+    if (sim->halted)
+        sim->reg.r[15] += 2;
+}
+
+/* memory map */
+
+static uint32_t sim_read32(struct stlink_sim *sim, uint32_t addr) {
+    const uint32_t size_reg = sim->params->flash_size_reg;
+    uint8_t *p;
+
+    sim_update(sim);
+
+    if (addr == (size_reg & ~3u)) {
+        uint32_t kib = (uint32_t) (sim->cfg.flash_size / 1024);
+        if (sim->params->chip_id == STLINK_CHIPID_STM32_L1_HIGH)
+            kib = (kib == 384) ? 0 : 1;
+        return kib << ((size_reg & 2) ? 16 : 0);
+    }
+
+    p = sim_region(sim, addr, 4);
+    if (p != NULL)
+        return sim_read_le32(p);
+
+    if (addr - sim->fpec_base < SIM_FLASH_REGS_SIZE)
+        return sim_fpec_read(sim, addr - sim->fpec_base);
+
+    switch (addr) {
+    case STLINK_REG_DHCSR:
+        sim_update(sim);
+        return SIM_DHCSR_C_DEBUGEN | SIM_DHCSR_S_REGRDY
+            | (sim->halted ? SIM_DHCSR_C_HALT | SIM_DHCSR_S_HALT : 0);
+    case STLINK_REG_DCRSR:
+        return 0;
+    case STLINK_REG_DCRDR:
+        return sim->dcrdr;
+    case SIM_DEMCR:
+        return sim->demcr;
+    case STLINK_REG_CM3_CPUID:
+        return sim->cpuid;
+    case SIM_DBGMCU_IDCODE:
+    case SIM_DBGMCU_IDCODE_M0:
+        return 0x10000000 | sim->params->chip_id;
+    default:
+        return sim_io_read(sim, addr);
+    }
+}
+
+static void sim_write(struct stlink_sim *sim, uint32_t addr, const uint8_t *data, size_t len);
+
+static void sim_write32(struct stlink_sim *sim, uint32_t addr, uint32_t val) {
+    uint8_t *p = sim_region(sim, addr, 4);
+
+    if (p != NULL) {
+        uint8_t data[4];
+        sim_write_le32(data, val);
+        sim_write(sim, addr, data, 4);
+        return;
+    }
+
+    if (addr - sim->fpec_base < SIM_FLASH_REGS_SIZE) {
+        sim_fpec_write(sim, addr - sim->fpec_base, val);
+        return;
+    }
+
+    switch (addr) {
+    case STLINK_REG_DHCSR:
+        if ((val & 0xffff0000) != STLINK_REG_DHCSR_DBGKEY)
+            break;
+        if (val & SIM_DHCSR_C_HALT)
+            sim_halt(sim);
+        else if (val & SIM_DHCSR_C_STEP)
+            sim_step(sim);
+        else
+            sim_resume(sim);
+        break;
+    case STLINK_REG_DCRSR:
+        if (val & SIM_DCRSR_REGWNR)
+            sim_set_core_reg(sim, val & 0x7f, sim->dcrdr);
+        else
+            sim->dcrdr = sim_core_reg(sim, val & 0x7f);
+        break;
+    case STLINK_REG_DCRDR:
+        sim->dcrdr = val;
+        break;
+    case SIM_DEMCR:
+        sim->demcr = val;
+        break;
+    case STLINK_REG_AIRCR:
+        if ((val & 0xffff0000) == STLINK_REG_AIRCR_VECTKEY && (val & STLINK_REG_AIRCR_SYSRESETREQ))
+            sim_reset_system(sim, false);
+        break;
+    default:
+        sim_io_write(sim, addr, val);
+        break;
+    }
+}
+
+static void sim_read(struct stlink_sim *sim, uint32_t addr, uint8_t *buf, size_t len) {
+    uint8_t *p = sim_region(sim, addr, len);
+
+    sim_update(sim);
+    if (p != NULL) {
+        memcpy(buf, p, len);
+        return;
+    }
+
+    for (size_t off = 0; off < len; off += 4) {
+        uint8_t word[4];
+        sim_write_le32(word, sim_read32(sim, addr + (uint32_t) off));
+        memcpy(buf + off, word, (len - off < 4) ? len - off : 4);
+    }
+}
+
+static void sim_write(struct stlink_sim *sim, uint32_t addr, const uint8_t *data, size_t len) {
+    uint8_t *p = sim_region(sim, addr, len);
+
+    if (p != NULL && sim_is_flash(sim, p)) {
+        sim_flash_program(sim, p, data, len);
+    } else if (p != NULL) {
+        if (p >= sim->sram && p < sim->sram + sim->params->sram_size) {
+            memcpy(p, data, len);
+            /* a running loader may be waiting for this */
+            sim_update(sim);
+        }
+    } else if ((addr & 3) == 0 && (len & 3) == 0) {
+        for (size_t off = 0; off < len; off += 4)
+            sim_write32(sim, addr + (uint32_t) off, sim_read_le32(data + off));
+    } else {
+        /* byte accesses to registers: read, modify, write the words */
+        for (size_t i = 0; i < len; i++) {
+            const uint32_t a = addr + (uint32_t) i;
+            const unsigned shift = 8 * (a & 3);
+            uint32_t v = sim_read32(sim, a & ~3u);
+            v = (v & ~(0xffu << shift)) | ((uint32_t) data[i] << shift);
+            sim_write32(sim, a & ~3u, v);
+        }
+    }
+}
+
+/* backend */
+
+void _stlink_sim_close(stlink_t *sl) {
+    struct stlink_sim *sim = sl->backend_data;
+
+    if (sim == NULL)
+        return;
+
+    free(sim->flash);
+    free(sim->sram);
+    free(sim->sys);
+    free(sim->eeprom);
+    free(sim->io);
+    free(sim);
+    sl->backend_data = NULL;
+}
+
+int _stlink_sim_exit_debug_mode(stlink_t *sl) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+
+    sim->mode = STLINK_DEV_MASS_MODE;
+    sim_cmd(sl, STLINK_DEBUG_EXIT, 0, start);
+    return 0;
+}
+
+int _stlink_sim_enter_swd_mode(stlink_t *sl) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+
+    sim->mode = STLINK_DEV_DEBUG_MODE;
+    sim_cmd(sl, STLINK_DEBUG_ENTER, 0, start);
+    return 0;
+}
+
+int _stlink_sim_exit_dfu_mode(stlink_t *sl) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+
+    sim->mode = STLINK_DEV_MASS_MODE;
+    sim_cmd(sl, STLINK_DFU_COMMAND, 0, start);
+    return 0;
+}
+
+int _stlink_sim_core_id(stlink_t *sl) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+
+    sl->core_id = sim->cfg.core_id;
+    sim_cmd(sl, STLINK_DEBUG_READCOREID, 4, start);
+    return 0;
+}
+
+int _stlink_sim_reset(stlink_t *sl) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+
+    sim_reset_system(sim, true);
+    sim_cmd(sl, STLINK_DEBUG_RESETSYS, 2, start);
+
+    // Like the libusb backend, let the core go through AIRCR
+    return stlink_write_debug32(sl, STLINK_REG_AIRCR,
+            STLINK_REG_AIRCR_VECTKEY | STLINK_REG_AIRCR_SYSRESETREQ);
+}
+
+int _stlink_sim_jtag_reset(stlink_t *sl, int value) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+
+    // releasing (1) or pulsing (2) NRST resets the target
+    if (value != 0)
+        sim_reset_system(sim, false);
+    sim_cmd(sl, STLINK_JTAG_DRIVE_NRST, 2, start);
+    return 0;
+}
+
+int _stlink_sim_run(stlink_t *sl) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+
+    sim_resume(sim);
+    sim_cmd(sl, STLINK_DEBUG_RUNCORE, 2, start);
+    return 0;
+}
+
+int _stlink_sim_status(stlink_t *sl) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+
+    sim_update(sim);
+    sl->q_buf[0] = sim->halted ? STLINK_CORE_HALTED : STLINK_CORE_RUNNING;
+    sl->q_buf[1] = 0;
+    sl->q_len = 2;
+    sim_cmd(sl, STLINK_DEBUG_GETSTATUS, 2, start);
+    return 0;
+}
+
+int _stlink_sim_version(stlink_t *sl) {
+    uint64_t start = stlink_time_us();
+
+    // STLINK V2, JTAG API 28, SWIM 7 on the ST vid/pid, see _parse_version()
+    sl->q_buf[0] = (2 << 4) | (28 >> 2);
+    sl->q_buf[1] = ((28 & 3) << 6) | 7;
+    sl->q_buf[2] = STLINK_USB_VID_ST & 0xff;
+    sl->q_buf[3] = STLINK_USB_VID_ST >> 8;
+    sl->q_buf[4] = STLINK_USB_PID_STLINK_32L & 0xff;
+    sl->q_buf[5] = STLINK_USB_PID_STLINK_32L >> 8;
+    sl->q_len = 6;
+    sim_cmd(sl, STLINK_GET_VERSION, 6, start);
+    return 0;
+}
+
+int _stlink_sim_read_debug32(stlink_t *sl, uint32_t addr, uint32_t *data) {
+    uint64_t start = stlink_time_us();
+
+    *data = sim_read32(sl->backend_data, addr);
+    sim_cmd(sl, STLINK_JTAG_READDEBUG_32BIT, 8, start);
+    return 0;
+}
+
+int _stlink_sim_read_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    uint64_t start = stlink_time_us();
+
+    sim_read(sl->backend_data, addr, sl->q_buf, len);
+    sl->q_len = len;
+    sim_cmd(sl, STLINK_DEBUG_READMEM_32BIT, len, start);
+    stlink_print_data(sl);
+    return 0;
+}
+
+int _stlink_sim_write_debug32(stlink_t *sl, uint32_t addr, uint32_t data) {
+    uint64_t start = stlink_time_us();
+
+    sim_write32(sl->backend_data, addr, data);
+    sim_cmd(sl, STLINK_JTAG_WRITEDEBUG_32BIT, 2, start);
+    return 0;
+}
+
+int _stlink_sim_write_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    uint64_t start = stlink_time_us();
+
+    sim_write(sl->backend_data, addr, sl->q_buf, len);
+    sim_cmd(sl, STLINK_DEBUG_WRITEMEM_32BIT, len, start);
+    return 0;
+}
+
+int _stlink_sim_write_mem8(stlink_t *sl, uint32_t addr, uint16_t len) {
+    uint64_t start = stlink_time_us();
+
+    sim_write(sl->backend_data, addr, sl->q_buf, len);
+    sim_cmd(sl, STLINK_DEBUG_WRITEMEM_8BIT, len, start);
+    return 0;
+}
+
+int _stlink_sim_read_all_regs(stlink_t *sl, struct stlink_reg *regp) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+
+    for (int i = 0; i < 21; i++)
+        write_uint32(sl->q_buf + 4 * i, *sim_reg_slot(&sim->reg, (uint32_t) i));
+    sl->q_len = 84;
+
+    for (int i = 0; i < 16; i++)
+        regp->r[i] = sim->reg.r[i];
+    regp->xpsr = sim->reg.xpsr;
+    regp->main_sp = sim->reg.main_sp;
+    regp->process_sp = sim->reg.process_sp;
+    regp->rw = sim->reg.rw;
+    regp->rw2 = sim->reg.rw2;
+
+    sim_cmd(sl, STLINK_DEBUG_READALLREGS, 84, start);
+    return 0;
+}
+
+int _stlink_sim_read_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+    uint32_t *src = sim_reg_slot(&sim->reg, (uint32_t) r_idx);
+    uint32_t *dst = sim_reg_slot(regp, (uint32_t) r_idx);
+
+    if (src == NULL || dst == NULL)
+        return -1;
+
+    *dst = *src;
+    write_uint32(sl->q_buf, *src);
+    sl->q_len = 4;
+    sim_cmd(sl, STLINK_DEBUG_READREG, 4, start);
+    return 0;
+}
+
+int _stlink_sim_write_reg(stlink_t *sl, uint32_t reg, int idx) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+    uint32_t *dst = sim_reg_slot(&sim->reg, (uint32_t) idx);
+
+    if (dst == NULL)
+        return -1;
+
+    *dst = reg;
+    sim_cmd(sl, STLINK_DEBUG_WRITEREG, 2, start);
+    return 0;
+}
+
+/* Through DCRSR/DCRDR like the libusb backend, see section C1.6 of the
+   ARMv7-M Architecture Reference Manual */
+int _stlink_sim_read_unsupported_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
+    uint32_t r;
+
+    write_uint32(sl->q_buf, (uint32_t) r_idx);
+    _stlink_sim_write_mem32(sl, STLINK_REG_DCRSR, 4);
+    _stlink_sim_read_mem32(sl, STLINK_REG_DCRDR, 4);
+    r = read_uint32(sl->q_buf, 0);
+
+    switch (r_idx) {
+    case 0x14:
+        regp->primask = (uint8_t) (r & 0xFF);
+        regp->basepri = (uint8_t) ((r>>8) & 0xFF);
+        regp->faultmask = (uint8_t) ((r>>16) & 0xFF);
+        regp->control = (uint8_t) ((r>>24) & 0xFF);
+        break;
+    case 0x21:
+        regp->fpscr = r;
+        break;
+    default:
+        regp->s[r_idx - 0x40] = r;
+        break;
+    }
+
+    return 0;
+}
+
+int _stlink_sim_read_all_unsupported_regs(stlink_t *sl, struct stlink_reg *regp) {
+    _stlink_sim_read_unsupported_reg(sl, 0x14, regp);
+    _stlink_sim_read_unsupported_reg(sl, 0x21, regp);
+    for (int i = 0; i < 32; i++)
+        _stlink_sim_read_unsupported_reg(sl, 0x40 + i, regp);
+
+    return 0;
+}
+
+int _stlink_sim_write_unsupported_reg(stlink_t *sl, uint32_t val, int r_idx, struct stlink_reg *regp) {
+    if (r_idx >= 0x1C && r_idx <= 0x1F) { /* primask, basepri, faultmask, or control */
+        /* These are held in the same register */
+        _stlink_sim_read_unsupported_reg(sl, 0x14, regp);
+
+        val = (uint8_t) (val>>24);
+
+        switch (r_idx) {
+        case 0x1C:  /* control */
+            val = (((uint32_t) val) << 24) | (((uint32_t) regp->faultmask) << 16) | (((uint32_t) regp->basepri) << 8) | ((uint32_t) regp->primask);
+            break;
+        case 0x1D:  /* faultmask */
+            val = (((uint32_t) regp->control) << 24) | (((uint32_t) val) << 16) | (((uint32_t) regp->basepri) << 8) | ((uint32_t) regp->primask);
+            break;
+        case 0x1E:  /* basepri */
+            val = (((uint32_t) regp->control) << 24) | (((uint32_t) regp->faultmask) << 16) | (((uint32_t) val) << 8) | ((uint32_t) regp->primask);
+            break;
+        case 0x1F:  /* primask */
+            val = (((uint32_t) regp->control) << 24) | (((uint32_t) regp->faultmask) << 16) | (((uint32_t) regp->basepri) << 8) | ((uint32_t) val);
+            break;
+        }
+
+        r_idx = 0x14;
+    }
+
+    write_uint32(sl->q_buf, val);
+    _stlink_sim_write_mem32(sl, STLINK_REG_DCRDR, 4);
+    write_uint32(sl->q_buf, SIM_DCRSR_REGWNR | (uint32_t) r_idx);
+    return _stlink_sim_write_mem32(sl, STLINK_REG_DCRSR, 4);
+}
+
+int _stlink_sim_step(stlink_t *sl) {
+    uint64_t start = stlink_time_us();
+
+    sim_step(sl->backend_data);
+    sim_cmd(sl, STLINK_DEBUG_STEPCORE, 2, start);
+    return 0;
+}
+
+int _stlink_sim_current_mode(stlink_t *sl) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+
+    sl->q_buf[0] = (unsigned char) sim->mode;
+    sim_cmd(sl, STLINK_GET_CURRENT_MODE, 2, start);
+    return sim->mode;
+}
+
+int _stlink_sim_force_debug(stlink_t *sl) {
+    uint64_t start = stlink_time_us();
+
+    sim_halt(sl->backend_data);
+    sim_cmd(sl, STLINK_DEBUG_FORCEDEBUG, 2, start);
+    return 0;
+}
+
+int32_t _stlink_sim_target_voltage(stlink_t *sl) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+
+    sim_cmd(sl, STLINK_GET_TARGET_VOLTAGE, 8, start);
+    return sim->cfg.voltage;
+}
+
+int _stlink_sim_set_swdclk(stlink_t *sl, uint16_t divisor) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+
+    sim->swdclk = divisor;
+    sim_cmd(sl, STLINK_DEBUG_APIV2_SWD_SET_FREQ, 2, start);
+    return 0;
+}
+
+int _stlink_sim_read_mem32_bulk(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len) {
+    uint64_t start = stlink_time_us();
+    size_t count = (len + STLINK_USB_MEM_CHUNK - 1) / STLINK_USB_MEM_CHUNK;
+
+    sim_read(sl->backend_data, addr, buf, len);
+    sim_charge(sl->backend_data, count, len, true);
+    for (size_t off = 0; off < len; off += STLINK_USB_MEM_CHUNK)
+        stlink_stats_record(&sl->stats, STLINK_DEBUG_READMEM_32BIT,
+                (len - off > STLINK_USB_MEM_CHUNK) ? STLINK_USB_MEM_CHUNK : len - off, start);
+    return 0;
+}
+
+int _stlink_sim_write_mem32_bulk(stlink_t *sl, uint32_t addr, const uint8_t *buf, size_t len) {
+    uint64_t start = stlink_time_us();
+    size_t count = (len + STLINK_USB_MEM_CHUNK - 1) / STLINK_USB_MEM_CHUNK;
+
+    sim_write(sl->backend_data, addr, buf, len);
+    sim_charge(sl->backend_data, count, len, true);
+    for (size_t off = 0; off < len; off += STLINK_USB_MEM_CHUNK)
+        stlink_stats_record(&sl->stats, STLINK_DEBUG_WRITEMEM_32BIT,
+                (len - off > STLINK_USB_MEM_CHUNK) ? STLINK_USB_MEM_CHUNK : len - off, start);
+    return 0;
+}
+
+int _stlink_sim_batch(stlink_t *sl, struct stlink_batch_op *ops, size_t count) {
+    struct stlink_sim *sim = sl->backend_data;
+    uint64_t start = stlink_time_us();
+    size_t bytes = 0;
+    int ret = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t opcode;
+
+        ops[i].error = 0;
+        switch (ops[i].type) {
+        case STLINK_BATCH_READ32:
+            ops[i].value = sim_read32(sim, ops[i].addr);
+            opcode = STLINK_JTAG_READDEBUG_32BIT;
+            bytes += 8;
+            break;
+        case STLINK_BATCH_WRITE32:
+            sim_write32(sim, ops[i].addr, ops[i].value);
+            opcode = STLINK_JTAG_WRITEDEBUG_32BIT;
+            bytes += 2;
+            break;
+        case STLINK_BATCH_WRITE_REG:
+        default:
+            if (sim_reg_slot(&sim->reg, ops[i].addr) != NULL) {
+                *sim_reg_slot(&sim->reg, ops[i].addr) = ops[i].value;
+            } else {
+                ops[i].error = -1;
+                ret = -1;
+            }
+            opcode = STLINK_DEBUG_WRITEREG;
+            bytes += 2;
+            break;
+        }
+        stlink_stats_record(&sl->stats, opcode, 0, start);
+    }
+
+    sim_charge(sim, count, bytes, true);
+    return ret;
+}
+
+uint64_t _stlink_sim_time_us(stlink_t *sl) {
+    return sim_now(sl->backend_data);
+}
+
+/* the host waiting for the target */
+void _stlink_sim_sleep_us(stlink_t *sl, uint64_t us) {
+    sim_pass(sl->backend_data, us);
+}
+
+static const stlink_backend_t _stlink_sim_backend = {
+    _stlink_sim_close,
+    _stlink_sim_exit_debug_mode,
+    _stlink_sim_enter_swd_mode,
+    NULL,  // no enter_jtag_mode here...
+    _stlink_sim_exit_dfu_mode,
+    _stlink_sim_core_id,
+    _stlink_sim_reset,
+    _stlink_sim_jtag_reset,
+    _stlink_sim_run,
+    _stlink_sim_status,
+    _stlink_sim_version,
+    _stlink_sim_read_debug32,
+    _stlink_sim_read_mem32,
+    _stlink_sim_write_debug32,
+    _stlink_sim_write_mem32,
+    _stlink_sim_write_mem8,
+    _stlink_sim_read_all_regs,
+    _stlink_sim_read_reg,
+    _stlink_sim_read_all_unsupported_regs,
+    _stlink_sim_read_unsupported_reg,
+    _stlink_sim_write_unsupported_reg,
+    _stlink_sim_write_reg,
+    _stlink_sim_step,
+    _stlink_sim_current_mode,
+    _stlink_sim_force_debug,
+    _stlink_sim_target_voltage,
+    _stlink_sim_set_swdclk,
+    _stlink_sim_read_mem32_bulk,
+    _stlink_sim_batch,
+    _stlink_sim_write_mem32_bulk,
+    _stlink_sim_time_us,
+    _stlink_sim_sleep_us
+};
+
+/* core id as read over SWD and CPUID for the chips' cores */
+static void sim_default_ids(const struct stlink_chipid_params *params, uint32_t *core_id, uint32_t *cpuid) {
+    const uint32_t chip = params->chip_id;
+
+    switch (params->flash_type) {
+    case STLINK_FLASH_TYPE_F4:
+        if (chip == STLINK_CHIPID_STM32_F2) {
+            *core_id = 0x2ba01477;
+            *cpuid = 0x412fc230;
+        } else if (chip == STLINK_CHIPID_STM32_F7 || chip == STLINK_CHIPID_STM32_F7XXXX
+                || chip == STLINK_CHIPID_STM32_F72XXX) {
+            *core_id = STM32F7_CORE_ID;
+            *cpuid = 0x411fc270;
+        } else {
+            *core_id = 0x2ba01477;
+            *cpuid = 0x410fc241;
+        }
+        break;
+    case STLINK_FLASH_TYPE_L4:
+        *core_id = 0x2ba01477;
+        *cpuid = 0x410fc241;
+        break;
+    case STLINK_FLASH_TYPE_L0:
+        if (chip == STLINK_CHIPID_STM32_L0 || chip == STLINK_CHIPID_STM32_L0_CAT5
+                || chip == STLINK_CHIPID_STM32_L0_CAT2 || chip == STLINK_CHIPID_STM32_L011) {
+            *core_id = 0x0bc11477;
+            *cpuid = 0x410cc601;
+        } else {
+            *core_id = 0x2ba01477;
+            *cpuid = 0x412fc231;
+        }
+        break;
+    case STLINK_FLASH_TYPE_G0:
+        *core_id = 0x0bc11477;
+        *cpuid = 0x410cc601;
+        break;
+    default:
+        if (chip == STLINK_CHIPID_STM32_F0 || chip == STLINK_CHIPID_STM32_F04
+                || chip == STLINK_CHIPID_STM32_F0_CAN || chip == STLINK_CHIPID_STM32_F0_SMALL
+                || chip == STLINK_CHIPID_STM32_F09X) {
+            *core_id = 0x0bb11477;
+            *cpuid = 0x410cc200;
+        } else {
+            *core_id = STM32VL_CORE_ID;
+            *cpuid = 0x412fc231;
+        }
+        break;
+    }
+}
+
+stlink_t *stlink_open_sim(enum ugly_loglevel verbose, bool reset, const struct stlink_sim_config *cfg)
+{
+    stlink_t *sl = NULL;
+    struct stlink_sim *sim = NULL;
+    uint32_t core_id;
+
+    ugly_init(verbose);
+
+    sl = calloc(1, sizeof (stlink_t));
+    sim = calloc(1, sizeof (struct stlink_sim));
+    if (sl == NULL || sim == NULL)
+        goto on_error;
+
+    sim->params = stlink_chipid_get_params(cfg->chip_id);
+    if (sim->params == NULL || sim->params->flash_type == STLINK_FLASH_TYPE_UNKNOWN) {
+        WLOG("sim: unsupported chip id %#x\n", cfg->chip_id);
+        goto on_error;
+    }
+
+    sim->cfg = *cfg;
+    sim_default_ids(sim->params, &core_id, &sim->cpuid);
+    if (sim->cfg.core_id == 0)
+        sim->cfg.core_id = core_id;
+    if (sim->cfg.flash_size == 0)
+        sim->cfg.flash_size = 128 * 1024;
+    if (sim->cfg.voltage == 0)
+        sim->cfg.voltage = 3300;
+    if (sim->cfg.depth == 0)
+        sim->cfg.depth = STLINK_USB_PIPELINE_DEPTH;
+
+    sim->flash_type = sim->params->flash_type;
+    sim->erased = (sim->flash_type == STLINK_FLASH_TYPE_L0) ? 0x00 : 0xff;
+    if (sim->flash_type == STLINK_FLASH_TYPE_F4
+            || (sim->flash_type == STLINK_FLASH_TYPE_L0 && sim->cpuid != 0x410cc601))
+        sim->fpec_base = SIM_FLASH_REGS_F4;
+    else
+        sim->fpec_base = SIM_FLASH_REGS;
+    /* L4 parts that can, come up dual banked */
+    sim->optr = 0xffeff8aa;
+
+    sim->flash = malloc(sim->cfg.flash_size);
+    sim->sram = calloc(1, sim->params->sram_size);
+    sim->sys = malloc(sim->params->bootrom_size);
+    if (sim->params->eeprom_size)
+        sim->eeprom = calloc(1, sim->params->eeprom_size);
+    if (sim->flash == NULL || sim->sram == NULL || sim->sys == NULL
+            || (sim->params->eeprom_size && sim->eeprom == NULL)) {
+        _stlink_sim_close(&(stlink_t) { .backend_data = sim });
+        sim = NULL;
+        goto on_error;
+    }
+    memset(sim->flash, sim->erased, sim->cfg.flash_size);
+    memset(sim->sys, 0xff, sim->params->bootrom_size);
+
+    sim->mode = STLINK_DEV_MASS_MODE;
+    sim->epoch = stlink_time_us();
+    sim_reset_system(sim, false);
+
+    sl->backend = (stlink_backend_t *) &_stlink_sim_backend;
+    sl->backend_data = sim;
+    sl->core_stat = STLINK_CORE_STAT_UNKNOWN;
+
+    if (stlink_current_mode(sl) == STLINK_DEV_DFU_MODE)
+        stlink_exit_dfu_mode(sl);
+
+    if (stlink_current_mode(sl) != STLINK_DEV_DEBUG_MODE)
+        stlink_enter_swd_mode(sl);
+
+    stlink_version(sl);
+    stlink_set_swdclk(sl, STLINK_SWDCLK_1P8MHZ_DIVISOR);
+
+    if (reset) {
+        stlink_jtag_reset(sl, 2);
+        stlink_reset(sl);
+    }
+
+    if (stlink_load_device_params(sl) == -1) {
+        stlink_close(sl);
+        return NULL;
+    }
+
+    return sl;
+
+on_error:
+    free(sim);
+    free(sl);
+    return NULL;
+}
+
+uint64_t stlink_sim_time_us(stlink_t *sl) {
+    if (sl->backend != &_stlink_sim_backend)
+        return 0;
+    return sim_now(sl->backend_data);
+}
+
+uint8_t *stlink_sim_mem(stlink_t *sl, uint32_t addr, size_t len) {
+    if (sl->backend != &_stlink_sim_backend)
+        return NULL;
+    return sim_region(sl->backend_data, addr, len);
+}
@@ -0,0 +1,165 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "stlink.h"
+#include "stlink/stats.h"
+#include "stats_internal.h"
+
+/* monotonic time in microseconds, only differences are meaningful */
+uint64_t stlink_time_us(void) {
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t) (now.QuadPart / (freq.QuadPart / 1000000.0));
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+#endif
+}
+
+uint8_t stlink_stats_opcode(const unsigned char *cmd) {
+    return (cmd[0] == STLINK_DEBUG_COMMAND) ? cmd[1] : cmd[0];
+}
+
+void stlink_stats_record(struct stlink_stats *st, uint8_t opcode, size_t bytes, uint64_t start_us) {
+    struct stlink_cmd_stats *c;
+    uint64_t us;
+    int bucket = 0;
+
+    if (st == NULL)
+        return;
+
+    us = stlink_time_us() - start_us;
+    while (bucket < STLINK_STATS_BUCKETS - 1 && (us >> (bucket + 1)) != 0)
+        bucket++;
+
+    c = &st->cmd[opcode];
+    c->count++;
+    c->bytes += bytes;
+    c->total_us += us;
+    if (us > c->max_us)
+        c->max_us = us;
+    c->hist[bucket]++;
+}
+
+static const char *stlink_stats_name(uint8_t opcode) {
+    switch (opcode) {
+    case STLINK_GET_VERSION:            return "GET_VERSION";
+    case STLINK_GET_CURRENT_MODE:       return "GET_CURRENT_MODE";
+    case STLINK_GET_TARGET_VOLTAGE:     return "GET_TARGET_VOLTAGE";
+    case STLINK_DFU_COMMAND:            return "DFU_COMMAND";
+    case STLINK_DEBUG_GETSTATUS:        return "GETSTATUS";
+    case STLINK_DEBUG_FORCEDEBUG:       return "FORCEDEBUG";
+    case STLINK_DEBUG_RESETSYS:         return "RESETSYS";
+    case STLINK_DEBUG_READALLREGS:      return "READALLREGS";
+    case STLINK_DEBUG_READREG:          return "READREG";
+    case STLINK_DEBUG_WRITEREG:         return "WRITEREG";
+    case STLINK_DEBUG_READMEM_32BIT:    return "READMEM_32BIT";
+    case STLINK_DEBUG_WRITEMEM_32BIT:   return "WRITEMEM_32BIT";
+    case STLINK_DEBUG_RUNCORE:          return "RUNCORE";
+    case STLINK_DEBUG_STEPCORE:         return "STEPCORE";
+    case STLINK_DEBUG_WRITEMEM_8BIT:    return "WRITEMEM_8BIT";
+    case STLINK_DEBUG_ENTER:            return "ENTER";
+    case STLINK_DEBUG_EXIT:             return "EXIT";
+    case STLINK_DEBUG_READCOREID:       return "READCOREID";
+    case STLINK_DEBUG_ENTER_SWD:        return "ENTER_SWD";
+    case STLINK_SWD_ENTER:              return "SWD_ENTER";
+    case STLINK_SWD_READCOREID:         return "SWD_READCOREID";
+    case STLINK_JTAG_WRITEDEBUG_32BIT:  return "WRITEDEBUG_32BIT";
+    case STLINK_JTAG_READDEBUG_32BIT:   return "READDEBUG_32BIT";
+    case STLINK_JTAG_DRIVE_NRST:        return "DRIVE_NRST";
+    case STLINK_DEBUG_APIV2_SWD_SET_FREQ: return "SWD_SET_FREQ";
+    default:                            return NULL;
+    }
+}
+
+const struct stlink_stats *stlink_get_stats(stlink_t *sl) {
+    return &sl->stats;
+}
+
+void stlink_reset_stats(stlink_t *sl) {
+    memset(&sl->stats, 0, sizeof(sl->stats));
+    sl->memcache.hits = sl->memcache.misses = 0;
+}
+
+void stlink_appendf(char *buf, size_t size, size_t *len, const char *fmt, ...) {
+    char empty[1];
+    va_list ap;
+    int n;
+
+    if (buf == NULL)
+        size = 0;
+    va_start(ap, fmt);
+    n = vsnprintf(*len < size ? buf + *len : empty, *len < size ? size - *len : 1, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        *len += (size_t) n;
+}
+
+/*
+ * Render the statistics as text into buf, one line per opcode that was
+ * used plus its latency histogram. Returns the length the full text
+ * needs, like snprintf.
+ */
+size_t stlink_format_stats(stlink_t *sl, char *buf, size_t size) {
+    size_t len = 0;
+
+    stlink_appendf(buf, size, &len, "%-20s %8s %10s %10s %8s %8s\n", "command", "count", "bytes",
+            "total ms", "avg us", "max us");
+    for (int op = 0; op < 256; op++) {
+        const struct stlink_cmd_stats *c = &sl->stats.cmd[op];
+        const char *name = stlink_stats_name((uint8_t) op);
+
+        if (c->count == 0)
+            continue;
+
+        if (name)
+            stlink_appendf(buf, size, &len, "%-20s", name);
+        else
+            stlink_appendf(buf, size, &len, "opcode 0x%02x         ", op);
+        stlink_appendf(buf, size, &len, " %8llu %10llu %10.1f %8llu %8llu\n",
+                (unsigned long long) c->count, (unsigned long long) c->bytes,
+                c->total_us / 1000.0, (unsigned long long) (c->total_us / c->count),
+                (unsigned long long) c->max_us);
+
+        stlink_appendf(buf, size, &len, "  latency:");
+        for (int i = 0; i < STLINK_STATS_BUCKETS; i++) {
+            if (c->hist[i] == 0)
+                continue;
+            if (i == STLINK_STATS_BUCKETS - 1)
+                stlink_appendf(buf, size, &len, " >=%lluus:%llu", 1ULL << i, (unsigned long long) c->hist[i]);
+            else
+                stlink_appendf(buf, size, &len, " <%lluus:%llu", 1ULL << (i + 1),
+                        (unsigned long long) c->hist[i]);
+        }
+        stlink_appendf(buf, size, &len, "\n");
+    }
+
+    if (sl->stats.flash.bytes) {
+        const struct stlink_flash_stats *f = &sl->stats.flash;
+
+        stlink_appendf(buf, size, &len,
+                "flash: %llu bytes written, %llu sent (ratio %.2f, %llu buffers compressed)",
+                (unsigned long long) f->bytes, (unsigned long long) f->sent,
+                f->sent ? (double) f->bytes / f->sent : 0.0, (unsigned long long) f->packed);
+        if (f->total_us)
+            stlink_appendf(buf, size, &len, ", %.1f KiB/s", f->bytes * 1e6 / 1024 / f->total_us);
+        stlink_appendf(buf, size, &len, "\n");
+    }
+
+    if (sl->memcache.hits || sl->memcache.misses)
+        stlink_appendf(buf, size, &len, "memcache: %llu pages read from the cache, %llu from the target\n",
+                (unsigned long long) sl->memcache.hits, (unsigned long long) sl->memcache.misses);
+
+    return len;
+}
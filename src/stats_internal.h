@@ -0,0 +1,26 @@
+/*
+ * File:   stats_internal.h
+ *
+ * Not installed: helpers shared by the library's text formatters.
+ */
+#ifndef STLINK_STATS_INTERNAL_H_
+#define STLINK_STATS_INTERNAL_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * printf to buf + *len, and add the length of the output to *len whether
+ * it fit into the size bytes of buf or not, so a formatter called with
+ * buf NULL (and size 0) finds out the size it needs, like snprintf.
+ */
+void stlink_appendf(char *buf, size_t size, size_t *len, const char *fmt, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STLINK_STATS_INTERNAL_H_ */
@@ -27,16 +27,37 @@ static void cleanup(int signum) {
     exit(1);
 }
 
+static void print_stats(stlink_t *sl)
+{
+    size_t len = stlink_format_stats(sl, NULL, 0);
+    char *text = malloc(len + 1);
+
+    if (text == NULL)
+        return;
+    stlink_format_stats(sl, text, len + 1);
+    fputs(text, stdout);
+    free(text);
+}
+
 static void usage(void)
 {
-    puts("stlinkv1 command line: ./st-flash [--debug] [--reset] [--format <format>] [--flash=<fsize>] {read|write} /dev/sgX <path> <addr> <size>");
+    puts("stlinkv1 command line: ./st-flash [--debug] [--reset] [--stats] [--format <format>] [--flash=<fsize>] {read|write} /dev/sgX <path> <addr> <size>");
     puts("stlinkv1 command line: ./st-flash [--debug] /dev/sgX erase");
-    puts("stlinkv2 command line: ./st-flash [--debug] [--reset] [--serial <serial>] [--format <format>] [--flash=<fsize>] {read|write} <path> <addr> <size>");
+    puts("stlinkv2 command line: ./st-flash [--debug] [--reset] [--stats] [--delta] [--agent] [--compress] [--dry-run] [--allow-mass-erase] [--fast-program] [--record|--replay <trace>] [--serial <serial>] [--format <format>] [--flash=<fsize>] {read|write} <path> <addr> <size>");
     puts("stlinkv2 command line: ./st-flash [--debug] [--serial <serial>] erase");
     puts("stlinkv2 command line: ./st-flash [--debug] [--serial <serial>] reset");
     puts("                       Use hex format for addr, <serial> and <size>.");
     puts("                       fsize: Use decimal, octal or hex by prefix 0xXXX for hex, optionally followed by k=KB, or m=MB (eg. --flash=128k)");
     puts("                       Format may be 'binary' (default) or 'ihex', although <addr> must be specified for binary format only.");
+    puts("                       --stats prints per command counts, bytes and latencies of the probe traffic on exit.");
+    puts("                       --delta reads back the flash and only erases and writes the pages that differ.");
+    puts("                       --agent writes flash with the flashing agent instead of the flash loaders (F0/F1 XL/F4/L4).");
+    puts("                       --compress sends the data compressed where it pays off, for the flashing agent to unpack (with --agent).");
+    puts("                       --dry-run prints which pages a write would erase, and how long that takes, without writing.");
+    puts("                       --allow-mass-erase mass erases instead of page by page where that is faster, losing the rest of the flash.");
+    puts("                       --fast-program writes whole rows in fast programming mode (G0, L4 after a mass erase, see --allow-mass-erase).");
+    puts("                       --record=<trace> saves the probe traffic to <trace>, --replay=<trace> plays it back instead of");
+    puts("                       using a probe, with the recorded timing if --realtime is given.");
     puts("                       ./st-flash [--version]");
 }
 
@@ -57,7 +78,9 @@ int main(int ac, char** av)
 
     printf("st-flash %s\n", STLINK_VERSION);
 
-    if (o.devname != NULL) /* stlinkv1 */
+    if (o.replay != NULL)
+        sl = stlink_open_replay(o.log_level, o.replay, o.realtime);
+    else if (o.devname != NULL) /* stlinkv1 */
         sl = stlink_v1_open(o.log_level, 1);
     else /* stlinkv2 */
         sl = stlink_open_usb(o.log_level, 1, (char *)o.serial);
@@ -65,12 +88,22 @@ int main(int ac, char** av)
     if (sl == NULL)
         return -1;
 
+    if (o.record != NULL && stlink_trace_record(sl, o.record)) {
+        stlink_close(sl);
+        return -1;
+    }
+
     if ( o.flash_size != 0u && o.flash_size != sl->flash_size ) {
         sl->flash_size = o.flash_size;
         printf("Forcing flash size: --flash=0x%08X\n",(unsigned int)sl->flash_size);
     }
 
     sl->verbose = o.log_level;
+    sl->flash_agent = o.agent;
+    sl->flash_compress = o.compress;
+    sl->flash_dry_run = o.dry_run;
+    sl->allow_mass_erase = o.allow_mass_erase;
+    sl->flash_fast_program = o.fast_program;
 
     connected_stlink = sl;
     signal(SIGINT, &cleanup);
@@ -140,8 +173,12 @@ int main(int ac, char** av)
 
         if ((o.addr >= sl->flash_base) &&
                 (o.addr < sl->flash_base + sl->flash_size)) {
-            if(o.format == FLASH_FORMAT_IHEX)
+            if(o.format == FLASH_FORMAT_IHEX && o.delta)
+                err = stlink_mwrite_flash_delta(sl, mem, (uint32_t)size, o.addr);
+            else if(o.format == FLASH_FORMAT_IHEX)
                 err = stlink_mwrite_flash(sl, mem, (uint32_t)size, o.addr);
+            else if(o.delta)
+                err = stlink_fwrite_flash_delta(sl, o.filename, o.addr);
             else
                 err = stlink_fwrite_flash(sl, o.filename, o.addr);
             if (err == -1)
@@ -150,6 +187,18 @@ int main(int ac, char** av)
                 goto on_error;
             }
         }
+        else if ((o.addr >= sl->eeprom_base) &&
+                (o.addr < sl->eeprom_base + sl->eeprom_size)) {
+            if(o.format == FLASH_FORMAT_IHEX)
+                err = stlink_mwrite_eeprom(sl, mem, (uint32_t)size, o.addr);
+            else
+                err = stlink_fwrite_eeprom(sl, o.filename, o.addr);
+            if (err == -1)
+            {
+                printf("stlink_fwrite_eeprom() == -1\n");
+                goto on_error;
+            }
+        }
         else if ((o.addr >= sl->sram_base) &&
                 (o.addr < sl->sram_base + sl->sram_size)) {
             if(o.format == FLASH_FORMAT_IHEX)
@@ -195,6 +244,9 @@ int main(int ac, char** av)
         else if ((o.addr >= sl->sram_base) && (o.size == 0) &&
                 (o.addr < sl->sram_base + sl->sram_size))
             o.size = sl->sram_size;
+        else if ((o.addr >= sl->eeprom_base) && (o.size == 0) &&
+                (o.addr < sl->eeprom_base + sl->eeprom_size))
+            o.size = sl->eeprom_size;
         err = stlink_fread(sl, o.filename, o.format == FLASH_FORMAT_IHEX, o.addr, o.size);
         if (err == -1)
         {
@@ -213,6 +265,8 @@ int main(int ac, char** av)
 
 on_error:
     stlink_exit_debug_mode(sl);
+    if (o.stats)
+        print_stats(sl);
     stlink_close(sl);
     free(mem);
 
@@ -33,6 +33,52 @@ int flash_get_opts(struct flash_opts* o, int ac, char** av)
         else if (strcmp(av[0], "--reset") == 0) {
             o->reset = 1;
         }
+        else if (strcmp(av[0], "--stats") == 0) {
+            o->stats = 1;
+        }
+        else if (strcmp(av[0], "--realtime") == 0) {
+            o->realtime = 1;
+        }
+        else if (strcmp(av[0], "--delta") == 0) {
+            o->delta = 1;
+        }
+        else if (strcmp(av[0], "--agent") == 0) {
+            o->agent = 1;
+        }
+        else if (strcmp(av[0], "--compress") == 0) {
+            o->compress = 1;
+        }
+        else if (strcmp(av[0], "--dry-run") == 0) {
+            o->dry_run = 1;
+        }
+        else if (strcmp(av[0], "--allow-mass-erase") == 0) {
+            o->allow_mass_erase = 1;
+        }
+        else if (strcmp(av[0], "--fast-program") == 0) {
+            o->fast_program = 1;
+        }
+        else if (strcmp(av[0], "--record") == 0 || starts_with(av[0], "--record=")) {
+            if(strcmp(av[0], "--record") == 0) {
+                ac--;
+                av++;
+                if (ac < 1) return -1;
+                o->record = av[0];
+            }
+            else {
+                o->record = av[0] + strlen("--record=");
+            }
+        }
+        else if (strcmp(av[0], "--replay") == 0 || starts_with(av[0], "--replay=")) {
+            if(strcmp(av[0], "--replay") == 0) {
+                ac--;
+                av++;
+                if (ac < 1) return -1;
+                o->replay = av[0];
+            }
+            else {
+                o->replay = av[0] + strlen("--replay=");
+            }
+        }
         else if (strcmp(av[0], "--serial") == 0 || starts_with(av[0], "--serial=")) {
             const char * serial;
             if(strcmp(av[0], "--serial") == 0) {
@@ -0,0 +1,945 @@
+/*
+ * Trace recording and replay.
+ *
+ * The recorder sits between common.c and the real backend: every backend
+ * call is passed on and logged with its arguments, the payload it sent
+ * and received, its return value and how long it took. Replay is a
+ * backend of its own that hands out the logged results in order.
+ *
+ * A trace is a header with the state of the stlink_t when recording
+ * started, followed by one entry per call. All numbers are little endian.
+ *
+ *   header: "STLKTRC" version, 17 u32 fields of the stlink_t (ids, memory
+ *           map, probe version) and the 16 byte serial
+ *   entry:  u8 op, u32 gap_us (since the previous call returned),
+ *           u32 dur_us, u32 a0, u32 a1, i32 ret, i32 q_len,
+ *           u32 in_len, u32 out_len, in[in_len], out[out_len]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stlink.h"
+#include "stlink/trace.h"
+#include "stlink/logging.h"
+
+#define TRACE_MAGIC         "STLKTRC"
+#define TRACE_VERSION       1
+#define TRACE_ENTRY_SIZE    33
+#define TRACE_REGS_SIZE     (55 * 4)
+
+/* backend calls, in stlink_backend_t order */
+enum trace_op {
+    TRACE_CLOSE = 0,
+    TRACE_EXIT_DEBUG_MODE,
+    TRACE_ENTER_SWD_MODE,
+    TRACE_ENTER_JTAG_MODE,
+    TRACE_EXIT_DFU_MODE,
+    TRACE_CORE_ID,
+    TRACE_RESET,
+    TRACE_JTAG_RESET,
+    TRACE_RUN,
+    TRACE_STATUS,
+    TRACE_VERSION_OP,
+    TRACE_READ_DEBUG32,
+    TRACE_READ_MEM32,
+    TRACE_WRITE_DEBUG32,
+    TRACE_WRITE_MEM32,
+    TRACE_WRITE_MEM8,
+    TRACE_READ_ALL_REGS,
+    TRACE_READ_REG,
+    TRACE_READ_ALL_UNSUPPORTED_REGS,
+    TRACE_READ_UNSUPPORTED_REG,
+    TRACE_WRITE_UNSUPPORTED_REG,
+    TRACE_WRITE_REG,
+    TRACE_STEP,
+    TRACE_CURRENT_MODE,
+    TRACE_FORCE_DEBUG,
+    TRACE_TARGET_VOLTAGE,
+    TRACE_SET_SWDCLK,
+    TRACE_READ_MEM32_BULK,
+    TRACE_BATCH,
+    TRACE_WRITE_MEM32_BULK,
+    TRACE_OP_COUNT
+};
+
+static const struct {
+    const char *name;
+    uint8_t opcode;     /* for the statistics on replay */
+} trace_ops[TRACE_OP_COUNT] = {
+    { "close", STLINK_DEBUG_EXIT },
+    { "exit_debug_mode", STLINK_DEBUG_EXIT },
+    { "enter_swd_mode", STLINK_DEBUG_ENTER },
+    { "enter_jtag_mode", STLINK_DEBUG_ENTER },
+    { "exit_dfu_mode", STLINK_DFU_COMMAND },
+    { "core_id", STLINK_DEBUG_READCOREID },
+    { "reset", STLINK_DEBUG_RESETSYS },
+    { "jtag_reset", STLINK_JTAG_DRIVE_NRST },
+    { "run", STLINK_DEBUG_RUNCORE },
+    { "status", STLINK_DEBUG_GETSTATUS },
+    { "version", STLINK_GET_VERSION },
+    { "read_debug32", STLINK_JTAG_READDEBUG_32BIT },
+    { "read_mem32", STLINK_DEBUG_READMEM_32BIT },
+    { "write_debug32", STLINK_JTAG_WRITEDEBUG_32BIT },
+    { "write_mem32", STLINK_DEBUG_WRITEMEM_32BIT },
+    { "write_mem8", STLINK_DEBUG_WRITEMEM_8BIT },
+    { "read_all_regs", STLINK_DEBUG_READALLREGS },
+    { "read_reg", STLINK_DEBUG_READREG },
+    { "read_all_unsupported_regs", STLINK_DEBUG_READMEM_32BIT },
+    { "read_unsupported_reg", STLINK_DEBUG_READMEM_32BIT },
+    { "write_unsupported_reg", STLINK_DEBUG_WRITEMEM_32BIT },
+    { "write_reg", STLINK_DEBUG_WRITEREG },
+    { "step", STLINK_DEBUG_STEPCORE },
+    { "current_mode", STLINK_GET_CURRENT_MODE },
+    { "force_debug", STLINK_DEBUG_FORCEDEBUG },
+    { "target_voltage", STLINK_GET_TARGET_VOLTAGE },
+    { "set_swdclk", STLINK_DEBUG_APIV2_SWD_SET_FREQ },
+    { "read_mem32_bulk", STLINK_DEBUG_READMEM_32BIT },
+    { "batch", STLINK_JTAG_WRITEDEBUG_32BIT },
+    { "write_mem32_bulk", STLINK_DEBUG_WRITEMEM_32BIT },
+};
+
+struct trace_entry {
+    uint8_t op;
+    uint32_t gap_us;
+    uint32_t dur_us;
+    uint32_t a0;
+    uint32_t a1;
+    int32_t ret;
+    int32_t q_len;
+    uint32_t in_len;
+    uint32_t out_len;
+    uint8_t *in;
+    uint8_t *out;
+};
+
+struct stlink_trace {
+    FILE *f;
+    // recording: the backend being recorded
+    stlink_backend_t *inner;
+    void *inner_data;
+    uint64_t start;
+    uint64_t last;
+    // replay
+    bool realtime;
+    struct trace_entry e;
+    uint8_t *buf;
+    size_t alloc;
+};
+
+static const stlink_backend_t _stlink_trace_record_backend;
+static const stlink_backend_t _stlink_trace_replay_backend;
+
+static void trace_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+    p[2] = (uint8_t) (v >> 16);
+    p[3] = (uint8_t) (v >> 24);
+}
+
+static uint32_t trace_get32(const uint8_t *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void trace_put_regs(uint8_t *p, const struct stlink_reg *regp) {
+    int i;
+
+    for (i = 0; i < 16; i++)
+        trace_put32(p + 4 * i, regp->r[i]);
+    for (i = 0; i < 32; i++)
+        trace_put32(p + 64 + 4 * i, regp->s[i]);
+    trace_put32(p + 192, regp->xpsr);
+    trace_put32(p + 196, regp->main_sp);
+    trace_put32(p + 200, regp->process_sp);
+    trace_put32(p + 204, regp->rw);
+    trace_put32(p + 208, regp->rw2);
+    trace_put32(p + 212, ((uint32_t) regp->control << 24) | ((uint32_t) regp->faultmask << 16)
+            | ((uint32_t) regp->basepri << 8) | regp->primask);
+    trace_put32(p + 216, regp->fpscr);
+}
+
+static void trace_get_regs(const uint8_t *p, struct stlink_reg *regp) {
+    int i;
+    uint32_t special;
+
+    for (i = 0; i < 16; i++)
+        regp->r[i] = trace_get32(p + 4 * i);
+    for (i = 0; i < 32; i++)
+        regp->s[i] = trace_get32(p + 64 + 4 * i);
+    regp->xpsr = trace_get32(p + 192);
+    regp->main_sp = trace_get32(p + 196);
+    regp->process_sp = trace_get32(p + 200);
+    regp->rw = trace_get32(p + 204);
+    regp->rw2 = trace_get32(p + 208);
+    special = trace_get32(p + 212);
+    regp->control = (uint8_t) (special >> 24);
+    regp->faultmask = (uint8_t) (special >> 16);
+    regp->basepri = (uint8_t) (special >> 8);
+    regp->primask = (uint8_t) special;
+    regp->fpscr = trace_get32(p + 216);
+}
+
+/* the stlink_t state a trace starts from */
+#define TRACE_HEADER_FIELDS 17
+#define TRACE_HEADER_SIZE   (8 + 4 * TRACE_HEADER_FIELDS + 16)
+
+static int trace_write_header(stlink_t *sl, FILE *f) {
+    uint8_t h[TRACE_HEADER_SIZE];
+    const uint32_t v[TRACE_HEADER_FIELDS] = {
+        sl->core_id, sl->chip_id, (uint32_t) sl->core_stat, (uint32_t) sl->flash_type,
+        sl->flash_base, (uint32_t) sl->flash_size, (uint32_t) sl->flash_pgsz,
+        sl->sram_base, (uint32_t) sl->sram_size, sl->sys_base, (uint32_t) sl->sys_size,
+        sl->version.stlink_v, sl->version.jtag_v, sl->version.swim_v,
+        sl->version.st_vid, sl->version.stlink_pid, (uint32_t) sl->serial_size,
+    };
+
+    memcpy(h, TRACE_MAGIC, 7);
+    h[7] = TRACE_VERSION;
+    for (int i = 0; i < TRACE_HEADER_FIELDS; i++)
+        trace_put32(h + 8 + 4 * i, v[i]);
+    memcpy(h + 8 + 4 * TRACE_HEADER_FIELDS, sl->serial, 16);
+
+    return (fwrite(h, sizeof(h), 1, f) == 1) ? 0 : -1;
+}
+
+static int trace_read_header(stlink_t *sl, FILE *f) {
+    uint8_t h[TRACE_HEADER_SIZE];
+    uint32_t v[TRACE_HEADER_FIELDS];
+
+    if (fread(h, sizeof(h), 1, f) != 1 || memcmp(h, TRACE_MAGIC, 7) != 0) {
+        ELOG("not a trace file\n");
+        return -1;
+    }
+    if (h[7] != TRACE_VERSION) {
+        ELOG("trace version %d is not supported\n", h[7]);
+        return -1;
+    }
+
+    for (int i = 0; i < TRACE_HEADER_FIELDS; i++)
+        v[i] = trace_get32(h + 8 + 4 * i);
+    sl->core_id = v[0];
+    sl->chip_id = v[1];
+    sl->core_stat = (int) v[2];
+    sl->flash_type = (enum stlink_flash_type) v[3];
+    sl->flash_base = v[4];
+    sl->flash_size = v[5];
+    sl->flash_pgsz = v[6];
+    sl->sram_base = v[7];
+    sl->sram_size = v[8];
+    sl->sys_base = v[9];
+    sl->sys_size = v[10];
+    sl->version.stlink_v = v[11];
+    sl->version.jtag_v = v[12];
+    sl->version.swim_v = v[13];
+    sl->version.st_vid = v[14];
+    sl->version.stlink_pid = v[15];
+    sl->serial_size = (int) v[16];
+    memcpy(sl->serial, h + 8 + 4 * TRACE_HEADER_FIELDS, 16);
+
+    return 0;
+}
+
+/* recording */
+
+static struct stlink_trace *trace_enter(stlink_t *sl) {
+    struct stlink_trace *tr = sl->backend_data;
+
+    // calls the backend makes on its own (e.g. reset through AIRCR) go
+    // straight to it and are part of this entry
+    sl->backend = tr->inner;
+    sl->backend_data = tr->inner_data;
+    tr->start = stlink_time_us();
+    return tr;
+}
+
+static void trace_leave(stlink_t *sl, struct stlink_trace *tr, enum trace_op op,
+        uint32_t a0, uint32_t a1, int ret,
+        const uint8_t *in, size_t in_len, const uint8_t *out, size_t out_len) {
+    const uint64_t end = stlink_time_us();
+    uint8_t h[TRACE_ENTRY_SIZE];
+
+    tr->inner_data = sl->backend_data;
+    sl->backend = (stlink_backend_t *) &_stlink_trace_record_backend;
+    sl->backend_data = tr;
+
+    if (tr->f == NULL)
+        return;
+
+    h[0] = (uint8_t) op;
+    trace_put32(h + 1, (uint32_t) (tr->start - tr->last));
+    trace_put32(h + 5, (uint32_t) (end - tr->start));
+    trace_put32(h + 9, a0);
+    trace_put32(h + 13, a1);
+    trace_put32(h + 17, (uint32_t) ret);
+    trace_put32(h + 21, (uint32_t) sl->q_len);
+    trace_put32(h + 25, (uint32_t) in_len);
+    trace_put32(h + 29, (uint32_t) out_len);
+    tr->last = end;
+
+    if (fwrite(h, sizeof(h), 1, tr->f) != 1
+            || (in_len && fwrite(in, in_len, 1, tr->f) != 1)
+            || (out_len && fwrite(out, out_len, 1, tr->f) != 1)) {
+        ELOG("writing the trace failed, stopped recording\n");
+        fclose(tr->f);
+        tr->f = NULL;
+    }
+}
+
+/* q_buf as left by the call */
+static size_t trace_q_len(stlink_t *sl) {
+    if (sl->q_len <= 0)
+        return 0;
+    return (sl->q_len > Q_BUF_LEN) ? Q_BUF_LEN : (size_t) sl->q_len;
+}
+
+static void _trace_close(stlink_t *sl) {
+    struct stlink_trace *tr = trace_enter(sl);
+
+    tr->inner->close(sl);
+    trace_leave(sl, tr, TRACE_CLOSE, 0, 0, 0, NULL, 0, NULL, 0);
+    if (tr->f != NULL)
+        fclose(tr->f);
+    free(tr);
+    sl->backend_data = NULL;
+}
+
+#define TRACE_SIMPLE(fn, op) \
+    static int _trace_##fn(stlink_t *sl) { \
+        struct stlink_trace *tr = trace_enter(sl); \
+        int ret = tr->inner->fn(sl); \
+        trace_leave(sl, tr, op, 0, 0, ret, NULL, 0, NULL, 0); \
+        return ret; \
+    }
+
+TRACE_SIMPLE(exit_debug_mode, TRACE_EXIT_DEBUG_MODE)
+TRACE_SIMPLE(enter_swd_mode, TRACE_ENTER_SWD_MODE)
+TRACE_SIMPLE(exit_dfu_mode, TRACE_EXIT_DFU_MODE)
+TRACE_SIMPLE(reset, TRACE_RESET)
+TRACE_SIMPLE(run, TRACE_RUN)
+TRACE_SIMPLE(step, TRACE_STEP)
+TRACE_SIMPLE(force_debug, TRACE_FORCE_DEBUG)
+
+static int _trace_enter_jtag_mode(stlink_t *sl) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->enter_jtag_mode ? tr->inner->enter_jtag_mode(sl) : -1;
+
+    trace_leave(sl, tr, TRACE_ENTER_JTAG_MODE, 0, 0, ret, NULL, 0, NULL, 0);
+    return ret;
+}
+
+static int _trace_core_id(stlink_t *sl) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->core_id(sl);
+    uint8_t out[4];
+
+    trace_put32(out, sl->core_id);
+    trace_leave(sl, tr, TRACE_CORE_ID, 0, 0, ret, NULL, 0, out, sizeof(out));
+    return ret;
+}
+
+static int _trace_jtag_reset(stlink_t *sl, int value) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->jtag_reset(sl, value);
+
+    trace_leave(sl, tr, TRACE_JTAG_RESET, (uint32_t) value, 0, ret, NULL, 0, NULL, 0);
+    return ret;
+}
+
+/* calls that answer in q_buf */
+#define TRACE_QBUF(fn, op) \
+    static int _trace_##fn(stlink_t *sl) { \
+        struct stlink_trace *tr = trace_enter(sl); \
+        int ret = tr->inner->fn(sl); \
+        trace_leave(sl, tr, op, 0, 0, ret, NULL, 0, sl->q_buf, trace_q_len(sl)); \
+        return ret; \
+    }
+
+TRACE_QBUF(status, TRACE_STATUS)
+TRACE_QBUF(version, TRACE_VERSION_OP)
+TRACE_QBUF(current_mode, TRACE_CURRENT_MODE)
+
+static int _trace_read_debug32(stlink_t *sl, uint32_t addr, uint32_t *data) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->read_debug32(sl, addr, data);
+    uint8_t out[4];
+
+    trace_put32(out, *data);
+    trace_leave(sl, tr, TRACE_READ_DEBUG32, addr, 0, ret, NULL, 0, out, sizeof(out));
+    return ret;
+}
+
+static int _trace_read_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->read_mem32(sl, addr, len);
+
+    trace_leave(sl, tr, TRACE_READ_MEM32, addr, len, ret, NULL, 0, sl->q_buf, trace_q_len(sl));
+    return ret;
+}
+
+static int _trace_write_debug32(stlink_t *sl, uint32_t addr, uint32_t data) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->write_debug32(sl, addr, data);
+
+    trace_leave(sl, tr, TRACE_WRITE_DEBUG32, addr, data, ret, NULL, 0, NULL, 0);
+    return ret;
+}
+
+static int _trace_write_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->write_mem32(sl, addr, len);
+
+    trace_leave(sl, tr, TRACE_WRITE_MEM32, addr, len, ret, sl->q_buf, len, NULL, 0);
+    return ret;
+}
+
+static int _trace_write_mem8(stlink_t *sl, uint32_t addr, uint16_t len) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->write_mem8(sl, addr, len);
+
+    trace_leave(sl, tr, TRACE_WRITE_MEM8, addr, len, ret, sl->q_buf, len, NULL, 0);
+    return ret;
+}
+
+/* register reads leave the registers first, then q_buf */
+static void trace_leave_regs(stlink_t *sl, struct stlink_trace *tr, enum trace_op op,
+        uint32_t a0, uint32_t a1, int ret, const struct stlink_reg *regp) {
+    const size_t q_len = trace_q_len(sl);
+    uint8_t *out = malloc(TRACE_REGS_SIZE + q_len);
+
+    if (out == NULL) {
+        trace_leave(sl, tr, op, a0, a1, ret, NULL, 0, NULL, 0);
+        return;
+    }
+    trace_put_regs(out, regp);
+    memcpy(out + TRACE_REGS_SIZE, sl->q_buf, q_len);
+    trace_leave(sl, tr, op, a0, a1, ret, NULL, 0, out, TRACE_REGS_SIZE + q_len);
+    free(out);
+}
+
+static int _trace_read_all_regs(stlink_t *sl, struct stlink_reg *regp) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->read_all_regs(sl, regp);
+
+    trace_leave_regs(sl, tr, TRACE_READ_ALL_REGS, 0, 0, ret, regp);
+    return ret;
+}
+
+static int _trace_read_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->read_reg(sl, r_idx, regp);
+
+    trace_leave_regs(sl, tr, TRACE_READ_REG, (uint32_t) r_idx, 0, ret, regp);
+    return ret;
+}
+
+static int _trace_read_all_unsupported_regs(stlink_t *sl, struct stlink_reg *regp) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->read_all_unsupported_regs(sl, regp);
+
+    trace_leave_regs(sl, tr, TRACE_READ_ALL_UNSUPPORTED_REGS, 0, 0, ret, regp);
+    return ret;
+}
+
+static int _trace_read_unsupported_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->read_unsupported_reg(sl, r_idx, regp);
+
+    trace_leave_regs(sl, tr, TRACE_READ_UNSUPPORTED_REG, (uint32_t) r_idx, 0, ret, regp);
+    return ret;
+}
+
+static int _trace_write_unsupported_reg(stlink_t *sl, uint32_t value, int r_idx, struct stlink_reg *regp) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->write_unsupported_reg(sl, value, r_idx, regp);
+
+    trace_leave_regs(sl, tr, TRACE_WRITE_UNSUPPORTED_REG, value, (uint32_t) r_idx, ret, regp);
+    return ret;
+}
+
+static int _trace_write_reg(stlink_t *sl, uint32_t reg, int idx) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->write_reg(sl, reg, idx);
+
+    trace_leave(sl, tr, TRACE_WRITE_REG, reg, (uint32_t) idx, ret, NULL, 0, NULL, 0);
+    return ret;
+}
+
+static int32_t _trace_target_voltage(stlink_t *sl) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int32_t ret = tr->inner->target_voltage(sl);
+
+    trace_leave(sl, tr, TRACE_TARGET_VOLTAGE, 0, 0, ret, NULL, 0, NULL, 0);
+    return ret;
+}
+
+static int _trace_set_swdclk(stlink_t *sl, uint16_t divisor) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = tr->inner->set_swdclk(sl, divisor);
+
+    trace_leave(sl, tr, TRACE_SET_SWDCLK, divisor, 0, ret, NULL, 0, NULL, 0);
+    return ret;
+}
+
+// The optional calls fall back to single commands, like common.c does,
+// if the backend does without them. They go to the inner backend, not
+// through stlink_read_mem32_bulk() and the memory cache a second time.
+static int _trace_read_mem32_bulk(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = 0;
+
+    if (tr->inner->read_mem32_bulk) {
+        ret = tr->inner->read_mem32_bulk(sl, addr, buf, len);
+    } else {
+        for (size_t off = 0; off < len && ret == 0; off += 0x1800) {
+            size_t chunk = (len - off > 0x1800) ? 0x1800 : len - off;
+            ret = tr->inner->read_mem32(sl, addr + (uint32_t) off, (uint16_t) chunk);
+            if (ret == 0)
+                memcpy(buf + off, sl->q_buf, chunk);
+        }
+    }
+
+    trace_leave(sl, tr, TRACE_READ_MEM32_BULK, addr, (uint32_t) len, ret, NULL, 0, buf, len);
+    return ret;
+}
+
+static int _trace_write_mem32_bulk(stlink_t *sl, uint32_t addr, const uint8_t *buf, size_t len) {
+    struct stlink_trace *tr = trace_enter(sl);
+    int ret = 0;
+
+    if (tr->inner->write_mem32_bulk) {
+        ret = tr->inner->write_mem32_bulk(sl, addr, buf, len);
+    } else {
+        for (size_t off = 0; off < len && ret == 0; off += 0x1800) {
+            size_t chunk = (len - off > 0x1800) ? 0x1800 : len - off;
+            memcpy(sl->q_buf, buf + off, chunk);
+            ret = tr->inner->write_mem32(sl, addr + (uint32_t) off, (uint16_t) chunk);
+        }
+    }
+
+    trace_leave(sl, tr, TRACE_WRITE_MEM32_BULK, addr, (uint32_t) len, ret, buf, len, NULL, 0);
+    return ret;
+}
+
+static int _trace_batch(stlink_t *sl, struct stlink_batch_op *ops, size_t count) {
+    struct stlink_trace *tr;
+    uint8_t *io = malloc(20 * count + 1);
+    int ret;
+
+    for (size_t i = 0; io != NULL && i < count; i++) {
+        trace_put32(io + 12 * i, (uint32_t) ops[i].type);
+        trace_put32(io + 12 * i + 4, ops[i].addr);
+        trace_put32(io + 12 * i + 8, ops[i].value);
+    }
+
+    tr = trace_enter(sl);
+    ret = tr->inner->batch ? tr->inner->batch(sl, ops, count) : stlink_batch_run_each(sl, ops, count);
+
+    if (io == NULL) {
+        trace_leave(sl, tr, TRACE_BATCH, (uint32_t) count, 0, ret, NULL, 0, NULL, 0);
+        return ret;
+    }
+    for (size_t i = 0; i < count; i++) {
+        trace_put32(io + 12 * count + 8 * i, ops[i].value);
+        trace_put32(io + 12 * count + 8 * i + 4, (uint32_t) ops[i].error);
+    }
+    trace_leave(sl, tr, TRACE_BATCH, (uint32_t) count, 0, ret, io, 12 * count, io + 12 * count, 8 * count);
+    free(io);
+    return ret;
+}
+
+// Waiting goes by the recorded backend's clock, but is not part of the
+// trace: a replay answers the same polls however long it waits.
+static uint64_t _trace_time_us(stlink_t *sl) {
+    struct stlink_trace *tr = sl->backend_data;
+    uint64_t ret;
+
+    if (tr->inner->time_us == NULL)
+        return stlink_time_us();
+    sl->backend_data = tr->inner_data;
+    ret = tr->inner->time_us(sl);
+    sl->backend_data = tr;
+    return ret;
+}
+
+static void _trace_sleep_us(stlink_t *sl, uint64_t us) {
+    struct stlink_trace *tr = sl->backend_data;
+
+    if (tr->inner->sleep_us == NULL) {
+        stlink_sleep_us(us);
+        return;
+    }
+    sl->backend_data = tr->inner_data;
+    tr->inner->sleep_us(sl, us);
+    sl->backend_data = tr;
+}
+
+static const stlink_backend_t _stlink_trace_record_backend = {
+    _trace_close,
+    _trace_exit_debug_mode,
+    _trace_enter_swd_mode,
+    _trace_enter_jtag_mode,
+    _trace_exit_dfu_mode,
+    _trace_core_id,
+    _trace_reset,
+    _trace_jtag_reset,
+    _trace_run,
+    _trace_status,
+    _trace_version,
+    _trace_read_debug32,
+    _trace_read_mem32,
+    _trace_write_debug32,
+    _trace_write_mem32,
+    _trace_write_mem8,
+    _trace_read_all_regs,
+    _trace_read_reg,
+    _trace_read_all_unsupported_regs,
+    _trace_read_unsupported_reg,
+    _trace_write_unsupported_reg,
+    _trace_write_reg,
+    _trace_step,
+    _trace_current_mode,
+    _trace_force_debug,
+    _trace_target_voltage,
+    _trace_set_swdclk,
+    _trace_read_mem32_bulk,
+    _trace_batch,
+    _trace_write_mem32_bulk,
+    _trace_time_us,
+    _trace_sleep_us
+};
+
+int stlink_trace_record(stlink_t *sl, const char *path) {
+    struct stlink_trace *tr = calloc(1, sizeof(*tr));
+
+    if (tr == NULL)
+        return -1;
+
+    tr->f = fopen(path, "wb");
+    if (tr->f == NULL) {
+        ELOG("can not create trace %s\n", path);
+        free(tr);
+        return -1;
+    }
+
+    if (trace_write_header(sl, tr->f)) {
+        ELOG("writing the trace failed\n");
+        fclose(tr->f);
+        free(tr);
+        return -1;
+    }
+
+    tr->inner = sl->backend;
+    tr->inner_data = sl->backend_data;
+    tr->last = stlink_time_us();
+    sl->backend = (stlink_backend_t *) &_stlink_trace_record_backend;
+    sl->backend_data = tr;
+
+    ILOG("Recording backend calls to %s\n", path);
+    return 0;
+}
+
+/* replay */
+
+/* Fetch the next entry and make sure it is the call the caller makes.
+   Takes as long as the recorded call did in realtime mode. */
+static struct trace_entry *replay_next(stlink_t *sl, enum trace_op op, uint32_t a0, uint32_t a1, size_t out_len) {
+    struct stlink_trace *tr = sl->backend_data;
+    struct trace_entry *e = &tr->e;
+    uint8_t h[TRACE_ENTRY_SIZE];
+    size_t len;
+
+    if (tr->f == NULL || fread(h, sizeof(h), 1, tr->f) != 1) {
+        ELOG("replay: trace ends before %s\n", trace_ops[op].name);
+        return NULL;
+    }
+
+    e->op = h[0];
+    e->gap_us = trace_get32(h + 1);
+    e->dur_us = trace_get32(h + 5);
+    e->a0 = trace_get32(h + 9);
+    e->a1 = trace_get32(h + 13);
+    e->ret = (int32_t) trace_get32(h + 17);
+    e->q_len = (int32_t) trace_get32(h + 21);
+    e->in_len = trace_get32(h + 25);
+    e->out_len = trace_get32(h + 29);
+
+    len = (size_t) e->in_len + e->out_len;
+    if (len > tr->alloc) {
+        uint8_t *buf = realloc(tr->buf, len);
+        if (buf == NULL) {
+            ELOG("replay: out of memory\n");
+            return NULL;
+        }
+        tr->buf = buf;
+        tr->alloc = len;
+    }
+    if (len && fread(tr->buf, len, 1, tr->f) != 1) {
+        ELOG("replay: trace truncated\n");
+        return NULL;
+    }
+    e->in = tr->buf;
+    e->out = tr->buf + e->in_len;
+
+    if (e->op != op || e->a0 != a0 || e->a1 != a1 || e->out_len < out_len) {
+        ELOG("replay: %s(%#x, %#x) called, but the trace has %s(%#x, %#x)\n",
+                trace_ops[op].name, a0, a1,
+                (e->op < TRACE_OP_COUNT) ? trace_ops[e->op].name : "?", e->a0, e->a1);
+        fclose(tr->f);
+        tr->f = NULL;
+        return NULL;
+    }
+
+    if (tr->realtime && e->dur_us)
+        stlink_sleep_us(e->dur_us);
+
+    sl->q_len = e->q_len;
+    stlink_stats_record(&sl->stats, trace_ops[op].opcode, len, stlink_time_us() - e->dur_us);
+    return e;
+}
+
+static void replay_q_buf(stlink_t *sl, const uint8_t *p, size_t len) {
+    memcpy(sl->q_buf, p, (len > Q_BUF_LEN) ? Q_BUF_LEN : len);
+}
+
+static void _replay_close(stlink_t *sl) {
+    struct stlink_trace *tr = sl->backend_data;
+
+    if (tr == NULL)
+        return;
+
+    // the close itself is in the trace too
+    if (tr->f != NULL) {
+        replay_next(sl, TRACE_CLOSE, 0, 0, 0);
+        if (tr->f != NULL)
+            fclose(tr->f);
+    }
+    free(tr->buf);
+    free(tr);
+    sl->backend_data = NULL;
+}
+
+#define REPLAY_SIMPLE(fn, op) \
+    static int _replay_##fn(stlink_t *sl) { \
+        struct trace_entry *e = replay_next(sl, op, 0, 0, 0); \
+        return e ? e->ret : -1; \
+    }
+
+REPLAY_SIMPLE(exit_debug_mode, TRACE_EXIT_DEBUG_MODE)
+REPLAY_SIMPLE(enter_swd_mode, TRACE_ENTER_SWD_MODE)
+REPLAY_SIMPLE(enter_jtag_mode, TRACE_ENTER_JTAG_MODE)
+REPLAY_SIMPLE(exit_dfu_mode, TRACE_EXIT_DFU_MODE)
+REPLAY_SIMPLE(reset, TRACE_RESET)
+REPLAY_SIMPLE(run, TRACE_RUN)
+REPLAY_SIMPLE(step, TRACE_STEP)
+REPLAY_SIMPLE(force_debug, TRACE_FORCE_DEBUG)
+
+static int _replay_core_id(stlink_t *sl) {
+    struct trace_entry *e = replay_next(sl, TRACE_CORE_ID, 0, 0, 4);
+
+    if (e == NULL)
+        return -1;
+    sl->core_id = trace_get32(e->out);
+    return e->ret;
+}
+
+static int _replay_jtag_reset(stlink_t *sl, int value) {
+    struct trace_entry *e = replay_next(sl, TRACE_JTAG_RESET, (uint32_t) value, 0, 0);
+    return e ? e->ret : -1;
+}
+
+#define REPLAY_QBUF(fn, op) \
+    static int _replay_##fn(stlink_t *sl) { \
+        struct trace_entry *e = replay_next(sl, op, 0, 0, 0); \
+        if (e == NULL) \
+            return -1; \
+        replay_q_buf(sl, e->out, e->out_len); \
+        return e->ret; \
+    }
+
+REPLAY_QBUF(status, TRACE_STATUS)
+REPLAY_QBUF(version, TRACE_VERSION_OP)
+
+static int _replay_current_mode(stlink_t *sl) {
+    struct trace_entry *e = replay_next(sl, TRACE_CURRENT_MODE, 0, 0, 0);
+
+    if (e == NULL)
+        return STLINK_DEV_UNKNOWN_MODE;
+    replay_q_buf(sl, e->out, e->out_len);
+    return e->ret;
+}
+
+static int _replay_read_debug32(stlink_t *sl, uint32_t addr, uint32_t *data) {
+    struct trace_entry *e = replay_next(sl, TRACE_READ_DEBUG32, addr, 0, 4);
+
+    if (e == NULL)
+        return -1;
+    *data = trace_get32(e->out);
+    return e->ret;
+}
+
+static int _replay_read_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    struct trace_entry *e = replay_next(sl, TRACE_READ_MEM32, addr, len, 0);
+
+    if (e == NULL)
+        return -1;
+    replay_q_buf(sl, e->out, e->out_len);
+    return e->ret;
+}
+
+static int _replay_write_debug32(stlink_t *sl, uint32_t addr, uint32_t data) {
+    struct trace_entry *e = replay_next(sl, TRACE_WRITE_DEBUG32, addr, data, 0);
+    return e ? e->ret : -1;
+}
+
+static int _replay_write_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
+    struct trace_entry *e = replay_next(sl, TRACE_WRITE_MEM32, addr, len, 0);
+    return e ? e->ret : -1;
+}
+
+static int _replay_write_mem8(stlink_t *sl, uint32_t addr, uint16_t len) {
+    struct trace_entry *e = replay_next(sl, TRACE_WRITE_MEM8, addr, len, 0);
+    return e ? e->ret : -1;
+}
+
+static int replay_regs(stlink_t *sl, enum trace_op op, uint32_t a0, uint32_t a1, struct stlink_reg *regp) {
+    struct trace_entry *e = replay_next(sl, op, a0, a1, TRACE_REGS_SIZE);
+
+    if (e == NULL)
+        return -1;
+    trace_get_regs(e->out, regp);
+    replay_q_buf(sl, e->out + TRACE_REGS_SIZE, e->out_len - TRACE_REGS_SIZE);
+    return e->ret;
+}
+
+static int _replay_read_all_regs(stlink_t *sl, struct stlink_reg *regp) {
+    return replay_regs(sl, TRACE_READ_ALL_REGS, 0, 0, regp);
+}
+
+static int _replay_read_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
+    return replay_regs(sl, TRACE_READ_REG, (uint32_t) r_idx, 0, regp);
+}
+
+static int _replay_read_all_unsupported_regs(stlink_t *sl, struct stlink_reg *regp) {
+    return replay_regs(sl, TRACE_READ_ALL_UNSUPPORTED_REGS, 0, 0, regp);
+}
+
+static int _replay_read_unsupported_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
+    return replay_regs(sl, TRACE_READ_UNSUPPORTED_REG, (uint32_t) r_idx, 0, regp);
+}
+
+static int _replay_write_unsupported_reg(stlink_t *sl, uint32_t value, int r_idx, struct stlink_reg *regp) {
+    return replay_regs(sl, TRACE_WRITE_UNSUPPORTED_REG, value, (uint32_t) r_idx, regp);
+}
+
+static int _replay_write_reg(stlink_t *sl, uint32_t reg, int idx) {
+    struct trace_entry *e = replay_next(sl, TRACE_WRITE_REG, reg, (uint32_t) idx, 0);
+    return e ? e->ret : -1;
+}
+
+static int32_t _replay_target_voltage(stlink_t *sl) {
+    struct trace_entry *e = replay_next(sl, TRACE_TARGET_VOLTAGE, 0, 0, 0);
+    return e ? e->ret : -1;
+}
+
+static int _replay_set_swdclk(stlink_t *sl, uint16_t divisor) {
+    struct trace_entry *e = replay_next(sl, TRACE_SET_SWDCLK, divisor, 0, 0);
+    return e ? e->ret : -1;
+}
+
+static int _replay_read_mem32_bulk(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len) {
+    struct trace_entry *e = replay_next(sl, TRACE_READ_MEM32_BULK, addr, (uint32_t) len, len);
+
+    if (e == NULL)
+        return -1;
+    memcpy(buf, e->out, len);
+    return e->ret;
+}
+
+static int _replay_write_mem32_bulk(stlink_t *sl, uint32_t addr, const uint8_t *buf, size_t len) {
+    struct trace_entry *e = replay_next(sl, TRACE_WRITE_MEM32_BULK, addr, (uint32_t) len, 0);
+
+    (void) buf;
+    return e ? e->ret : -1;
+}
+
+static int _replay_batch(stlink_t *sl, struct stlink_batch_op *ops, size_t count) {
+    struct trace_entry *e = replay_next(sl, TRACE_BATCH, (uint32_t) count, 0, 8 * count);
+
+    if (e == NULL)
+        return -1;
+    for (size_t i = 0; i < count; i++) {
+        ops[i].value = trace_get32(e->out + 8 * i);
+        ops[i].error = (int) trace_get32(e->out + 8 * i + 4);
+    }
+    return e->ret;
+}
+
+static const stlink_backend_t _stlink_trace_replay_backend = {
+    _replay_close,
+    _replay_exit_debug_mode,
+    _replay_enter_swd_mode,
+    _replay_enter_jtag_mode,
+    _replay_exit_dfu_mode,
+    _replay_core_id,
+    _replay_reset,
+    _replay_jtag_reset,
+    _replay_run,
+    _replay_status,
+    _replay_version,
+    _replay_read_debug32,
+    _replay_read_mem32,
+    _replay_write_debug32,
+    _replay_write_mem32,
+    _replay_write_mem8,
+    _replay_read_all_regs,
+    _replay_read_reg,
+    _replay_read_all_unsupported_regs,
+    _replay_read_unsupported_reg,
+    _replay_write_unsupported_reg,
+    _replay_write_reg,
+    _replay_step,
+    _replay_current_mode,
+    _replay_force_debug,
+    _replay_target_voltage,
+    _replay_set_swdclk,
+    _replay_read_mem32_bulk,
+    _replay_batch,
+    _replay_write_mem32_bulk,
+    NULL, /* time_us */
+    NULL  /* sleep_us */
+};
+
+stlink_t *stlink_open_replay(enum ugly_loglevel verbose, const char *path, bool realtime) {
+    stlink_t *sl;
+    struct stlink_trace *tr;
+
+    ugly_init(verbose);
+
+    sl = calloc(1, sizeof(stlink_t));
+    tr = calloc(1, sizeof(*tr));
+    if (sl == NULL || tr == NULL)
+        goto on_error;
+
+    tr->f = fopen(path, "rb");
+    if (tr->f == NULL) {
+        ELOG("can not open trace %s\n", path);
+        goto on_error;
+    }
+    if (trace_read_header(sl, tr->f))
+        goto on_error;
+
+    tr->realtime = realtime;
+    sl->backend = (stlink_backend_t *) &_stlink_trace_replay_backend;
+    sl->backend_data = tr;
+    sl->verbose = verbose;
+
+    ILOG("Replaying %s\n", path);
+    return sl;
+
+on_error:
+    if (tr != NULL && tr->f != NULL)
+        fclose(tr->f);
+    free(tr);
+    free(sl);
+    return NULL;
+}
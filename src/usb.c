@@ -45,6 +45,18 @@ ssize_t send_recv(struct stlink_libusb* handle, int terminate,
     int res = 0;
     int t;
 
+    if (!handle->stats_pending) {
+        /* txbuf is a command, skip the SG wrapper of V1 to find the opcode */
+        handle->stats_start = stlink_time_us();
+        handle->stats_opcode = stlink_stats_opcode(txbuf + (handle->protocoll == 1 ? 15 : 0));
+        handle->stats_bytes = 0;
+    } else {
+        /* txbuf is the data phase of the pending command */
+        handle->stats_bytes += txsize;
+    }
+    handle->stats_bytes += rxsize;
+    handle->stats_pending = !terminate;
+
     t = libusb_bulk_transfer(handle->usb_handle, handle->ep_req,
             txbuf,
             (int) txsize,
@@ -52,6 +64,7 @@ ssize_t send_recv(struct stlink_libusb* handle, int terminate,
             3000);
     if (t) {
         printf("[!] send_recv send request failed: %s\n", libusb_error_name(t));
+        handle->stats_pending = 0;
         return -1;
     } else if ((size_t)res != txsize) {
         printf("[!] send_recv send request wrote %u bytes (instead of %u).\n",
@@ -67,6 +80,7 @@ ssize_t send_recv(struct stlink_libusb* handle, int terminate,
         if (t) {
             printf("[!] send_recv read reply failed: %s\n",
                     libusb_error_name(t));
+            handle->stats_pending = 0;
             return -1;
         }
     }
@@ -82,12 +96,17 @@ ssize_t send_recv(struct stlink_libusb* handle, int terminate,
         if (t) {
             printf("[!] send_recv read storage failed: %s\n",
                     libusb_error_name(t));
+            handle->stats_pending = 0;
             return -1;
         }
         /* The STLink doesn't seem to evaluate the sequence number */
         handle->sg_transfer_idx++;
     }
 
+    if (terminate)
+        stlink_stats_record(handle->stats, handle->stats_opcode, handle->stats_bytes,
+                handle->stats_start);
+
     return res;
 }
 
@@ -530,6 +549,335 @@ int _stlink_usb_read_mem32(stlink_t *sl, uint32_t addr, uint16_t len) {
     return 0;
 }
 
+/* One request of a pipelined sequence: the command transfer, an optional
+   data stage and an optional reply, both in buf. The transfers only ever
+   point into the slot, never into the caller's buffers, so the slots can
+   be left to libusb along with transfers it doesn't give back. */
+struct stlink_usb_slot {
+    struct libusb_transfer *out;
+    struct libusb_transfer *data;
+    struct libusb_transfer *in;
+    unsigned char cmd[STLINK_CMD_SIZE];
+    unsigned char buf[STLINK_USB_MEM_CHUNK];
+    size_t tx_len;
+    size_t rx_len;
+    size_t idx;
+    uint64_t start;
+    int active;
+    int pending;
+    int failed;
+};
+
+/* Fill in cmd, tx_len (with the data in buf) and rx_len of slot for request idx */
+typedef void (*stlink_usb_prepare_fn)(void *arg, size_t idx, struct stlink_usb_slot *slot);
+/* Called once per request, in request order, when it went through (optional) */
+typedef void (*stlink_usb_complete_fn)(void *arg, size_t idx, struct stlink_usb_slot *slot);
+
+static void LIBUSB_CALL _stlink_usb_slot_cb(struct libusb_transfer *transfer) {
+    struct stlink_usb_slot *slot = transfer->user_data;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+            transfer->actual_length != transfer->length) {
+        slot->failed = 1;
+    }
+    slot->pending--;
+}
+
+static int _stlink_usb_slot_submit(struct stlink_libusb *slu, struct stlink_usb_slot *slot) {
+    slot->failed = 0;
+    slot->pending = 0;
+    slot->active = 1;
+    slot->start = stlink_time_us();
+
+    libusb_fill_bulk_transfer(slot->out, slu->usb_handle, (unsigned char) slu->ep_req,
+            slot->cmd, (int) slu->cmd_len, _stlink_usb_slot_cb, slot, 3000);
+    if (libusb_submit_transfer(slot->out)) {
+        slot->active = 0;
+        return -1;
+    }
+    slot->pending++;
+
+    /* once the command is on its way, failures are left to the caller to drain */
+    if (slot->tx_len) {
+        libusb_fill_bulk_transfer(slot->data, slu->usb_handle, (unsigned char) slu->ep_req,
+                slot->buf, (int) slot->tx_len, _stlink_usb_slot_cb, slot, 3000);
+        if (libusb_submit_transfer(slot->data)) {
+            slot->failed = 1;
+            return -1;
+        }
+        slot->pending++;
+    }
+
+    if (slot->rx_len) {
+        libusb_fill_bulk_transfer(slot->in, slu->usb_handle, (unsigned char) slu->ep_rep,
+                slot->buf, (int) slot->rx_len, _stlink_usb_slot_cb, slot, 3000);
+        if (libusb_submit_transfer(slot->in)) {
+            slot->failed = 1;
+            return -1;
+        }
+        slot->pending++;
+    }
+
+    return 0;
+}
+
+/* failed event handling rounds before in flight transfers are given up on */
+#define STLINK_USB_DRAIN_TRIES 100
+
+/*
+ * Issue count requests keeping up to STLINK_USB_PIPELINE_DEPTH of them
+ * queued, so the probe never waits for the host between two of them.
+ * The probe serves the requests in order and every reply has its own
+ * buffer, so the order in which the completions are reaped doesn't
+ * matter. Stops submitting at the first failure; returns the number of
+ * requests that completed successfully.
+ */
+static size_t _stlink_usb_pipeline(stlink_t *sl, size_t count,
+        stlink_usb_prepare_fn prepare, stlink_usb_complete_fn complete, void *arg) {
+    struct stlink_libusb * const slu = sl->backend_data;
+    struct stlink_usb_slot *slots;
+    size_t next = 0;
+    size_t done = 0;
+    int error = 0;
+    int i;
+
+    slots = calloc(STLINK_USB_PIPELINE_DEPTH, sizeof(*slots));
+    if (slots == NULL)
+        return 0;
+    for (i = 0; i < STLINK_USB_PIPELINE_DEPTH; i++) {
+        slots[i].out = libusb_alloc_transfer(0);
+        slots[i].data = libusb_alloc_transfer(0);
+        slots[i].in = libusb_alloc_transfer(0);
+        if (slots[i].out == NULL || slots[i].data == NULL || slots[i].in == NULL)
+            goto out;
+    }
+
+    while (done < count && !error) {
+        for (i = 0; i < STLINK_USB_PIPELINE_DEPTH && next < count; i++) {
+            struct stlink_usb_slot *slot = &slots[i];
+
+            if (slot->active)
+                continue;
+
+            memset(slot->cmd, 0, sizeof(slot->cmd));
+            slot->tx_len = 0;
+            slot->rx_len = 0;
+            slot->idx = next;
+            prepare(arg, next, slot);
+            if (_stlink_usb_slot_submit(slu, slot)) {
+                printf("[!] libusb_submit_transfer failed\n");
+                error = 1;
+                break;
+            }
+            next++;
+        }
+
+        if (!error && libusb_handle_events_completed(slu->libusb_ctx, NULL))
+            error = 1;
+
+        /* hand the replies back in request order */
+        for (;;) {
+            struct stlink_usb_slot *slot = NULL;
+
+            for (i = 0; i < STLINK_USB_PIPELINE_DEPTH; i++) {
+                if (slots[i].active && slots[i].idx == done)
+                    slot = &slots[i];
+            }
+            if (slot == NULL || slot->pending)
+                break;
+            slot->active = 0;
+            if (slot->failed) {
+                error = 1;
+                break;
+            }
+            stlink_stats_record(slu->stats, stlink_stats_opcode(slot->cmd),
+                    slot->tx_len + slot->rx_len, slot->start);
+            if (complete)
+                complete(arg, done, slot);
+            done++;
+        }
+    }
+
+    if (error) {
+        /* nothing may complete into freed slots once we return */
+        for (i = 0; i < STLINK_USB_PIPELINE_DEPTH; i++) {
+            if (slots[i].pending) {
+                libusb_cancel_transfer(slots[i].out);
+                libusb_cancel_transfer(slots[i].data);
+                libusb_cancel_transfer(slots[i].in);
+            }
+        }
+        for (int tries = 0;;) {
+            int busy = 0;
+            for (i = 0; i < STLINK_USB_PIPELINE_DEPTH; i++) {
+                if (slots[i].pending)
+                    busy = 1;
+            }
+            if (!busy)
+                break;
+            if (libusb_handle_events_completed(slu->libusb_ctx, NULL) == 0)
+                continue;
+            if (++tries == STLINK_USB_DRAIN_TRIES) {
+                /* libusb still owns them: leak them, and the slots they
+                   complete into, rather than free them under it */
+                ELOG("USB transfers did not complete, leaking them\n");
+                return done;
+            }
+        }
+    }
+
+out:
+    for (i = 0; i < STLINK_USB_PIPELINE_DEPTH; i++) {
+        if (slots[i].out)
+            libusb_free_transfer(slots[i].out);
+        if (slots[i].data)
+            libusb_free_transfer(slots[i].data);
+        if (slots[i].in)
+            libusb_free_transfer(slots[i].in);
+    }
+    free(slots);
+
+    return done;
+}
+
+struct stlink_usb_mem_arg {
+    uint32_t addr;
+    uint8_t *rbuf;
+    const uint8_t *wbuf;
+    size_t len;
+};
+
+static void _stlink_usb_mem_prepare(void *arg, size_t idx, struct stlink_usb_slot *slot) {
+    struct stlink_usb_mem_arg *a = arg;
+    size_t off = idx * STLINK_USB_MEM_CHUNK;
+    size_t chunk = a->len - off;
+
+    if (chunk > STLINK_USB_MEM_CHUNK)
+        chunk = STLINK_USB_MEM_CHUNK;
+
+    slot->cmd[0] = STLINK_DEBUG_COMMAND;
+    slot->cmd[1] = a->rbuf ? STLINK_DEBUG_READMEM_32BIT : STLINK_DEBUG_WRITEMEM_32BIT;
+    write_uint32(&slot->cmd[2], a->addr + (uint32_t) off);
+    write_uint16(&slot->cmd[6], (uint16_t) chunk);
+    if (a->rbuf) {
+        slot->rx_len = chunk;
+    } else {
+        memcpy(slot->buf, a->wbuf + off, chunk);
+        slot->tx_len = chunk;
+    }
+}
+
+static void _stlink_usb_mem_complete(void *arg, size_t idx, struct stlink_usb_slot *slot) {
+    struct stlink_usb_mem_arg *a = arg;
+
+    memcpy(a->rbuf + idx * STLINK_USB_MEM_CHUNK, slot->buf, slot->rx_len);
+}
+
+/* Read len bytes (a multiple of 4) starting at addr into buf */
+int _stlink_usb_read_mem32_bulk(stlink_t *sl, uint32_t addr, uint8_t *buf, size_t len) {
+    struct stlink_libusb * const slu = sl->backend_data;
+    struct stlink_usb_mem_arg arg = { addr, buf, NULL, len };
+    size_t chunks = (len + STLINK_USB_MEM_CHUNK - 1) / STLINK_USB_MEM_CHUNK;
+
+    if (slu->protocoll == 1) {
+        /* V1 wraps every request in a SCSI status phase, stay synchronous */
+        for (size_t off = 0; off < len; off += STLINK_USB_MEM_CHUNK) {
+            size_t chunk = len - off;
+            if (chunk > STLINK_USB_MEM_CHUNK)
+                chunk = STLINK_USB_MEM_CHUNK;
+            if (_stlink_usb_read_mem32(sl, addr + (uint32_t) off, (uint16_t) chunk))
+                return -1;
+            memcpy(buf + off, sl->q_buf, chunk);
+        }
+        return 0;
+    }
+
+    if (_stlink_usb_pipeline(sl, chunks, _stlink_usb_mem_prepare, _stlink_usb_mem_complete, &arg) != chunks) {
+        printf("[!] pipelined STLINK_DEBUG_READMEM_32BIT failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Write len bytes (a multiple of 4) from buf to addr, without staging them in q_buf */
+int _stlink_usb_write_mem32_bulk(stlink_t *sl, uint32_t addr, const uint8_t *buf, size_t len) {
+    struct stlink_libusb * const slu = sl->backend_data;
+    struct stlink_usb_mem_arg arg = { addr, NULL, buf, len };
+    size_t chunks = (len + STLINK_USB_MEM_CHUNK - 1) / STLINK_USB_MEM_CHUNK;
+
+    if (slu->protocoll == 1) {
+        for (size_t off = 0; off < len; off += STLINK_USB_MEM_CHUNK) {
+            size_t chunk = len - off;
+            if (chunk > STLINK_USB_MEM_CHUNK)
+                chunk = STLINK_USB_MEM_CHUNK;
+            memcpy(sl->q_buf, buf + off, chunk);
+            if (_stlink_usb_write_mem32(sl, addr + (uint32_t) off, (uint16_t) chunk))
+                return -1;
+        }
+        return 0;
+    }
+
+    if (_stlink_usb_pipeline(sl, chunks, _stlink_usb_mem_prepare, NULL, &arg) != chunks) {
+        printf("[!] pipelined STLINK_DEBUG_WRITEMEM_32BIT failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void _stlink_usb_batch_prepare(void *arg, size_t idx, struct stlink_usb_slot *slot) {
+    struct stlink_batch_op *op = (struct stlink_batch_op *) arg + idx;
+    unsigned char * const cmd = slot->cmd;
+
+    cmd[0] = STLINK_DEBUG_COMMAND;
+    switch (op->type) {
+    case STLINK_BATCH_READ32:
+        cmd[1] = STLINK_JTAG_READDEBUG_32BIT;
+        write_uint32(&cmd[2], op->addr);
+        slot->rx_len = 8;
+        break;
+    case STLINK_BATCH_WRITE32:
+        cmd[1] = STLINK_JTAG_WRITEDEBUG_32BIT;
+        write_uint32(&cmd[2], op->addr);
+        write_uint32(&cmd[6], op->value);
+        slot->rx_len = 2;
+        break;
+    case STLINK_BATCH_WRITE_REG:
+        cmd[1] = STLINK_DEBUG_WRITEREG;
+        cmd[2] = (uint8_t) op->addr;
+        write_uint32(&cmd[3], op->value);
+        slot->rx_len = 2;
+        break;
+    }
+}
+
+static void _stlink_usb_batch_complete(void *arg, size_t idx, struct stlink_usb_slot *slot) {
+    struct stlink_batch_op *op = (struct stlink_batch_op *) arg + idx;
+
+    if (op->type == STLINK_BATCH_READ32)
+        op->value = read_uint32(slot->buf, 4);
+    op->error = 0;
+}
+
+/* Run all queued operations back to back, see _stlink_usb_pipeline */
+int _stlink_usb_batch(stlink_t *sl, struct stlink_batch_op *ops, size_t count) {
+    struct stlink_libusb * const slu = sl->backend_data;
+
+    if (slu->protocoll == 1) {
+        /* V1 can't pipeline, run them one by one */
+        return stlink_batch_run_each(sl, ops, count);
+    }
+
+    if (_stlink_usb_pipeline(sl, count, _stlink_usb_batch_prepare,
+                _stlink_usb_batch_complete, ops) != count) {
+        printf("[!] pipelined batch failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
 int _stlink_usb_read_all_regs(stlink_t *sl, struct stlink_reg *regp) {
     struct stlink_libusb * const slu = sl->backend_data;
     unsigned char* const cmd = sl->c_buf;
@@ -612,6 +960,25 @@ int _stlink_usb_read_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
 }
 
 /* See section C1.6 of the ARMv7-M Architecture Reference Manual */
+static void _stlink_usb_store_unsupported_reg(struct stlink_reg *regp, int r_idx, uint32_t r) {
+    DLOG("r_idx (%2d) = 0x%08x\n", r_idx, r);
+
+    switch (r_idx) {
+    case 0x14:
+        regp->primask = (uint8_t) (r & 0xFF);
+        regp->basepri = (uint8_t) ((r>>8) & 0xFF);
+        regp->faultmask = (uint8_t) ((r>>16) & 0xFF);
+        regp->control = (uint8_t) ((r>>24) & 0xFF);
+        break;
+    case 0x21:
+        regp->fpscr = r;
+        break;
+    default:
+        regp->s[r_idx - 0x40] = r;
+        break;
+    }
+}
+
 int _stlink_usb_read_unsupported_reg(stlink_t *sl, int r_idx, struct stlink_reg *regp) {
     uint32_t r;
     int ret;
@@ -630,44 +997,36 @@ int _stlink_usb_read_unsupported_reg(stlink_t *sl, int r_idx, struct stlink_reg
         return ret;
 
     r = read_uint32(sl->q_buf, 0);
-    DLOG("r_idx (%2d) = 0x%08x\n", r_idx, r);
-
-    switch (r_idx) {
-    case 0x14:
-        regp->primask = (uint8_t) (r & 0xFF);
-        regp->basepri = (uint8_t) ((r>>8) & 0xFF);
-        regp->faultmask = (uint8_t) ((r>>16) & 0xFF);
-        regp->control = (uint8_t) ((r>>24) & 0xFF);
-        break;
-    case 0x21:
-        regp->fpscr = r;
-        break;
-    default:
-        regp->s[r_idx - 0x40] = r;
-        break;
-    }
+    _stlink_usb_store_unsupported_reg(regp, r_idx, r);
 
     return 0;
 }
 
+/* All the DCRSR selects and DCRDR reads go out as one pipelined batch */
 int _stlink_usb_read_all_unsupported_regs(stlink_t *sl, struct stlink_reg *regp) {
+    int sel[34], val[34];
+    stlink_batch_t b;
     int ret;
 
-    ret = _stlink_usb_read_unsupported_reg(sl, 0x14, regp);
-    if (ret == -1)
-        return ret;
+    sel[0] = 0x14;
+    sel[1] = 0x21;
+    for (int i = 0; i < 32; i++)
+        sel[2 + i] = 0x40 + i;
 
-    ret = _stlink_usb_read_unsupported_reg(sl, 0x21, regp);
-    if (ret == -1)
-        return ret;
+    stlink_batch_init(&b);
+    for (int i = 0; i < 34; i++) {
+        stlink_batch_write32(&b, STLINK_REG_DCRSR, (uint32_t) sel[i]);
+        val[i] = stlink_batch_read32(&b, STLINK_REG_DCRDR);
+    }
 
-    for (int i = 0; i < 32; i++) {
-        ret = _stlink_usb_read_unsupported_reg(sl, 0x40+i, regp);
-        if (ret == -1)
-            return ret;
+    ret = stlink_batch_submit(sl, &b);
+    if (ret == 0) {
+        for (int i = 0; i < 34; i++)
+            _stlink_usb_store_unsupported_reg(regp, sel[i], b.ops[val[i]].value);
     }
+    stlink_batch_free(&b);
 
-    return 0;
+    return ret;
 }
 
 /* See section C1.6 of the ARMv7-M Architecture Reference Manual */
@@ -764,7 +1123,12 @@ static stlink_backend_t _stlink_usb_backend = {
     _stlink_usb_current_mode,
     _stlink_usb_force_debug,
     _stlink_usb_target_voltage,
-    _stlink_usb_set_swdclk
+    _stlink_usb_set_swdclk,
+    _stlink_usb_read_mem32_bulk,
+    _stlink_usb_batch,
+    _stlink_usb_write_mem32_bulk,
+    NULL, /* time_us */
+    NULL  /* sleep_us */
 };
 
 stlink_t *stlink_open_usb(enum ugly_loglevel verbose, bool reset, char serial[16])
@@ -784,6 +1148,7 @@ stlink_t *stlink_open_usb(enum ugly_loglevel verbose, bool reset, char serial[16
     ugly_init(verbose);
     sl->backend = &_stlink_usb_backend;
     sl->backend_data = slu;
+    slu->stats = &sl->stats;
 
     sl->core_stat = STLINK_CORE_STAT_UNKNOWN;
     if (libusb_init(&(slu->libusb_ctx))) {
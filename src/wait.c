@@ -0,0 +1,171 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "stlink.h"
+#include "stlink/wait.h"
+#include "stlink/logging.h"
+
+/* sleeps shorter than a round trip to the probe are not worth it */
+#define WAIT_SLEEP_MIN_US 500
+#define WAIT_STEP_MIN_US 100
+#define WAIT_STEP_MAX_US 50000
+/* for waits without a model */
+#define WAIT_TIMEOUT_US 30000000
+#define WAIT_SCALE_ONE 1024
+
+/*
+ * Typical times from the datasheets. Erase and program times are per
+ * operation plus per KiB; programming goes the fastest way the chip has
+ * (x32 on F2/F4/F7, double words on L4/G0, half pages on L0/L1).
+ */
+struct flash_timing {
+    uint32_t erase_us;
+    uint32_t erase_kib_us;
+    uint32_t mass_erase_us;
+    uint32_t mass_erase_kib_us;
+    uint32_t program_us;
+    uint32_t program_kib_us;
+};
+
+static const struct flash_timing flash_timings[] = {
+    [STLINK_FLASH_TYPE_F0] = { 20000, 0, 20000, 0, 0, 13600 },
+    [STLINK_FLASH_TYPE_F1_XL] = { 20000, 0, 20000, 0, 0, 13600 },
+    [STLINK_FLASH_TYPE_L0] = { 3200, 0, 3200, 0, 3200, 0 },
+    [STLINK_FLASH_TYPE_F4] = { 100000, 7000, 100000, 8000, 0, 4096 },
+    [STLINK_FLASH_TYPE_L4] = { 22000, 0, 22000, 0, 0, 10500 },
+    [STLINK_FLASH_TYPE_G0] = { 22000, 0, 22000, 0, 0, 10900 },
+};
+
+/* usleep() need not take a second or more */
+void stlink_sleep_us(uint64_t us) {
+    while (us > 0) {
+        uint64_t n = (us > 500000) ? 500000 : us;
+        usleep((useconds_t) n);
+        us -= n;
+    }
+}
+
+uint64_t stlink_now_us(stlink_t *sl) {
+    return sl->backend->time_us ? sl->backend->time_us(sl) : stlink_time_us();
+}
+
+static void wait_sleep(stlink_t *sl, uint64_t us) {
+    if (sl->backend->sleep_us)
+        sl->backend->sleep_us(sl, us);
+    else
+        stlink_sleep_us(us);
+}
+
+static uint64_t wait_clamp(uint64_t us, uint64_t lo, uint64_t hi) {
+    return (us < lo) ? lo : (us > hi) ? hi : us;
+}
+
+struct wait_plan {
+    uint64_t expect_us;
+    uint64_t timeout_us;
+    uint64_t step_max_us;
+    uint64_t busy_us;       /* out: when done() last said no, 0 if never */
+    uint64_t done_us;       /* out: when it said yes */
+};
+
+/*
+ * Sleep 3/4 of the expected time, poll in steps of 1/16 of it until it is
+ * up, then back off exponentially up to step_max_us. Without an
+ * expectation, start polling at once.
+ */
+static int wait_poll(stlink_t *sl, struct wait_plan *p, stlink_wait_cb done, void *arg) {
+    const uint64_t start = stlink_now_us(sl);
+    uint64_t step = wait_clamp(p->expect_us / 16, WAIT_STEP_MIN_US, WAIT_STEP_MAX_US);
+    const uint64_t step_max = wait_clamp(p->step_max_us, 16 * WAIT_STEP_MIN_US, WAIT_STEP_MAX_US);
+    uint64_t now;
+    int ret;
+
+    if (p->expect_us == 0)
+        step = WAIT_STEP_MIN_US;
+    else if (p->expect_us * 3 / 4 >= WAIT_SLEEP_MIN_US)
+        wait_sleep(sl, p->expect_us * 3 / 4);
+
+    p->busy_us = 0;
+    while ((ret = done(sl, arg)) == 0) {
+        now = stlink_now_us(sl) - start;
+        if (now > p->timeout_us) {
+            ELOG("timed out after %u ms\n", (unsigned int) (now / 1000));
+            return -1;
+        }
+        p->busy_us = now;
+        wait_sleep(sl, step);
+        if (now >= p->expect_us)
+            step = (step * 2 < step_max) ? step * 2 : step_max;
+    }
+    p->done_us = stlink_now_us(sl) - start;
+
+    return (ret < 0) ? -1 : 0;
+}
+
+int stlink_wait(stlink_t *sl, uint64_t expect_us, uint64_t timeout_us,
+        stlink_wait_cb done, void *arg) {
+    struct wait_plan p = { expect_us, timeout_us, expect_us / 4, 0, 0 };
+    return wait_poll(sl, &p, done, arg);
+}
+
+uint64_t stlink_flash_op_us(stlink_t *sl, enum stlink_flash_op op, size_t len) {
+    const struct flash_timing *t;
+    const uint64_t kib = (len + 1023) / 1024;
+
+    if (len == 0 || (size_t) sl->flash_type >= sizeof(flash_timings) / sizeof(flash_timings[0]))
+        return 0;
+
+    t = &flash_timings[sl->flash_type];
+    switch (op) {
+    case STLINK_FLASH_OP_ERASE:
+        return t->erase_us + kib * t->erase_kib_us;
+    case STLINK_FLASH_OP_MASS_ERASE:
+        return t->mass_erase_us + kib * t->mass_erase_kib_us;
+    case STLINK_FLASH_OP_PROGRAM:
+        return t->program_us + (uint64_t) len * t->program_kib_us / 1024;
+    }
+
+    return 0;
+}
+
+/* plan a wait for what the model says takes model_us */
+static void wait_plan_model(stlink_t *sl, enum stlink_flash_op op, uint64_t model, struct wait_plan *p) {
+    const uint32_t scale = sl->wait_model.scale[op];
+
+    /* Until this operation has been measured on this target, only poll:
+       the datasheet time can be far off, e.g. on a simulator. */
+    p->expect_us = model * scale / WAIT_SCALE_ONE;
+    p->timeout_us = 10 * model + 1000000;
+    p->step_max_us = scale ? p->expect_us / 4 : model / 64;
+}
+
+int stlink_wait_model(stlink_t *sl, enum stlink_flash_op op, uint64_t model_us,
+        stlink_wait_cb done, void *arg) {
+    struct wait_plan p;
+
+    wait_plan_model(sl, op, model_us, &p);
+    return wait_poll(sl, &p, done, arg);
+}
+
+int stlink_wait_flash(stlink_t *sl, enum stlink_flash_op op, size_t len,
+        stlink_wait_cb done, void *arg) {
+    uint32_t *scale = &sl->wait_model.scale[op];
+    const uint64_t model = stlink_flash_op_us(sl, op, len);
+    struct wait_plan p;
+    uint64_t sample;
+
+    if (model == 0)
+        return stlink_wait(sl, 0, WAIT_TIMEOUT_US, done, arg);
+
+    wait_plan_model(sl, op, model, &p);
+    if (wait_poll(sl, &p, done, arg) == -1)
+        return -1;
+
+    /* it finished somewhere between the last two polls */
+    sample = wait_clamp((p.busy_us + p.done_us) / 2 * WAIT_SCALE_ONE / model, 1, 64 * WAIT_SCALE_ONE);
+    *scale = (*scale) ? (uint32_t) ((3 * (uint64_t) *scale + sample) / 4) : (uint32_t) sample;
+    DLOG("flash op %d on %u bytes: %u us, model %u us, scale %u/%u\n", op, (unsigned int) len,
+            (unsigned int) p.done_us, (unsigned int) model, *scale, WAIT_SCALE_ONE);
+
+    return 0;
+}
@@ -60,6 +60,16 @@ static bool execute_test(const struct Test * test) {
         ret &= (opts.reset == test->opts.reset);
         ret &= (opts.log_level == test->opts.log_level);
         ret &= (opts.format == test->opts.format);
+        ret &= (opts.stats == test->opts.stats);
+        ret &= cmp_strings(opts.record, test->opts.record);
+        ret &= cmp_strings(opts.replay, test->opts.replay);
+        ret &= (opts.realtime == test->opts.realtime);
+        ret &= (opts.delta == test->opts.delta);
+        ret &= (opts.agent == test->opts.agent);
+        ret &= (opts.compress == test->opts.compress);
+        ret &= (opts.dry_run == test->opts.dry_run);
+        ret &= (opts.allow_mass_erase == test->opts.allow_mass_erase);
+        ret &= (opts.fast_program == test->opts.fast_program);
     }
 
     printf("[%s] (%d) %s\n", ret ? "OK" : "ERROR", res, test->cmd_line);
@@ -90,6 +100,39 @@ static struct Test tests[] = {
     { "--debug --reset --format=ihex write test.hex", 0,
         { .cmd = FLASH_CMD_WRITE, .devname = NULL, .serial = { 0 }, .filename = "test.hex",
           .addr = 0, .size = 0, .reset = 1, .log_level = DEBUG_LOG_LEVEL, .format = FLASH_FORMAT_IHEX } },
+    { "--stats --reset read test.bin 0x80000000 0x1000", 0,
+        { .cmd = FLASH_CMD_READ, .devname = NULL, .serial = { 0 }, .filename = "test.bin",
+          .addr = 0x80000000, .size = 0x1000, .reset = 1, .log_level = STND_LOG_LEVEL, .format = FLASH_FORMAT_BINARY,
+          .stats = 1 } },
+    { "--record=f4.trace write test.bin 0x80000000", 0,
+        { .cmd = FLASH_CMD_WRITE, .devname = NULL, .serial = { 0 }, .filename = "test.bin",
+          .addr = 0x80000000, .size = 0, .reset = 0, .log_level = STND_LOG_LEVEL, .format = FLASH_FORMAT_BINARY,
+          .record = "f4.trace" } },
+    { "--replay f4.trace --realtime write test.bin 0x80000000", 0,
+        { .cmd = FLASH_CMD_WRITE, .devname = NULL, .serial = { 0 }, .filename = "test.bin",
+          .addr = 0x80000000, .size = 0, .reset = 0, .log_level = STND_LOG_LEVEL, .format = FLASH_FORMAT_BINARY,
+          .replay = "f4.trace", .realtime = 1 } },
+    { "--delta --format=ihex write test.hex", 0,
+        { .cmd = FLASH_CMD_WRITE, .devname = NULL, .serial = { 0 }, .filename = "test.hex",
+          .addr = 0, .size = 0, .reset = 0, .log_level = STND_LOG_LEVEL, .format = FLASH_FORMAT_IHEX,
+          .delta = 1 } },
+    { "--compress --stats write test.bin 0x80000000", 0,
+        { .cmd = FLASH_CMD_WRITE, .devname = NULL, .serial = { 0 }, .filename = "test.bin",
+          .addr = 0x80000000, .size = 0, .reset = 0, .log_level = STND_LOG_LEVEL, .format = FLASH_FORMAT_BINARY,
+          .stats = 1, .compress = 1 } },
+    { "--agent write test.bin 0x80000000", 0,
+        { .cmd = FLASH_CMD_WRITE, .devname = NULL, .serial = { 0 }, .filename = "test.bin",
+          .addr = 0x80000000, .size = 0, .reset = 0, .log_level = STND_LOG_LEVEL, .format = FLASH_FORMAT_BINARY,
+          .agent = 1 } },
+    { "--dry-run --allow-mass-erase write test.bin 0x80000000", 0,
+        { .cmd = FLASH_CMD_WRITE, .devname = NULL, .serial = { 0 }, .filename = "test.bin",
+          .addr = 0x80000000, .size = 0, .reset = 0, .log_level = STND_LOG_LEVEL, .format = FLASH_FORMAT_BINARY,
+          .dry_run = 1, .allow_mass_erase = 1 } },
+    { "--allow-mass-erase --fast-program write test.bin 0x80000000", 0,
+        { .cmd = FLASH_CMD_WRITE, .devname = NULL, .serial = { 0 }, .filename = "test.bin",
+          .addr = 0x80000000, .size = 0, .reset = 0, .log_level = STND_LOG_LEVEL, .format = FLASH_FORMAT_BINARY,
+          .allow_mass_erase = 1, .fast_program = 1 } },
+    { "--replay", -1, FLASH_OPTS_INITIALIZER },
     { "--debug --reset --format=binary write test.hex", -1, FLASH_OPTS_INITIALIZER },
     { "--debug --reset --format=ihex write test.hex 0x80000000", -1, FLASH_OPTS_INITIALIZER },
     { "--debug --reset write test.hex sometext", -1, FLASH_OPTS_INITIALIZER },
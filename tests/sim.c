@@ -0,0 +1,794 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stlink.h>
+
+#include "../src/flash_loader_internal.h"
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("  FAIL line %d: %s\n", __LINE__, #cond); \
+            failed = true; \
+        } \
+    } while (0)
+
+struct sim_test {
+    uint32_t chip_id;
+    size_t flash_size;
+    stm32_addr_t addr;      /* 16 KiB written from here */
+    const char *name;
+    unsigned erase_us;      /* 0 for 20 ms */
+    unsigned program_us;    /* 0 for 50 us */
+};
+
+static const struct sim_test tests[] = {
+    { STLINK_CHIPID_STM32_F1_MEDIUM, 128 * 1024, 0x0801c000, "F1 medium density", 0, 0 },
+    { STLINK_CHIPID_STM32_F1_XL, 1024 * 1024, 0x0807e000, "F1 XL, across banks", 0, 0 },
+    { STLINK_CHIPID_STM32_F4, 1024 * 1024, 0x08080000, "F4", 0, 0 },
+    // a half page or a single word at a time, both take 3.2 ms
+    { STLINK_CHIPID_STM32_L0, 64 * 1024, 0x08008000, "L0", 3200, 3200 },
+    { STLINK_CHIPID_STM32_L4, 1024 * 1024, 0x0807e000, "L4, across banks", 0, 0 },
+    { STLINK_CHIPID_STM32_G0X1, 64 * 1024, 0x08008000, "G0", 0, 0 },
+};
+
+static bool run_test(const struct sim_test *t) {
+    const struct stlink_sim_config cfg = {
+        .chip_id = t->chip_id,
+        .flash_size = t->flash_size,
+        .cmd_us = 125,
+        .kib_us = 1000,
+        .erase_us = t->erase_us ? t->erase_us : 20000,
+        .mass_erase_us = 40000,
+        .program_us = t->program_us ? t->program_us : 50,
+    };
+    const uint32_t len = 16 * 1024;
+    const stm32_addr_t addr = t->addr;
+    bool failed = false;
+    struct stlink_reg regs;
+    uint8_t *data, *back;
+    uint64_t t0, us;
+    stlink_t *sl;
+
+    printf("%s (%#x)\n", t->name, t->chip_id);
+
+    sl = stlink_open_sim(UWARN, true, &cfg);
+    if (sl == NULL) {
+        printf("  FAIL: stlink_open_sim\n");
+        return false;
+    }
+
+    CHECK(sl->chip_id == t->chip_id);
+    CHECK(sl->flash_size == t->flash_size);
+
+    // like st-flash does
+    stlink_force_debug(sl);
+
+    data = malloc(len);
+    back = malloc(len);
+    srand(t->chip_id);
+    for (uint32_t i = 0; i < len; i++)
+        data[i] = (uint8_t) rand();
+
+    t0 = stlink_sim_time_us(sl);
+    CHECK(stlink_write_flash(sl, addr, data, len, 0) == 0);
+    us = stlink_sim_time_us(sl) - t0;
+    printf("  wrote %u bytes in %llu us simulated, %.1f KiB/s\n", len,
+            (unsigned long long) us, us ? len * 1e6 / 1024 / us : 0.0);
+
+    CHECK(memcmp(stlink_sim_mem(sl, addr, len), data, len) == 0);
+    CHECK(stlink_read_mem(sl, addr, back, len) == 0);
+    CHECK(memcmp(back, data, len) == 0);
+    CHECK(stlink_verify_write_flash(sl, addr, data, len) == 0);
+
+    // and through a file, like st-flash read
+    {
+        const char *path = "sim_fread.bin";
+        FILE *f;
+
+        memset(back, 0, len);
+        CHECK(stlink_fread(sl, path, false, addr, len) == 0);
+        f = fopen(path, "rb");
+        CHECK(f != NULL && fread(back, 1, len, f) == len);
+        CHECK(memcmp(back, data, len) == 0);
+        if (f)
+            fclose(f);
+
+        // and chunk by chunk, like the SG and V1 backends
+        {
+            stlink_backend_t *backend = sl->backend;
+            stlink_backend_t nobulk = *backend;
+
+            nobulk.read_mem32_bulk = NULL;
+            sl->backend = &nobulk;
+            memset(back, 0, len);
+            CHECK(stlink_fread(sl, path, false, addr, len) == 0);
+            sl->backend = backend;
+            f = fopen(path, "rb");
+            CHECK(f != NULL && fread(back, 1, len, f) == len);
+            CHECK(memcmp(back, data, len) == 0);
+            if (f)
+                fclose(f);
+        }
+        remove(path);
+    }
+
+    // delta writes only touch the pages that changed
+    if (stlink_calculate_pagesize(sl, addr) < len) {
+        uint64_t delta_us;
+
+        data[len / 2] ^= 0x5a;
+        t0 = stlink_sim_time_us(sl);
+        CHECK(stlink_write_flash_delta(sl, addr, data, len, 0) == 0);
+        delta_us = stlink_sim_time_us(sl) - t0;
+        printf("  delta write of one page in %llu us simulated\n", (unsigned long long) delta_us);
+        CHECK(delta_us < us / 2);
+        CHECK(memcmp(stlink_sim_mem(sl, addr, len), data, len) == 0);
+    }
+
+    // what reads as erased is left to the erase
+    {
+        const struct stlink_flash_stats *f = &stlink_get_stats(sl)->flash;
+        uint64_t full_us, gap_us;
+
+        // over flash that is not blank, unlike the first write
+        t0 = stlink_sim_time_us(sl);
+        CHECK(stlink_write_flash(sl, addr, data, len, 0) == 0);
+        full_us = stlink_sim_time_us(sl) - t0;
+
+        memset(data + len / 4, stlink_get_erased_pattern(sl), len / 2);
+        stlink_reset_stats(sl);
+        t0 = stlink_sim_time_us(sl);
+        CHECK(stlink_write_flash(sl, addr, data, len, 0) == 0);
+        gap_us = stlink_sim_time_us(sl) - t0;
+        printf("  write with an erased half in %llu us simulated\n", (unsigned long long) gap_us);
+        CHECK(gap_us < full_us);
+        CHECK(f->bytes == len && f->sent == len / 2);
+        CHECK(memcmp(stlink_sim_mem(sl, addr, len), data, len) == 0);
+    }
+
+    // unaligned reads
+    memset(back, 0, len);
+    CHECK(stlink_read_mem(sl, addr + 3, back, 101) == 0);
+    CHECK(memcmp(back, data + 3, 101) == 0);
+
+    // registers, through the core and DCRSR/DCRDR
+    stlink_status(sl);
+    CHECK(sl->core_stat == STLINK_CORE_HALTED);
+    stlink_write_reg(sl, 0x12345678, 3);
+    stlink_write_reg(sl, 0x20000100, 15);
+    stlink_read_all_regs(sl, &regs);
+    CHECK(regs.r[3] == 0x12345678);
+    CHECK(regs.r[15] == 0x20000100);
+    regs.r[0] = 0xa0;
+    regs.r[2] = 0xa2;
+    regs.r[3] = 0xa3;
+    CHECK(stlink_write_regs(sl, (1u << 0) | (1u << 2), regs.r) == 0);
+    stlink_read_all_regs(sl, &regs);
+    CHECK(regs.r[0] == 0xa0 && regs.r[2] == 0xa2 && regs.r[3] == 0x12345678);
+    stlink_write_unsupported_reg(sl, 0x5a000000, 0x1e, &regs);
+    stlink_read_all_unsupported_regs(sl, &regs);
+    CHECK(regs.basepri == 0x5a);
+
+    t0 = stlink_sim_time_us(sl);
+    CHECK(stlink_erase_flash_mass(sl) == 0);
+    printf("  mass erase in %llu us simulated\n",
+            (unsigned long long) (stlink_sim_time_us(sl) - t0));
+    CHECK(stlink_read_mem(sl, addr, back, len) == 0);
+    for (uint32_t i = 0; i < len; i++) {
+        if (back[i] != back[0]) {
+            CHECK(back[i] == back[0]);
+            break;
+        }
+    }
+
+    free(data);
+    free(back);
+    stlink_close(sl);
+    return !failed;
+}
+
+/* a core that never leaves the halt, for loaders that fail */
+static int never_runs(stlink_t *sl) {
+    (void) sl;
+    return 0;
+}
+
+static int never_done(stlink_t *sl, void *arg) {
+    (void) sl;
+    (*(int *) arg)++;
+    return 0;
+}
+
+/* With a slow link the double buffered loader hides the upload of all but
+   the first buffer behind programming: writing takes less than uploading,
+   programming and reading back for verification one after the other. */
+static bool run_overlap_test(void) {
+    const struct stlink_sim_config cfg = {
+        .chip_id = STLINK_CHIPID_STM32_F4,
+        .flash_size = 1024 * 1024,
+        .cmd_us = 100,
+        .kib_us = 4000,
+        .program_us = 16,
+    };
+    const uint32_t len = 64 * 1024;
+    const uint64_t serial_us = 2ull * len * cfg.kib_us / 1024 + (len / 4) * cfg.program_us;
+    bool failed = false;
+    uint8_t *data;
+    uint64_t t0, us;
+    uint32_t crc;
+    stlink_t *sl;
+
+    printf("F4 flash loaders\n");
+
+    sl = stlink_open_sim(UWARN, true, &cfg);
+    if (sl == NULL) {
+        printf("  FAIL: stlink_open_sim\n");
+        return false;
+    }
+    stlink_force_debug(sl);
+
+    data = malloc(len);
+    for (uint32_t i = 0; i < len; i++)
+        data[i] = (uint8_t) (i ^ (i >> 8));
+
+    t0 = stlink_sim_time_us(sl);
+    CHECK(stlink_write_flash(sl, 0x08020000, data, len, 0) == 0);
+    us = stlink_sim_time_us(sl) - t0;
+    printf("  wrote %u bytes in %llu us simulated, %llu us one after the other\n", len,
+            (unsigned long long) us, (unsigned long long) serial_us);
+    CHECK(us < serial_us);
+    CHECK(memcmp(stlink_sim_mem(sl, 0x08020000, len), data, len) == 0);
+
+    // the loader stays in sram for the next write, unless it is overwritten
+    CHECK(sl->loader_cache.code != NULL);
+    CHECK(stlink_write_mem(sl, sl->sram_base + 2, data, 1) == 0);
+    CHECK(sl->loader_cache.code == NULL);
+    CHECK(stlink_write_flash(sl, 0x08040000, data, 1024, 0) == 0);
+    CHECK(sl->loader_cache.code != NULL);
+    // behind the library's back
+    memset(stlink_sim_mem(sl, sl->sram_base, 4), 0, 4);
+    CHECK(stlink_write_flash(sl, 0x08060000, data, 1024, 0) == 0);
+    CHECK(memcmp(stlink_sim_mem(sl, 0x08060000, 1024), data, 1024) == 0);
+
+    // verification by a crc computed on the target, which leaves the top
+    // of sram and the registers as they were
+    {
+        const uint32_t top = (uint32_t) (sl->sram_base + sl->sram_size - 256);
+        struct stlink_reg before, after;
+        uint8_t stack[256];
+
+        for (uint32_t i = 0; i < sizeof(stack); i++)
+            stack[i] = (uint8_t) (i ^ 0x3c);
+        memcpy(stlink_sim_mem(sl, top, sizeof(stack)), stack, sizeof(stack));
+        CHECK(stlink_write_reg(sl, 0x11223344, 4) == 0);
+        CHECK(stlink_write_reg(sl, 0x08000123, 15) == 0);
+        CHECK(stlink_read_all_regs(sl, &before) == 0);
+
+        CHECK(stlink_crc32(0, (const uint8_t *) "123456789", 9) == 0xcbf43926);
+        CHECK(stlink_flash_crc32(sl, 0x08020000, len, &crc) == 0);
+        CHECK(crc == stlink_crc32(0, data, len));
+
+        CHECK(memcmp(stlink_sim_mem(sl, top, sizeof(stack)), stack, sizeof(stack)) == 0);
+        CHECK(stlink_read_all_regs(sl, &after) == 0);
+        CHECK(memcmp(after.r, before.r, sizeof(after.r)) == 0 && after.xpsr == before.xpsr);
+    }
+    CHECK(stlink_verify_write_flash(sl, 0x08020000, data, len) == 0);
+    stlink_sim_mem(sl, 0x08020000 + 12345, 1)[0] ^= 0x10;
+    CHECK(stlink_verify_write_flash(sl, 0x08020000, data, len) == -1);
+
+    // a wait that never ends times out, without polling flat out
+    {
+        int polls = 0;
+        CHECK(stlink_wait(sl, 0, 100000, never_done, &polls) == -1);
+        CHECK(polls > 1 && polls < 100);
+    }
+
+    free(data);
+    stlink_close(sl);
+    return !failed;
+}
+
+/* The flashing agent overlaps uploads with programming as well, and stops
+   at the first descriptor that fails. */
+static bool run_agent_test(void) {
+    const struct stlink_sim_config cfg = {
+        .chip_id = STLINK_CHIPID_STM32_F4,
+        .flash_size = 1024 * 1024,
+        .cmd_us = 100,
+        .kib_us = 4000,
+        .program_us = 16,
+    };
+    const uint32_t len = 64 * 1024;
+    const uint64_t serial_us = 2ull * len * cfg.kib_us / 1024 + (len / 4) * cfg.program_us;
+    const struct stlink_flash_stats *f;
+    bool failed = false;
+    flash_agent_t ag;
+    uint8_t *data, *packed, *back;
+    uint64_t t0, us;
+    size_t n;
+    stlink_t *sl;
+
+    printf("F4 flashing agent\n");
+
+    sl = stlink_open_sim(UWARN, true, &cfg);
+    if (sl == NULL) {
+        printf("  FAIL: stlink_open_sim\n");
+        return false;
+    }
+    stlink_force_debug(sl);
+    sl->flash_agent = true;
+
+    data = malloc(len);
+    packed = malloc(len);
+    back = malloc(len);
+    for (uint32_t i = 0; i < len; i++)
+        data[i] = (uint8_t) (i * 7);
+
+    t0 = stlink_sim_time_us(sl);
+    CHECK(stlink_write_flash(sl, 0x08020000, data, len, 0) == 0);
+    us = stlink_sim_time_us(sl) - t0;
+    printf("  wrote %u bytes in %llu us simulated, %llu us one after the other\n", len,
+            (unsigned long long) us, (unsigned long long) serial_us);
+    CHECK(us < serial_us);
+    CHECK(memcmp(stlink_sim_mem(sl, 0x08020000, len), data, len) == 0);
+
+    // programming with the flash still locked fails, and leaves the core halted
+    CHECK(stlink_flash_agent_start(sl, &ag) == 0);
+    CHECK(stlink_flash_agent_program(sl, &ag, 0x08060000, data, 1024) == 0);
+    CHECK(stlink_flash_agent_finish(sl, &ag) == -1);
+    CHECK(stlink_sim_mem(sl, 0x08060000, 1)[0] == 0xff);
+    stlink_status(sl);
+    CHECK(sl->core_stat == STLINK_CORE_HALTED);
+    CHECK(stlink_write_flash(sl, 0x08060000, data, 1024, 0) == 0);
+    CHECK(memcmp(stlink_sim_mem(sl, 0x08060000, 1024), data, 1024) == 0);
+
+    // compression: random data does not compress, runs do
+    srand(len);
+    for (uint32_t i = 0; i < len; i++)
+        data[i] = (uint8_t) rand();
+    CHECK(stlink_lz_compress(packed, len, data, len) == 0);
+    memset(data + len / 4, 0, len - len / 4);
+    n = stlink_lz_compress(packed, len, data, len);
+    CHECK(n > len / 4 && n < len / 2);
+    CHECK(stlink_lz_decompress(back, len, packed, n) == 0);
+    CHECK(memcmp(back, data, len) == 0);
+
+    // and is unpacked by the agent
+    stlink_reset_stats(sl);
+    sl->flash_compress = true;
+    CHECK(stlink_write_flash(sl, 0x08080000, data, len, 0) == 0);
+    CHECK(memcmp(stlink_sim_mem(sl, 0x08080000, len), data, len) == 0);
+    f = &stlink_get_stats(sl)->flash;
+    printf("  compressed, sent %llu of %llu bytes\n", (unsigned long long) f->sent,
+            (unsigned long long) f->bytes);
+    CHECK(f->bytes == len && f->packed > 0 && f->sent < len / 2);
+    {
+        char text[4096];
+        stlink_format_stats(sl, text, sizeof(text));
+        CHECK(strstr(text, "flash: 65536 bytes written") != NULL);
+    }
+
+    free(data);
+    free(packed);
+    free(back);
+    stlink_close(sl);
+    return !failed;
+}
+
+/* The F1 XL has a flash controller for each bank: across both, an image
+   is erased in one bank while it is programmed in the other. */
+static bool run_dual_bank_test(void) {
+    const struct stlink_sim_config cfg = {
+        .chip_id = STLINK_CHIPID_STM32_F1_XL,
+        .flash_size = 1024 * 1024,
+        .cmd_us = 100,
+        .kib_us = 1000,
+        .erase_us = 20000,
+        .program_us = 20,
+    };
+    const uint32_t len = 128 * 1024;
+    const stm32_addr_t addr[2] = { 0x08000000, 0x08070000 };
+    bool failed = false;
+    uint64_t t0, us[2];
+    uint8_t *data;
+    stlink_t *sl;
+
+    printf("F1 XL, both banks at once\n");
+
+    sl = stlink_open_sim(UWARN, true, &cfg);
+    if (sl == NULL) {
+        printf("  FAIL: stlink_open_sim\n");
+        return false;
+    }
+    sl->flash_agent = true;
+    stlink_force_debug(sl);
+
+    data = malloc(len);
+    for (uint32_t i = 0; i < len; i++)
+        data[i] = (uint8_t) (i * 13);
+
+    // in bank 1 only, then half in each; over flash that has to be erased
+    for (int i = 0; i < 2; i++) {
+        memset(stlink_sim_mem(sl, addr[i], len), 0, len);
+        t0 = stlink_sim_time_us(sl);
+        CHECK(stlink_write_flash(sl, addr[i], data, len, 0) == 0);
+        us[i] = stlink_sim_time_us(sl) - t0;
+        CHECK(memcmp(stlink_sim_mem(sl, addr[i], len), data, len) == 0);
+    }
+    printf("  wrote %u bytes in %llu us simulated, %llu us in one bank\n", len,
+            (unsigned long long) us[1], (unsigned long long) us[0]);
+    CHECK(us[1] < us[0] * 2 / 3);
+
+    free(data);
+    stlink_close(sl);
+    return !failed;
+}
+
+/* With the option, the G0 loader programs whole rows of 32 double words, a write
+   that starts or ends within a row leaves the rest of it erased. */
+static bool run_g0_test(void) {
+    const struct stlink_sim_config cfg = {
+        .chip_id = STLINK_CHIPID_STM32_G0X1,
+        .flash_size = 64 * 1024,
+        .cmd_us = 125,
+        .kib_us = 1000,
+        .erase_us = 22000,
+        .program_us = 85,
+    };
+    const uint32_t len = 16 * 1024;
+    const uint64_t dword_us = (len / 8) * cfg.program_us;
+    bool failed = false;
+    uint64_t t0, us;
+    uint8_t *data;
+    stlink_t *sl;
+
+    printf("G0 fast programming\n");
+
+    sl = stlink_open_sim(UWARN, true, &cfg);
+    if (sl == NULL) {
+        printf("  FAIL: stlink_open_sim\n");
+        return false;
+    }
+    stlink_force_debug(sl);
+    sl->flash_fast_program = true;
+
+    data = malloc(len);
+    for (uint32_t i = 0; i < len; i++)
+        data[i] = (uint8_t) (i * 7);
+
+    t0 = stlink_sim_time_us(sl);
+    CHECK(stlink_write_flash(sl, 0x08004000, data, len, 0) == 0);
+    us = stlink_sim_time_us(sl) - t0;
+    printf("  wrote %u bytes in %llu us simulated, %llu us a double word at a time\n", len,
+            (unsigned long long) us, (unsigned long long) dword_us);
+    CHECK(us < dword_us);
+    CHECK(memcmp(stlink_sim_mem(sl, 0x08004000, len), data, len) == 0);
+
+    // from 0x08000810 on, the erased part in front is not written
+    memset(data, 0xff, 16);
+    CHECK(stlink_write_flash(sl, 0x08000800, data, 316, 0) == 0);
+    CHECK(memcmp(stlink_sim_mem(sl, 0x08000800, 316), data, 316) == 0);
+    CHECK(stlink_sim_mem(sl, 0x08000800 + 316, 1)[0] == 0xff);
+
+    free(data);
+    stlink_close(sl);
+    return !failed;
+}
+
+/* With the option, the L4 fast programs whole rows after a mass erase; a
+   write that erases pages programs the standard way. */
+static bool run_l4_fast_test(void) {
+    const struct stlink_sim_config cfg = {
+        .chip_id = STLINK_CHIPID_STM32_L4,
+        .flash_size = 256 * 1024,
+        .cmd_us = 125,
+        .kib_us = 1000,
+        .erase_us = 22000,
+        .mass_erase_us = 22000,
+        .program_us = 82,
+    };
+    const uint32_t len = 256 * 1024;
+    bool failed = false;
+    uint64_t t0, us[2];
+    uint8_t *data;
+    stlink_t *sl;
+
+    printf("L4 fast programming\n");
+
+    sl = stlink_open_sim(UWARN, true, &cfg);
+    if (sl == NULL) {
+        printf("  FAIL: stlink_open_sim\n");
+        return false;
+    }
+    stlink_force_debug(sl);
+    sl->allow_mass_erase = true;
+
+    data = malloc(len);
+    for (uint32_t i = 0; i < len; i++)
+        data[i] = (uint8_t) (i * 11);
+
+    // the whole flash, standard and then fast
+    for (int i = 0; i < 2; i++) {
+        sl->flash_fast_program = (i == 1);
+        memset(stlink_sim_mem(sl, 0x08000000, len), 0, len);
+        t0 = stlink_sim_time_us(sl);
+        CHECK(stlink_write_flash(sl, 0x08000000, data, len, 0) == 0);
+        us[i] = stlink_sim_time_us(sl) - t0;
+        CHECK(memcmp(stlink_sim_mem(sl, 0x08000000, len), data, len) == 0);
+    }
+    printf("  wrote %u bytes in %llu us simulated, %llu us the standard way\n", len,
+            (unsigned long long) us[1], (unsigned long long) us[0]);
+    CHECK(us[1] < us[0] * 3 / 4);
+
+    // pages erased on their own, then it has to be the standard way
+    sl->allow_mass_erase = false;
+    memset(data, 0x5a, 4096);
+    CHECK(stlink_write_flash(sl, 0x08001000, data, 4096, 0) == 0);
+    CHECK(!sl->flash_mass_erased);
+    CHECK(memcmp(stlink_sim_mem(sl, 0x08001000, 4096), data, 4096) == 0);
+
+    free(data);
+    stlink_close(sl);
+    return !failed;
+}
+
+/* L0 programming goes a half page at a time where it can, with the words
+   before and after in the same loader run; the data eeprom a word at a
+   time, through the same loader. */
+static bool run_l0_test(void) {
+    const struct stlink_sim_config cfg = {
+        .chip_id = STLINK_CHIPID_STM32_L0,
+        .flash_size = 64 * 1024,
+        .cmd_us = 125,
+        .kib_us = 1000,
+        .erase_us = 3200,
+        .program_us = 3200,
+    };
+    const uint32_t len = 16 * 1024 - 8;
+    const uint64_t word_us = (len / 4) * (uint64_t) cfg.program_us;
+    const stm32_addr_t eeprom = 0x08080000;
+    bool failed = false;
+    uint8_t *data;
+    uint64_t t0, us;
+    stlink_t *sl;
+
+    printf("L0 half pages and data eeprom\n");
+
+    sl = stlink_open_sim(UWARN, true, &cfg);
+    if (sl == NULL) {
+        printf("  FAIL: stlink_open_sim\n");
+        return false;
+    }
+    stlink_force_debug(sl);
+    CHECK(sl->eeprom_base == eeprom && sl->eeprom_size == 0x800);
+
+    data = malloc(len);
+    for (uint32_t i = 0; i < len; i++)
+        data[i] = (uint8_t) (i * 7 + 1);
+
+    // the first 20 bytes read as erased: 11 words up to the first half page
+    memset(data, 0, 20);
+    t0 = stlink_sim_time_us(sl);
+    CHECK(stlink_write_flash(sl, 0x08004000, data, len, 0) == 0);
+    us = stlink_sim_time_us(sl) - t0;
+    printf("  wrote %u bytes in %llu us simulated, %llu us a word at a time\n", len,
+            (unsigned long long) us, (unsigned long long) word_us);
+    CHECK(us < word_us / 4);
+    CHECK(memcmp(stlink_sim_mem(sl, 0x08004000, len), data, len) == 0);
+
+    // a block of odd length keeps the bytes around it
+    memset(data, 0xa5, 0x800);
+    CHECK(stlink_mwrite_eeprom(sl, data, 0x800, eeprom) == 0);
+    for (uint32_t i = 0; i < 1022; i++)
+        data[i] = (uint8_t) (i * 3);
+    t0 = stlink_sim_time_us(sl);
+    CHECK(stlink_mwrite_eeprom(sl, data, 1022, eeprom + 8) == 0);
+    us = stlink_sim_time_us(sl) - t0;
+    printf("  wrote 1022 bytes of data eeprom in %llu us simulated\n", (unsigned long long) us);
+    CHECK(memcmp(stlink_sim_mem(sl, eeprom + 8, 1022), data, 1022) == 0);
+    CHECK(stlink_sim_mem(sl, eeprom, 1)[0] == 0xa5 && stlink_sim_mem(sl, eeprom + 7, 1)[0] == 0xa5);
+    CHECK(stlink_sim_mem(sl, eeprom + 8 + 1022, 1)[0] == 0xa5);
+    CHECK(stlink_sim_mem(sl, eeprom + 8 + 1023, 1)[0] == 0xa5);
+
+    CHECK(stlink_mwrite_eeprom(sl, data, 8, eeprom + 0x800 - 4) == -1);
+    CHECK(stlink_mwrite_eeprom(sl, data, 4, eeprom + 2) == -1);
+
+    // should the loader fail, flash and eeprom are written a word at a time
+    {
+        stlink_backend_t *backend = sl->backend;
+        stlink_backend_t norun = *backend;
+
+        norun.run = never_runs;
+        sl->backend = &norun;
+        for (uint32_t i = 0; i < len; i++)
+            data[i] = (uint8_t) (i * 5 + 3);
+        CHECK(stlink_write_flash(sl, 0x08004000, data, len, 0) == 0);
+        CHECK(stlink_mwrite_eeprom(sl, data, 64, eeprom) == 0);
+        sl->backend = backend;
+        CHECK(memcmp(stlink_sim_mem(sl, 0x08004000, len), data, len) == 0);
+        CHECK(memcmp(stlink_sim_mem(sl, eeprom, 64), data, 64) == 0);
+    }
+
+    free(data);
+    stlink_close(sl);
+    return !failed;
+}
+
+/* The erase plan leaves out blank sectors, and mass erases when told it may
+   and that is faster. */
+static bool run_erase_plan_test(void) {
+    const struct stlink_sim_config cfg = {
+        .chip_id = STLINK_CHIPID_STM32_F4,
+        .flash_size = 1024 * 1024,
+        .cmd_us = 100,
+        .kib_us = 1000,
+        .erase_us = 20000,
+        .program_us = 16,
+    };
+    const struct stlink_flash_range low = { 0x08000000, 64 * 1024 };
+    const struct stlink_flash_range all = { 0x08000000, 1024 * 1024 };
+    struct stlink_flash_geometry g;
+    stlink_erase_plan_t plan;
+    bool failed = false;
+    uint8_t data[1024];
+    char text[1024];
+    stlink_t *sl;
+
+    printf("F4 erase plan\n");
+
+    sl = stlink_open_sim(UWARN, true, &cfg);
+    if (sl == NULL) {
+        printf("  FAIL: stlink_open_sim\n");
+        return false;
+    }
+    stlink_force_debug(sl);
+    memset(data, 0x5a, sizeof(data));
+
+    // 4 x 16k, 64k, 7 x 128k
+    CHECK(stlink_flash_geometry(sl, &g) == 0);
+    CHECK(g.count == 3 && g.region[0].size == 0x4000 && g.region[0].count == 4
+            && g.region[1].size == 0x10000 && g.region[2].count == 7);
+
+    CHECK(stlink_erase_plan(sl, &low, 1, STLINK_ERASE_BLANK_CHECK, &plan) == 0);
+    CHECK(plan.count == 4 && plan.pages[0].blank && plan.pages[3].blank && plan.est_us == 0);
+    stlink_erase_plan_free(&plan);
+
+    // a dry run leaves the flash alone
+    sl->flash_dry_run = true;
+    CHECK(stlink_write_flash(sl, 0x08004000, data, sizeof(data), 0) == 0);
+    CHECK(stlink_sim_mem(sl, 0x08004000, 1)[0] == 0xff);
+    sl->flash_dry_run = false;
+
+    CHECK(stlink_write_flash(sl, 0x08004000, data, sizeof(data), 0) == 0);
+    CHECK(stlink_erase_plan(sl, &low, 1, STLINK_ERASE_BLANK_CHECK, &plan) == 0);
+    CHECK(plan.count == 4 && plan.pages[0].blank && !plan.pages[1].blank && plan.pages[2].blank);
+    CHECK(!plan.mass && plan.est_us == stlink_flash_op_us(sl, STLINK_FLASH_OP_ERASE, 0x4000));
+    stlink_format_erase_plan(&plan, text, sizeof(text));
+    CHECK(strstr(text, "0x08004000   16384 bytes  erase") != NULL);
+    stlink_erase_plan_free(&plan);
+
+    // every sector one by one takes longer than a mass erase
+    CHECK(stlink_erase_plan(sl, &all, 1, STLINK_ERASE_MASS, &plan) == 0);
+    CHECK(plan.count == 12 && plan.mass && plan.est_us == plan.mass_us && plan.mass_us < plan.pages_us);
+    CHECK(stlink_erase_plan_run(sl, &plan) == 0);
+    CHECK(stlink_sim_mem(sl, 0x08004000, 1)[0] == 0xff);
+    stlink_erase_plan_free(&plan);
+
+    stlink_close(sl);
+    return !failed;
+}
+
+/* While the core stays halted, memory and registers come from the target
+   once, the stack along with the registers; a step, a run or a write to a
+   peripheral has them read again. */
+static bool run_memcache_test(void) {
+    const struct stlink_sim_config cfg = {
+        .chip_id = STLINK_CHIPID_STM32_F4,
+        .flash_size = 1024 * 1024,
+        .cmd_us = 100,
+        .kib_us = 1000,
+    };
+    const struct stlink_cmd_stats *rd, *rd_regs, *rd_reg;
+    bool failed = false;
+    struct stlink_reg regs;
+    uint8_t buf[256];
+    uint64_t reads;
+    uint32_t sp;
+    stlink_t *sl;
+
+    printf("F4 memory cache\n");
+
+    sl = stlink_open_sim(UWARN, true, &cfg);
+    if (sl == NULL) {
+        printf("  FAIL: stlink_open_sim\n");
+        return false;
+    }
+    rd = &sl->stats.cmd[STLINK_DEBUG_READMEM_32BIT];
+    rd_regs = &sl->stats.cmd[STLINK_DEBUG_READALLREGS];
+    rd_reg = &sl->stats.cmd[STLINK_DEBUG_READREG];
+
+    stlink_memcache_enable(sl, true, true);
+    stlink_force_debug(sl);
+    sp = (uint32_t) sl->sram_base + 0x1000 - 0x48;
+    for (uint32_t i = 0; i < 0x800; i++)
+        stlink_sim_mem(sl, sp - 0x400 + i, 1)[0] = (uint8_t) (i * 13);
+    CHECK(stlink_write_reg(sl, sp, 13) == 0);
+
+    reads = rd->count;
+    CHECK(stlink_read_all_regs(sl, &regs) == 0 && regs.r[13] == sp);
+    CHECK(rd->count == reads + 1);
+    CHECK(stlink_read_all_regs(sl, &regs) == 0 && regs.r[13] == sp);
+    CHECK(stlink_read_reg(sl, 13, &regs) == 0 && regs.r[13] == sp);
+    CHECK(rd_regs->count == 1 && rd_reg->count == 0);
+
+    CHECK(stlink_read_mem(sl, sp + 3, buf, 200) == 0);
+    CHECK(memcmp(buf, stlink_sim_mem(sl, sp + 3, 200), 200) == 0);
+    CHECK(stlink_read_mem32(sl, sp + 8, 64) == 0);
+    CHECK(memcmp(sl->q_buf, stlink_sim_mem(sl, sp + 8, 64), 64) == 0);
+    CHECK(rd->count == reads + 1);
+
+    // below the prefetched pages, and then cached
+    CHECK(stlink_read_mem(sl, sp - 0x200, buf, 16) == 0);
+    CHECK(stlink_read_mem(sl, sp - 0x200, buf, 16) == 0);
+    CHECK(memcmp(buf, stlink_sim_mem(sl, sp - 0x200, 16), 16) == 0);
+    CHECK(rd->count == reads + 2);
+
+    // written through
+    CHECK(stlink_write_mem(sl, sp + 1, (const uint8_t *) "abcdefgh", 8) == 0);
+    CHECK(stlink_read_mem(sl, sp, buf, 12) == 0);
+    CHECK(memcmp(buf + 1, "abcdefgh", 8) == 0 && memcmp(buf, stlink_sim_mem(sl, sp, 12), 12) == 0);
+    CHECK(rd->count == reads + 2);
+
+    // peripherals are read every time
+    CHECK(stlink_read_mem(sl, 0x40023c00, buf, 4) == 0);
+    CHECK(stlink_read_mem(sl, 0x40023c00, buf, 4) == 0);
+    CHECK(rd->count == reads + 4);
+
+    // the core halts again after a step, with the cache dropped
+    CHECK(stlink_step(sl) == 0);
+    CHECK(stlink_read_mem(sl, sp, buf, 4) == 0);
+    CHECK(stlink_read_mem(sl, sp, buf, 4) == 0);
+    CHECK(rd->count == reads + 5);
+    CHECK(stlink_read_all_regs(sl, &regs) == 0 && rd_regs->count == 2);
+    CHECK(rd->count == reads + 6);
+
+    // nothing is cached while the core runs, or after a write to a peripheral
+    CHECK(stlink_run(sl) == 0);
+    CHECK(stlink_status(sl) == 0 && sl->core_stat == STLINK_CORE_RUNNING);
+    CHECK(stlink_read_mem(sl, sp, buf, 4) == 0);
+    CHECK(stlink_read_mem(sl, sp, buf, 4) == 0);
+    CHECK(rd->count == reads + 8);
+    CHECK(stlink_force_debug(sl) == 0);
+    CHECK(stlink_read_mem(sl, sp, buf, 4) == 0);
+    CHECK(stlink_write_debug32(sl, 0x40023c08, 0) == 0);
+    CHECK(stlink_read_mem(sl, sp, buf, 4) == 0);
+    CHECK(rd->count == reads + 10);
+
+    printf("  %llu pages from the cache, %llu from the target\n",
+            (unsigned long long) sl->memcache.hits, (unsigned long long) sl->memcache.misses);
+
+    stlink_close(sl);
+    return !failed;
+}
+
+int main(int ac, char** av)
+{
+    (void)ac;
+    (void)av;
+
+    bool allgood = true;
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+        allgood &= run_test(&tests[i]);
+    allgood &= run_overlap_test();
+    allgood &= run_agent_test();
+    allgood &= run_dual_bank_test();
+    allgood &= run_g0_test();
+    allgood &= run_l4_fast_test();
+    allgood &= run_l0_test();
+    allgood &= run_erase_plan_test();
+    allgood &= run_memcache_test();
+
+    return allgood ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stlink.h>
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("  FAIL line %d: %s\n", __LINE__, #cond); \
+            failed = true; \
+        } \
+    } while (0)
+
+#define TRACE_PATH  "trace_test.trace"
+#define FLASH_ADDR  0x08020000
+#define LEN         (8 * 1024)
+
+static bool failed = false;
+
+/* the session recorded and replayed, returns what it read back */
+static void session(stlink_t *sl, const uint8_t *data, uint8_t *back, struct stlink_reg *regs) {
+    stlink_force_debug(sl);
+    CHECK(stlink_write_flash(sl, FLASH_ADDR, (uint8_t *) data, LEN, 0) == 0);
+    CHECK(stlink_read_mem(sl, FLASH_ADDR, back, LEN) == 0);
+    stlink_write_reg(sl, 0xcafe, 4);
+    stlink_read_all_regs(sl, regs);
+    stlink_read_all_unsupported_regs(sl, regs);
+}
+
+int main(int ac, char** av)
+{
+    (void)ac;
+    (void)av;
+
+    const struct stlink_sim_config cfg = {
+        .chip_id = STLINK_CHIPID_STM32_F4,
+        .flash_size = 1024 * 1024,
+        .cmd_us = 100,
+        .program_us = 20,
+    };
+    uint8_t *data = malloc(LEN), *back = malloc(LEN), *replayed = malloc(LEN);
+    struct stlink_reg regs, replayed_regs;
+    uint32_t val;
+    stlink_t *sl;
+
+    for (int i = 0; i < LEN; i++)
+        data[i] = (uint8_t) (i * 7 + 3);
+
+    printf("record\n");
+    sl = stlink_open_sim(UWARN, true, &cfg);
+    CHECK(sl != NULL && stlink_trace_record(sl, TRACE_PATH) == 0);
+    if (sl == NULL)
+        return 1;
+    session(sl, data, back, &regs);
+    CHECK(memcmp(back, data, LEN) == 0);
+    stlink_close(sl);
+
+    printf("replay\n");
+    sl = stlink_open_replay(UWARN, TRACE_PATH, false);
+    CHECK(sl != NULL);
+    if (sl == NULL)
+        return 1;
+    CHECK(sl->chip_id == STLINK_CHIPID_STM32_F4);
+    CHECK(sl->flash_size == cfg.flash_size);
+    memset(&replayed_regs, 0, sizeof(replayed_regs));
+    session(sl, data, replayed, &replayed_regs);
+    CHECK(memcmp(replayed, data, LEN) == 0);
+    CHECK(replayed_regs.r[4] == 0xcafe);
+    CHECK(memcmp(&replayed_regs, &regs, sizeof(regs)) == 0);
+    CHECK(stlink_get_stats(sl)->cmd[STLINK_DEBUG_READMEM_32BIT].count > 0);
+
+    // anything past the recorded session fails
+    CHECK(stlink_read_debug32(sl, 0xe000ed00, &val) == -1);
+    stlink_close(sl);
+
+    printf("diverging replay\n");
+    sl = stlink_open_replay(UWARN, TRACE_PATH, false);
+    CHECK(sl != NULL);
+    if (sl != NULL) {
+        CHECK(stlink_read_debug32(sl, 0xe000ed00, &val) == -1);
+        stlink_close(sl);
+    }
+
+    remove(TRACE_PATH);
+    free(data);
+    free(back);
+    free(replayed);
+    return failed ? 1 : 0;
+}